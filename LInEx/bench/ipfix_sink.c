@@ -0,0 +1,344 @@
+/*
+ * ipfix_sink.c
+ *
+ * Minimal IPFIX collector for the end-to-end tests. Receives the export of
+ * LInEx via UDP or reads DATAFILE files and evaluates the IPv4 flow records
+ * and the capture statistics.
+ *
+ * Flow records from the generator network 10.1.0.0/16 (see trafficgen.c)
+ * are counted per source address which yields the number of distinct flows
+ * and their total number of bytes. The export latency of a flow record is
+ * the time between its last packet (flowEndSeconds) and the arrival of the
+ * record (UDP) or the export time of its message (DATAFILE).
+ *
+ * The summary is printed in key=value format when the sink is terminated
+ * with SIGINT or SIGTERM or after all files have been read.
+ */
+
+#include "../flows/export.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define SINK_MESSAGE_HEADER_LEN 16
+#define SINK_SET_HEADER_LEN 4
+
+/* Record lengths of FlowTemplateIPv4 and CaptureStatisticsTemplate */
+#define SINK_FLOW_RECORD_LEN 29
+#define SINK_CAPTURE_RECORD_LEN 14
+
+#define SINK_GENERATOR_NETWORK 0x0a010000
+#define SINK_GENERATOR_FLOWS 65536
+
+struct sink_result {
+	uint64_t messages;
+	uint64_t invalid_messages;
+	uint64_t flow_records;
+	uint64_t other_flow_records;
+	uint64_t flow_bytes;
+
+	uint64_t flow_captured;
+	uint64_t flow_dropped;
+	uint64_t olsr_captured;
+	uint64_t olsr_dropped;
+	uint64_t statistics_records;
+
+	uint64_t latency_samples;
+	double latency_total;
+	double latency_min;
+	double latency_max;
+};
+
+static struct sink_result result;
+static uint8_t seen_flows[SINK_GENERATOR_FLOWS / 8];
+static volatile sig_atomic_t stop = 0;
+
+static void handle_signal(int signal) {
+	stop = 1;
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return ntohs(v);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return ntohl(v);
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+	return ((uint64_t) get_u32(p) << 32) | get_u32(p + 4);
+}
+
+static void handle_flow_record(const uint8_t *p, double arrival) {
+	uint32_t src = get_u32(p);
+	uint64_t octets = get_u64(p + 13);
+	uint32_t end = get_u32(p + 25);
+
+	if ((src & 0xffff0000) != SINK_GENERATOR_NETWORK) {
+		result.other_flow_records++;
+		return;
+	}
+
+	result.flow_records++;
+	result.flow_bytes += octets;
+	seen_flows[(src & 0xffff) / 8] |= 1 << (src & 7);
+
+	double latency = arrival - end;
+
+	if (result.latency_samples == 0 || latency < result.latency_min)
+		result.latency_min = latency;
+	if (latency > result.latency_max)
+		result.latency_max = latency;
+
+	result.latency_total += latency;
+	result.latency_samples++;
+}
+
+/**
+  * The kernel resets the counters of PACKET_STATISTICS on every read, hence
+  * the values of all records are summed up.
+  */
+static void handle_capture_record(const uint8_t *p) {
+	uint8_t type = p[0];
+	uint32_t total = get_u32(p + 2);
+	uint32_t dropped = get_u32(p + 6);
+
+	result.statistics_records++;
+
+	if (type == 0) {
+		result.flow_captured += total;
+		result.flow_dropped += dropped;
+	} else {
+		result.olsr_captured += total;
+		result.olsr_dropped += dropped;
+	}
+}
+
+/**
+  * Processes a single IPFIX message. If arrival is 0, the export time of
+  * the message header is used as arrival time.
+  *
+  * Returns the length of the message or -1 if it is malformed.
+  */
+static int handle_message(const uint8_t *data, size_t len, double arrival) {
+	const uint8_t *p, *end;
+	uint16_t message_len;
+
+	if (len < SINK_MESSAGE_HEADER_LEN || get_u16(data) != 10) {
+		result.invalid_messages++;
+		return -1;
+	}
+
+	message_len = get_u16(data + 2);
+	if (message_len < SINK_MESSAGE_HEADER_LEN || message_len > len) {
+		result.invalid_messages++;
+		return -1;
+	}
+
+	if (arrival == 0)
+		arrival = get_u32(data + 4);
+
+	result.messages++;
+
+	p = data + SINK_MESSAGE_HEADER_LEN;
+	end = data + message_len;
+
+	while (p + SINK_SET_HEADER_LEN <= end) {
+		uint16_t set_id = get_u16(p);
+		uint16_t set_len = get_u16(p + 2);
+		const uint8_t *record, *set_end;
+
+		if (set_len < SINK_SET_HEADER_LEN || p + set_len > end) {
+			result.invalid_messages++;
+			return -1;
+		}
+
+		record = p + SINK_SET_HEADER_LEN;
+		set_end = p + set_len;
+
+		switch (set_id) {
+		case FlowTemplateIPv4:
+			for (; record + SINK_FLOW_RECORD_LEN <= set_end; record += SINK_FLOW_RECORD_LEN)
+				handle_flow_record(record, arrival);
+			break;
+		case CaptureStatisticsTemplate:
+			for (; record + SINK_CAPTURE_RECORD_LEN <= set_end; record += SINK_CAPTURE_RECORD_LEN)
+				handle_capture_record(record);
+			break;
+		default:
+			break;
+		}
+
+		p = set_end;
+	}
+
+	return message_len;
+}
+
+static int receive_udp(uint16_t port) {
+	struct sockaddr_in addr;
+	uint8_t buffer[IPFIX_MAX_PACKETSIZE];
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+
+	while (!stop) {
+		ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+		struct timespec ts;
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			perror("recv");
+			break;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		handle_message(buffer, len, ts.tv_sec + ts.tv_nsec / 1e9);
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+static int read_file(const char *filename) {
+	struct stat st;
+	uint8_t *data;
+	size_t offset = 0;
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(filename);
+		return -1;
+	}
+
+	data = malloc(st.st_size);
+	if (data == NULL || read(fd, data, st.st_size) != st.st_size) {
+		fprintf(stderr, "Failed to read %s.\n", filename);
+		free(data);
+		close(fd);
+		return -1;
+	}
+
+	while (offset < (size_t) st.st_size) {
+		int len = handle_message(data + offset, st.st_size - offset, 0);
+
+		if (len < 0)
+			break;
+
+		offset += len;
+	}
+
+	free(data);
+	close(fd);
+
+	return 0;
+}
+
+static void print_summary() {
+	uint32_t flows = 0;
+	size_t i;
+
+	for (i = 0; i < sizeof(seen_flows); i++)
+		flows += __builtin_popcount(seen_flows[i]);
+
+	printf("messages=%llu\n", (unsigned long long) result.messages);
+	printf("invalid_messages=%llu\n", (unsigned long long) result.invalid_messages);
+	printf("flow_records=%llu\n", (unsigned long long) result.flow_records);
+	printf("other_flow_records=%llu\n", (unsigned long long) result.other_flow_records);
+	printf("flows=%u\n", flows);
+	printf("bytes=%llu\n", (unsigned long long) result.flow_bytes);
+	printf("statistics_records=%llu\n", (unsigned long long) result.statistics_records);
+	printf("captured=%llu\n", (unsigned long long) result.flow_captured);
+	printf("dropped=%llu\n", (unsigned long long) result.flow_dropped);
+	printf("olsr_captured=%llu\n", (unsigned long long) result.olsr_captured);
+	printf("olsr_dropped=%llu\n", (unsigned long long) result.olsr_dropped);
+	printf("latency_min=%.3f\n", result.latency_min);
+	printf("latency_avg=%.3f\n", result.latency_samples ? result.latency_total / result.latency_samples : 0);
+	printf("latency_max=%.3f\n", result.latency_max);
+	fflush(stdout);
+}
+
+static void usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s -u <port> | <DATAFILE files...>\n"
+			"  -u <port>  Receive IPFIX messages via UDP until SIGINT or SIGTERM\n",
+			name);
+}
+
+int main(int argc, char **argv) {
+	int port = -1;
+	int c;
+
+	while ((c = getopt(argc, argv, "u:h")) != -1) {
+		switch (c) {
+		case 'u':
+			port = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if ((port <= 0 || port > 0xffff) && optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	memset(&result, 0, sizeof(result));
+
+	if (port > 0) {
+		// Do not restart recv() so that the loop notices the signal
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = handle_signal;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+
+		if (receive_udp(port))
+			return 1;
+	} else {
+		for (; optind < argc; optind++)
+			read_file(argv[optind]);
+	}
+
+	print_summary();
+
+	return 0;
+}
@@ -0,0 +1,927 @@
+/*
+ * linex_bench.c
+ *
+ * Microbenchmarks for the hot paths of LInEx: flow key hashing, the flow
+ * table, the object cache, CryptoPAN, the flow export encoder, the IPFIX
+ * send path, the transform rules and the compression modules.
+ *
+ * Every benchmark is calibrated to run for at least the minimum run time
+ * and repeated a number of times. The fastest repetition is reported as
+ * ns/op together with the operation rate and, where applicable, the byte
+ * throughput. Results can be printed as a table, CSV or JSON lines so that
+ * runs on different commits and CPUs can be compared by scripts.
+ */
+
+#include "../flows/flows.h"
+#include "../flows/export.h"
+#include "../flows/object_cache.h"
+#include "../ipfixlolib/ipfixlolib.h"
+#include "../ipfixlolib/msg.h"
+#include "../transform_rules.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/utsname.h>
+
+/* Number of distinct flow keys used by the hash and flow table benchmarks */
+#define BENCH_KEYS 65536
+
+/* Number of flows exported per round of the export benchmark */
+#define BENCH_EXPORT_FLOWS 4096
+
+/* Number of objects allocated before they are released again */
+#define BENCH_OBJECT_BATCH 64
+
+/* Length of an IPv4 flow record (see FlowTemplateIPv4) */
+#define BENCH_FLOW_RECORD_LEN (2 * sizeof(uint32_t) + sizeof(uint8_t) + 2 * sizeof(uint16_t) + sizeof(uint64_t) + 2 * sizeof(uint32_t))
+
+/* Number of flow records in a message of the send benchmarks */
+#define BENCH_MESSAGE_RECORDS 48
+
+enum bench_format {
+	BenchFormatText,
+	BenchFormatCSV,
+	BenchFormatJSON
+};
+
+struct bench_config {
+	uint32_t min_time_ms;
+	uint32_t repetitions;
+	const char *filter;
+	const char *basename;
+	enum bench_format format;
+};
+
+struct bench_case {
+	const char *name;
+
+	/**
+	  * Number of payload bytes processed per operation or 0 if no byte
+	  * throughput should be reported.
+	  */
+	size_t bytes_per_op;
+
+	/**
+	  * Prepares the benchmark. Returns 0 on success or -1 if the benchmark
+	  * is not available (it is skipped in that case).
+	  */
+	int (*setup)(void);
+
+	/**
+	  * Performs at least the given number of operations and returns the
+	  * number of operations which were actually performed.
+	  */
+	uint64_t (*run)(uint64_t ops);
+
+	void (*teardown)(void);
+};
+
+struct bench_result {
+	uint64_t ops;
+	double ns_per_op;
+	double mean_ns_per_op;
+};
+
+static struct bench_config conf = { 200, 3, NULL, "linex-bench-", BenchFormatText };
+
+static flow_key keys[BENCH_KEYS];
+static flow_key missing_keys[BENCH_KEYS];
+
+/* Prevents the compiler from optimizing away the benchmarked calls */
+static volatile uint32_t sink;
+
+/* Time spent in bench_pause() sections of the current run */
+static uint64_t paused_ns;
+static struct timespec pause_start;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+  * Excludes the following code from the measurement (e.g. preparation of
+  * input data between rounds) until bench_resume() is called.
+  */
+static void bench_pause() {
+	clock_gettime(CLOCK_MONOTONIC, &pause_start);
+}
+
+static void bench_resume() {
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	paused_ns += (end.tv_sec - pause_start.tv_sec) * 1000000000ULL + end.tv_nsec - pause_start.tv_nsec;
+}
+
+static void init_keys(flow_key *k, size_t count, uint32_t network) {
+	size_t i;
+
+	memset(k, 0, count * sizeof(flow_key));
+
+	for (i = 0; i < count; i++) {
+		k[i].protocol = IPv4;
+		k[i].t_protocol = (rand() & 1) ? TRANSPORT_TCP : TRANSPORT_UDP;
+		k[i].src_addr.v4.s_addr = htonl(network | (rand() & 0xffff));
+		k[i].dst_addr.v4.s_addr = htonl(0xc0a80000 | (rand() & 0xffff));
+		k[i].src_port = htons(1024 + rand() % 60000);
+		k[i].dst_port = htons((rand() & 1) ? 80 : 53);
+	}
+}
+
+#ifdef SUPPORT_IPV6
+static flow_key keys_ipv6[BENCH_KEYS];
+
+static void init_keys_ipv6(flow_key *k, size_t count) {
+	size_t i, j;
+
+	memset(k, 0, count * sizeof(flow_key));
+
+	for (i = 0; i < count; i++) {
+		k[i].protocol = IPv6;
+		k[i].t_protocol = TRANSPORT_TCP;
+		k[i].src_addr.v6.s6_addr[0] = 0x20;
+		k[i].src_addr.v6.s6_addr[1] = 0x01;
+		k[i].dst_addr.v6.s6_addr[0] = 0x20;
+		k[i].dst_addr.v6.s6_addr[1] = 0x01;
+
+		for (j = 8; j < 16; j++) {
+			k[i].src_addr.v6.s6_addr[j] = rand();
+			k[i].dst_addr.v6.s6_addr[j] = rand();
+		}
+
+		k[i].src_port = htons(1024 + rand() % 60000);
+		k[i].dst_port = htons(443);
+	}
+}
+#endif
+
+/* ---- flow_key_hash_code() ---- */
+
+static uint64_t hash_keys(flow_key *k, uint64_t ops) {
+	uint32_t hash = 0;
+	uint64_t i;
+
+	for (i = 0; i < ops; i++)
+		hash ^= flow_key_hash_code(&k[i & (BENCH_KEYS - 1)]);
+
+	sink = hash;
+
+	return ops;
+}
+
+static int setup_hash_multiplicative() {
+	set_sampling_polynom(0);
+
+	return 0;
+}
+
+static int setup_hash_crc32() {
+	set_sampling_polynom(0xedb88320);
+
+	return 0;
+}
+
+static void teardown_hash() {
+	set_sampling_polynom(0);
+}
+
+static uint64_t run_hash_ipv4(uint64_t ops) {
+	return hash_keys(keys, ops);
+}
+
+#ifdef SUPPORT_IPV6
+static uint64_t run_hash_ipv6(uint64_t ops) {
+	return hash_keys(keys_ipv6, ops);
+}
+#endif
+
+/* ---- Flow table (KHASH_INIT(1, ...)) ---- */
+
+static khash_t(1) *flow_table;
+
+static uint64_t run_khash_insert(uint64_t ops) {
+	uint64_t done = 0;
+
+	while (done < ops) {
+		khash_t(1) *table = kh_init(1);
+		size_t i;
+		int ret;
+
+		for (i = 0; i < BENCH_KEYS; i++) {
+			khiter_t k = kh_put(1, table, &keys[i], &ret);
+			kh_value(table, k) = NULL;
+		}
+
+		bench_pause();
+		kh_destroy(1, table);
+		bench_resume();
+
+		done += BENCH_KEYS;
+	}
+
+	return done;
+}
+
+static int setup_khash_lookup() {
+	size_t i;
+	int ret;
+
+	flow_table = kh_init(1);
+
+	for (i = 0; i < BENCH_KEYS; i++) {
+		khiter_t k = kh_put(1, flow_table, &keys[i], &ret);
+		kh_value(flow_table, k) = NULL;
+	}
+
+	return 0;
+}
+
+static void teardown_khash_lookup() {
+	kh_destroy(1, flow_table);
+	flow_table = NULL;
+}
+
+static uint64_t lookup_keys(flow_key *k, uint64_t ops) {
+	uint32_t found = 0;
+	uint64_t i;
+
+	for (i = 0; i < ops; i++)
+		found += kh_get(1, flow_table, &k[i & (BENCH_KEYS - 1)]) != kh_end(flow_table);
+
+	sink = found;
+
+	return ops;
+}
+
+static uint64_t run_khash_lookup_hit(uint64_t ops) {
+	return lookup_keys(keys, ops);
+}
+
+static uint64_t run_khash_lookup_miss(uint64_t ops) {
+	return lookup_keys(missing_keys, ops);
+}
+
+/* ---- allocate_object() / release_object() ---- */
+
+static struct object_cache *object_cache;
+
+static int setup_object_cache() {
+	object_cache = init_object_cache(BENCH_OBJECT_BATCH, sizeof(flow_info));
+
+	return object_cache ? 0 : -1;
+}
+
+static void teardown_object_cache() {
+	free_object_cache(object_cache);
+	object_cache = NULL;
+}
+
+static uint64_t run_object_cache(uint64_t ops) {
+	void *objects[BENCH_OBJECT_BATCH];
+	uint64_t done;
+	size_t i;
+
+	for (done = 0; done < ops; done += BENCH_OBJECT_BATCH) {
+		for (i = 0; i < BENCH_OBJECT_BATCH; i++)
+			objects[i] = allocate_object(object_cache);
+
+		for (i = 0; i < BENCH_OBJECT_BATCH; i++)
+			release_object(object_cache, objects[i]);
+	}
+
+	return done;
+}
+
+/* ---- anonymize_ipv4() and anonymize_ipv6() ---- */
+
+#ifdef SUPPORT_ANONYMIZATION
+static struct cryptopan cryptopan;
+
+static int setup_cryptopan() {
+	uint8_t key[16] = { 21, 34, 23, 141, 51, 164, 207, 128, 19, 10, 91, 22, 73, 144, 125, 16 };
+	uint8_t pad[16] = { 216, 178, 185, 52, 138, 115, 223, 2, 125, 211, 242, 66, 229, 176, 182, 77 };
+
+	if (init_cryptopan(&cryptopan, key, pad))
+		return -1;
+
+	// Refuse to measure a backend producing wrong results
+	return cryptopan_self_test(cryptopan.accel.backend, 0) ? -1 : 0;
+}
+
+static int setup_cryptopan_software() {
+	if (setup_cryptopan())
+		return -1;
+
+	return cryptopan_set_backend(&cryptopan, AES_BACKEND_SOFTWARE);
+}
+
+static uint64_t run_cryptopan(uint64_t ops) {
+	uint32_t result = 0;
+	uint64_t i;
+
+	for (i = 0; i < ops; i++)
+		result ^= anonymize_ipv4(&cryptopan, ntohl(keys[i & (BENCH_KEYS - 1)].src_addr.v4.s_addr));
+
+	sink = result;
+
+	return ops;
+}
+
+static uint64_t run_cryptopan_batch(uint64_t ops) {
+	uint32_t addrs[64];
+	uint32_t result = 0;
+	uint64_t i;
+	size_t j;
+
+	for (i = 0; i < ops; i += 64) {
+		for (j = 0; j < 64; j++)
+			addrs[j] = ntohl(keys[(i + j) & (BENCH_KEYS - 1)].src_addr.v4.s_addr);
+
+		anonymize_ipv4_batch(&cryptopan, addrs, addrs, 64);
+		result ^= addrs[0];
+	}
+
+	sink = result;
+
+	return i;
+}
+
+#ifdef SUPPORT_IPV6
+static uint64_t run_cryptopan_ipv6(uint64_t ops) {
+	uint8_t result[16];
+	uint8_t hash = 0;
+	uint64_t i;
+
+	for (i = 0; i < ops; i++) {
+		anonymize_ipv6(&cryptopan, keys_ipv6[i & (BENCH_KEYS - 1)].src_addr.v6.s6_addr, result);
+		hash ^= result[15];
+	}
+
+	sink = hash;
+
+	return ops;
+}
+#endif
+
+static int setup_cryptopan_cached() {
+	if (setup_cryptopan())
+		return -1;
+
+	return cryptopan_init_cache(&cryptopan, CRYPTOPAN_CACHE_DEFAULT_SIZE);
+}
+
+static void teardown_cryptopan() {
+	cryptopan_free_cache(&cryptopan);
+}
+#endif
+
+/* ---- IPFIX export ---- */
+
+static ipfix_exporter *exporter;
+static uint8_t message[BENCH_MESSAGE_RECORDS * BENCH_FLOW_RECORD_LEN];
+
+/**
+  * Empties the DATAFILE collector so that long runs do not fill the disk.
+  */
+static void reset_datafile() {
+	int i;
+
+	for (i = 0; i < exporter->collector_max_num; i++) {
+		ipfix_receiving_collector *col = &exporter->collector_arr[i];
+
+		if (col->state == C_UNUSED || col->protocol != DATAFILE || col->fh < 0)
+			continue;
+
+		if (ftruncate(col->fh, 0) == 0)
+			lseek(col->fh, 0, SEEK_SET);
+		col->bytes_written = 0;
+	}
+}
+
+static int setup_exporter_collector(const char *address, int port,
+									enum ipfix_transport_protocol protocol,
+									void *aux_config) {
+	size_t i;
+
+	if (ipfix_init_exporter(1, &exporter))
+		return -1;
+
+	if (ipfix_add_collector(exporter, address, port, protocol, aux_config)) {
+		ipfix_deinit_exporter(exporter);
+		return -1;
+	}
+
+	if (declare_templates(exporter)) {
+		ipfix_deinit_exporter(exporter);
+		return -1;
+	}
+
+	// Flow records as encoded by export_flow_database()
+	for (i = 0; i < BENCH_MESSAGE_RECORDS; i++) {
+		uint8_t *p = message + i * BENCH_FLOW_RECORD_LEN;
+		uint32_t timestamp = htonl(1300000000 + i);
+		uint64_t bytes = (uint64_t) (rand() % 100000);
+
+		memcpy(p, &keys[i].src_addr.v4.s_addr, sizeof(uint32_t));
+		memcpy(p + 4, &keys[i].dst_addr.v4.s_addr, sizeof(uint32_t));
+		p[8] = keys[i].t_protocol == TRANSPORT_TCP ? 6 : 17;
+		memcpy(p + 9, &keys[i].src_port, sizeof(uint16_t));
+		memcpy(p + 11, &keys[i].dst_port, sizeof(uint16_t));
+		memcpy(p + 13, &bytes, sizeof(uint64_t));
+		memcpy(p + 21, &timestamp, sizeof(uint32_t));
+		memcpy(p + 25, &timestamp, sizeof(uint32_t));
+	}
+
+	return 0;
+}
+
+static int setup_exporter() {
+	// The port of a DATAFILE collector is the maximum file size in KiB
+	return setup_exporter_collector(conf.basename, 0x7fffffff, DATAFILE, NULL);
+}
+
+/**
+  * Shuts the exporter down and removes the file of its DATAFILE collector.
+  */
+static void teardown_exporter() {
+	char filename[FILENAME_MAX];
+	int i;
+
+	filename[0] = '\0';
+
+	for (i = 0; i < exporter->collector_max_num; i++) {
+		ipfix_receiving_collector *col = &exporter->collector_arr[i];
+
+		if (col->state != C_UNUSED && col->protocol == DATAFILE)
+			snprintf(filename, sizeof(filename), "%s%010d", col->basename, col->filenum);
+	}
+
+	ipfix_deinit_exporter(exporter);
+	exporter = NULL;
+
+	if (filename[0] != '\0')
+		unlink(filename);
+}
+
+static flow_capture_session session;
+
+static int setup_export_flows() {
+	if (setup_exporter())
+		return -1;
+
+	memset(&session, 0, sizeof(session));
+	session.ipv4_flow_database = kh_init(1);
+#ifdef SUPPORT_IPV6
+	session.ipv6_flow_database = kh_init(1);
+#endif
+	session.flow_key_cache = init_object_cache(BENCH_EXPORT_FLOWS, sizeof(flow_key));
+	session.flow_info_cache = init_object_cache(BENCH_EXPORT_FLOWS, sizeof(flow_info));
+
+	return 0;
+}
+
+static void teardown_export_flows() {
+	kh_destroy(1, session.ipv4_flow_database);
+#ifdef SUPPORT_IPV6
+	kh_destroy(1, session.ipv6_flow_database);
+#endif
+	free_object_cache(session.flow_key_cache);
+	free_object_cache(session.flow_info_cache);
+	teardown_exporter();
+}
+
+static uint64_t run_export_flows(uint64_t ops) {
+	struct export_flow_parameter param = { exporter, &session };
+	time_t now = time(NULL);
+	uint64_t done = 0;
+	size_t i;
+	int ret;
+
+	while (done < ops) {
+		bench_pause();
+
+		for (i = 0; i < BENCH_EXPORT_FLOWS; i++) {
+			flow_key *key = allocate_object(session.flow_key_cache);
+			flow_info *info = allocate_object(session.flow_info_cache);
+
+			memcpy(key, &keys[i], sizeof(flow_key));
+			info->first_packet_timestamp = now;
+			info->last_packet_timestamp = now;
+			info->total_bytes = i * 1000;
+
+			khiter_t k = kh_put(1, session.ipv4_flow_database, key, &ret);
+			kh_value(session.ipv4_flow_database, k) = info;
+		}
+
+		reset_datafile();
+		bench_resume();
+
+		// All flows have expired as both timeouts are 0
+		export_flows(&param);
+
+		done += BENCH_EXPORT_FLOWS;
+	}
+
+	return done;
+}
+
+static uint64_t run_ipfix_send(uint64_t ops) {
+	uint64_t i;
+
+	for (i = 0; i < ops; i++) {
+		if ((i & 1023) == 0) {
+			bench_pause();
+			reset_datafile();
+			bench_resume();
+		}
+
+		ipfix_start_data_set(exporter, htons(FlowTemplateIPv4));
+		ipfix_put_data_field(exporter, message, sizeof(message));
+		ipfix_end_data_set(exporter, BENCH_MESSAGE_RECORDS);
+		ipfix_send(exporter);
+	}
+
+	ipfix_flush(exporter);
+
+	return ops;
+}
+
+/**
+  * Socket receiving the messages of the UDP benchmarks. It is never read,
+  * the kernel drops the messages once its receive buffer is full.
+  */
+static int udp_sink = -1;
+
+static int setup_udp_exporter(unsigned batch) {
+	ipfix_aux_config_udp aux_config = { 1500 };
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	udp_sink = socket(AF_INET, SOCK_DGRAM, 0);
+	if (udp_sink < 0
+			|| bind(udp_sink, (struct sockaddr *) &addr, sizeof(addr))
+			|| getsockname(udp_sink, (struct sockaddr *) &addr, &addr_len)
+			|| setup_exporter_collector("127.0.0.1", ntohs(addr.sin_port), UDP, &aux_config)) {
+		if (udp_sink >= 0)
+			close(udp_sink);
+		udp_sink = -1;
+		return -1;
+	}
+
+	return ipfix_set_deferred_flush(exporter, batch, 1000);
+}
+
+static int setup_udp() {
+	return setup_udp_exporter(0);
+}
+
+static int setup_udp_batched() {
+	return setup_udp_exporter(IPFIX_SEND_QUEUE_MAX_MESSAGES);
+}
+
+static void teardown_udp_exporter() {
+	teardown_exporter();
+	close(udp_sink);
+	udp_sink = -1;
+}
+
+#ifdef SUPPORT_COMPRESSION
+/**
+  * Loads the given compression module into a fresh exporter. The module is
+  * looked up relative to the working directory, i.e. the benchmark has to
+  * be started from the build directory.
+  */
+static int setup_compression(const char *module, const char *params) {
+	if (setup_exporter())
+		return -1;
+
+	if (ipfix_init_compression(exporter, module, params)) {
+		teardown_exporter();
+		return -1;
+	}
+
+	return 0;
+}
+
+static int setup_deflate() {
+	return setup_compression("deflate", "6");
+}
+
+static int setup_bzip2() {
+	return setup_compression("bzip2", "9");
+}
+
+static int setup_quicklz() {
+	return setup_compression("quicklz", "");
+}
+#endif
+
+/* ---- transform_* rules ---- */
+
+struct transform_input {
+	unsigned int index;
+	uint16_t bytecount;
+	char *input;
+};
+
+static struct transform_input transform_inputs[] = {
+	{ 0, 4, "abcd" },
+	{ 1, 4, "-123456" },
+	{ 2, 4, "3456789" },
+	{ 3, 4, "192.168.100.254" },
+	{ 4, 6, "00:1b:21:3a:4f:9e" },
+	{ 5, 8, "1234.5678" },
+	{ 6, 2, "42.17" },
+	{ 7, 16, "eth0.100" }
+};
+
+static uint64_t run_transform(unsigned int index, uint64_t ops) {
+	struct transform_input *t = &transform_inputs[index];
+	transform_rule rule;
+	uint8_t buffer[64];
+	uint64_t i;
+
+	memset(&rule, 0, sizeof(rule));
+	rule.bytecount = t->bytecount;
+	rule.transform_id = t->index;
+	rule.transform_func = get_rule_by_index(t->index, t->bytecount);
+
+	for (i = 0; i < ops; i++)
+		rule.transform_func(t->input, buffer, &rule);
+
+	sink = buffer[0];
+
+	return ops;
+}
+
+#define TRANSFORM_BENCH(n) \
+	static uint64_t run_transform_##n(uint64_t ops) { return run_transform(n, ops); }
+
+TRANSFORM_BENCH(0)
+TRANSFORM_BENCH(1)
+TRANSFORM_BENCH(2)
+TRANSFORM_BENCH(3)
+TRANSFORM_BENCH(4)
+TRANSFORM_BENCH(5)
+TRANSFORM_BENCH(6)
+TRANSFORM_BENCH(7)
+
+static struct bench_case benchmarks[] = {
+	{ "hash_ipv4_multiplicative", 0, setup_hash_multiplicative, run_hash_ipv4, teardown_hash },
+	{ "hash_ipv4_crc32", 0, setup_hash_crc32, run_hash_ipv4, teardown_hash },
+#ifdef SUPPORT_IPV6
+	{ "hash_ipv6_multiplicative", 0, setup_hash_multiplicative, run_hash_ipv6, teardown_hash },
+	{ "hash_ipv6_crc32", 0, setup_hash_crc32, run_hash_ipv6, teardown_hash },
+#endif
+	{ "khash_insert", 0, NULL, run_khash_insert, NULL },
+	{ "khash_lookup_hit", 0, setup_khash_lookup, run_khash_lookup_hit, teardown_khash_lookup },
+	{ "khash_lookup_miss", 0, setup_khash_lookup, run_khash_lookup_miss, teardown_khash_lookup },
+	{ "object_cache_alloc_release", 0, setup_object_cache, run_object_cache, teardown_object_cache },
+#ifdef SUPPORT_ANONYMIZATION
+	{ "cryptopan_ipv4", 0, setup_cryptopan, run_cryptopan, NULL },
+	{ "cryptopan_ipv4_software", 0, setup_cryptopan_software, run_cryptopan, NULL },
+	{ "cryptopan_ipv4_batch", 0, setup_cryptopan, run_cryptopan_batch, NULL },
+	{ "cryptopan_ipv4_cached", 0, setup_cryptopan_cached, run_cryptopan, teardown_cryptopan },
+#ifdef SUPPORT_IPV6
+	{ "cryptopan_ipv6", 0, setup_cryptopan, run_cryptopan_ipv6, NULL },
+	{ "cryptopan_ipv6_cached", 0, setup_cryptopan_cached, run_cryptopan_ipv6, teardown_cryptopan },
+#endif
+#endif
+	{ "export_flow_record", BENCH_FLOW_RECORD_LEN, setup_export_flows, run_export_flows, teardown_export_flows },
+	{ "ipfix_send_datafile", sizeof(message), setup_exporter, run_ipfix_send, teardown_exporter },
+	{ "ipfix_send_udp", sizeof(message), setup_udp, run_ipfix_send, teardown_udp_exporter },
+	{ "ipfix_send_udp_batched", sizeof(message), setup_udp_batched, run_ipfix_send, teardown_udp_exporter },
+#ifdef SUPPORT_COMPRESSION
+	{ "ipfix_send_deflate", sizeof(message), setup_deflate, run_ipfix_send, teardown_exporter },
+	{ "ipfix_send_bzip2", sizeof(message), setup_bzip2, run_ipfix_send, teardown_exporter },
+	{ "ipfix_send_quicklz", sizeof(message), setup_quicklz, run_ipfix_send, teardown_exporter },
+#endif
+	{ "transform_none", 0, NULL, run_transform_0, NULL },
+	{ "transform_int", 0, NULL, run_transform_1, NULL },
+	{ "transform_uint", 0, NULL, run_transform_2, NULL },
+	{ "transform_ip", 0, NULL, run_transform_3, NULL },
+	{ "transform_mac_address", 0, NULL, run_transform_4, NULL },
+	{ "transform_float", 0, NULL, run_transform_5, NULL },
+	{ "transform_percent", 0, NULL, run_transform_6, NULL },
+	{ "transform_string", 0, NULL, run_transform_7, NULL },
+	{ NULL }
+};
+
+/**
+  * Runs the given number of operations and returns the elapsed time in
+  * nanoseconds without the paused sections. ops is updated with the number
+  * of operations which were actually performed.
+  */
+static uint64_t timed_run(struct bench_case *bench, uint64_t *ops) {
+	uint64_t start;
+
+	paused_ns = 0;
+	start = now_ns();
+	*ops = bench->run(*ops);
+
+	return now_ns() - start - paused_ns;
+}
+
+static void run_benchmark(struct bench_case *bench, struct bench_result *result) {
+	uint64_t min_ns = (uint64_t) conf.min_time_ms * 1000000ULL;
+	uint64_t ops = 1;
+	uint64_t elapsed;
+	double total = 0;
+	uint32_t i;
+
+	// Calibration: grow the number of operations until a run takes at least
+	// a tenth of the minimum run time.
+	for (;;) {
+		elapsed = timed_run(bench, &ops);
+
+		if (elapsed >= min_ns / 10 || ops >= (1ULL << 40))
+			break;
+
+		ops *= elapsed > 0 && min_ns / 10 / elapsed < 100 ? min_ns / 10 / elapsed + 1 : 100;
+	}
+
+	ops = elapsed > 0 ? (uint64_t) ((double) ops * min_ns / elapsed) + 1 : ops;
+
+	result->ops = ops;
+	result->ns_per_op = 0;
+
+	for (i = 0; i < conf.repetitions; i++) {
+		uint64_t done = ops;
+		double ns_per_op;
+
+		elapsed = timed_run(bench, &done);
+		ns_per_op = (double) elapsed / done;
+
+		if (i == 0 || ns_per_op < result->ns_per_op)
+			result->ns_per_op = ns_per_op;
+
+		total += ns_per_op;
+	}
+
+	result->mean_ns_per_op = total / conf.repetitions;
+}
+
+static void print_header() {
+	struct utsname uts;
+
+	uname(&uts);
+
+	switch (conf.format) {
+	case BenchFormatText:
+		printf("# %s %s, minimum run time %u ms, %u repetitions\n",
+			   uts.sysname, uts.machine, conf.min_time_ms, conf.repetitions);
+		printf("%-28s %14s %12s %12s %14s %12s\n",
+			   "benchmark", "ops", "ns/op", "mean ns/op", "ops/s", "MB/s");
+		break;
+	case BenchFormatCSV:
+		printf("benchmark,machine,ops,ns_per_op,mean_ns_per_op,ops_per_sec,bytes_per_sec\n");
+		break;
+	case BenchFormatJSON:
+		break;
+	}
+}
+
+static void print_result(const struct bench_case *bench, const struct bench_result *result) {
+	double ops_per_sec = result->ns_per_op > 0 ? 1e9 / result->ns_per_op : 0;
+	double bytes_per_sec = ops_per_sec * bench->bytes_per_op;
+	struct utsname uts;
+
+	uname(&uts);
+
+	switch (conf.format) {
+	case BenchFormatText:
+		if (bench->bytes_per_op)
+			printf("%-28s %14llu %12.2f %12.2f %14.0f %12.1f\n", bench->name,
+				   (unsigned long long) result->ops, result->ns_per_op,
+				   result->mean_ns_per_op, ops_per_sec, bytes_per_sec / 1e6);
+		else
+			printf("%-28s %14llu %12.2f %12.2f %14.0f %12s\n", bench->name,
+				   (unsigned long long) result->ops, result->ns_per_op,
+				   result->mean_ns_per_op, ops_per_sec, "-");
+		break;
+	case BenchFormatCSV:
+		printf("%s,%s,%llu,%.3f,%.3f,%.0f,%.0f\n", bench->name, uts.machine,
+			   (unsigned long long) result->ops, result->ns_per_op,
+			   result->mean_ns_per_op, ops_per_sec, bytes_per_sec);
+		break;
+	case BenchFormatJSON:
+		printf("{\"benchmark\": \"%s\", \"machine\": \"%s\", \"ops\": %llu, "
+			   "\"ns_per_op\": %.3f, \"mean_ns_per_op\": %.3f, "
+			   "\"ops_per_sec\": %.0f, \"bytes_per_sec\": %.0f}\n",
+			   bench->name, uts.machine, (unsigned long long) result->ops,
+			   result->ns_per_op, result->mean_ns_per_op, ops_per_sec,
+			   bytes_per_sec);
+		break;
+	}
+
+	fflush(stdout);
+}
+
+static void usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  -t <ms>        Minimum run time per repetition (default: 200)\n"
+			"  -r <count>     Number of repetitions (default: 3)\n"
+			"  -b <filter>    Only run benchmarks whose name contains filter\n"
+			"  -o <format>    Output format: text, csv or json (default: text)\n"
+			"  -f <basename>  Basename of the DATAFILE collector (default: linex-bench-)\n"
+			"  -l             List the available benchmarks\n"
+			"  -v <level>     Message verbosity level\n",
+			name);
+}
+
+static int parse_arguments(int argc, char **argv) {
+	struct bench_case *bench;
+	int c;
+
+	while ((c = getopt(argc, argv, "t:r:b:o:f:lv:h")) != -1) {
+		switch (c) {
+		case 't':
+			conf.min_time_ms = atoi(optarg);
+			break;
+		case 'r':
+			conf.repetitions = atoi(optarg);
+			break;
+		case 'b':
+			conf.filter = optarg;
+			break;
+		case 'o':
+			if (!strcmp(optarg, "text"))
+				conf.format = BenchFormatText;
+			else if (!strcmp(optarg, "csv"))
+				conf.format = BenchFormatCSV;
+			else if (!strcmp(optarg, "json"))
+				conf.format = BenchFormatJSON;
+			else
+				return -1;
+			break;
+		case 'f':
+			conf.basename = optarg;
+			break;
+		case 'l':
+			for (bench = benchmarks; bench->name != NULL; bench++)
+				printf("%s\n", bench->name);
+			exit(0);
+		case 'v':
+			msg_setlevel(atoi(optarg));
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (conf.min_time_ms == 0 || conf.repetitions == 0) {
+		fprintf(stderr, "Run time and repetitions must be positive.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct bench_case *bench;
+	struct bench_result result;
+
+	if (parse_arguments(argc, argv)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	srand(1);
+	init_keys(keys, BENCH_KEYS, 0x0a000000);
+	init_keys(missing_keys, BENCH_KEYS, 0x0b000000);
+#ifdef SUPPORT_IPV6
+	init_keys_ipv6(keys_ipv6, BENCH_KEYS);
+#endif
+
+	print_header();
+
+	for (bench = benchmarks; bench->name != NULL; bench++) {
+		if (conf.filter && !strstr(bench->name, conf.filter))
+			continue;
+
+		if (bench->setup && bench->setup()) {
+			fprintf(stderr, "Skipping %s: not available.\n", bench->name);
+			continue;
+		}
+
+		run_benchmark(bench, &result);
+		print_result(bench, &result);
+
+		if (bench->teardown)
+			bench->teardown();
+	}
+
+	return 0;
+}
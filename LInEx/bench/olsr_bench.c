@@ -0,0 +1,703 @@
+/*
+ * olsr_bench.c
+ *
+ * Synthetic mesh benchmark for the OLSR processing and export path.
+ *
+ * Generates a random mesh of N nodes with the requested average degree,
+ * encodes the HELLO, TC, HNA and MID messages every node would emit and
+ * feeds them through olsr_parse_packet(). Flooded messages (TC, HNA, MID)
+ * are delivered once per neighbor of the originator so that the duplicate
+ * set is exercised as in a real mesh. After each round the topology is
+ * exported into a DATAFILE collector.
+ *
+ * Between rounds a fraction of the links (churn rate) is rewired which
+ * changes the advertised neighbor sets and hence the ANSNs.
+ *
+ * In delta mode every node then doubles its HELLO interval without changing
+ * any link, and the following delta has to report the new HTime.
+ *
+ * Optionally a fraction of the nodes advertises a short validity time and
+ * falls silent after the last round. Once their entries have aged past the
+ * validity time, one more round is run and its export, which has to expire
+ * and withdraw these entries, is measured separately.
+ */
+
+#include "../flows/olsr.h"
+#include "../flows/olsr_protocol.h"
+#include "../flows/node_set.h"
+#include "../flows/export.h"
+#include "../ipfixlolib/ipfixlolib.h"
+#include "../ipfixlolib/msg.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+extern node_set_hash *node_set;
+
+#define BENCH_PACKET_SIZE 65535
+
+/* Validity and emission intervals as used by olsrd (in milliseconds) */
+#define BENCH_HELLO_INTERVAL 2000
+#define BENCH_HELLO_VTIME 6000
+#define BENCH_TC_VTIME 15000
+#define BENCH_HNA_VTIME 15000
+#define BENCH_MID_VTIME 15000
+/* Validity time of the nodes which fall silent in the expiry phase */
+#define BENCH_EXPIRY_VTIME 1000
+
+/* SYM_LINK with SYM_NEIGH */
+#define BENCH_LINK_CODE 0x06
+#define BENCH_WILLINGNESS 3
+
+/* Every n-th node announces an additional interface address */
+#define BENCH_MID_RATIO 10
+
+struct bench_node {
+	uint32_t *neighbors;
+	uint32_t degree;
+	uint32_t capacity;
+	uint16_t ansn;
+	uint16_t seqno;
+	uint8_t expiring; // falls silent in the expiry phase
+};
+
+struct bench_mesh {
+	struct bench_node *nodes;
+	uint32_t node_count;
+	uint32_t link_count;
+	uint32_t hello_interval; // advertised as HTime
+};
+
+struct bench_config {
+	uint32_t nodes;
+	uint32_t degree;
+	double churn;
+	uint32_t rounds;
+	double expiry;
+	uint16_t snapshot_interval;
+	const char *basename;
+	unsigned int seed;
+};
+
+struct bench_result {
+	uint64_t messages;
+	uint64_t duplicates;
+	uint64_t packets;
+	double parse_time;
+
+	uint32_t exports;
+	double export_time;
+	double export_min;
+	double export_max;
+
+	uint64_t htime_bytes; // exported for the HTime change
+
+	uint32_t expiry_nodes; // nodes known before the expiry phase
+	uint32_t expired_nodes;
+	double expiry_export_time;
+};
+
+static uint8_t packet_buffer[BENCH_PACKET_SIZE];
+static uint16_t packet_seqno = 0;
+
+static uint32_t node_addr(uint32_t node) {
+	return htonl(0x0a000001 + node);
+}
+
+static uint32_t node_alias_addr(uint32_t node) {
+	return htonl(0x0b000001 + node);
+}
+
+static uint32_t node_hna_network(uint32_t node) {
+	return htonl(0xac100000 + (node << 8));
+}
+
+/**
+  * Returns the validity time node n advertises instead of vtime.
+  */
+static olsr_reltime node_vtime(const struct bench_mesh *mesh, uint32_t n,
+							   olsr_reltime vtime) {
+	return mesh->nodes[n].expiring ? BENCH_EXPIRY_VTIME : vtime;
+}
+
+static double elapsed(const struct timespec *start, const struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+  * Returns 1 if there is a link between a and b.
+  */
+static int mesh_has_link(struct bench_mesh *mesh, uint32_t a, uint32_t b) {
+	struct bench_node *node = &mesh->nodes[a];
+	uint32_t i;
+
+	for (i = 0; i < node->degree; i++) {
+		if (node->neighbors[i] == b)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int mesh_add_neighbor(struct bench_node *node, uint32_t neighbor) {
+	if (node->degree == node->capacity) {
+		uint32_t capacity = node->capacity ? 2 * node->capacity : 8;
+		uint32_t *neighbors = realloc(node->neighbors, capacity * sizeof(uint32_t));
+
+		if (neighbors == NULL)
+			return -1;
+
+		node->neighbors = neighbors;
+		node->capacity = capacity;
+	}
+
+	node->neighbors[node->degree++] = neighbor;
+	node->ansn++;
+
+	return 0;
+}
+
+static void mesh_remove_neighbor(struct bench_node *node, uint32_t neighbor) {
+	uint32_t i;
+
+	for (i = 0; i < node->degree; i++) {
+		if (node->neighbors[i] == neighbor) {
+			node->neighbors[i] = node->neighbors[--node->degree];
+			node->ansn++;
+			return;
+		}
+	}
+}
+
+/**
+  * Adds a link between two distinct random nodes which are not yet
+  * connected.
+  *
+  * Returns 0 on success or -1 if no link could be added.
+  */
+static int mesh_add_random_link(struct bench_mesh *mesh) {
+	int attempts;
+
+	for (attempts = 0; attempts < 64; attempts++) {
+		uint32_t a = rand() % mesh->node_count;
+		uint32_t b = rand() % mesh->node_count;
+
+		if (a == b || mesh_has_link(mesh, a, b))
+			continue;
+
+		if (mesh_add_neighbor(&mesh->nodes[a], b)
+				|| mesh_add_neighbor(&mesh->nodes[b], a))
+			return -1;
+
+		mesh->link_count++;
+		return 0;
+	}
+
+	return -1;
+}
+
+static int mesh_init(struct bench_mesh *mesh, uint32_t nodes, uint32_t degree) {
+	uint32_t links = (uint32_t) (((uint64_t) nodes * degree) / 2);
+	uint32_t i;
+
+	mesh->node_count = nodes;
+	mesh->link_count = 0;
+	mesh->hello_interval = BENCH_HELLO_INTERVAL;
+	mesh->nodes = calloc(nodes, sizeof(struct bench_node));
+
+	if (mesh->nodes == NULL)
+		return -1;
+
+	// Chain all nodes first so that the mesh is connected
+	for (i = 1; i < nodes && mesh->link_count < links; i++) {
+		if (mesh_add_neighbor(&mesh->nodes[i - 1], i)
+				|| mesh_add_neighbor(&mesh->nodes[i], i - 1))
+			return -1;
+
+		mesh->link_count++;
+	}
+
+	while (mesh->link_count < links) {
+		if (mesh_add_random_link(mesh))
+			break;
+	}
+
+	return 0;
+}
+
+static void mesh_free(struct bench_mesh *mesh) {
+	uint32_t i;
+
+	for (i = 0; i < mesh->node_count; i++)
+		free(mesh->nodes[i].neighbors);
+
+	free(mesh->nodes);
+}
+
+/**
+  * Rewires the given fraction of links by replacing them with random links.
+  */
+static void mesh_churn(struct bench_mesh *mesh, double churn) {
+	uint32_t count = (uint32_t) (mesh->link_count * churn);
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		uint32_t a = rand() % mesh->node_count;
+		struct bench_node *node = &mesh->nodes[a];
+
+		if (node->degree == 0)
+			continue;
+
+		uint32_t b = node->neighbors[rand() % node->degree];
+
+		mesh_remove_neighbor(node, b);
+		mesh_remove_neighbor(&mesh->nodes[b], a);
+		mesh->link_count--;
+
+		mesh_add_random_link(mesh);
+	}
+}
+
+static void put_u8(uint8_t **p, uint8_t val) {
+	**p = val;
+	*p += sizeof(uint8_t);
+}
+
+static void put_u16(uint8_t **p, uint16_t val) {
+	val = htons(val);
+	memcpy(*p, &val, sizeof(uint16_t));
+	*p += sizeof(uint16_t);
+}
+
+static void put_addr(uint8_t **p, uint32_t addr) {
+	memcpy(*p, &addr, sizeof(uint32_t));
+	*p += sizeof(uint32_t);
+}
+
+/**
+  * Writes the message header and returns a pointer to the start of the
+  * message which has to be passed to end_message() later.
+  */
+static uint8_t *begin_message(uint8_t **p, uint8_t type, olsr_reltime vtime,
+							  uint32_t orig, uint8_t hops, uint16_t seqno) {
+	uint8_t *start = *p;
+
+	put_u8(p, type);
+	put_u8(p, reltime_to_me(vtime));
+	put_u16(p, 0); // Size - filled in by end_message()
+	put_addr(p, orig);
+	put_u8(p, 255 - hops);
+	put_u8(p, hops);
+	put_u16(p, seqno);
+
+	return start;
+}
+
+static void end_message(uint8_t *start, uint8_t *end) {
+	uint8_t *size = start + 2;
+
+	put_u16(&size, end - start);
+}
+
+/**
+  * Returns the number of neighbor addresses which fit into a single message
+  * next to the other messages of the packet.
+  */
+static uint32_t message_neighbor_limit(const struct bench_node *node) {
+	uint32_t max = (BENCH_PACKET_SIZE - 128) / 2 / sizeof(uint32_t);
+
+	return node->degree < max ? node->degree : max;
+}
+
+static void encode_hello(uint8_t **p, struct bench_mesh *mesh, uint32_t n) {
+	struct bench_node *node = &mesh->nodes[n];
+	uint32_t count = message_neighbor_limit(node);
+	uint32_t i;
+
+	uint8_t *start = begin_message(p, HELLO_MESSAGE,
+								   node_vtime(mesh, n, BENCH_HELLO_VTIME),
+								   node_addr(n), 0, node->seqno++);
+	put_u16(p, 0); // Reserved
+	put_u8(p, reltime_to_me(mesh->hello_interval));
+	put_u8(p, BENCH_WILLINGNESS);
+
+	put_u8(p, BENCH_LINK_CODE);
+	put_u8(p, 0); // Reserved
+	put_u16(p, OLSR_HELLO_INFO_HEADER_LEN + count * sizeof(uint32_t));
+
+	for (i = 0; i < count; i++)
+		put_addr(p, node_addr(node->neighbors[i]));
+
+	end_message(start, *p);
+}
+
+/**
+  * Encodes the messages which are flooded through the mesh (TC, HNA and
+  * optionally MID) and returns the number of encoded messages.
+  */
+static uint32_t encode_flooded(uint8_t **p, struct bench_mesh *mesh, uint32_t n) {
+	struct bench_node *node = &mesh->nodes[n];
+	uint32_t count = message_neighbor_limit(node);
+	uint32_t messages = 2;
+	uint32_t i;
+	uint8_t *start;
+
+	start = begin_message(p, TC_MESSAGE, node_vtime(mesh, n, BENCH_TC_VTIME),
+						  node_addr(n), 1, node->seqno++);
+	put_u16(p, node->ansn);
+	put_u16(p, 0); // Reserved
+
+	for (i = 0; i < count; i++)
+		put_addr(p, node_addr(node->neighbors[i]));
+
+	end_message(start, *p);
+
+	start = begin_message(p, HNA_MESSAGE, node_vtime(mesh, n, BENCH_HNA_VTIME),
+						  node_addr(n), 1, node->seqno++);
+	put_addr(p, node_hna_network(n));
+	put_addr(p, htonl(0xffffff00));
+	end_message(start, *p);
+
+	if (n % BENCH_MID_RATIO == 0) {
+		start = begin_message(p, MID_MESSAGE, node_vtime(mesh, n, BENCH_MID_VTIME),
+							  node_addr(n), 1, node->seqno++);
+		put_addr(p, node_alias_addr(n));
+		end_message(start, *p);
+
+		messages++;
+	}
+
+	return messages;
+}
+
+static int parse_packet(uint8_t *end) {
+	uint8_t *size = packet_buffer;
+	struct pktinfo pkt = { packet_buffer, end, packet_buffer, end - packet_buffer, NULL };
+
+	put_u16(&size, end - packet_buffer);
+
+	return olsr_parse_packet(&pkt, IPv4);
+}
+
+/**
+  * Delivers all messages emitted by the given node in one round.
+  *
+  * The first packet carries the HELLO message as well as the flooded
+  * messages. The flooded messages are then retransmitted once by every
+  * further neighbor.
+  */
+static int process_node(struct bench_mesh *mesh, uint32_t n, struct bench_result *result) {
+	struct bench_node *node = &mesh->nodes[n];
+	uint8_t *p = packet_buffer;
+	uint8_t *flooded;
+	uint32_t flooded_count;
+	uint32_t i;
+
+	// Packet header - size is filled in by parse_packet()
+	put_u16(&p, 0);
+	put_u16(&p, packet_seqno++);
+
+	encode_hello(&p, mesh, n);
+	flooded = p;
+	flooded_count = encode_flooded(&p, mesh, n);
+
+	if (parse_packet(p))
+		return -1;
+
+	result->packets++;
+	result->messages += 1 + flooded_count;
+
+	// Retransmissions by the remaining neighbors
+	size_t flooded_len = p - flooded;
+	memmove(packet_buffer + OLSR_PACKET_HEADER_LEN, flooded, flooded_len);
+
+	for (i = 1; i < node->degree; i++) {
+		p = packet_buffer + sizeof(uint16_t);
+		put_u16(&p, packet_seqno++);
+
+		if (parse_packet(packet_buffer + OLSR_PACKET_HEADER_LEN + flooded_len))
+			return -1;
+
+		result->packets++;
+		result->messages += flooded_count;
+		result->duplicates += flooded_count;
+	}
+
+	return 0;
+}
+
+static uint64_t exported_bytes(ipfix_exporter *exporter) {
+	uint64_t bytes = 0;
+	int i;
+
+	for (i = 0; i < exporter->collector_max_num; i++) {
+		ipfix_receiving_collector *col = &exporter->collector_arr[i];
+
+		if (col->state != C_UNUSED && col->protocol == DATAFILE)
+			bytes += col->bytes_written;
+	}
+
+	return bytes;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  -n <nodes>     Number of mesh nodes (default: 100)\n"
+			"  -d <degree>    Average node degree (default: 4)\n"
+			"  -c <churn>     Fraction of links rewired per round (default: 0.05)\n"
+			"  -r <rounds>    Number of rounds (default: 10)\n"
+			"  -x <fraction>  Fraction of nodes which fall silent and expire after the last round (default: 0)\n"
+			"  -S <interval>  Export deltas with the given snapshot interval (default: full exports only)\n"
+			"  -f <basename>  Basename of the DATAFILE collector (default: olsr-bench-)\n"
+			"  -s <seed>      Seed of the topology generator (default: 1)\n"
+			"  -v <level>     Message verbosity level\n",
+			name);
+}
+
+static int parse_arguments(int argc, char **argv, struct bench_config *conf) {
+	int c;
+
+	while ((c = getopt(argc, argv, "n:d:c:r:x:S:f:s:v:h")) != -1) {
+		switch (c) {
+		case 'n':
+			conf->nodes = atoi(optarg);
+			break;
+		case 'd':
+			conf->degree = atoi(optarg);
+			break;
+		case 'c':
+			conf->churn = atof(optarg);
+			break;
+		case 'r':
+			conf->rounds = atoi(optarg);
+			break;
+		case 'x':
+			conf->expiry = atof(optarg);
+			break;
+		case 'S':
+			conf->snapshot_interval = atoi(optarg);
+			break;
+		case 'f':
+			conf->basename = optarg;
+			break;
+		case 's':
+			conf->seed = atoi(optarg);
+			break;
+		case 'v':
+			msg_setlevel(atoi(optarg));
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (conf->nodes < 2 || conf->nodes > 0xffffff) {
+		fprintf(stderr, "Number of nodes must be between 2 and %d.\n", 0xffffff);
+		return -1;
+	}
+
+	if (conf->degree < 1 || conf->degree >= conf->nodes) {
+		fprintf(stderr, "Degree must be between 1 and the number of nodes - 1.\n");
+		return -1;
+	}
+
+	if (conf->churn < 0 || conf->churn > 1) {
+		fprintf(stderr, "Churn rate must be between 0 and 1.\n");
+		return -1;
+	}
+
+	if (conf->expiry < 0 || conf->expiry > 1) {
+		fprintf(stderr, "Expiry fraction must be between 0 and 1.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct bench_config conf = { 100, 4, 0.05, 10, 0, 0, "olsr-bench-", 1 };
+	struct bench_result result;
+	struct bench_mesh mesh;
+	struct timespec start, end;
+	struct rusage usage_info;
+	ipfix_exporter *exporter;
+	uint32_t round, n;
+
+	if (parse_arguments(argc, argv, &conf)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	srand(conf.seed);
+	memset(&result, 0, sizeof(result));
+
+	if (ipfix_init_exporter(1, &exporter)) {
+		fprintf(stderr, "ipfix_init_exporter failed.\n");
+		return 1;
+	}
+
+	// The port of a DATAFILE collector is the maximum file size in KiB
+	if (ipfix_add_collector(exporter, conf.basename, 0x7fffffff, DATAFILE, NULL)) {
+		fprintf(stderr, "Failed to add DATAFILE collector %s.\n", conf.basename);
+		return 1;
+	}
+
+	if (declare_templates(exporter)) {
+		fprintf(stderr, "Failed to declare templates.\n");
+		return 1;
+	}
+
+	if (mesh_init(&mesh, conf.nodes, conf.degree)) {
+		fprintf(stderr, "Failed to generate mesh.\n");
+		return 1;
+	}
+
+	for (n = 0; n < mesh.node_count * conf.expiry; n++)
+		mesh.nodes[n].expiring = 1;
+
+	node_set = kh_init(2);
+
+	struct export_parameters params = {
+		exporter,
+		node_set,
+		conf.snapshot_interval,
+		0,
+		0,
+		0
+	};
+
+	printf("Mesh: %u nodes, %u links (average degree %.2f), churn %.3f, %u rounds\n",
+		   mesh.node_count, mesh.link_count,
+		   2.0 * mesh.link_count / mesh.node_count, conf.churn, conf.rounds);
+
+	for (round = 0; round < conf.rounds; round++) {
+		if (round > 0)
+			mesh_churn(&mesh, conf.churn);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		for (n = 0; n < mesh.node_count; n++) {
+			if (process_node(&mesh, n, &result)) {
+				fprintf(stderr, "Failed to parse packet of node %u.\n", n);
+				return 1;
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		result.parse_time += elapsed(&start, &end);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if (conf.snapshot_interval)
+			export_olsr(&params);
+		else
+			export_full(&params);
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		double export_time = elapsed(&start, &end);
+		if (result.exports == 0 || export_time < result.export_min)
+			result.export_min = export_time;
+		if (export_time > result.export_max)
+			result.export_max = export_time;
+
+		result.export_time += export_time;
+		result.exports++;
+	}
+
+	// HTime phase: the nodes only change their HELLO interval. None of the
+	// entries changes, yet the delta has to carry the new HTime.
+	if (conf.snapshot_interval && params.snapshot_timestamp) {
+		uint64_t bytes = exported_bytes(exporter);
+
+		mesh.hello_interval *= 2;
+
+		for (n = 0; n < mesh.node_count; n++) {
+			if (process_node(&mesh, n, &result)) {
+				fprintf(stderr, "Failed to parse packet of node %u.\n", n);
+				return 1;
+			}
+		}
+
+		params.exports_since_snapshot++;
+		export_delta(&params);
+		result.htime_bytes = exported_bytes(exporter) - bytes;
+
+		if (result.htime_bytes == 0) {
+			fprintf(stderr, "The HTime change has not been exported.\n");
+			return 1;
+		}
+	}
+
+	// Expiry phase: the expiring nodes fall silent, their entries age past
+	// the validity time and the next export has to withdraw them. TC
+	// entries superseded by a newer ANSN are kept for TC_INTERVAL seconds
+	// and all times have a resolution of one second.
+	if (conf.expiry > 0) {
+		result.expiry_nodes = kh_size(node_set);
+
+		if (BENCH_EXPIRY_VTIME / 1000 > TC_INTERVAL)
+			sleep(BENCH_EXPIRY_VTIME / 1000 + 1);
+		else
+			sleep(TC_INTERVAL + 1);
+
+		for (n = 0; n < mesh.node_count; n++) {
+			if (mesh.nodes[n].expiring)
+				continue;
+
+			if (process_node(&mesh, n, &result)) {
+				fprintf(stderr, "Failed to parse packet of node %u.\n", n);
+				return 1;
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if (conf.snapshot_interval)
+			export_olsr(&params);
+		else
+			export_full(&params);
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		result.expiry_export_time = elapsed(&start, &end);
+		result.expired_nodes = result.expiry_nodes - kh_size(node_set);
+	}
+
+	getrusage(RUSAGE_SELF, &usage_info);
+	uint64_t bytes = exported_bytes(exporter);
+
+	printf("Messages: %llu (%llu duplicates) in %llu packets\n",
+		   (unsigned long long) result.messages,
+		   (unsigned long long) result.duplicates,
+		   (unsigned long long) result.packets);
+	printf("Parsing: %.3f s, %.0f messages/s\n",
+		   result.parse_time,
+		   result.parse_time > 0 ? result.messages / result.parse_time : 0);
+	printf("Export latency: min %.3f ms avg %.3f ms max %.3f ms (%u exports)\n",
+		   result.export_min * 1e3,
+		   result.exports ? result.export_time * 1e3 / result.exports : 0,
+		   result.export_max * 1e3,
+		   result.exports);
+	printf("Bytes exported: %llu (%llu per export)\n",
+		   (unsigned long long) bytes,
+		   (unsigned long long) (result.exports ? bytes / result.exports : 0));
+	if (conf.snapshot_interval)
+		printf("HTime change: %llu bytes exported\n",
+			   (unsigned long long) result.htime_bytes);
+	if (conf.expiry > 0)
+		printf("Expiry: %u of %u nodes removed, export %.3f ms\n",
+			   result.expired_nodes, result.expiry_nodes,
+			   result.expiry_export_time * 1e3);
+	printf("Peak memory: %ld KiB\n", usage_info.ru_maxrss);
+
+	mesh_free(&mesh);
+	ipfix_deinit_exporter(exporter);
+
+	return 0;
+}
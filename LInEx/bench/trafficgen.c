@@ -0,0 +1,440 @@
+/*
+ * trafficgen.c
+ *
+ * Synthetic traffic generator for end-to-end tests of the capture path.
+ *
+ * Sends Ethernet frames carrying UDP and/or TCP packets of a configurable
+ * number of flows at a controlled packet rate through an AF_PACKET socket.
+ * Optionally OLSR HELLO messages are interleaved as broadcast frames so
+ * that the OLSR capture runs concurrently.
+ *
+ * Flow f uses the source address 10.1.(f / 256).(f % 256) and sends to
+ * 10.2.0.1, hence every flow is identified by its source address. The
+ * summary printed at the end contains the number of sent packets, flows
+ * and bytes (as seen by the capturing side, i.e. including the Ethernet
+ * header) in key=value format.
+ */
+
+#include "../flows/olsr_protocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <netinet/tcp.h>
+#include <netpacket/packet.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#define GEN_MAX_FRAME_SIZE 1514
+#define GEN_MIN_FRAME_SIZE (sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(struct tcphdr))
+#define GEN_MAX_FLOWS 65536
+
+/* Packets sent between two checks of the clock */
+#define GEN_BATCH 16
+
+#define OLSR_PORT 698
+
+enum gen_protocol_mix {
+	GenUDP,
+	GenTCP,
+	GenMixed
+};
+
+struct gen_config {
+	const char *interface;
+	uint8_t dst_mac[ETH_ALEN];
+	uint32_t rate;
+	uint64_t count;
+	double duration;
+	uint32_t flows;
+	uint32_t frame_size;
+	enum gen_protocol_mix mix;
+	uint32_t olsr_ratio;
+};
+
+struct gen_result {
+	uint64_t sent;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t olsr_sent;
+	double duration;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static void handle_signal(int signal) {
+	stop = 1;
+}
+
+static double now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint16_t ip_checksum(const void *data, size_t len) {
+	const uint16_t *p = data;
+	uint32_t sum = 0;
+
+	for (; len > 1; len -= 2)
+		sum += *p++;
+
+	if (len)
+		sum += *(const uint8_t *) p;
+
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum;
+}
+
+static int parse_mac(const char *str, uint8_t *mac) {
+	unsigned int b[ETH_ALEN];
+	int i;
+
+	if (sscanf(str, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != ETH_ALEN)
+		return -1;
+
+	for (i = 0; i < ETH_ALEN; i++)
+		mac[i] = b[i];
+
+	return 0;
+}
+
+static void put_ip_header(uint8_t *p, uint8_t protocol, uint32_t src, uint32_t dst, size_t len) {
+	struct iphdr *ip = (struct iphdr *) p;
+
+	memset(ip, 0, sizeof(struct iphdr));
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->ttl = 64;
+	ip->protocol = protocol;
+	ip->tot_len = htons(len);
+	ip->saddr = src;
+	ip->daddr = dst;
+	ip->check = ip_checksum(ip, sizeof(struct iphdr));
+}
+
+/**
+  * Encodes the frame of the given flow. The payload is left as zeros; the
+  * transport checksums are not computed as the capturing side does not
+  * verify them.
+  */
+static size_t build_flow_frame(uint8_t *frame, const struct gen_config *conf,
+							   const uint8_t *src_mac, uint32_t flow) {
+	struct ether_header *eth = (struct ether_header *) frame;
+	uint8_t *l4 = frame + sizeof(struct ether_header) + sizeof(struct iphdr);
+	size_t ip_len = conf->frame_size - sizeof(struct ether_header);
+	uint32_t src = htonl(0x0a010000 | flow);
+	uint32_t dst = htonl(0x0a020001);
+	int tcp = conf->mix == GenTCP || (conf->mix == GenMixed && (flow & 1));
+
+	memset(frame, 0, conf->frame_size);
+	memcpy(eth->ether_dhost, conf->dst_mac, ETH_ALEN);
+	memcpy(eth->ether_shost, src_mac, ETH_ALEN);
+	eth->ether_type = htons(ETHERTYPE_IP);
+
+	if (tcp) {
+		struct tcphdr *th = (struct tcphdr *) l4;
+
+		put_ip_header(frame + sizeof(struct ether_header), IPPROTO_TCP, src, dst, ip_len);
+		th->source = htons(10000 + flow % 50000);
+		th->dest = htons(80);
+		th->doff = sizeof(struct tcphdr) / 4;
+		th->ack = 1;
+		th->window = htons(65535);
+	} else {
+		struct udphdr *uh = (struct udphdr *) l4;
+
+		put_ip_header(frame + sizeof(struct ether_header), IPPROTO_UDP, src, dst, ip_len);
+		uh->source = htons(10000 + flow % 50000);
+		uh->dest = htons(53);
+		uh->len = htons(ip_len - sizeof(struct iphdr));
+	}
+
+	return conf->frame_size;
+}
+
+/**
+  * Encodes a broadcast OLSR packet with a HELLO message of the node
+  * 10.3.0.1 announcing a single symmetric neighbor.
+  */
+static size_t build_olsr_frame(uint8_t *frame, const uint8_t *src_mac, uint16_t seqno) {
+	static const uint8_t broadcast[ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+	struct ether_header *eth = (struct ether_header *) frame;
+	struct udphdr *uh = (struct udphdr *) (frame + sizeof(struct ether_header) + sizeof(struct iphdr));
+	uint8_t *olsr = (uint8_t *) (uh + 1);
+	uint8_t *p = olsr;
+	uint32_t originator = htonl(0x0a030001);
+	uint32_t neighbor = htonl(0x0a030002);
+	size_t message_len = OLSR_MESSAGE_HEADER_LEN + sizeof(uint32_t) + OLSR_HELLO_MESSAGE_HEADER_LEN
+						 + OLSR_HELLO_INFO_HEADER_LEN + sizeof(uint32_t);
+	size_t olsr_len = OLSR_PACKET_HEADER_LEN + message_len;
+	size_t udp_len = sizeof(struct udphdr) + olsr_len;
+
+	memset(frame, 0, sizeof(struct ether_header) + sizeof(struct iphdr) + udp_len);
+	memcpy(eth->ether_dhost, broadcast, ETH_ALEN);
+	memcpy(eth->ether_shost, src_mac, ETH_ALEN);
+	eth->ether_type = htons(ETHERTYPE_IP);
+
+	put_ip_header(frame + sizeof(struct ether_header), IPPROTO_UDP,
+				  originator, htonl(0xffffffff), sizeof(struct iphdr) + udp_len);
+	uh->source = htons(OLSR_PORT);
+	uh->dest = htons(OLSR_PORT);
+	uh->len = htons(udp_len);
+
+	// Packet header
+	*(uint16_t *) p = htons(olsr_len); p += 2;
+	*(uint16_t *) p = htons(seqno); p += 2;
+
+	// Message header: HELLO, vtime 6 s, size, originator, ttl 1, hops 0
+	*p++ = HELLO_MESSAGE;
+	*p++ = 0x86;
+	*(uint16_t *) p = htons(message_len); p += 2;
+	memcpy(p, &originator, sizeof(uint32_t)); p += 4;
+	*p++ = 1;
+	*p++ = 0;
+	*(uint16_t *) p = htons(seqno); p += 2;
+
+	// HELLO: reserved, htime 2 s, willingness
+	*(uint16_t *) p = 0; p += 2;
+	*p++ = 0x05;
+	*p++ = 3;
+
+	// Link message: SYM_LINK / SYM_NEIGH
+	*p++ = 0x06;
+	*p++ = 0;
+	*(uint16_t *) p = htons(OLSR_HELLO_INFO_HEADER_LEN + sizeof(uint32_t)); p += 2;
+	memcpy(p, &neighbor, sizeof(uint32_t)); p += 4;
+
+	return p - frame;
+}
+
+static int open_socket(const char *interface, int *if_index, uint8_t *mac) {
+	struct sockaddr_ll addr;
+	struct ifreq req;
+	// Protocol 0: the socket is only used for sending and receives nothing
+	int fd = socket(AF_PACKET, SOCK_RAW, 0);
+
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	strncpy(req.ifr_name, interface, IFNAMSIZ - 1);
+
+	if (ioctl(fd, SIOCGIFINDEX, &req) < 0) {
+		perror("SIOCGIFINDEX");
+		close(fd);
+		return -1;
+	}
+	*if_index = req.ifr_ifindex;
+
+	if (ioctl(fd, SIOCGIFHWADDR, &req) < 0) {
+		perror("SIOCGIFHWADDR");
+		close(fd);
+		return -1;
+	}
+	memcpy(mac, req.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = 0;
+	addr.sll_ifindex = *if_index;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s -i <interface> -m <destination MAC> [options]\n"
+			"  -r <pps>       Packet rate, 0 sends as fast as possible (default: 10000)\n"
+			"  -c <packets>   Number of packets to send (default: unlimited)\n"
+			"  -d <seconds>   Duration (default: 10)\n"
+			"  -F <flows>     Number of flows (default: 1000, at most %d)\n"
+			"  -s <bytes>     Frame size without FCS (default: 128)\n"
+			"  -p <protocol>  udp, tcp or mixed (default: mixed)\n"
+			"  -o <n>         Send an OLSR HELLO after every n-th packet (default: 0, off)\n",
+			name, GEN_MAX_FLOWS);
+}
+
+static int parse_arguments(int argc, char **argv, struct gen_config *conf) {
+	int have_mac = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "i:m:r:c:d:F:s:p:o:h")) != -1) {
+		switch (c) {
+		case 'i':
+			conf->interface = optarg;
+			break;
+		case 'm':
+			if (parse_mac(optarg, conf->dst_mac))
+				return -1;
+			have_mac = 1;
+			break;
+		case 'r':
+			conf->rate = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			conf->count = strtoull(optarg, NULL, 10);
+			break;
+		case 'd':
+			conf->duration = atof(optarg);
+			break;
+		case 'F':
+			conf->flows = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			conf->frame_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			if (!strcmp(optarg, "udp"))
+				conf->mix = GenUDP;
+			else if (!strcmp(optarg, "tcp"))
+				conf->mix = GenTCP;
+			else if (!strcmp(optarg, "mixed"))
+				conf->mix = GenMixed;
+			else
+				return -1;
+			break;
+		case 'o':
+			conf->olsr_ratio = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (conf->interface == NULL || !have_mac)
+		return -1;
+
+	if (conf->flows < 1 || conf->flows > GEN_MAX_FLOWS) {
+		fprintf(stderr, "Number of flows must be between 1 and %d.\n", GEN_MAX_FLOWS);
+		return -1;
+	}
+
+	if (conf->frame_size < GEN_MIN_FRAME_SIZE || conf->frame_size > GEN_MAX_FRAME_SIZE) {
+		fprintf(stderr, "Frame size must be between %zu and %d.\n", GEN_MIN_FRAME_SIZE, GEN_MAX_FRAME_SIZE);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct gen_config conf = { NULL, { 0 }, 10000, 0, 10, 1000, 128, GenMixed, 0 };
+	struct gen_result result;
+	uint8_t src_mac[ETH_ALEN];
+	uint8_t olsr_frame[GEN_MAX_FRAME_SIZE];
+	uint8_t *frames;
+	uint64_t *flow_packets;
+	int if_index;
+	int fd;
+	uint32_t f;
+
+	if (parse_arguments(argc, argv, &conf)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if ((fd = open_socket(conf.interface, &if_index, src_mac)) < 0)
+		return 1;
+
+	// All frames are prepared up front so that sending only costs the
+	// system call.
+	frames = malloc((size_t) conf.flows * conf.frame_size);
+	flow_packets = calloc(conf.flows, sizeof(uint64_t));
+	if (frames == NULL || flow_packets == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	for (f = 0; f < conf.flows; f++)
+		build_flow_frame(frames + (size_t) f * conf.frame_size, &conf, src_mac, f);
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	memset(&result, 0, sizeof(result));
+
+	double start = now();
+	double deadline = conf.duration > 0 ? start + conf.duration : 0;
+	uint64_t i = 0;
+	uint16_t olsr_seqno = 0;
+
+	while (!stop && (conf.count == 0 || i < conf.count)) {
+		uint32_t b;
+
+		if (conf.rate > 0) {
+			// Sleep until the first packet of the batch is due
+			double due = start + (double) i / conf.rate;
+			double delta = due - now();
+
+			if (delta > 0) {
+				struct timespec ts = { (time_t) delta, (long) ((delta - (time_t) delta) * 1e9) };
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		if (deadline && now() >= deadline)
+			break;
+
+		for (b = 0; b < GEN_BATCH && (conf.count == 0 || i < conf.count); b++, i++) {
+			uint32_t flow = i % conf.flows;
+
+			if (send(fd, frames + (size_t) flow * conf.frame_size, conf.frame_size, 0) < 0) {
+				result.errors++;
+			} else {
+				result.sent++;
+				result.bytes += conf.frame_size;
+				flow_packets[flow]++;
+			}
+
+			if (conf.olsr_ratio && (i + 1) % conf.olsr_ratio == 0) {
+				size_t len = build_olsr_frame(olsr_frame, src_mac, olsr_seqno++);
+
+				if (send(fd, olsr_frame, len, 0) >= 0)
+					result.olsr_sent++;
+			}
+		}
+	}
+
+	result.duration = now() - start;
+
+	uint32_t active_flows = 0;
+	for (f = 0; f < conf.flows; f++) {
+		if (flow_packets[f])
+			active_flows++;
+	}
+
+	printf("sent=%llu\n", (unsigned long long) result.sent);
+	printf("send_errors=%llu\n", (unsigned long long) result.errors);
+	printf("olsr_sent=%llu\n", (unsigned long long) result.olsr_sent);
+	printf("flows=%u\n", active_flows);
+	printf("bytes=%llu\n", (unsigned long long) result.bytes);
+	printf("duration=%.3f\n", result.duration);
+	printf("rate=%.0f\n", result.duration > 0 ? result.sent / result.duration : 0);
+
+	free(frames);
+	free(flow_packets);
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,187 @@
+#!/bin/bash
+#
+# veth_harness.sh
+#
+# End-to-end test of the capture and export path. Creates a veth pair whose
+# capturing end lives in a separate network namespace, runs LInEx on it and
+# sends traffic with linex-trafficgen at a list of packet rates. The export
+# is received by linex-sink inside the namespace.
+#
+# For every rate the number of sent, captured and dropped packets, the number
+# of exported flows and bytes, the export latency and the CPU usage of LInEx
+# are printed. The highest rate without any loss is reported at the end.
+#
+# Has to be run as root from the build directory (built with
+# -D WITH_BENCHMARKS=ON) or with -b <build directory>.
+
+set -e
+
+BUILD_DIR=.
+RATES="10000 50000 100000 200000 500000"
+DURATION=10
+FLOWS=1000
+FRAME_SIZE=128
+PROTOCOL=mixed
+OLSR_RATIO=0
+PORT=4739
+
+NS=linex-test
+GEN_IF=linex-gen
+CAP_IF=linex-cap
+
+# Flow timeouts and export interval of LInEx in seconds
+INACTIVE_TIMEOUT=1
+ACTIVE_TIMEOUT=5
+EXPORT_INTERVAL=1
+# The capture statistics are exported every 10 seconds
+STATISTICS_INTERVAL=10
+
+usage() {
+	cat >&2 <<EOF
+Usage: $0 [options]
+  -b <dir>       Build directory containing LInEx and the benchmarks (default: .)
+  -r "<rates>"   Packet rates to test (default: "$RATES")
+  -d <seconds>   Duration of every run (default: $DURATION)
+  -F <flows>     Number of flows (default: $FLOWS)
+  -s <bytes>     Frame size (default: $FRAME_SIZE)
+  -p <protocol>  udp, tcp or mixed (default: $PROTOCOL)
+  -o <n>         Send an OLSR HELLO after every n-th packet (default: off)
+EOF
+	exit 1
+}
+
+while getopts "b:r:d:F:s:p:o:h" opt; do
+	case $opt in
+		b) BUILD_DIR=$OPTARG ;;
+		r) RATES=$OPTARG ;;
+		d) DURATION=$OPTARG ;;
+		F) FLOWS=$OPTARG ;;
+		s) FRAME_SIZE=$OPTARG ;;
+		p) PROTOCOL=$OPTARG ;;
+		o) OLSR_RATIO=$OPTARG ;;
+		*) usage ;;
+	esac
+done
+
+BUILD_DIR=$(cd "$BUILD_DIR" && pwd)
+for binary in LInEx linex-trafficgen linex-sink; do
+	if [ ! -x "$BUILD_DIR/$binary" ]; then
+		echo "$BUILD_DIR/$binary not found." >&2
+		exit 1
+	fi
+done
+
+if [ "$(id -u)" != 0 ]; then
+	echo "$0 has to be run as root." >&2
+	exit 1
+fi
+
+WORK_DIR=$(mktemp -d)
+LINEX_PID=
+SINK_PID=
+
+cleanup() {
+	[ -n "$LINEX_PID" ] && kill $LINEX_PID 2>/dev/null
+	[ -n "$SINK_PID" ] && kill $SINK_PID 2>/dev/null
+	ip link del $GEN_IF 2>/dev/null
+	ip netns del $NS 2>/dev/null
+	rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+trap "exit 1" INT TERM
+
+ip netns add $NS
+ip link add $GEN_IF type veth peer name $CAP_IF
+ip link set $CAP_IF netns $NS
+ip link set $GEN_IF up
+ip netns exec $NS ip link set lo up
+ip netns exec $NS ip link set $CAP_IF up
+CAP_MAC=$(ip netns exec $NS cat /sys/class/net/$CAP_IF/address)
+
+# Returns the value of key $1 in the key=value file $2
+get() {
+	sed -n "s/^$1=//p" "$2"
+}
+
+# Returns the CPU time of process $1 in clock ticks
+cpu_ticks() {
+	awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+cat > "$WORK_DIR/linex.conf" <<EOF
+COLLECTOR 127.0.0.1:$PORT UDP
+INTERFACE $CAP_IF
+INTERVAL 3600
+FLOW_PARAMS $INACTIVE_TIMEOUT $ACTIVE_TIMEOUT 1024
+EXPORT_FLOW_INTERVAL $EXPORT_INTERVAL
+EOF
+
+# Time after the end of the traffic until all flows and capture statistics
+# have been exported
+DRAIN=$((INACTIVE_TIMEOUT + EXPORT_INTERVAL + 1))
+[ $DRAIN -le $STATISTICS_INTERVAL ] && DRAIN=$((STATISTICS_INTERVAL + 1))
+
+MAX_LOSSLESS=0
+
+printf "%10s %10s %10s %10s %8s %8s %8s %9s %9s %9s %6s\n" \
+	rate sent captured dropped loss% flows bytes% lat_avg lat_max olsr cpu%
+
+for rate in $RATES; do
+	SINK_OUT="$WORK_DIR/sink-$rate"
+	GEN_OUT="$WORK_DIR/gen-$rate"
+
+	ip netns exec $NS "$BUILD_DIR/linex-sink" -u $PORT > "$SINK_OUT" &
+	SINK_PID=$!
+	ip netns exec $NS "$BUILD_DIR/LInEx" -f "$WORK_DIR/linex.conf" -v 0 > "$WORK_DIR/linex-$rate.log" 2>&1 &
+	LINEX_PID=$!
+	sleep 1
+
+	START_TICKS=$(cpu_ticks $LINEX_PID)
+	START_TIME=$(date +%s.%N)
+
+	"$BUILD_DIR/linex-trafficgen" -i $GEN_IF -m $CAP_MAC -r $rate -d $DURATION \
+		-F $FLOWS -s $FRAME_SIZE -p $PROTOCOL -o $OLSR_RATIO > "$GEN_OUT"
+	sleep $DRAIN
+
+	END_TICKS=$(cpu_ticks $LINEX_PID)
+	END_TIME=$(date +%s.%N)
+
+	kill -INT $LINEX_PID
+	wait $LINEX_PID || true
+	LINEX_PID=
+	kill -TERM $SINK_PID
+	wait $SINK_PID || true
+	SINK_PID=
+
+	sent=$(get sent "$GEN_OUT")
+	sent_flows=$(get flows "$GEN_OUT")
+	sent_bytes=$(get bytes "$GEN_OUT")
+	olsr_sent=$(get olsr_sent "$GEN_OUT")
+	captured=$(get captured "$SINK_OUT")
+	dropped=$(get dropped "$SINK_OUT")
+	flows=$(get flows "$SINK_OUT")
+	bytes=$(get bytes "$SINK_OUT")
+	olsr_captured=$(get olsr_captured "$SINK_OUT")
+
+	# tp_packets of PACKET_STATISTICS includes the dropped packets
+	received=$((captured - dropped))
+
+	awk -v rate=$rate -v sent=$sent -v captured=$received -v dropped=$dropped \
+		-v flows=$flows -v sent_flows=$sent_flows -v bytes=$bytes -v sent_bytes=$sent_bytes \
+		-v lat_avg=$(get latency_avg "$SINK_OUT") -v lat_max=$(get latency_max "$SINK_OUT") \
+		-v olsr="$olsr_captured/$olsr_sent" -v ticks=$((END_TICKS - START_TICKS)) \
+		-v hz=$(getconf CLK_TCK) -v start=$START_TIME -v end=$END_TIME \
+		'BEGIN {
+			printf "%10d %10d %10d %10d %8.3f %4d/%-4d %8.2f %9.3f %9.3f %9s %6.1f\n",
+				rate, sent, captured, dropped,
+				sent ? 100 * (sent - captured) / sent : 0,
+				flows, sent_flows, sent_bytes ? 100 * bytes / sent_bytes : 0,
+				lat_avg, lat_max, olsr, 100 * ticks / hz / (end - start)
+		}'
+
+	if [ "$received" -ge "$sent" ] && [ "$dropped" -eq 0 ] && [ "$flows" -eq "$sent_flows" ]; then
+		[ $rate -gt $MAX_LOSSLESS ] && MAX_LOSSLESS=$rate
+	fi
+done
+
+echo "max_lossless_rate=$MAX_LOSSLESS"
@@ -53,11 +53,20 @@ regex_t regex_collector;
 regex_t regex_interval;
 regex_t regex_interface;
 regex_t regex_compression;
+regex_t regex_compression_streaming;
+regex_t regex_compression_dictionary;
+regex_t regex_compression_adaptive;
+regex_t regex_compression_fallback;
 regex_t regex_flow_params;
 regex_t regex_flow_sampling;
 regex_t regex_anonymization;
 regex_t regex_export_flow_interval;
 regex_t regex_export_olsr_interval;
+regex_t regex_export_olsr_delta;
+regex_t regex_stall_threshold;
+regex_t regex_send_batch;
+regex_t regex_tcp_backlog;
+regex_t regex_spill;
 regex_t regex_dtls;
 regex_t regex_odid;
 regex_t regex_xmlfile;
@@ -81,6 +90,12 @@ config_file_descriptor* create_config_file_descriptor(){
 	current_config_file->interfaces = list_create();
 	current_config_file->compression_method = NULL;
 	current_config_file->compression_method_params = NULL;
+	current_config_file->compression_streaming = 0;
+	current_config_file->compression_dictionary = NULL;
+	current_config_file->compression_fallbacks = list_create();
+	current_config_file->compression_adaptive = 0;
+	current_config_file->compression_min_size = 0;
+	current_config_file->compression_cpu_budget = 0;
 	current_config_file->flow_inactive_timeout = 15;
 	current_config_file->flow_active_timeout = 120;
 	current_config_file->flow_object_cache_size = 64;
@@ -91,6 +106,7 @@ config_file_descriptor* create_config_file_descriptor(){
 	current_config_file->anonymization_enabled = 0;
 	memset(current_config_file->anonymization_key, 0, sizeof(current_config_file->anonymization_key));
 	memset(current_config_file->anonymization_pad, 0, sizeof(current_config_file->anonymization_pad));
+	current_config_file->anonymization_cache_size = 1024;
 #endif
 #ifdef SUPPORT_DTLS
 	current_config_file->certificate = NULL;
@@ -100,6 +116,15 @@ config_file_descriptor* create_config_file_descriptor(){
 #endif
 	current_config_file->export_flow_interval = 60000;
 	current_config_file->export_olsr_interval = 120000;
+	current_config_file->export_olsr_snapshot_interval = 0;
+	current_config_file->stall_threshold = 500;
+	current_config_file->send_batch_messages = 32;
+	current_config_file->send_batch_delay = 100;
+	current_config_file->tcp_backlog = 512;
+	current_config_file->tcp_buffer_unconnected = 0;
+	current_config_file->spill_directory = NULL;
+	current_config_file->spill_size = 0;
+	current_config_file->spill_rate = 0;
 	current_config_file->observation_domain_id = OBSERVATION_DOMAIN_STANDARD_ID;
 	current_config_file->xmlfile = NULL;
 	current_config_file->xmlpostprocessing = NULL;
@@ -183,13 +208,22 @@ void init_config_regex(){
 	regcomp(&regex_interval,"^[ \t]*INTERVAL[ \t]+([0-9]+)[ \t\n]*$",REG_EXTENDED);
 	regcomp(&regex_interface,"^[ \t]*INTERFACE[ \t]+([A-Za-z0-9.-]+)[ \t\n]*$",REG_EXTENDED);
 	regcomp(&regex_compression,"^[ \t]*COMPRESSION[ \t]+([A-Za-z0-9.-]+)([ \t]+(.+))?[ \t\n]*$",REG_EXTENDED);
+	regcomp(&regex_compression_streaming,"^[ \t]*COMPRESSION_STREAMING[ \t\n]*$",REG_EXTENDED);
+	regcomp(&regex_compression_dictionary,"^[ \t]*COMPRESSION_DICTIONARY[ \t]+([^ \t\n]+)[ \t\n]*$",REG_EXTENDED);
+	regcomp(&regex_compression_adaptive,"^[ \t]*COMPRESSION_ADAPTIVE[ \t]+([0-9]+)[ \t]+([0-9]+)[ \t\n]*$",REG_EXTENDED);
+	regcomp(&regex_compression_fallback,"^[ \t]*COMPRESSION_FALLBACK[ \t]+([A-Za-z0-9.-]+)([ \t]+([0-9]+))?[ \t\n]*$",REG_EXTENDED);
 	regcomp(&regex_flow_params, "^[ \t]*FLOW_PARAMS[ \t]+([0-9]+)[ \t]+([0-9]+)[ \t]+([0-9]+)[ \t\n]*$",REG_EXTENDED);
 	regcomp(&regex_flow_sampling, "^[ \t]*FLOW_SAMPLING[ \t]+(CRC32|BPF)[ \t]+([0-9]+)[ \t]*(0x[0-9a-fA-F]+|[0-9]+)?[ \t\n]*$", REG_EXTENDED);
 #ifdef SUPPORT_ANONYMIZATION
-	regcomp(&regex_anonymization,"^[ \t]*ANONYMIZATION[ \t]+([A-Fa-f0-9]+)[ \t]+([A-Fa-f0-9]+)[ \t\n]*$", REG_EXTENDED);
+	regcomp(&regex_anonymization,"^[ \t]*ANONYMIZATION[ \t]+([A-Fa-f0-9]+)[ \t]+([A-Fa-f0-9]+)([ \t]+([0-9]+))?[ \t\n]*$", REG_EXTENDED);
 #endif
 	regcomp(&regex_export_flow_interval, "^[ \t]*EXPORT_FLOW_INTERVAL[ \t]+([0-9]+)", REG_EXTENDED);
 	regcomp(&regex_export_olsr_interval, "^[ \t]*EXPORT_OLSR_INTERVAL[ \t]+([0-9]+)", REG_EXTENDED);
+	regcomp(&regex_export_olsr_delta, "^[ \t]*EXPORT_OLSR_DELTA[ \t]+([0-9]+)[ \t\n]*$", REG_EXTENDED);
+	regcomp(&regex_stall_threshold, "^[ \t]*STALL_THRESHOLD[ \t]+([0-9]+)[ \t\n]*$", REG_EXTENDED);
+	regcomp(&regex_send_batch, "^[ \t]*SEND_BATCH[ \t]+([0-9]+)([ \t]+([0-9]+))?[ \t\n]*$", REG_EXTENDED);
+	regcomp(&regex_tcp_backlog, "^[ \t]*TCP_BACKLOG[ \t]+([0-9]+)([ \t]+(BUFFER|DROP))?[ \t\n]*$", REG_EXTENDED);
+	regcomp(&regex_spill, "^[ \t]*SPILL[ \t]+([^ \t\n]+)[ \t]+([0-9]+)([ \t]+([0-9]+))?[ \t\n]*$", REG_EXTENDED);
 #ifdef SUPPORT_DTLS
 	regcomp(&regex_dtls, "^[ \t]*DTLS[ \t]+([^ ]+)[ \t]+([^ ]+)[ \t]+([^ ]+)[ \t]+([^ ]+)[ \t\n]*$", REG_EXTENDED);
 #endif
@@ -212,6 +246,10 @@ void deinit_config_regex() {
 	regfree(&regex_interval);
 	regfree(&regex_interface);
 	regfree(&regex_compression);
+	regfree(&regex_compression_streaming);
+	regfree(&regex_compression_dictionary);
+	regfree(&regex_compression_adaptive);
+	regfree(&regex_compression_fallback);
 	regfree(&regex_flow_params);
 	regfree(&regex_flow_sampling);
 #ifdef SUPPORT_ANONYMIZATION
@@ -219,6 +257,11 @@ void deinit_config_regex() {
 #endif
 	regfree(&regex_export_flow_interval);
 	regfree(&regex_export_olsr_interval);
+	regfree(&regex_export_olsr_delta);
+	regfree(&regex_stall_threshold);
+	regfree(&regex_send_batch);
+	regfree(&regex_tcp_backlog);
+	regfree(&regex_spill);
 #ifdef SUPPORT_DTLS
 	regfree(&regex_dtls);
 #endif
@@ -467,6 +510,59 @@ int process_compression_line(char* line, int in_line){
 	return 1;
 }
 
+/**
+ * Processes the compression dictionary line in the config file
+ * <line> is the content of that line
+ * <in_line> is the number of that line
+ */
+int process_compression_dictionary_line(char* line, int in_line){
+	if(regexec(&regex_compression_dictionary,line,2,config_buffer,0)){
+		THROWEXCEPTION("COMPRESSION_DICTIONARY line %d in config file is malformed:\n%s",in_line,line);
+	}
+
+	free(current_config_file->compression_dictionary);
+	current_config_file->compression_dictionary = extract_string_from_regmatch(&config_buffer[1], line);
+
+	return 1;
+}
+
+/**
+ * Processes the adaptive compression line in the config file
+ * <line> is the content of that line
+ * <in_line> is the number of that line
+ */
+int process_compression_adaptive_line(char* line, int in_line){
+	if(regexec(&regex_compression_adaptive,line,3,config_buffer,0)){
+		THROWEXCEPTION("COMPRESSION_ADAPTIVE line %d in config file is malformed:\n%s",in_line,line);
+	}
+
+	current_config_file->compression_adaptive = 1;
+	current_config_file->compression_min_size = extract_uint_from_regmatch(&config_buffer[1], line);
+	current_config_file->compression_cpu_budget = extract_uint_from_regmatch(&config_buffer[2], line);
+
+	return 1;
+}
+
+/**
+ * Processes a compression fallback line in the config file
+ * <line> is the content of that line
+ * <in_line> is the number of that line
+ */
+int process_compression_fallback_line(char* line, int in_line){
+	compression_fallback_descriptor* fallback;
+
+	if(regexec(&regex_compression_fallback,line,4,config_buffer,0)){
+		THROWEXCEPTION("COMPRESSION_FALLBACK line %d in config file is malformed:\n%s",in_line,line);
+	}
+
+	fallback = (compression_fallback_descriptor*) malloc(sizeof(compression_fallback_descriptor));
+	fallback->method = extract_string_from_regmatch(&config_buffer[1], line);
+	fallback->level = config_buffer[3].rm_so < 0 ? 0 : extract_uint_from_regmatch(&config_buffer[3], line);
+	list_insert(current_config_file->compression_fallbacks, fallback);
+
+	return 1;
+}
+
 /**
  * Processes the flow params line in the config file
  * <line> is the content of that line
@@ -546,7 +642,7 @@ void read_hex_string(char *input, uint8_t *dst, size_t dst_len) {
  * <in_line> is the number of that line
  */
 int process_anonymization_line(char* line, int in_line){
-	if(regexec(&regex_anonymization,line,3,config_buffer,0)){
+	if(regexec(&regex_anonymization,line,5,config_buffer,0)){
 		THROWEXCEPTION("ANONYMIZATION line %d in config file is malformed:\n%s",in_line,line);
 	}
 
@@ -561,6 +657,10 @@ int process_anonymization_line(char* line, int in_line){
 	free(key);
 	free(pad);
 
+	// Optional number of cached prefixes, 0 disables the cache
+	if (config_buffer[4].rm_so != -1)
+		current_config_file->anonymization_cache_size = extract_uint_from_regmatch(&config_buffer[4], line);
+
 	current_config_file->anonymization_enabled = 1;
 
 	return 1;
@@ -597,6 +697,93 @@ int process_export_olsr_interval_line(char* line, int in_line){
 	return 1;
 }
 
+/**
+ * Processes the export_olsr_delta line in the config file
+ * <line> is the content of that line
+ * <in_line> is the number of that line
+ */
+int process_export_olsr_delta_line(char* line, int in_line){
+	if(regexec(&regex_export_olsr_delta,line,2,config_buffer,0)){
+		THROWEXCEPTION("EXPORT_OLSR_DELTA line %d in config file is malformed:\n%s",in_line,line);
+	}
+
+	current_config_file->export_olsr_snapshot_interval = extract_uint_from_regmatch(&config_buffer[1], line);
+
+	return 1;
+}
+
+/**
+ * Processes the stall_threshold line in the config file
+ * <line> is the content of that line
+ * <in_line> is the number of that line
+ */
+int process_stall_threshold_line(char* line, int in_line){
+	if(regexec(&regex_stall_threshold,line,2,config_buffer,0)){
+		THROWEXCEPTION("STALL_THRESHOLD line %d in config file is malformed:\n%s",in_line,line);
+	}
+
+	current_config_file->stall_threshold = extract_uint_from_regmatch(&config_buffer[1], line);
+
+	return 1;
+}
+
+/**
+ * Processes the send_batch line in the config file
+ * <line> is the content of that line
+ * <in_line> is the number of that line
+ */
+int process_send_batch_line(char* line, int in_line){
+	if(regexec(&regex_send_batch,line,4,config_buffer,0)){
+		THROWEXCEPTION("SEND_BATCH line %d in config file is malformed:\n%s",in_line,line);
+	}
+
+	current_config_file->send_batch_messages = extract_uint_from_regmatch(&config_buffer[1], line);
+	if (config_buffer[3].rm_so != -1)
+		current_config_file->send_batch_delay = extract_uint_from_regmatch(&config_buffer[3], line);
+
+	return 1;
+}
+
+/**
+ * Processes the tcp_backlog line in the config file
+ * <line> is the content of that line
+ * <in_line> is the number of that line
+ */
+int process_tcp_backlog_line(char* line, int in_line){
+	if(regexec(&regex_tcp_backlog,line,4,config_buffer,0)){
+		THROWEXCEPTION("TCP_BACKLOG line %d in config file is malformed:\n%s",in_line,line);
+	}
+
+	current_config_file->tcp_backlog = extract_uint_from_regmatch(&config_buffer[1], line);
+	if (current_config_file->tcp_backlog == 0 || current_config_file->tcp_backlog > 1024 * 1024)
+		THROWEXCEPTION("TCP_BACKLOG line %d in config file is out of range (1 to 1048576 KiB)", in_line);
+	if (config_buffer[3].rm_so != -1)
+		current_config_file->tcp_buffer_unconnected = !strncmp(&line[config_buffer[3].rm_so], "BUFFER", 6);
+
+	return 1;
+}
+
+/**
+ * Processes the spill line in the config file
+ * <line> is the content of that line
+ * <in_line> is the number of that line
+ */
+int process_spill_line(char* line, int in_line){
+	if(regexec(&regex_spill,line,5,config_buffer,0)){
+		THROWEXCEPTION("SPILL line %d in config file is malformed:\n%s",in_line,line);
+	}
+
+	free(current_config_file->spill_directory);
+	current_config_file->spill_directory = extract_string_from_regmatch(&config_buffer[1], line);
+	current_config_file->spill_size = extract_uint_from_regmatch(&config_buffer[2], line);
+	if (current_config_file->spill_size == 0 || current_config_file->spill_size > 1024 * 1024)
+		THROWEXCEPTION("SPILL line %d in config file is out of range (1 to 1048576 KiB)", in_line);
+	if (config_buffer[4].rm_so != -1)
+		current_config_file->spill_rate = extract_uint_from_regmatch(&config_buffer[4], line);
+
+	return 1;
+}
+
 /**
  * Processes the interface line in the config file
  * <line> is the content of that line
@@ -732,6 +919,14 @@ int process_config_line(char* line, int in_line){
 				process_interval_line(line, in_line);
 			} else if(!regexec(&regex_compression,line,2,config_buffer,0)) {
 				process_compression_line(line, in_line);
+			} else if(!regexec(&regex_compression_streaming,line,1,config_buffer,0)) {
+				current_config_file->compression_streaming = 1;
+			} else if(!regexec(&regex_compression_dictionary,line,2,config_buffer,0)) {
+				process_compression_dictionary_line(line, in_line);
+			} else if(!regexec(&regex_compression_adaptive,line,1,config_buffer,0)) {
+				process_compression_adaptive_line(line, in_line);
+			} else if(!regexec(&regex_compression_fallback,line,1,config_buffer,0)) {
+				process_compression_fallback_line(line, in_line);
 			} else if(!regexec(&regex_flow_params,line,4,config_buffer,0)) {
 				process_flow_params_line(line, in_line);
 			} else if(!regexec(&regex_flow_sampling,line,4,config_buffer,0)) {
@@ -746,6 +941,16 @@ int process_config_line(char* line, int in_line){
 				process_export_flow_interval_line(line, in_line);
 			} else if (!regexec(&regex_export_olsr_interval, line, 2, config_buffer, 0)) {
 				process_export_olsr_interval_line(line, in_line);
+			} else if (!regexec(&regex_export_olsr_delta, line, 2, config_buffer, 0)) {
+				process_export_olsr_delta_line(line, in_line);
+			} else if (!regexec(&regex_stall_threshold, line, 2, config_buffer, 0)) {
+				process_stall_threshold_line(line, in_line);
+			} else if (!regexec(&regex_send_batch, line, 4, config_buffer, 0)) {
+				process_send_batch_line(line, in_line);
+			} else if (!regexec(&regex_tcp_backlog, line, 2, config_buffer, 0)) {
+				process_tcp_backlog_line(line, in_line);
+			} else if (!regexec(&regex_spill, line, 5, config_buffer, 0)) {
+				process_spill_line(line, in_line);
 #ifdef SUPPORT_DTLS
 			} else if (!regexec(&regex_dtls, line, 5, config_buffer, 0)) {
 				process_dtls_line(line, in_line);
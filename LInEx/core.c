@@ -39,7 +39,9 @@
 #include "flows/topology_set.h"
 #include "flows/hello_set.h"
 #include "flows/object_cache.h"
+#include "flows/duplicate_set.h"
 #include "flows/export.h"
+#include "flows/perf_counters.h"
 #include "event_loop.h"
 
 
@@ -61,6 +63,67 @@ extern node_set_hash *node_set;
 
 flow_capture_session flow_session;
 struct capture_session *olsr_capture_session = NULL;
+static void collector_socket_readable(int fd, ipfix_exporter *exporter) {
+	ipfix_socket_event(exporter, fd, IPFIX_SOCKET_READ);
+}
+
+static void collector_socket_writable(int fd, ipfix_exporter *exporter) {
+	ipfix_socket_event(exporter, fd, IPFIX_SOCKET_WRITE);
+}
+
+/**
+ * The event loop has removed the socket already, ipfixlolib detects the
+ * error on either event.
+ */
+static void collector_socket_error(int fd, ipfix_exporter *exporter) {
+	ipfix_socket_event(exporter, fd, IPFIX_SOCKET_READ | IPFIX_SOCKET_WRITE);
+}
+
+/**
+ * Watches the sockets of TCP collectors in the event loop on behalf of
+ * ipfixlolib.
+ */
+static void watch_collector_socket(int fd, int old_events, int events, ipfix_exporter *exporter) {
+	if (events == 0) {
+		event_loop_remove_fd(fd);
+		return;
+	}
+
+	if (old_events == 0 &&
+			event_loop_add_fd(fd, (event_fd_callback) &collector_socket_readable,
+							  (event_fd_error_callback) &collector_socket_error, exporter)) {
+		msg(MSG_ERROR, "Failed to watch collector socket %d.", fd);
+		return;
+	}
+
+	event_loop_set_write_callback(fd, (events & IPFIX_SOCKET_WRITE) ?
+								  (event_fd_callback) &collector_socket_writable : NULL);
+}
+
+#ifdef SUPPORT_COMPRESSION
+/**
+ * Builds the compression dictionary from the templates of <exporter> and
+ * writes it to <filename>, from where the collector has to load it.
+ */
+static void init_compression_dictionary(ipfix_exporter *exporter, const char *filename) {
+	unsigned char dictionary[IPFIX_MAX_DICTIONARY_SIZE];
+	int length = ipfix_build_compression_dictionary(exporter, dictionary, sizeof(dictionary));
+	FILE *fh;
+
+	if (length < 0)
+		THROWEXCEPTION("Failed to build compression dictionary.");
+
+	fh = fopen(filename, "w");
+	if (fh == NULL || fwrite(dictionary, 1, length, fh) != (size_t) length)
+		THROWEXCEPTION("Could not write compression dictionary %s", filename);
+	fclose(fh);
+
+	if (ipfix_set_compression_dictionary(exporter, dictionary, length))
+		THROWEXCEPTION("Failed to set compression dictionary.");
+	msg(MSG_INFO, "Wrote %d byte compression dictionary to %s", length, filename);
+}
+#endif
+
 /**
  * Takes all collectors from config file <conf>
  * and adds them to the exporter <exporter>
@@ -158,12 +221,18 @@ void sigwait_handler(int signal)
 	childpid = -1;
 }
 
+void sigusr1_handler(int signal)
+{
+	event_loop_request_statistics();
+}
+
 #ifdef OBJECT_CACHE_DEBUG
 void sigterm_handler(int signal)
 {
 
 	object_cache_statistics(flow_session.flow_key_cache);
 	object_cache_statistics(flow_session.flow_info_cache);
+	duplicate_set_statistics();
 
 	exit(0);
 }
@@ -183,6 +252,15 @@ int main(int argc, char **argv)
 		THROWEXCEPTION("Could not install signal handler.");
 	}
 
+	// Print event loop statistics on demand
+	struct sigaction usr1;
+	usr1.sa_handler = sigusr1_handler;
+	sigemptyset(&usr1.sa_mask);
+	usr1.sa_flags = 0;
+	if (sigaction(SIGUSR1, &usr1, NULL) == -1) {
+		THROWEXCEPTION("Could not install signal handler.");
+	}
+
 #ifdef OBJECT_CACHE_DEBUG
 	struct sigaction term;
 
@@ -213,12 +291,40 @@ int main(int argc, char **argv)
 									 conf->compression_method_params);
 		if (ret)
 			THROWEXCEPTION("Failed to initialize compression module.");
+		ipfix_set_compression_streaming(send_exporter, conf->compression_streaming);
+
+		list_node* cur;
+		for (cur = conf->compression_fallbacks->first; cur != NULL; cur = cur->next) {
+			compression_fallback_descriptor* fallback = (compression_fallback_descriptor*) cur->data;
+			// the level replaces the parameters of the COMPRESSION line
+			if (ipfix_add_compression(send_exporter, fallback->method, NULL, fallback->level))
+				THROWEXCEPTION("Failed to add compression module %s.", fallback->method);
+		}
+		if (conf->compression_adaptive)
+			ipfix_set_adaptive_compression(send_exporter, conf->compression_min_size,
+						       conf->compression_cpu_budget);
 	}
 #endif
 #ifdef SUPPORT_DTLS
 	ipfix_set_dtls_certificate(send_exporter, conf->certificate, conf->certificate_key);
 	ipfix_set_ca_locations(send_exporter, conf->ca, conf->ca_path);
 #endif
+	// Messages to UDP collectors are sent in batches at the end of each export
+	if (ipfix_set_deferred_flush(send_exporter, conf->send_batch_messages, conf->send_batch_delay))
+		THROWEXCEPTION("Failed to allocate IPFIX send queue.");
+	// TCP collectors are served by the event loop and drop data once the
+	// backlog exceeds its limit
+	ipfix_set_tcp_backlog(send_exporter, conf->tcp_backlog * 1024);
+	ipfix_set_unconnected_policy(send_exporter, conf->tcp_buffer_unconnected ?
+								 IPFIX_UNCONNECTED_BUFFER : IPFIX_UNCONNECTED_DROP);
+	// Messages for unreachable collectors wait on disk and are replayed by
+	// ipfix_beat() once they are back
+	if (ipfix_set_spill_queue(send_exporter, conf->spill_directory,
+							  conf->spill_size * 1024, conf->spill_rate * 1024))
+		THROWEXCEPTION("Failed to allocate IPFIX spill queue.");
+	ipfix_set_socket_watcher(send_exporter,
+							 (void (*)(int, int, int, void *)) &watch_collector_socket,
+							 send_exporter);
 	//Add collectors from config file
 	init_collectors(conf,send_exporter);
 
@@ -261,13 +367,28 @@ int main(int argc, char **argv)
 	} else if (!conf->anonymization_enabled) {
 		msg(MSG_INFO, "CryptoPAN disabled");
 	} else {
-		msg(MSG_INFO, "CryptoPAN enabled");
+		enum aes_backend backend = flow_session.cryptopan.accel.backend;
+
+		// Never trust the hardware backend with wrong results
+		if (backend != AES_BACKEND_SOFTWARE && cryptopan_self_test(backend, 0)) {
+			msg(MSG_ERROR, "CryptoPAN self test failed with %s, using software AES.", aes_accel_name(backend));
+			cryptopan_set_backend(&flow_session.cryptopan, AES_BACKEND_SOFTWARE);
+		}
+		msg(MSG_INFO, "CryptoPAN enabled (%s)", aes_accel_name(flow_session.cryptopan.accel.backend));
+
+		if (cryptopan_init_cache(&flow_session.cryptopan, conf->anonymization_cache_size))
+			msg(MSG_ERROR, "Failed to allocate CryptoPAN cache, continuing without.");
 	}
 #endif
 
 	// Declare IPFIX templates to export monitoring information
 	if (declare_templates(send_exporter))
 		msg(MSG_ERROR, "Failed to export templates.");
+#ifdef SUPPORT_COMPRESSION
+	// The dictionary depends on all templates
+	if (conf->compression_dictionary)
+		init_compression_dictionary(send_exporter, conf->compression_dictionary);
+#endif
 
 	//Open XML file
 	FILE* xmlfh = NULL;
@@ -280,8 +401,15 @@ int main(int argc, char **argv)
 	// Add timer to export routing tables
 	node_set = kh_init(2);
 
-	struct export_parameters params = { send_exporter, node_set };
-	event_loop_add_timer(conf->export_olsr_interval, (void (*)(void *)) &export_full, &params);
+	struct export_parameters params = {
+		send_exporter,
+		node_set,
+		conf->export_olsr_snapshot_interval,
+		0,
+		0,
+		0
+	};
+	event_loop_add_timer(conf->export_olsr_interval, (void (*)(void *)) &export_olsr, &params);
 
 	// Add timer to export flows
 	struct export_flow_parameter flow_param = { send_exporter, &flow_session };
@@ -299,6 +427,37 @@ int main(int argc, char **argv)
 	};
 	event_loop_add_timer(10000, (void (*) (void *)) &export_capture_statistics, &capture_statistics_param);
 
+	// Add timer to export event loop statistics
+	event_loop_add_timer(60000, (void (*) (void *)) &export_event_loop_statistics, send_exporter);
+
+	// Collectors are connected and reconnected by the event loop
+	event_loop_add_timer(200, (event_timer_callback) &ipfix_beat, send_exporter);
+
+#ifdef SUPPORT_PERF_COUNTERS
+	// Statistics are still exported without hardware counters if the PMU
+	// is not accessible.
+	perf_counters_init();
+#endif
+
+	event_loop_set_stall_threshold(conf->stall_threshold);
+	event_loop_set_callback_name((const void *) &bind_to_interfaces, "bind_to_interfaces");
+	event_loop_set_callback_name((const void *) &export_olsr, "export_olsr");
+	event_loop_set_callback_name((const void *) &export_flows, "export_flows");
+	event_loop_set_callback_name((const void *) &export_records, "export_records");
+	event_loop_set_callback_name((const void *) &export_capture_statistics, "export_capture_statistics");
+	event_loop_set_callback_name((const void *) &export_event_loop_statistics, "export_event_loop_statistics");
+	event_loop_set_callback_name((const void *) &collector_socket_readable, "collector_socket_readable");
+	event_loop_set_callback_name((const void *) &collector_socket_writable, "collector_socket_writable");
+	event_loop_set_callback_name((const void *) &ipfix_beat, "ipfix_beat");
+
+	// From now on log messages are queued and printed by the event loop so
+	// that the packet path never blocks on stdout
+	if (msg_init_async())
+		THROWEXCEPTION("Failed to allocate log ring.");
+	atexit(&msg_flush);
+	event_loop_add_timer(100, (event_timer_callback) &msg_flush, NULL);
+	event_loop_set_callback_name((const void *) &msg_flush, "msg_flush");
+
 	return event_loop_run();
 }
 
@@ -317,6 +476,7 @@ void export_records(struct export_record_parameters *params) {
 		msg(MSG_INFO, "Exporting IPFIX messages...");
 
 		config_to_ipfix(send_exporter, conf);
+		ipfix_flush(send_exporter);
 	}
 
 	if(xmlfh != NULL) {
@@ -334,6 +494,8 @@ void export_records(struct export_record_parameters *params) {
 				msg(MSG_FATAL, "Could not fork. XML postprocessing skipped.");
 			}
 			if(childpid == 0) {
+				// The parent prints the messages queued before the fork
+				msg_exit_async(0);
 				msg(MSG_INFO, "Trigger XML postprocessing.");
 				int ret = system(conf->xmlpostprocessing);
 				exit(ret);
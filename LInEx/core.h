@@ -99,6 +99,12 @@ typedef struct{
 	char* xmlpostprocessing;
 	char* compression_method;
 	char* compression_method_params;
+	uint8_t compression_streaming; // keep the compression history across messages
+	char *compression_dictionary; // file receiving the dictionary built from the templates, NULL if none
+	list* compression_fallbacks; // cheaper compressors for adaptive compression
+	uint8_t compression_adaptive; // choose the compression of each message
+	uint32_t compression_min_size; // messages shorter than this are sent uncompressed
+	uint32_t compression_cpu_budget; // percent of one CPU spent compressing, 0 for no limit
 	uint16_t flow_inactive_timeout;
 	uint16_t flow_active_timeout;
 	uint16_t flow_object_cache_size;
@@ -109,9 +115,19 @@ typedef struct{
 	uint8_t anonymization_enabled;
 	uint8_t anonymization_key[16];
 	uint8_t anonymization_pad[16];
+	uint32_t anonymization_cache_size;
 #endif
 	uint32_t export_flow_interval;
 	uint32_t export_olsr_interval;
+	uint16_t export_olsr_snapshot_interval;
+	uint32_t stall_threshold;
+	uint32_t send_batch_messages;
+	uint32_t send_batch_delay;
+	uint32_t tcp_backlog; // KiB waiting per TCP collector before data is dropped
+	uint8_t tcp_buffer_unconnected; // keep data for TCP collectors which are not connected
+	char *spill_directory; // spill queues of unreachable collectors, NULL if disabled
+	uint32_t spill_size; // KiB of each spill queue
+	uint32_t spill_rate; // KiB/s replayed per collector, 0 for no limit
 #ifdef SUPPORT_DTLS
 	char *certificate;
 	char *certificate_key;
@@ -132,6 +148,14 @@ typedef struct{
 #endif
 } collector_descriptor;
 
+/**
+ * A cheaper compressor to switch to once compressing takes too long
+ */
+typedef struct{
+	char* method;
+	int level; // 0 for the level of the COMPRESSION line
+} compression_fallback_descriptor;
+
 
 /**
  * A descriptor for one record which becomes one
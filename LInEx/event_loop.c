@@ -2,241 +2,895 @@
 #include "ipfixlolib/msg.h"
 
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <poll.h>
 #include <errno.h>
-#include <sys/time.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#ifdef SUPPORT_EPOLL
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+/**
+  * Maximum number of events fetched by a single call to epoll_wait().
+  */
+#define EVENT_LOOP_MAX_EVENTS 64
+
+/**
+  * Default stall threshold in milliseconds.
+  */
+#define EVENT_LOOP_DEFAULT_STALL_THRESHOLD 500
+
+/**
+  * Maximum number of timer callbacks run before the file descriptors are
+  * polled again.
+  */
+#define EVENT_LOOP_MAX_TIMER_RUNS 64
+
+/**
+  * Maximum number of missed runs an EVENT_TIMER_CATCHUP_BURST timer catches
+  * up on. Further runs are skipped.
+  */
+#define EVENT_TIMER_MAX_BURST 16
 
-struct dynamic_array {
+struct event_loop_fd_entry {
 	/**
-	  * Size of one item in the array.
+	  * The file descriptor or -1 if the entry has been removed.
 	  */
-	size_t item_size;
+	int fd;
+	enum event_fd_mode mode;
+	event_fd_callback callback;
+	event_fd_error_callback error_callback;
+	void *user_param;
+	struct event_callback_statistics *statistics;
 
 	/**
-	  * Number of set items in the array.
+	  * Invoked when the file descriptor is writable or NULL if writability
+	  * is not monitored.
 	  */
-	size_t size;
+	event_fd_callback write_callback;
+	struct event_callback_statistics *write_statistics;
 
+#ifndef SUPPORT_EPOLL
 	/**
-	  * Total amount of space allocated in this array.
+	  * Position of the file descriptor in the pollfd array.
 	  */
-	size_t space;
+	size_t index;
+#endif
 
 	/**
-	  * Buffer in which the array items are stored.
+	  * Next entry in the list of removed entries.
 	  */
-	char *buffer;
+	struct event_loop_fd_entry *next_removed;
 };
 
-struct event_loop_fd_entry {
-	int fd;
-	event_fd_callback callback;
-	event_fd_error_callback error_callback;
-	void *user_param;
-};
+struct event_timer {
+	/**
+	  * Absolute expiry time in nanoseconds on the monotonic clock.
+	  */
+	uint64_t deadline;
 
-struct event_loop_timer_entry {
-	uint32_t ms_timeout;
+	/**
+	  * Interval of periodic timers in milliseconds or 0 for one-shot timers.
+	  */
+	uint32_t ms_interval;
+	enum event_timer_catchup catchup;
 	event_timer_callback callback;
 	void *user_param;
-	struct timeval next_run;
+	struct event_callback_statistics *statistics;
+
+	/**
+	  * Position in the timer heap or -1 while the timer is not queued (i.e.
+	  * while its callback is running).
+	  */
+	int32_t index;
+
+	/**
+	  * Set if the timer has been cancelled from within its own callback.
+	  */
+	uint8_t cancelled;
 };
 
 struct event_loop {
+#ifdef SUPPORT_EPOLL
+	int epoll_fd;
+#else
 	struct pollfd *fds;
 
-	uint32_t min_timer_value;
+	/**
+	  * Entries in the same order as the pollfd array.
+	  */
+	struct event_loop_fd_entry **poll_entries;
+	size_t fds_space;
+#endif
+
+	/**
+	  * Number of registered file descriptors.
+	  */
+	size_t fd_count;
+
+	/**
+	  * Entries indexed by their file descriptor.
+	  */
+	struct event_loop_fd_entry **fd_table;
+	size_t fd_table_size;
 
-	struct dynamic_array fd_entries;
-	struct dynamic_array timer_entries;
+	/**
+	  * Entries removed while dispatching events. Pending events may still
+	  * refer to them so they are only freed once the dispatch has finished.
+	  */
+	struct event_loop_fd_entry *removed_entries;
+
+	/**
+	  * Binary min-heap of timers ordered by their deadline.
+	  */
+	struct event_timer **timers;
+	size_t timer_count;
+	size_t timer_space;
+
+	/**
+	  * Run time statistics of all callbacks ever registered.
+	  */
+	struct event_callback_statistics *statistics;
+
+	/**
+	  * Callback runs taking longer than this are reported as stalls.
+	  */
+	uint64_t stall_threshold_us;
+
+	/**
+	  * Set from signal handlers to print the statistics once the current
+	  * wait has been interrupted.
+	  */
+	volatile sig_atomic_t statistics_requested;
 };
 
 struct event_loop global_event_loop = {
+#ifdef SUPPORT_EPOLL
+	-1, // epoll_fd
+#else
 	NULL, // fds
-	4294967295U, // min_timer_value
-	{ sizeof(struct event_loop_fd_entry), 0, 0, NULL }, // fd_entries
-	{ sizeof(struct event_loop_timer_entry), 0, 0, NULL } // timer_entries
+	NULL, // poll_entries
+	0, // fds_space
+#endif
+	0, // fd_count
+	NULL, // fd_table
+	0, // fd_table_size
+	NULL, // removed_entries
+	NULL, // timers
+	0, // timer_count
+	0, // timer_space
+	NULL, // statistics
+	EVENT_LOOP_DEFAULT_STALL_THRESHOLD * 1000ULL, // stall_threshold_us
+	0 // statistics_requested
 };
 
-static char *array_alloc_new_item(struct dynamic_array *array) {
-	if (array->buffer == NULL) {
-		array->buffer = malloc(array->item_size);
+static uint64_t monotonic_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-		if (array->buffer == NULL)
-			return NULL;
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-		array->space = 1;
-	} else if (array->space == array->size) {
-		void *new_buffer = realloc(array->buffer, array->item_size * (array->space + 1));
+/**
+  * Returns the statistics of the given callback, creating them if needed.
+  */
+static struct event_callback_statistics *callback_statistics(const void *callback,
+															 enum event_callback_kind kind) {
+	struct event_callback_statistics *statistics = global_event_loop.statistics;
 
-		if (new_buffer == NULL)
-			return NULL;
+	while (statistics != NULL) {
+		if (statistics->callback == callback)
+			return statistics;
 
-		array->buffer = new_buffer;
-		array->space++;
+		statistics = statistics->next;
 	}
 
-	array->size++;
+	statistics = (struct event_callback_statistics *) calloc(1, sizeof(struct event_callback_statistics));
+	if (statistics == NULL)
+		return NULL;
+
+	statistics->callback = callback;
+	statistics->kind = kind;
+	statistics->next = global_event_loop.statistics;
+	global_event_loop.statistics = statistics;
 
-	return array->buffer + ((array->size - 1) * array->item_size);
+	return statistics;
 }
 
-static int array_remove_item(struct dynamic_array *array, uint32_t index) {
-	if (index >= array->size)
-		return -1;
+/**
+  * Assigns a human readable name to a callback which is used in stall
+  * reports and exported statistics.
+  */
+void event_loop_set_callback_name(const void *callback, const char *name) {
+	struct event_callback_statistics *statistics = global_event_loop.statistics;
+
+	while (statistics != NULL) {
+		if (statistics->callback == callback) {
+			statistics->name = name;
+			return;
+		}
+
+		statistics = statistics->next;
+	}
 
-	array->size--;
+	// Not registered yet - the kind is updated on registration
+	statistics = callback_statistics(callback, EVENT_CALLBACK_FD);
+	if (statistics != NULL)
+		statistics->name = name;
+}
 
+void event_loop_set_stall_threshold(uint32_t ms_threshold) {
+	global_event_loop.stall_threshold_us = (uint64_t) ms_threshold * 1000ULL;
+}
 
-	memmove(array->buffer + (index * array->item_size),
-			array->buffer + ((index + 1) * array->item_size),
-			array->item_size * (array->size - index));
+const struct event_callback_statistics *event_loop_statistics() {
+	return global_event_loop.statistics;
+}
 
-	if (array->space - array->size >= 4) {
-		char *new_buffer = realloc(array->buffer, array->item_size * array->size);
+/**
+  * Requests the statistics to be printed by the event loop. Safe to be called
+  * from signal handlers.
+  */
+void event_loop_request_statistics() {
+	global_event_loop.statistics_requested = 1;
+}
 
-		if (new_buffer != NULL) {
-			array->buffer = new_buffer;
-			array->space = array->size;
+void event_loop_print_statistics() {
+	const struct event_callback_statistics *statistics = global_event_loop.statistics;
+	uint64_t suppressed, dropped;
+
+	// Keep the order with respect to queued log messages
+	msg_flush();
+
+	printf("Event loop callback statistics (stall threshold %llu ms):\n",
+		   (unsigned long long) (global_event_loop.stall_threshold_us / 1000));
+
+	for (; statistics != NULL; statistics = statistics->next) {
+		size_t i;
+
+		printf("%s %p (%s): Calls: %llu Total: %llu us Avg: %llu us Max: %u us Stalls: %u\n",
+			   statistics->name ? statistics->name : "<unnamed>",
+			   statistics->callback,
+			   statistics->kind == EVENT_CALLBACK_TIMER ? "timer" : "fd",
+			   (unsigned long long) statistics->calls,
+			   (unsigned long long) statistics->total_us,
+			   (unsigned long long) (statistics->calls ? statistics->total_us / statistics->calls : 0),
+			   statistics->max_us,
+			   statistics->stalls);
+
+		for (i = 0; i < EVENT_LOOP_HISTOGRAM_BUCKETS; i++) {
+			if (statistics->histogram[i] == 0)
+				continue;
+
+			printf("\t< %llu us: %u\n", 1ULL << (i + 1), statistics->histogram[i]);
 		}
 	}
 
+	msg_statistics(&suppressed, &dropped);
+	printf("Log messages suppressed: %llu dropped: %llu\n",
+		   (unsigned long long) suppressed, (unsigned long long) dropped);
+
+	fflush(stdout);
+}
+
+/**
+  * Accounts a callback run which started at the given time and returns the
+  * current time.
+  */
+static uint64_t record_callback_run(struct event_callback_statistics *statistics, uint64_t start) {
+	uint64_t end = monotonic_now();
+
+	if (statistics == NULL)
+		return end;
+
+	uint64_t us = (end - start) / 1000;
+	size_t bucket = 0;
+
+	if (us > 1)
+		bucket = 63 - __builtin_clzll(us);
+	if (bucket >= EVENT_LOOP_HISTOGRAM_BUCKETS)
+		bucket = EVENT_LOOP_HISTOGRAM_BUCKETS - 1;
+
+	statistics->calls++;
+	statistics->total_us += us;
+	statistics->histogram[bucket]++;
+	if (us > statistics->max_us)
+		statistics->max_us = us > UINT32_MAX ? UINT32_MAX : (uint32_t) us;
+
+	if (us > global_event_loop.stall_threshold_us) {
+		statistics->stalls++;
+		msg(MSG_ERROR, "Callback %s (%p) stalled the event loop for %llu ms.",
+			statistics->name ? statistics->name : "<unnamed>",
+			statistics->callback,
+			(unsigned long long) (us / 1000));
+	}
+
+	return end;
+}
+
+/**
+  * Makes sure that the file descriptor table can hold the given file
+  * descriptor.
+  */
+static int fd_table_reserve(int fd) {
+	if ((size_t) fd < global_event_loop.fd_table_size)
+		return 0;
+
+	size_t size = global_event_loop.fd_table_size ? global_event_loop.fd_table_size : 16;
+	while (size <= (size_t) fd)
+		size *= 2;
+
+	struct event_loop_fd_entry **table =
+			(struct event_loop_fd_entry **) realloc(global_event_loop.fd_table,
+													sizeof(struct event_loop_fd_entry *) * size);
+	if (table == NULL)
+		return -1;
+
+	memset(table + global_event_loop.fd_table_size, 0,
+		   sizeof(struct event_loop_fd_entry *) * (size - global_event_loop.fd_table_size));
+
+	global_event_loop.fd_table = table;
+	global_event_loop.fd_table_size = size;
+
 	return 0;
 }
 
-static void add_time(const struct timeval *source, struct timeval *dest, uint32_t ms_time) {
-	dest->tv_usec = source->tv_usec + (ms_time * 1000);
-	dest->tv_sec = source->tv_sec + (dest->tv_usec / 1000000);
-	dest->tv_usec %= 100000;
+#ifdef SUPPORT_EPOLL
+static int backend_init() {
+	if (global_event_loop.epoll_fd != -1)
+		return 0;
+
+	global_event_loop.epoll_fd = epoll_create(EVENT_LOOP_MAX_EVENTS);
+
+	if (global_event_loop.epoll_fd == -1) {
+		msg(MSG_ERROR, "Failed to create epoll instance: %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
 }
 
-int event_loop_add_fd(int fd,
-					  event_fd_callback callback,
-					  event_fd_error_callback error_callback,
-					  void *user_param) {
-	struct event_loop_fd_entry *fd_entry =
-			(struct event_loop_fd_entry *) array_alloc_new_item(&global_event_loop.fd_entries);
+static int backend_ctl_fd(struct event_loop_fd_entry *entry, int op) {
+	struct epoll_event event;
 
-	if (fd_entry == NULL)
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	if (entry->write_callback)
+		event.events |= EPOLLOUT;
+	if (entry->mode == EVENT_FD_EDGE_TRIGGERED)
+		event.events |= EPOLLET;
+	event.data.ptr = entry;
+
+	if (epoll_ctl(global_event_loop.epoll_fd, op, entry->fd, &event)) {
+		msg(MSG_ERROR, "Failed to %s fd %d in epoll instance: %s",
+			op == EPOLL_CTL_ADD ? "add" : "modify", entry->fd, strerror(errno));
 		return -1;
+	}
 
-	if (global_event_loop.fds == NULL) {
-		global_event_loop.fds = (struct pollfd *) malloc(sizeof(struct pollfd));
+	return 0;
+}
 
-		if (global_event_loop.fds == NULL)
-			return -1;
-	} else {
-		struct pollfd *fds =
-				(struct pollfd *) realloc(global_event_loop.fds, sizeof(struct pollfd) * (global_event_loop.fd_entries.size));
+static int backend_add_fd(struct event_loop_fd_entry *entry) {
+	if (backend_init())
+		return -1;
+
+	return backend_ctl_fd(entry, EPOLL_CTL_ADD);
+}
+
+static int backend_update_fd(struct event_loop_fd_entry *entry) {
+	return backend_ctl_fd(entry, EPOLL_CTL_MOD);
+}
+
+static void backend_remove_fd(struct event_loop_fd_entry *entry) {
+	// The file descriptor may have been closed already which removes it from
+	// the epoll instance implicitly.
+	if (epoll_ctl(global_event_loop.epoll_fd, EPOLL_CTL_DEL, entry->fd, NULL)
+			&& errno != EBADF && errno != ENOENT)
+		msg(MSG_ERROR, "Failed to remove fd %d from epoll instance: %s", entry->fd, strerror(errno));
+}
+#else
+static int backend_add_fd(struct event_loop_fd_entry *entry) {
+	if (global_event_loop.fd_count == global_event_loop.fds_space) {
+		size_t space = global_event_loop.fds_space ? 2 * global_event_loop.fds_space : 8;
 
+		struct pollfd *fds =
+				(struct pollfd *) realloc(global_event_loop.fds, sizeof(struct pollfd) * space);
 		if (fds == NULL)
 			return -1;
-
 		global_event_loop.fds = fds;
+
+		struct event_loop_fd_entry **entries =
+				(struct event_loop_fd_entry **) realloc(global_event_loop.poll_entries,
+														sizeof(struct event_loop_fd_entry *) * space);
+		if (entries == NULL)
+			return -1;
+		global_event_loop.poll_entries = entries;
+
+		global_event_loop.fds_space = space;
+	}
+
+	struct pollfd *poll_fd = global_event_loop.fds + global_event_loop.fd_count;
+
+	poll_fd->fd = entry->fd;
+	poll_fd->events = POLLIN;
+	poll_fd->revents = 0;
+
+	entry->index = global_event_loop.fd_count;
+	global_event_loop.poll_entries[entry->index] = entry;
+
+	return 0;
+}
+
+static int backend_update_fd(struct event_loop_fd_entry *entry) {
+	struct pollfd *poll_fd = global_event_loop.fds + entry->index;
+
+	poll_fd->events = POLLIN;
+	if (entry->write_callback)
+		poll_fd->events |= POLLOUT;
+
+	return 0;
+}
+
+static void backend_remove_fd(struct event_loop_fd_entry *entry) {
+	// Move the last pollfd into the gap. fd_count has already been decremented.
+	size_t last = global_event_loop.fd_count;
+
+	if (entry->index != last) {
+		global_event_loop.fds[entry->index] = global_event_loop.fds[last];
+		global_event_loop.poll_entries[entry->index] = global_event_loop.poll_entries[last];
+		global_event_loop.poll_entries[entry->index]->index = entry->index;
+	}
+}
+#endif
+
+int event_loop_add_fd(int fd,
+					  event_fd_callback callback,
+					  event_fd_error_callback error_callback,
+					  void *user_param) {
+	return event_loop_add_fd_mode(fd, callback, error_callback, user_param,
+								  EVENT_FD_LEVEL_TRIGGERED);
+}
+
+int event_loop_add_fd_mode(int fd,
+						   event_fd_callback callback,
+						   event_fd_error_callback error_callback,
+						   void *user_param,
+						   enum event_fd_mode mode) {
+	if (fd < 0 || fd_table_reserve(fd))
+		return -1;
+
+	if (global_event_loop.fd_table[fd] != NULL) {
+		msg(MSG_ERROR, "fd %d is already registered in the event loop.", fd);
+		return -1;
 	}
 
+	struct event_loop_fd_entry *fd_entry =
+			(struct event_loop_fd_entry *) malloc(sizeof(struct event_loop_fd_entry));
+
+	if (fd_entry == NULL)
+		return -1;
+
 	fd_entry->fd = fd;
+	fd_entry->mode = mode;
 	fd_entry->callback = callback;
 	fd_entry->error_callback = error_callback;
 	fd_entry->user_param = user_param;
+	fd_entry->statistics = callback_statistics((const void *) callback, EVENT_CALLBACK_FD);
+	fd_entry->write_callback = NULL;
+	fd_entry->write_statistics = NULL;
+	fd_entry->next_removed = NULL;
 
-	struct pollfd *poll_fd = (global_event_loop.fds + global_event_loop.fd_entries.size - 1);
+	if (backend_add_fd(fd_entry)) {
+		free(fd_entry);
+		return -1;
+	}
 
-	poll_fd->fd = fd;
-	poll_fd->events = POLLIN;
+	global_event_loop.fd_table[fd] = fd_entry;
+	global_event_loop.fd_count++;
 
 	return 0;
 }
 
-int event_loop_add_timer(uint32_t ms_timeout, event_timer_callback callback, void *user_param) {
-	struct event_loop_timer_entry *timer_entry = (struct event_loop_timer_entry *) array_alloc_new_item(&global_event_loop.timer_entries);
+/**
+  * Removes the given file descriptor from the event loop. This function may
+  * be called from within callbacks.
+  *
+  * Returns 0 on success or -1 if the file descriptor was not registered.
+  */
+int event_loop_remove_fd(int fd) {
+	if (fd < 0 || (size_t) fd >= global_event_loop.fd_table_size)
+		return -1;
+
+	struct event_loop_fd_entry *fd_entry = global_event_loop.fd_table[fd];
 
-	if (timer_entry == NULL)
+	if (fd_entry == NULL)
+		return -1;
+
+	global_event_loop.fd_table[fd] = NULL;
+	global_event_loop.fd_count--;
+	backend_remove_fd(fd_entry);
+
+	fd_entry->fd = -1;
+	fd_entry->next_removed = global_event_loop.removed_entries;
+	global_event_loop.removed_entries = fd_entry;
+
+	return 0;
+}
+
+/**
+  * Additionally invokes the given callback whenever the registered file
+  * descriptor is writable, e.g. to send buffered data once a non-blocking
+  * socket accepts it again. Passing NULL stops monitoring writability. This
+  * function may be called from within callbacks.
+  *
+  * Returns 0 on success or -1 if the file descriptor was not registered.
+  */
+int event_loop_set_write_callback(int fd, event_fd_callback callback) {
+	if (fd < 0 || (size_t) fd >= global_event_loop.fd_table_size)
 		return -1;
 
-	timer_entry->ms_timeout = ms_timeout;
-	timer_entry->callback = callback;
-	timer_entry->user_param = user_param;
+	struct event_loop_fd_entry *fd_entry = global_event_loop.fd_table[fd];
 
-	gettimeofday(&timer_entry->next_run, NULL);
+	if (fd_entry == NULL)
+		return -1;
+
+	if (fd_entry->write_callback == callback)
+		return 0;
+
+	fd_entry->write_callback = callback;
+	if (callback)
+		fd_entry->write_statistics = callback_statistics((const void *) callback, EVENT_CALLBACK_FD);
 
-	add_time(&timer_entry->next_run, &timer_entry->next_run, ms_timeout);
+	return backend_update_fd(fd_entry);
+}
+
+static void free_removed_entries() {
+	while (global_event_loop.removed_entries != NULL) {
+		struct event_loop_fd_entry *fd_entry = global_event_loop.removed_entries;
 
-	if (ms_timeout < global_event_loop.min_timer_value) {
-		global_event_loop.min_timer_value = ms_timeout;
+		global_event_loop.removed_entries = fd_entry->next_removed;
+		free(fd_entry);
 	}
+}
 
-	return 0;
+/**
+  * Invokes the callbacks of a file descriptor for which an event has been
+  * reported. Erroneous file descriptors are removed from the event loop
+  * before their error callback is invoked.
+  */
+static void dispatch_fd_event(struct event_loop_fd_entry *fd_entry, int readable, int writable, int error) {
+	if (fd_entry->fd == -1)
+		return;
+
+	uint64_t start = monotonic_now();
+
+	// Errors of sockets monitored for writability are reported along with
+	// EPOLLOUT / POLLOUT, the write callback has to query them.
+	if (writable && fd_entry->write_callback) {
+		(*fd_entry->write_callback)(fd_entry->fd, fd_entry->user_param);
+		start = record_callback_run(fd_entry->write_statistics, start);
+
+		if (fd_entry->fd == -1)
+			return;
+	}
+
+	if (readable) {
+		(*fd_entry->callback)(fd_entry->fd, fd_entry->user_param);
+	} else if (error && !(writable && fd_entry->write_callback)) {
+		int fd = fd_entry->fd;
+
+		event_loop_remove_fd(fd);
+
+		if (fd_entry->error_callback)
+			(*fd_entry->error_callback)(fd, fd_entry->user_param);
+	}
+
+	record_callback_run(fd_entry->statistics, start);
 }
 
-int event_loop_run() {
-	int timeout = global_event_loop.min_timer_value;
+#ifdef SUPPORT_EPOLL
+static int wait_for_events(int timeout) {
+	struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
 
-	while (1) {
-		int ret = poll(global_event_loop.fds, global_event_loop.fd_entries.size, timeout);
+	if (backend_init())
+		return -1;
+
+	int ret = epoll_wait(global_event_loop.epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+
+	if (ret == -1) {
+		if (errno != EINTR)
+			msg(MSG_ERROR, "Error occured while waiting for events: %s", strerror(errno));
+		return -1;
+	}
+
+	int i;
+	for (i = 0; i < ret; i++) {
+		dispatch_fd_event((struct event_loop_fd_entry *) events[i].data.ptr,
+						  events[i].events & EPOLLIN,
+						  events[i].events & EPOLLOUT,
+						  events[i].events & (EPOLLERR | EPOLLHUP));
+	}
 
-		if (ret == -1) {
+	return 0;
+}
+#else
+static int wait_for_events(int timeout) {
+	int ret = poll(global_event_loop.fds, global_event_loop.fd_count, timeout);
+
+	if (ret == -1) {
+		if (errno != EINTR)
 			msg(MSG_ERROR, "Error occured while polling: %s", strerror(errno));
-			continue;
-		}
+		return -1;
+	}
 
-		if (ret > 0) {
-			// At least one file descriptor is ready for reading
-			size_t i;
-
-			for (i = 0; i < global_event_loop.fd_entries.size; i++) {
-				struct event_loop_fd_entry *fd_entry =
-						((struct event_loop_fd_entry *) global_event_loop.fd_entries.buffer) + i;
-				struct pollfd *fd = global_event_loop.fds + i;
-
-				// DPRINTF("%d", fd->revents);
-				if (fd->revents & POLLIN)
-					(*fd_entry->callback)(fd_entry->fd, fd_entry->user_param);
-				else if (fd->revents & (POLLERR | POLLHUP | POLLNVAL)) {
-					if (fd_entry->error_callback)
-						(*fd_entry->error_callback)(fd_entry->fd, fd_entry->user_param);
-
-					// Remove from event loop
-					array_remove_item(&global_event_loop.fd_entries, i);
-
-					// Remove from pollfd list
-					memmove(global_event_loop.fds + i,
-							global_event_loop.fds + i + 1,
-							global_event_loop.fd_entries.size - i);
-					global_event_loop.fds =
-							(struct pollfd *) realloc(global_event_loop.fds,
-													  sizeof(struct pollfd) * (global_event_loop.fd_entries.size));
-					i--;
-				}
-			}
+	size_t i = 0;
+	while (ret > 0 && i < global_event_loop.fd_count) {
+		struct event_loop_fd_entry *fd_entry = global_event_loop.poll_entries[i];
+		short revents = global_event_loop.fds[i].revents;
+
+		global_event_loop.fds[i].revents = 0;
+
+		if (revents) {
+			ret--;
+			dispatch_fd_event(fd_entry, revents & POLLIN, revents & POLLOUT,
+							  revents & (POLLERR | POLLHUP | POLLNVAL));
 		}
 
-		size_t i;
-		struct timeval now;
-		int diff;
-		timeout = global_event_loop.min_timer_value;
-		gettimeofday(&now, NULL);
+		// If the entry has been removed the last entry took its place
+		if (i < global_event_loop.fd_count && global_event_loop.poll_entries[i] == fd_entry)
+			i++;
+	}
+
+	return 0;
+}
+#endif
+
+static void timer_heap_set(size_t index, struct event_timer *timer) {
+	global_event_loop.timers[index] = timer;
+	timer->index = index;
+}
 
-		for (i = 0; i < global_event_loop.timer_entries.size; i++) {
-			struct event_loop_timer_entry *timer_entry = ((struct event_loop_timer_entry *) global_event_loop.timer_entries.buffer) + i;
+static void timer_heap_sift_up(size_t index) {
+	struct event_timer **timers = global_event_loop.timers;
+	struct event_timer *timer = timers[index];
 
-			if (timer_entry->next_run.tv_sec < now.tv_sec || (timer_entry->next_run.tv_sec == now.tv_sec && timer_entry->next_run.tv_usec <= now.tv_usec)) {
-				DPRINTF("Running timer due to expiry");
+	while (index > 0) {
+		size_t parent = (index - 1) / 2;
 
-				(*timer_entry->callback)(timer_entry->user_param);
+		if (timers[parent]->deadline <= timer->deadline)
+			break;
 
-				add_time(&now, &timer_entry->next_run, timer_entry->ms_timeout);
+		timer_heap_set(index, timers[parent]);
+		index = parent;
+	}
+
+	timer_heap_set(index, timer);
+}
+
+static void timer_heap_sift_down(size_t index) {
+	struct event_timer **timers = global_event_loop.timers;
+	struct event_timer *timer = timers[index];
+	size_t count = global_event_loop.timer_count;
+
+	while (2 * index + 1 < count) {
+		size_t child = 2 * index + 1;
+
+		if (child + 1 < count && timers[child + 1]->deadline < timers[child]->deadline)
+			child++;
+
+		if (timer->deadline <= timers[child]->deadline)
+			break;
+
+		timer_heap_set(index, timers[child]);
+		index = child;
+	}
+
+	timer_heap_set(index, timer);
+}
+
+static int timer_heap_push(struct event_timer *timer) {
+	if (global_event_loop.timer_count == global_event_loop.timer_space) {
+		size_t space = global_event_loop.timer_space ? 2 * global_event_loop.timer_space : 8;
+		struct event_timer **timers =
+				(struct event_timer **) realloc(global_event_loop.timers,
+												sizeof(struct event_timer *) * space);
+
+		if (timers == NULL)
+			return -1;
+
+		global_event_loop.timers = timers;
+		global_event_loop.timer_space = space;
+	}
+
+	global_event_loop.timers[global_event_loop.timer_count] = timer;
+	global_event_loop.timer_count++;
+	timer_heap_sift_up(global_event_loop.timer_count - 1);
+
+	return 0;
+}
+
+static void timer_heap_remove(struct event_timer *timer) {
+	size_t index = timer->index;
+	struct event_timer *last = global_event_loop.timers[--global_event_loop.timer_count];
+
+	timer->index = -1;
+
+	if (last == timer)
+		return;
+
+	timer_heap_set(index, last);
+
+	if (index > 0 && global_event_loop.timers[(index - 1) / 2]->deadline > last->deadline)
+		timer_heap_sift_up(index);
+	else
+		timer_heap_sift_down(index);
+}
+
+/**
+  * Schedules a timer which first fires after ms_delay milliseconds. If
+  * ms_interval is non-zero the timer fires periodically afterwards, otherwise
+  * it is released after the callback has been invoked.
+  *
+  * The catch-up policy determines how a periodic timer behaves if its
+  * callback could not be run in time (e.g. because the event loop was busy):
+  *  - EVENT_TIMER_CATCHUP_SKIP skips all missed runs and keeps the original
+  *    schedule.
+  *  - EVENT_TIMER_CATCHUP_BURST runs the callback once for each missed run,
+  *    but skips runs once it is more than EVENT_TIMER_MAX_BURST runs behind
+  *    (e.g. because the callback takes longer than the interval).
+  *  - EVENT_TIMER_CATCHUP_DELAY schedules the next run one interval after the
+  *    late run, shifting the schedule.
+  *
+  * Returns a handle which can be passed to event_loop_cancel_timer() or NULL
+  * on failure.
+  */
+struct event_timer *event_loop_schedule_timer(uint32_t ms_delay,
+											  uint32_t ms_interval,
+											  enum event_timer_catchup catchup,
+											  event_timer_callback callback,
+											  void *user_param) {
+	struct event_timer *timer = (struct event_timer *) malloc(sizeof(struct event_timer));
+
+	if (timer == NULL)
+		return NULL;
+
+	timer->deadline = monotonic_now() + (uint64_t) ms_delay * 1000000ULL;
+	timer->ms_interval = ms_interval;
+	timer->catchup = catchup;
+	timer->callback = callback;
+	timer->user_param = user_param;
+	timer->index = -1;
+	timer->cancelled = 0;
+	timer->statistics = callback_statistics((const void *) callback, EVENT_CALLBACK_TIMER);
+	if (timer->statistics != NULL)
+		timer->statistics->kind = EVENT_CALLBACK_TIMER;
+
+	if (timer_heap_push(timer)) {
+		free(timer);
+		return NULL;
+	}
+
+	return timer;
+}
+
+/**
+  * Cancels the given timer and releases it. This function may be called from
+  * within any callback including the timer's own one. The handle must not be
+  * used afterwards.
+  */
+void event_loop_cancel_timer(struct event_timer *timer) {
+	if (timer == NULL)
+		return;
+
+	if (timer->index == -1) {
+		// Callback is running - the timer is released once it returns
+		timer->cancelled = 1;
+		return;
+	}
+
+	timer_heap_remove(timer);
+	free(timer);
+}
+
+int event_loop_add_timer(uint32_t ms_timeout, event_timer_callback callback, void *user_param) {
+	if (event_loop_schedule_timer(ms_timeout, ms_timeout, EVENT_TIMER_CATCHUP_SKIP,
+								  callback, user_param) == NULL)
+		return -1;
+
+	return 0;
+}
+
+/**
+  * Computes the next deadline of a periodic timer whose callback returned at
+  * the given time.
+  */
+static void timer_reschedule(struct event_timer *timer, uint64_t now) {
+	uint64_t interval = (uint64_t) timer->ms_interval * 1000000ULL;
+
+	switch (timer->catchup) {
+	case EVENT_TIMER_CATCHUP_BURST:
+		timer->deadline += interval;
+		if (timer->deadline + EVENT_TIMER_MAX_BURST * interval <= now)
+			timer->deadline += ((now - timer->deadline) / interval + 1) * interval;
+		break;
+	case EVENT_TIMER_CATCHUP_DELAY:
+		timer->deadline = now + interval;
+		break;
+	case EVENT_TIMER_CATCHUP_SKIP:
+	default:
+		timer->deadline += interval;
+		if (timer->deadline <= now)
+			timer->deadline += ((now - timer->deadline) / interval + 1) * interval;
+		break;
+	}
+}
+
+/**
+  * Runs the callbacks of all timers which are due, but at most
+  * EVENT_LOOP_MAX_TIMER_RUNS so that file descriptors are not starved.
+  *
+  * Returns the number of milliseconds until the next timer is due (0 if
+  * timers are still due) or -1 if there are no timers.
+  */
+static int run_timers() {
+	uint64_t now = monotonic_now();
+	unsigned runs = 0;
+
+	while (global_event_loop.timer_count > 0) {
+		struct event_timer *timer = global_event_loop.timers[0];
+
+		if (timer->deadline > now)
+			break;
+
+		if (runs++ == EVENT_LOOP_MAX_TIMER_RUNS)
+			return 0;
+
+		timer_heap_remove(timer);
+
+		DPRINTF("Running timer due to expiry");
+		(*timer->callback)(timer->user_param);
+		now = record_callback_run(timer->statistics, now);
+
+		if (timer->cancelled || timer->ms_interval == 0) {
+			free(timer);
+		} else {
+			timer_reschedule(timer, now);
+
+			if (timer_heap_push(timer)) {
+				msg(MSG_ERROR, "Failed to reschedule timer.");
+				free(timer);
 			}
+		}
+	}
+
+	if (global_event_loop.timer_count == 0)
+		return -1;
 
-			diff = (timer_entry->next_run.tv_sec - now.tv_sec) * 1000 + (timer_entry->next_run.tv_usec - now.tv_usec) / 1000;
+	// Round up so that the timer is due once we wake up
+	uint64_t diff = global_event_loop.timers[0]->deadline - now;
+	uint64_t timeout = (diff + 999999ULL) / 1000000ULL;
 
-			if (diff < timeout && diff != 0)
-				timeout = diff;
+	return timeout > INT_MAX ? INT_MAX : (int) timeout;
+}
+
+int event_loop_run() {
+	while (1) {
+		int timeout = run_timers();
+
+		wait_for_events(timeout);
+		free_removed_entries();
+
+		if (global_event_loop.statistics_requested) {
+			global_event_loop.statistics_requested = 0;
+			event_loop_print_statistics();
 		}
 	}
 
 	return 0;
-
 }
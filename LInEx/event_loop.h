@@ -7,12 +7,90 @@ typedef void(*event_fd_callback)(int fd, void *user_param);
 typedef void(*event_fd_error_callback)(int fd, void *user_param);
 typedef void(*event_timer_callback)(void *user_param);
 
+/**
+  * Determines when the callback of a file descriptor is invoked.
+  *
+  * Level-triggered callbacks are invoked as long as data is available.
+  * Edge-triggered callbacks are only invoked when new data arrives, hence
+  * they have to read until the file descriptor would block. Without epoll
+  * support all file descriptors are level-triggered.
+  */
+enum event_fd_mode {
+	EVENT_FD_LEVEL_TRIGGERED,
+	EVENT_FD_EDGE_TRIGGERED
+};
+
 int event_loop_add_fd(int fd, event_fd_callback callback,
 					  event_fd_error_callback error_callback,
 					  void *user_param);
+int event_loop_add_fd_mode(int fd, event_fd_callback callback,
+						   event_fd_error_callback error_callback,
+						   void *user_param,
+						   enum event_fd_mode mode);
+int event_loop_remove_fd(int fd);
+int event_loop_set_write_callback(int fd, event_fd_callback callback);
+
+/**
+  * Determines how a periodic timer catches up after it could not be run in
+  * time. See event_loop_schedule_timer().
+  */
+enum event_timer_catchup {
+	EVENT_TIMER_CATCHUP_SKIP,
+	EVENT_TIMER_CATCHUP_BURST,
+	EVENT_TIMER_CATCHUP_DELAY
+};
+
+struct event_timer;
+
 int event_loop_add_timer(uint32_t ms_timeout,
 						 event_timer_callback callback,
 						 void *user_param);
+struct event_timer *event_loop_schedule_timer(uint32_t ms_delay,
+											  uint32_t ms_interval,
+											  enum event_timer_catchup catchup,
+											  event_timer_callback callback,
+											  void *user_param);
+void event_loop_cancel_timer(struct event_timer *timer);
+
+#define EVENT_LOOP_HISTOGRAM_BUCKETS 24
+
+enum event_callback_kind {
+	EVENT_CALLBACK_FD=0,
+	EVENT_CALLBACK_TIMER=1
+};
+
+/**
+  * Run time statistics of all fd or timer registrations sharing the same
+  * callback function.
+  *
+  * Bucket 0 of the histogram counts the runs shorter than 2 microseconds,
+  * bucket i > 0 the runs which took between 2^i and 2^(i+1) microseconds.
+  * The last bucket also contains all longer runs.
+  */
+struct event_callback_statistics {
+	const void *callback;
+	const char *name;
+	enum event_callback_kind kind;
+
+	uint64_t calls;
+	uint64_t total_us;
+	uint32_t max_us;
+
+	/**
+	  * Number of runs exceeding the stall threshold.
+	  */
+	uint32_t stalls;
+	uint32_t histogram[EVENT_LOOP_HISTOGRAM_BUCKETS];
+
+	struct event_callback_statistics *next;
+};
+
+void event_loop_set_callback_name(const void *callback, const char *name);
+void event_loop_set_stall_threshold(uint32_t ms_threshold);
+const struct event_callback_statistics *event_loop_statistics();
+void event_loop_print_statistics();
+void event_loop_request_statistics();
+
 int event_loop_run();
 
 #endif
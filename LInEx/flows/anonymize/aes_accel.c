@@ -0,0 +1,226 @@
+#include "aes_accel.h"
+
+#include <string.h>
+
+#if defined(SUPPORT_AES_ACCEL) && (defined(__x86_64__) || defined(__i386__))
+#define AES_ACCEL_X86
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#if defined(SUPPORT_AES_ACCEL) && defined(__aarch64__)
+#define AES_ACCEL_ARM
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/**
+  * Number of blocks encrypted side by side. The AES instructions have a
+  * latency of several cycles but can be issued every cycle, hence
+  * independent blocks are interleaved round by round.
+  */
+#define AES_ACCEL_INTERLEAVE 8
+
+#ifdef AES_ACCEL_X86
+__attribute__((target("sse2,aes")))
+static void aesni_encrypt_blocks(const uint8_t *round_keys, int rounds,
+								 const uint8_t *input, uint8_t *output,
+								 size_t blocks) {
+	__m128i k[15];
+	__m128i b[AES_ACCEL_INTERLEAVE];
+	int i, r;
+
+	for (r = 0; r <= rounds; r++)
+		k[r] = _mm_load_si128((const __m128i *) (round_keys + 16 * r));
+
+	while (blocks >= AES_ACCEL_INTERLEAVE) {
+		for (i = 0; i < AES_ACCEL_INTERLEAVE; i++)
+			b[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (input + 16 * i)), k[0]);
+
+		for (r = 1; r < rounds; r++)
+			for (i = 0; i < AES_ACCEL_INTERLEAVE; i++)
+				b[i] = _mm_aesenc_si128(b[i], k[r]);
+
+		for (i = 0; i < AES_ACCEL_INTERLEAVE; i++)
+			_mm_storeu_si128((__m128i *) (output + 16 * i), _mm_aesenclast_si128(b[i], k[rounds]));
+
+		input += 16 * AES_ACCEL_INTERLEAVE;
+		output += 16 * AES_ACCEL_INTERLEAVE;
+		blocks -= AES_ACCEL_INTERLEAVE;
+	}
+
+	for (; blocks > 0; blocks--) {
+		__m128i block = _mm_xor_si128(_mm_loadu_si128((const __m128i *) input), k[0]);
+
+		for (r = 1; r < rounds; r++)
+			block = _mm_aesenc_si128(block, k[r]);
+
+		_mm_storeu_si128((__m128i *) output, _mm_aesenclast_si128(block, k[rounds]));
+
+		input += 16;
+		output += 16;
+	}
+}
+
+static int aesni_supported() {
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	return (ecx & bit_AES) && (edx & bit_SSE2);
+}
+#endif
+
+#ifdef AES_ACCEL_ARM
+#ifdef __clang__
+__attribute__((target("crypto")))
+#else
+__attribute__((target("+crypto")))
+#endif
+static void armv8_ce_encrypt_blocks(const uint8_t *round_keys, int rounds,
+									const uint8_t *input, uint8_t *output,
+									size_t blocks) {
+	uint8x16_t k[15];
+	uint8x16_t b[AES_ACCEL_INTERLEAVE];
+	int i, r;
+
+	for (r = 0; r <= rounds; r++)
+		k[r] = vld1q_u8(round_keys + 16 * r);
+
+	// AESE combines AddRoundKey with SubBytes and ShiftRows, hence the last
+	// round key is added separately.
+	while (blocks >= AES_ACCEL_INTERLEAVE) {
+		for (i = 0; i < AES_ACCEL_INTERLEAVE; i++)
+			b[i] = vld1q_u8(input + 16 * i);
+
+		for (r = 0; r < rounds - 1; r++)
+			for (i = 0; i < AES_ACCEL_INTERLEAVE; i++)
+				b[i] = vaesmcq_u8(vaeseq_u8(b[i], k[r]));
+
+		for (i = 0; i < AES_ACCEL_INTERLEAVE; i++)
+			vst1q_u8(output + 16 * i, veorq_u8(vaeseq_u8(b[i], k[rounds - 1]), k[rounds]));
+
+		input += 16 * AES_ACCEL_INTERLEAVE;
+		output += 16 * AES_ACCEL_INTERLEAVE;
+		blocks -= AES_ACCEL_INTERLEAVE;
+	}
+
+	for (; blocks > 0; blocks--) {
+		uint8x16_t block = vld1q_u8(input);
+
+		for (r = 0; r < rounds - 1; r++)
+			block = vaesmcq_u8(vaeseq_u8(block, k[r]));
+
+		vst1q_u8(output, veorq_u8(vaeseq_u8(block, k[rounds - 1]), k[rounds]));
+
+		input += 16;
+		output += 16;
+	}
+}
+
+static int armv8_ce_supported() {
+	return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+}
+#endif
+
+/**
+  * Returns 1 if the backend can be used on this CPU, 0 otherwise.
+  */
+int aes_accel_supported(enum aes_backend backend) {
+	switch (backend) {
+	case AES_BACKEND_AUTO:
+	case AES_BACKEND_SOFTWARE:
+		return 1;
+#ifdef AES_ACCEL_X86
+	case AES_BACKEND_AESNI:
+		return aesni_supported();
+#endif
+#ifdef AES_ACCEL_ARM
+	case AES_BACKEND_ARMV8_CE:
+		return armv8_ce_supported();
+#endif
+	default:
+		return 0;
+	}
+}
+
+/**
+  * Selects the backend for the key of the given PolarSSL context, which has
+  * to be set up with aes_setkey_enc(). AES_BACKEND_AUTO selects the hardware
+  * backend if available.
+  *
+  * Returns 0 on success, -1 if the backend is not supported.
+  */
+int aes_accel_init(struct aes_accel *accel, aes_context *ctx, enum aes_backend backend) {
+	int i, j;
+
+	if (backend == AES_BACKEND_AUTO) {
+		if (aes_accel_supported(AES_BACKEND_AESNI))
+			backend = AES_BACKEND_AESNI;
+		else if (aes_accel_supported(AES_BACKEND_ARMV8_CE))
+			backend = AES_BACKEND_ARMV8_CE;
+		else
+			backend = AES_BACKEND_SOFTWARE;
+	} else if (!aes_accel_supported(backend)) {
+		return -1;
+	}
+
+	accel->backend = backend;
+	accel->rounds = ctx->nr;
+	accel->encrypt_blocks = NULL;
+
+	// PolarSSL stores the round keys as little endian words
+	for (i = 0; i < 4 * (ctx->nr + 1); i++)
+		for (j = 0; j < 4; j++)
+			accel->round_keys[4 * i + j] = (uint8_t) (ctx->rk[i] >> (8 * j));
+
+	switch (backend) {
+#ifdef AES_ACCEL_X86
+	case AES_BACKEND_AESNI:
+		accel->encrypt_blocks = aesni_encrypt_blocks;
+		break;
+#endif
+#ifdef AES_ACCEL_ARM
+	case AES_BACKEND_ARMV8_CE:
+		accel->encrypt_blocks = armv8_ce_encrypt_blocks;
+		break;
+#endif
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/**
+  * Encrypts consecutive 16 byte blocks in ECB mode.
+  */
+void aes_accel_encrypt_blocks(const struct aes_accel *accel, aes_context *ctx,
+							  const uint8_t *input, uint8_t *output, size_t blocks) {
+	if (accel->encrypt_blocks != NULL) {
+		accel->encrypt_blocks(accel->round_keys, accel->rounds, input, output, blocks);
+		return;
+	}
+
+	for (; blocks > 0; blocks--) {
+		aes_crypt_ecb(ctx, AES_ENCRYPT, input, output);
+		input += 16;
+		output += 16;
+	}
+}
+
+const char *aes_accel_name(enum aes_backend backend) {
+	switch (backend) {
+	case AES_BACKEND_SOFTWARE:
+		return "software";
+	case AES_BACKEND_AESNI:
+		return "AES-NI";
+	case AES_BACKEND_ARMV8_CE:
+		return "ARMv8 CE";
+	default:
+		return "auto";
+	}
+}
@@ -0,0 +1,41 @@
+/**
+  * AES-128/192/256 block encryption with hardware instructions (AES-NI on
+  * x86, the ARMv8 cryptography extensions on AArch64) and the PolarSSL
+  * implementation as fallback. The backend is chosen at runtime.
+  */
+#ifndef AES_ACCEL_H_
+#define AES_ACCEL_H_
+
+#include "aes.h"
+#include <stdint.h>
+#include <stddef.h>
+
+enum aes_backend {
+	AES_BACKEND_AUTO=0, // fastest backend supported by the CPU
+	AES_BACKEND_SOFTWARE=1,
+	AES_BACKEND_AESNI=2,
+	AES_BACKEND_ARMV8_CE=3
+};
+
+typedef void (*aes_encrypt_blocks_fn)(const uint8_t *round_keys, int rounds,
+									  const uint8_t *input, uint8_t *output,
+									  size_t blocks);
+
+struct aes_accel {
+	enum aes_backend backend;
+	aes_encrypt_blocks_fn encrypt_blocks;
+	int rounds;
+
+	/**
+	  * Expanded encryption key in the byte order of FIPS-197.
+	  */
+	uint8_t round_keys[15 * 16] __attribute__((aligned(16)));
+};
+
+int aes_accel_supported(enum aes_backend backend);
+int aes_accel_init(struct aes_accel *accel, aes_context *ctx, enum aes_backend backend);
+void aes_accel_encrypt_blocks(const struct aes_accel *accel, aes_context *ctx,
+							  const uint8_t *input, uint8_t *output, size_t blocks);
+const char *aes_accel_name(enum aes_backend backend);
+
+#endif
@@ -1,53 +1,765 @@
 #include "cryptopan.h"
+#include "../khash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+#define CRYPTOPAN_CACHE_NONE UINT32_MAX
+
+/**
+  * Number of addresses whose prefix blocks are encrypted in one pass.
+  */
+#define CRYPTOPAN_BATCH 8
+#define CRYPTOPAN6_BATCH 2
+
+static const uint8_t cache_prefix_lengths[CRYPTOPAN_CACHE_LEVELS] = { 16, 24, 32 };
+static const uint8_t cache6_prefix_lengths[CRYPTOPAN6_CACHE_LEVELS] = { 48, 64, 96, 112, 128 };
+
+struct cryptopan_cache_entry {
+	uint64_t key;
+
+	/**
+	  * One-time-pad bits of all prefixes up to the length of the entry.
+	  */
+	uint32_t pad;
+};
+
+struct cryptopan6_cache_entry {
+	uint8_t len;
+	uint8_t prefix[16];
+
+	/**
+	  * One-time-pad bits of all prefixes up to the length of the entry.
+	  */
+	uint8_t pad[16];
+};
+
+static uint32_t cryptopan6_cache_hash(const struct cryptopan6_cache_entry *entry) {
+	uint64_t a, b;
+
+	memcpy(&a, entry->prefix, sizeof(a));
+	memcpy(&b, entry->prefix + 8, sizeof(b));
+
+	return (uint32_t) (((a ^ (b * 0xc2b2ae3d27d4eb4fULL) ^ entry->len) * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static int cryptopan6_cache_equal(const struct cryptopan6_cache_entry *a, const struct cryptopan6_cache_entry *b) {
+	return a->len == b->len && !memcmp(a->prefix, b->prefix, sizeof(a->prefix));
+}
+
+#define cryptopan_cache_hash(key) ((uint32_t) (((key) * 0x9e3779b97f4a7c15ULL) >> 32))
+
+KHASH_INIT(4, uint64_t, uint32_t, 1, cryptopan_cache_hash, kh_int64_hash_equal)
+KHASH_INIT(5, struct cryptopan6_cache_entry *, char, 0, cryptopan6_cache_hash, cryptopan6_cache_equal)
+
+/**
+  * Neighbours of a cache entry in the LRU list.
+  */
+struct cryptopan_lru_link {
+	uint32_t prev;
+	uint32_t next;
+};
+
+/**
+  * Entries of a cache ordered by their last use. The least recently used
+  * entry is replaced once all entries are in use.
+  */
+struct cryptopan_lru {
+	struct cryptopan_lru_link *links;
+	uint32_t size;
+	uint32_t used;
+	uint32_t head;
+	uint32_t tail;
+};
+
+/**
+  * Bounded caches of one-time-pad bits for IPv4 and IPv6 prefixes.
+  */
+struct cryptopan_cache {
+	khash_t(4) *index;
+	struct cryptopan_cache_entry *entries;
+	struct cryptopan_lru lru;
+
+	khash_t(5) *index6;
+	struct cryptopan6_cache_entry *entries6;
+	struct cryptopan_lru lru6;
+};
 
 int init_cryptopan(struct cryptopan *state, uint8_t key[16], uint8_t pad[16]) {
 	if (aes_setkey_enc(&state->ctx, key, 128))
 		return -1;
 
 	aes_crypt_ecb(&state->ctx, AES_ENCRYPT, pad, state->pad);
+	aes_accel_init(&state->accel, &state->ctx, AES_BACKEND_AUTO);
+	state->cache = NULL;
+	memset(&state->statistics, 0, sizeof(state->statistics));
+	memset(&state->statistics6, 0, sizeof(state->statistics6));
 	state->initialised = 1;
 	return 0;
 }
 
-uint32_t anonymize_ipv4(struct cryptopan *state, uint32_t addr) {
-	uint8_t rin_output[16];
-	uint8_t rin_input[16];
+/**
+  * Selects the AES implementation. AES_BACKEND_AUTO selects hardware AES if
+  * the CPU supports it.
+  *
+  * Returns 0 on success, -1 if the backend is not supported.
+  */
+int cryptopan_set_backend(struct cryptopan *state, enum aes_backend backend) {
+	return aes_accel_init(&state->accel, &state->ctx, backend);
+}
+
+static int lru_init(struct cryptopan_lru *lru, uint32_t size) {
+	lru->links = (struct cryptopan_lru_link *) calloc(size, sizeof(struct cryptopan_lru_link));
+	lru->size = size;
+	lru->used = 0;
+	lru->head = CRYPTOPAN_CACHE_NONE;
+	lru->tail = CRYPTOPAN_CACHE_NONE;
+
+	return (lru->links != NULL) ? 0 : -1;
+}
+
+static void lru_unlink(struct cryptopan_lru *lru, uint32_t i) {
+	struct cryptopan_lru_link *link = &lru->links[i];
+
+	if (link->prev != CRYPTOPAN_CACHE_NONE)
+		lru->links[link->prev].next = link->next;
+	else
+		lru->head = link->next;
+
+	if (link->next != CRYPTOPAN_CACHE_NONE)
+		lru->links[link->next].prev = link->prev;
+	else
+		lru->tail = link->prev;
+}
+
+static void lru_push_front(struct cryptopan_lru *lru, uint32_t i) {
+	struct cryptopan_lru_link *link = &lru->links[i];
+
+	link->prev = CRYPTOPAN_CACHE_NONE;
+	link->next = lru->head;
+
+	if (lru->head != CRYPTOPAN_CACHE_NONE)
+		lru->links[lru->head].prev = i;
+	else
+		lru->tail = i;
+
+	lru->head = i;
+}
+
+static void lru_touch(struct cryptopan_lru *lru, uint32_t i) {
+	if (lru->head != i) {
+		lru_unlink(lru, i);
+		lru_push_front(lru, i);
+	}
+}
+
+/**
+  * Returns an unused entry or, if all entries are in use, the least
+  * recently used one, which the caller has to remove from its index. The
+  * returned entry is moved to the front of the list.
+  */
+static uint32_t lru_allocate(struct cryptopan_lru *lru, int *evicted) {
+	uint32_t i;
+
+	if (lru->used < lru->size) {
+		i = lru->used++;
+		*evicted = 0;
+	} else {
+		i = lru->tail;
+		lru_unlink(lru, i);
+		*evicted = 1;
+	}
+
+	lru_push_front(lru, i);
+
+	return i;
+}
+
+/**
+  * Enables caching of the one-time-pad bits of up to size prefixes and
+  * addresses per address family. The anonymized addresses are identical
+  * with and without cache.
+  *
+  * Returns 0 on success, -1 otherwise.
+  */
+int cryptopan_init_cache(struct cryptopan *state, uint32_t size) {
+	struct cryptopan_cache *cache;
+
+	cryptopan_free_cache(state);
+
+	if (size == 0)
+		return 0;
+
+	cache = (struct cryptopan_cache *) calloc(1, sizeof(struct cryptopan_cache));
+	if (cache == NULL)
+		return -1;
+
+	state->cache = cache;
+
+	cache->entries = (struct cryptopan_cache_entry *) calloc(size, sizeof(struct cryptopan_cache_entry));
+	cache->entries6 = (struct cryptopan6_cache_entry *) calloc(size, sizeof(struct cryptopan6_cache_entry));
+	cache->index = kh_init(4);
+	cache->index6 = kh_init(5);
+	if (lru_init(&cache->lru, size) || lru_init(&cache->lru6, size)
+			|| cache->entries == NULL || cache->entries6 == NULL
+			|| cache->index == NULL || cache->index6 == NULL) {
+		cryptopan_free_cache(state);
+		return -1;
+	}
+
+	kh_resize(4, cache->index, size);
+	kh_resize(5, cache->index6, size);
+
+	return 0;
+}
+
+void cryptopan_free_cache(struct cryptopan *state) {
+	struct cryptopan_cache *cache = state->cache;
+
+	if (cache == NULL)
+		return;
+
+	if (cache->index)
+		kh_destroy(4, cache->index);
+	if (cache->index6)
+		kh_destroy(5, cache->index6);
+	free(cache->entries);
+	free(cache->entries6);
+	free(cache->lru.links);
+	free(cache->lru6.links);
+	free(cache);
+	state->cache = NULL;
+}
+
+static inline uint64_t cache_key(int level, uint32_t addr) {
+	uint8_t len = cache_prefix_lengths[level];
+	uint32_t prefix = (len == 32) ? addr : addr & ~(UINT32_MAX >> len);
+
+	return ((uint64_t) len << 32) | prefix;
+}
+
+static int cache_lookup(struct cryptopan_cache *cache, int level, uint32_t addr, uint32_t *pad) {
+	khiter_t k = kh_get(4, cache->index, cache_key(level, addr));
+	uint32_t i;
+
+	if (k == kh_end(cache->index))
+		return 0;
+
+	i = kh_value(cache->index, k);
+	lru_touch(&cache->lru, i);
+	*pad = cache->entries[i].pad;
+
+	return 1;
+}
+
+static void cache_insert(struct cryptopan *state, int level, uint32_t addr, uint32_t pad) {
+	struct cryptopan_cache *cache = state->cache;
+	uint64_t key = cache_key(level, addr);
+	khiter_t k, old;
+	uint32_t i;
+	int ret, evicted;
+
+	k = kh_put(4, cache->index, key, &ret);
+	if (ret == -1)
+		return;
+
+	// The prefix has been inserted by another address of the same batch
+	if (ret == 0) {
+		lru_touch(&cache->lru, kh_value(cache->index, k));
+		return;
+	}
+
+	i = lru_allocate(&cache->lru, &evicted);
+	if (evicted) {
+		old = kh_get(4, cache->index, cache->entries[i].key);
+		if (old != kh_end(cache->index))
+			kh_del(4, cache->index, old);
+
+		state->statistics.evictions++;
+	}
+
+	kh_value(cache->index, k) = i;
+	cache->entries[i].key = key;
+	cache->entries[i].pad = pad;
+}
+
+/**
+  * Copies the first bits of src to dst and clears the remaining bits.
+  */
+static void copy_prefix(uint8_t *dst, const uint8_t *src, int bits) {
+	int bytes = bits / 8;
+
+	memcpy(dst, src, bytes);
+	if (bytes < 16) {
+		memset(dst + bytes, 0, 16 - bytes);
+		if (bits % 8)
+			dst[bytes] = src[bytes] & (uint8_t) (0xff << (8 - bits % 8));
+	}
+}
+
+static int cache6_lookup(struct cryptopan_cache *cache, int level, const uint8_t *addr, uint8_t *pad) {
+	struct cryptopan6_cache_entry probe;
+	khiter_t k;
+	uint32_t i;
+
+	probe.len = cache6_prefix_lengths[level];
+	copy_prefix(probe.prefix, addr, probe.len);
+
+	k = kh_get(5, cache->index6, &probe);
+	if (k == kh_end(cache->index6))
+		return 0;
+
+	i = kh_key(cache->index6, k) - cache->entries6;
+	lru_touch(&cache->lru6, i);
+	memcpy(pad, cache->entries6[i].pad, 16);
+
+	return 1;
+}
+
+static void cache6_insert(struct cryptopan *state, int level, const uint8_t *addr, const uint8_t *pad) {
+	struct cryptopan_cache *cache = state->cache;
+	struct cryptopan6_cache_entry probe, *entry;
+	khiter_t k;
+	uint32_t i;
+	int ret, evicted;
+
+	probe.len = cache6_prefix_lengths[level];
+	copy_prefix(probe.prefix, addr, probe.len);
+
+	// The prefix has been inserted by another address of the same batch
+	k = kh_get(5, cache->index6, &probe);
+	if (k != kh_end(cache->index6)) {
+		lru_touch(&cache->lru6, kh_key(cache->index6, k) - cache->entries6);
+		return;
+	}
+
+	// The index refers to the entries, hence the replaced entry has to be
+	// removed before its key is overwritten.
+	i = lru_allocate(&cache->lru6, &evicted);
+	entry = &cache->entries6[i];
+	if (evicted) {
+		k = kh_get(5, cache->index6, entry);
+		if (k != kh_end(cache->index6))
+			kh_del(5, cache->index6, k);
+
+		state->statistics6.evictions++;
+	}
+
+	*entry = probe;
+	memcpy(entry->pad, pad, 16);
+
+	kh_put(5, cache->index6, entry, &ret);
+	if (ret == -1)
+		entry->len = 0; // not indexed, the entry is reused eventually
+}
+
+/**
+  * Returns the mask of the one-time-pad bits of all prefixes up to length
+  * len.
+  */
+static inline uint32_t pad_mask(uint8_t len) {
+	return (len >= 31) ? UINT32_MAX : ~(UINT32_MAX >> (len + 1));
+}
+
+/**
+  * Computes the one-time-pad bits for the prefixes of addrs[i] with lengths
+  * from first[i] to 31 and ORs them into pads[i]. The bit of the prefix with
+  * length pos is bit 31 - pos.
+  *
+  * The blocks of all addresses are encrypted in one pass so that the
+  * hardware backends can pipeline them.
+  */
+static void cryptopan_pad_bits(struct cryptopan *state, const uint32_t *addrs,
+							   const int *first, uint32_t *pads, size_t count) {
+	uint8_t rin_input[CRYPTOPAN_BATCH * 32][16];
+	uint8_t rin_output[CRYPTOPAN_BATCH * 32][16];
 
-	uint32_t result = 0;
 	uint32_t first4bytes_pad, first4bytes_input;
+	size_t i, blocks = 0;
 	int pos;
 
 	uint8_t *pad = state->pad;
-	memcpy(rin_input, pad, 16);
 	first4bytes_pad = (((uint32_t) pad[0]) << 24) + (((uint32_t) pad[1]) << 16) +
 			(((uint32_t) pad[2]) << 8) + (uint32_t) pad[3];
 
 	// For each prefixes with length from 0 to 31, generate a bit using the Rijndael cipher,
 	// which is used as a pseudorandom function here. The bits generated in every rounds
 	// are combineed into a pseudorandom one-time-pad.
-	for (pos = 0; pos <= 31 ; pos++) {
+	for (i = 0; i < count; i++) {
+		uint32_t addr = addrs[i];
 
-		//Padding: The most significant pos bits are taken from orig_addr. The other 128-pos
-		//bits are taken from pad. The variables first4bytes_pad and first4bytes_input are used
-		//to handle the annoying byte order problem.
-		if (pos==0) {
-			first4bytes_input =  first4bytes_pad;
+		for (pos = first[i]; pos <= 31; pos++) {
+			//Padding: The most significant pos bits are taken from orig_addr. The other 128-pos
+			//bits are taken from pad. The variables first4bytes_pad and first4bytes_input are used
+			//to handle the annoying byte order problem.
+			if (pos==0) {
+				first4bytes_input =  first4bytes_pad;
+			}
+			else {
+				first4bytes_input = ((addr >> (32-pos)) << (32-pos)) | ((first4bytes_pad<<pos) >> pos);
+			}
+			memcpy(rin_input[blocks], pad, 16);
+			rin_input[blocks][0] = (uint8_t) (first4bytes_input >> 24);
+			rin_input[blocks][1] = (uint8_t) ((first4bytes_input << 8) >> 24);
+			rin_input[blocks][2] = (uint8_t) ((first4bytes_input << 16) >> 24);
+			rin_input[blocks][3] = (uint8_t) ((first4bytes_input << 24) >> 24);
+			blocks++;
 		}
-		else {
-			first4bytes_input = ((addr >> (32-pos)) << (32-pos)) | ((first4bytes_pad<<pos) >> pos);
+	}
+
+	if (blocks == 0)
+		return;
+
+	//Encryption: The Rijndael cipher is used as pseudorandom function. During each
+	//round, only the first bit of rin_output is used.
+	aes_accel_encrypt_blocks(&state->accel, &state->ctx, rin_input[0], rin_output[0], blocks);
+	state->statistics.blocks += blocks;
+
+	//Combination: the bits are combined into a pseudorandom one-time-pad
+	blocks = 0;
+	for (i = 0; i < count; i++) {
+		for (pos = first[i]; pos <= 31; pos++)
+			pads[i] |= (rin_output[blocks++][0] >> 7) << (31-pos);
+	}
+}
+
+/**
+  * Anonymizes up to CRYPTOPAN_BATCH addresses. With cache, only the
+  * one-time-pad bits of prefixes longer than the longest cached prefix of an
+  * address are computed.
+  */
+static void anonymize_ipv4_chunk(struct cryptopan *state, const uint32_t *addrs,
+								 uint32_t *results, size_t count) {
+	struct cryptopan_cache *cache = state->cache;
+	uint32_t pending_addrs[CRYPTOPAN_BATCH];
+	uint32_t pads[CRYPTOPAN_BATCH];
+	int first[CRYPTOPAN_BATCH];
+	int levels[CRYPTOPAN_BATCH];
+	size_t indices[CRYPTOPAN_BATCH];
+	size_t i, pending = 0;
+	int level;
+
+	for (i = 0; i < count; i++) {
+		uint32_t addr = addrs[i];
+		uint32_t pad = 0;
+
+		level = -1;
+		if (cache != NULL) {
+			state->statistics.lookups++;
+
+			for (level = CRYPTOPAN_CACHE_LEVELS - 1; level >= 0; level--) {
+				if (cache_lookup(cache, level, addr, &pad))
+					break;
+			}
+
+			if (level >= 0)
+				state->statistics.hits[level]++;
+
+			if (level == CRYPTOPAN_CACHE_LEVELS - 1) {
+				results[i] = pad ^ addr;
+				continue;
+			}
 		}
-		rin_input[0] = (uint8_t) (first4bytes_input >> 24);
-		rin_input[1] = (uint8_t) ((first4bytes_input << 8) >> 24);
-		rin_input[2] = (uint8_t) ((first4bytes_input << 16) >> 24);
-		rin_input[3] = (uint8_t) ((first4bytes_input << 24) >> 24);
 
-		//Encryption: The Rijndael cipher is used as pseudorandom function. During each
-		//round, only the first bit of rin_output is used.
-		aes_crypt_ecb(&state->ctx, AES_ENCRYPT, rin_input, rin_output);
+		pending_addrs[pending] = addr;
+		pads[pending] = pad;
+		first[pending] = (level >= 0) ? cache_prefix_lengths[level] + 1 : 0;
+		levels[pending] = level;
+		indices[pending] = i;
+		pending++;
+	}
+
+	if (pending == 0)
+		return;
+
+	cryptopan_pad_bits(state, pending_addrs, first, pads, pending);
 
-		//Combination: the bits are combined into a pseudorandom one-time-pad
-		result |=  (rin_output[0] >> 7) << (31-pos);
+	for (i = 0; i < pending; i++) {
+		if (cache != NULL) {
+			for (level = levels[i] + 1; level < CRYPTOPAN_CACHE_LEVELS; level++)
+				cache_insert(state, level, pending_addrs[i],
+							 pads[i] & pad_mask(cache_prefix_lengths[level]));
+		}
+
+		//XOR the orginal address with the pseudorandom one-time-pad
+		results[indices[i]] = pads[i] ^ pending_addrs[i];
 	}
-	//XOR the orginal address with the pseudorandom one-time-pad
-	return result ^ addr;
+}
+
+/**
+  * Anonymizes count addresses given in host byte order. The prefix blocks
+  * of several addresses are encrypted together, which is considerably
+  * faster than single calls with hardware AES. results may equal addrs.
+  */
+void anonymize_ipv4_batch(struct cryptopan *state, const uint32_t *addrs,
+						  uint32_t *results, size_t count) {
+	while (count > 0) {
+		size_t n = (count < CRYPTOPAN_BATCH) ? count : CRYPTOPAN_BATCH;
+
+		anonymize_ipv4_chunk(state, addrs, results, n);
+
+		addrs += n;
+		results += n;
+		count -= n;
+	}
+}
+
+/**
+  * Anonymizes the address given in host byte order.
+  */
+uint32_t anonymize_ipv4(struct cryptopan *state, uint32_t addr) {
+	uint32_t result;
+
+	anonymize_ipv4_chunk(state, &addr, &result, 1);
+
+	return result;
+}
+
+/**
+  * Sets the bits of pad which belong to the prefixes up to length len and
+  * clears all other bits.
+  */
+static void pad6_mask(uint8_t *dst, const uint8_t *pad, uint8_t len) {
+	copy_prefix(dst, pad, (len >= 127) ? 128 : len + 1);
+}
+
+/**
+  * IPv6 variant of cryptopan_pad_bits(): computes the one-time-pad bits for
+  * the prefixes of addrs[i] with lengths from first[i] to 127. The bit of
+  * the prefix with length pos is the bit pos of pads[i], counted from the
+  * most significant bit of the first byte.
+  *
+  * The input of the pseudorandom function consists of the first pos bits
+  * of the address followed by the remaining bits of the pad. For prefixes
+  * up to 31 bits, the input equals that of the IPv4 variant.
+  */
+static void cryptopan6_pad_bits(struct cryptopan *state, const uint8_t (*addrs)[16],
+								const int *first, uint8_t (*pads)[16], size_t count) {
+	uint8_t rin_input[CRYPTOPAN6_BATCH * 128][16];
+	uint8_t rin_output[CRYPTOPAN6_BATCH * 128][16];
+	size_t i, blocks = 0;
+	int pos;
+
+	for (i = 0; i < count; i++) {
+		for (pos = first[i]; pos <= 127; pos++) {
+			int bytes = pos / 8;
+			uint8_t mask = (uint8_t) (0xff << (8 - pos % 8));
+
+			memcpy(rin_input[blocks], addrs[i], bytes);
+			memcpy(rin_input[blocks] + bytes, state->pad + bytes, 16 - bytes);
+			if (pos % 8)
+				rin_input[blocks][bytes] = (addrs[i][bytes] & mask) | (state->pad[bytes] & ~mask);
+			blocks++;
+		}
+	}
+
+	if (blocks == 0)
+		return;
+
+	aes_accel_encrypt_blocks(&state->accel, &state->ctx, rin_input[0], rin_output[0], blocks);
+	state->statistics6.blocks += blocks;
+
+	blocks = 0;
+	for (i = 0; i < count; i++) {
+		for (pos = first[i]; pos <= 127; pos++)
+			pads[i][pos / 8] |= (rin_output[blocks++][0] >> 7) << (7 - pos % 8);
+	}
+}
+
+/**
+  * Anonymizes up to CRYPTOPAN6_BATCH addresses, see anonymize_ipv4_chunk().
+  */
+static void anonymize_ipv6_chunk(struct cryptopan *state, const uint8_t *addrs,
+								 uint8_t *results, size_t count) {
+	struct cryptopan_cache *cache = state->cache;
+	uint8_t pending_addrs[CRYPTOPAN6_BATCH][16];
+	uint8_t pads[CRYPTOPAN6_BATCH][16];
+	uint8_t masked[16];
+	int first[CRYPTOPAN6_BATCH];
+	int levels[CRYPTOPAN6_BATCH];
+	size_t indices[CRYPTOPAN6_BATCH];
+	size_t i, pending = 0;
+	int j, level;
+
+	for (i = 0; i < count; i++) {
+		const uint8_t *addr = addrs + 16 * i;
+
+		memset(pads[pending], 0, 16);
+
+		level = -1;
+		if (cache != NULL) {
+			state->statistics6.lookups++;
+
+			for (level = CRYPTOPAN6_CACHE_LEVELS - 1; level >= 0; level--) {
+				if (cache6_lookup(cache, level, addr, pads[pending]))
+					break;
+			}
+
+			if (level >= 0)
+				state->statistics6.hits[level]++;
+
+			if (level == CRYPTOPAN6_CACHE_LEVELS - 1) {
+				for (j = 0; j < 16; j++)
+					results[16 * i + j] = pads[pending][j] ^ addr[j];
+				continue;
+			}
+		}
+
+		memcpy(pending_addrs[pending], addr, 16);
+		first[pending] = (level >= 0) ? cache6_prefix_lengths[level] + 1 : 0;
+		levels[pending] = level;
+		indices[pending] = i;
+		pending++;
+	}
+
+	if (pending == 0)
+		return;
+
+	cryptopan6_pad_bits(state, (const uint8_t (*)[16]) pending_addrs, first, pads, pending);
+
+	for (i = 0; i < pending; i++) {
+		if (cache != NULL) {
+			for (level = levels[i] + 1; level < CRYPTOPAN6_CACHE_LEVELS; level++) {
+				pad6_mask(masked, pads[i], cache6_prefix_lengths[level]);
+				cache6_insert(state, level, pending_addrs[i], masked);
+			}
+		}
+
+		for (j = 0; j < 16; j++)
+			results[16 * indices[i] + j] = pads[i][j] ^ pending_addrs[i][j];
+	}
+}
+
+/**
+  * Anonymizes count IPv6 addresses stored consecutively in addrs (16 bytes
+  * each, network byte order). results may equal addrs.
+  */
+void anonymize_ipv6_batch(struct cryptopan *state, const uint8_t *addrs,
+						  uint8_t *results, size_t count) {
+	while (count > 0) {
+		size_t n = (count < CRYPTOPAN6_BATCH) ? count : CRYPTOPAN6_BATCH;
+
+		anonymize_ipv6_chunk(state, addrs, results, n);
+
+		addrs += 16 * n;
+		results += 16 * n;
+		count -= n;
+	}
+}
+
+/**
+  * Anonymizes the IPv6 address in network byte order. result may equal
+  * addr.
+  */
+void anonymize_ipv6(struct cryptopan *state, const uint8_t addr[16], uint8_t result[16]) {
+	anonymize_ipv6_chunk(state, addr, result, 1);
+}
+
+/*
+ * Reference key and addresses from the sample trace of the original
+ * CryptoPAN implementation
+ */
+static const uint8_t self_test_key[32] = {
+	21, 34, 23, 141, 51, 164, 207, 128, 19, 10, 91, 22, 73, 144, 125, 16,
+	216, 152, 143, 131, 121, 121, 101, 39, 98, 87, 76, 45, 42, 132, 34, 2
+};
+
+static const uint32_t self_test_vectors[][2] = {
+	{ 0x800b4484, 0x87f2b484 }, // 128.11.68.132 -> 135.242.180.132
+	{ 0x81764a04, 0x8688ba7b }, // 129.118.74.4 -> 134.136.186.123
+	{ 0x8284fcf4, 0x8544a4ea }, // 130.132.252.244 -> 133.68.164.234
+	{ 0x8ddf072b, 0x8da708a0 }, // 141.223.7.43 -> 141.167.8.160
+	{ 0x8de9916c, 0x8d81edeb }, // 141.233.145.108 -> 141.129.237.235
+	{ 0xc066f90d, 0xfc8a3e83 }, // 192.102.249.13 -> 252.138.62.131
+	{ 0xc0d7207d, 0xfc2b2fbd }, // 192.215.32.125 -> 252.43.47.189
+	{ 0xc3cd3f64, 0xffbadf05 }, // 195.205.63.100 -> 255.186.223.5
+	{ 0xcdbc9399, 0xf2601065 }, // 205.188.147.153 -> 242.96.16.101
+	{ 0xcdbcf819, 0xf260581b }, // 205.188.248.25 -> 242.96.88.27
+	{ 0xd82084fa, 0xebc08b26 }, // 216.32.132.250 -> 235.192.139.38
+	{ 0x1800fadd, 0x640fc6e2 }, // 24.0.250.221 -> 100.15.198.226
+	{ 0x180ed58a, 0x64012a8d }, // 24.14.213.138 -> 100.1.42.141
+	{ 0x040358e1, 0x7c3c9b3f }, // 4.3.88.225 -> 124.60.155.63
+	{ 0x3fc3f12c, 0x5fb3ee2c }, // 63.195.241.44 -> 95.179.238.44
+	{ 0x40270fee, 0x00db0729 }  // 64.39.15.238 -> 0.219.7.41
+};
+
+#define SELF_TEST_VECTORS (sizeof(self_test_vectors) / sizeof(self_test_vectors[0]))
+
+/**
+  * Checks the given AES backend against the reference CryptoPAN vectors,
+  * with single and batched calls as well as with and without cache.
+  *
+  * There are no IPv6 reference vectors. IPv6 addresses starting with the
+  * IPv4 reference addresses have to keep the anonymized IPv4 prefix, and
+  * all backends have to agree with the uncached software implementation.
+  *
+  * Returns 0 if successful, 1 if the test failed and -1 if the backend is
+  * not supported.
+  */
+int cryptopan_self_test(enum aes_backend backend, int verbose) {
+	struct cryptopan state, reference;
+	uint32_t addrs[SELF_TEST_VECTORS];
+	uint8_t addrs6[SELF_TEST_VECTORS][16];
+	uint8_t expected6[SELF_TEST_VECTORS][16];
+	uint8_t result6[16];
+	uint8_t key[16], pad[16];
+	size_t i, j;
+	int pass, failed = 0;
+
+	memcpy(key, self_test_key, 16);
+	memcpy(pad, self_test_key + 16, 16);
+
+	if (init_cryptopan(&state, key, pad) || cryptopan_set_backend(&state, backend)
+			|| init_cryptopan(&reference, key, pad)
+			|| cryptopan_set_backend(&reference, AES_BACKEND_SOFTWARE))
+		return -1;
+
+	for (i = 0; i < SELF_TEST_VECTORS; i++) {
+		uint32_t prefix;
+
+		for (j = 0; j < 16; j++)
+			addrs6[i][j] = (uint8_t) (i * 16 + j);
+		prefix = htonl(self_test_vectors[i][0]);
+		memcpy(addrs6[i], &prefix, 4);
+		prefix = htonl(self_test_vectors[i][1]);
+
+		anonymize_ipv6(&reference, addrs6[i], expected6[i]);
+		if (memcmp(expected6[i], &prefix, 4))
+			failed = 1;
+	}
+
+	// Uncached, cached with empty cache and cached with warm cache
+	for (pass = 0; pass < 3; pass++) {
+		if (pass == 1 && cryptopan_init_cache(&state, 4))
+			return -1;
+
+		for (i = 0; i < SELF_TEST_VECTORS; i++) {
+			if (anonymize_ipv4(&state, self_test_vectors[i][0]) != self_test_vectors[i][1])
+				failed = 1;
+			addrs[i] = self_test_vectors[i][0];
+
+			anonymize_ipv6(&state, addrs6[i], result6);
+			if (memcmp(result6, expected6[i], 16))
+				failed = 1;
+		}
+
+		anonymize_ipv4_batch(&state, addrs, addrs, SELF_TEST_VECTORS);
+		for (i = 0; i < SELF_TEST_VECTORS; i++) {
+			if (addrs[i] != self_test_vectors[i][1])
+				failed = 1;
+		}
+	}
+
+	anonymize_ipv6_batch(&state, addrs6[0], addrs6[0], SELF_TEST_VECTORS);
+	if (memcmp(addrs6, expected6, sizeof(expected6)))
+		failed = 1;
+
+	cryptopan_free_cache(&state);
+
+	if (verbose)
+		printf("  CryptoPAN (%s): %s\n", aes_accel_name(state.accel.backend),
+			   failed ? "failed" : "passed");
+
+	return failed;
 }
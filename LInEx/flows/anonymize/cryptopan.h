@@ -5,14 +5,68 @@
 #ifndef CRYPTOPAN_H_
 #define CRYPTOPAN_H_
 #include "aes.h"
+#include "aes_accel.h"
 #include <stdint.h>
+#include <stddef.h>
+
+/**
+  * Prefix lengths whose one-time-pad bits are cached: /16, /24 and /32 for
+  * IPv4, /48, /64, /96, /112 and /128 for IPv6. The last level caches
+  * complete addresses.
+  */
+#define CRYPTOPAN_CACHE_LEVELS 3
+#define CRYPTOPAN6_CACHE_LEVELS 5
+#define CRYPTOPAN_CACHE_DEFAULT_SIZE 1024
+
+struct cryptopan_cache;
+
+struct cryptopan_statistics {
+	/**
+	  * Number of addresses anonymized while the cache was enabled.
+	  */
+	uint64_t lookups;
+
+	/**
+	  * Number of lookups per longest cached prefix, indexed by cache level.
+	  * IPv4 only uses the first CRYPTOPAN_CACHE_LEVELS entries.
+	  */
+	uint64_t hits[CRYPTOPAN6_CACHE_LEVELS];
+
+	/**
+	  * Number of AES block encryptions.
+	  */
+	uint64_t blocks;
+
+	/**
+	  * Number of cache entries replaced as the cache was full.
+	  */
+	uint64_t evictions;
+};
 
 struct cryptopan {
 	uint8_t initialised;
 	aes_context ctx;
+	struct aes_accel accel;
 	uint8_t pad[16];
+
+	/**
+	  * Cache of one-time-pad bits of recently anonymized prefixes, NULL if
+	  * caching is disabled.
+	  */
+	struct cryptopan_cache *cache;
+	struct cryptopan_statistics statistics;
+	struct cryptopan_statistics statistics6;
 };
 
 int init_cryptopan(struct cryptopan *state, uint8_t key[16], uint8_t pad[16]);
+int cryptopan_set_backend(struct cryptopan *state, enum aes_backend backend);
+int cryptopan_init_cache(struct cryptopan *state, uint32_t size);
+void cryptopan_free_cache(struct cryptopan *state);
 uint32_t anonymize_ipv4(struct cryptopan *state, uint32_t addr);
+void anonymize_ipv4_batch(struct cryptopan *state, const uint32_t *addrs,
+						  uint32_t *results, size_t count);
+void anonymize_ipv6(struct cryptopan *state, const uint8_t addr[16], uint8_t result[16]);
+void anonymize_ipv6_batch(struct cryptopan *state, const uint8_t *addrs,
+						  uint8_t *results, size_t count);
+int cryptopan_self_test(enum aes_backend backend, int verbose);
 #endif
@@ -0,0 +1,129 @@
+#include "duplicate_set.h"
+#include "node_set.h"
+#include "olsr_protocol.h"
+#include "../ipfixlolib/msg.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+  * Entry of the expiry queue. As all tuples are held for the same amount of
+  * time the queue is ordered by expiry time.
+  */
+struct duplicate_queue_entry {
+	struct duplicate_key key;
+	time_t expires;
+};
+
+static struct {
+	khash_t(3) *hash;
+
+	/**
+	  * Ring buffer containing the tuples in order of insertion.
+	  */
+	struct duplicate_queue_entry *queue;
+	size_t head;
+	size_t size;
+	size_t capacity;
+
+	uint64_t hits;
+	uint64_t misses;
+} duplicate_set = { NULL, NULL, 0, 0, 0, 0, 0 };
+
+uint32_t duplicate_key_hash_code(struct duplicate_key key) {
+	return ip_addr_hash_code(key.orig) * 31 + key.seqno;
+}
+
+uint32_t duplicate_key_eq(struct duplicate_key a, struct duplicate_key b) {
+	return a.seqno == b.seqno && ip_addr_eq(a.orig, b.orig) == 1;
+}
+
+/**
+  * Removes all tuples whose hold time has passed.
+  */
+static void duplicate_set_expire(time_t now) {
+	while (duplicate_set.size > 0) {
+		struct duplicate_queue_entry *entry =
+				&duplicate_set.queue[duplicate_set.head];
+
+		if (entry->expires >= now)
+			break;
+
+		khiter_t k = kh_get(3, duplicate_set.hash, entry->key);
+		if (k != kh_end(duplicate_set.hash))
+			kh_del(3, duplicate_set.hash, k);
+
+		duplicate_set.head = (duplicate_set.head + 1) % duplicate_set.capacity;
+		duplicate_set.size--;
+	}
+}
+
+/**
+  * Appends the tuple to the expiry queue growing the queue if necessary.
+  *
+  * Returns 0 on success, -1 otherwise.
+  */
+static int duplicate_set_enqueue(const struct duplicate_key *key, time_t expires) {
+	if (duplicate_set.size == duplicate_set.capacity) {
+		size_t capacity = duplicate_set.capacity ? 2 * duplicate_set.capacity : 256;
+		struct duplicate_queue_entry *queue =
+				malloc(capacity * sizeof(struct duplicate_queue_entry));
+
+		if (!queue)
+			return -1;
+
+		// Unwrap the ring buffer
+		size_t i;
+		for (i = 0; i < duplicate_set.size; i++) {
+			queue[i] = duplicate_set.queue[(duplicate_set.head + i) % duplicate_set.capacity];
+		}
+
+		free(duplicate_set.queue);
+		duplicate_set.queue = queue;
+		duplicate_set.head = 0;
+		duplicate_set.capacity = capacity;
+	}
+
+	struct duplicate_queue_entry *entry =
+			&duplicate_set.queue[(duplicate_set.head + duplicate_set.size) % duplicate_set.capacity];
+	entry->key = *key;
+	entry->expires = expires;
+	duplicate_set.size++;
+
+	return 0;
+}
+
+int duplicate_set_check(const struct ip_addr_t *orig, uint16_t seqno, time_t now) {
+	if (!duplicate_set.hash)
+		duplicate_set.hash = kh_init(3);
+
+	duplicate_set_expire(now);
+
+	struct duplicate_key key;
+	memset(&key, 0, sizeof(key));
+	key.orig = *orig;
+	key.seqno = seqno;
+
+	if (kh_get(3, duplicate_set.hash, key) != kh_end(duplicate_set.hash)) {
+		duplicate_set.hits++;
+		return 1;
+	}
+
+	duplicate_set.misses++;
+
+	if (duplicate_set_enqueue(&key, now + DUP_HOLD_TIME)) {
+		msg(MSG_ERROR, "Failed to grow duplicate set.");
+		return 0;
+	}
+
+	int ret;
+	kh_put(3, duplicate_set.hash, key, &ret);
+
+	return 0;
+}
+
+void duplicate_set_statistics() {
+	printf("Duplicate set hits: %llu Misses: %llu\n",
+		   (unsigned long long) duplicate_set.hits,
+		   (unsigned long long) duplicate_set.misses);
+}
@@ -0,0 +1,46 @@
+#ifndef DUPLICATE_SET_H_
+#define DUPLICATE_SET_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include "khash.h"
+#include "ip_helper.h"
+
+/**
+  * Duplicate tuple as defined in RFC 3626 section 3.4: identifies a message
+  * by its originator and its message sequence number.
+  */
+struct duplicate_key {
+	struct ip_addr_t orig;
+	uint16_t seqno;
+};
+
+uint32_t duplicate_key_hash_code(struct duplicate_key key);
+uint32_t duplicate_key_eq(struct duplicate_key a, struct duplicate_key b);
+
+#define duplicate_key_hash_code_macro(key) duplicate_key_hash_code(key)
+#define duplicate_key_eq_macro(a, b) duplicate_key_eq(a, b)
+
+KHASH_INIT(3,
+		   struct duplicate_key,
+		   char,
+		   0,
+		   duplicate_key_hash_code_macro,
+		   duplicate_key_eq_macro);
+
+/**
+  * Checks whether the message identified by originator and sequence number
+  * has already been seen within the last DUP_HOLD_TIME seconds. If not, the
+  * message is recorded so that later copies are recognised as duplicates.
+  *
+  * Returns 1 if the message is a duplicate, 0 otherwise.
+  */
+int duplicate_set_check(const struct ip_addr_t *orig, uint16_t seqno, time_t now);
+
+/**
+  * Prints the number of duplicate set hits and misses.
+  */
+void duplicate_set_statistics();
+
+#endif
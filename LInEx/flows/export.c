@@ -4,12 +4,20 @@
 #include "hna_set.h"
 #include "mid_set.h"
 #include "object_cache.h"
+#include "pipeline_stats.h"
+#include "perf_counters.h"
+#include "../event_loop.h"
 #include "../ipfixlolib/msg.h"
 #include "../ipfixlolib/ipfix.h"
 
 #define SUBTEMPLATE_MULTILIST_HDR_LEN (sizeof(uint16_t) + sizeof(uint16_t))
 #define SUBTEMPLATE_LIST_HDR_LEN (sizeof(uint16_t) + sizeof(uint8_t))
 
+/**
+  * Length of the (zero padded) callback name in event loop statistics.
+  */
+#define EVENT_CALLBACK_NAME_LEN 32
+
 enum CaptureStatisticsInterfaceType {
 	CaptureStatisticsFlowType=0,
 	CaptureStatisticsOLSRType=1
@@ -42,15 +50,48 @@ struct export_status {
 	vtime_container_iterator(mid_set) mid_iterator;
 };
 
+/**
+  * Stores the status of a delta export which allows fragmenting the changes
+  * over multiple IPFIX packets.
+  */
+struct delta_export_status {
+	/**
+	  * The dirty node which is currently being exported.
+	  */
+	struct node_entry *node;
+
+	/**
+	  * The kind of entries of the current node which are being exported.
+	  */
+	enum delta_entry_action action;
+
+	/**
+	  * Number of entries of the topology, hello, HNA and MID set which have
+	  * already been exported for the current node and action.
+	  */
+	size_t offset[4];
+
+	/**
+	  * Number of entries contained in the current IPFIX message.
+	  */
+	size_t records;
+};
+
 static u_char message_buffer[IPFIX_MAX_PACKETSIZE];
 
+/**
+  * Scratch buffer used to build the cached encoding of a node.
+  */
+static u_char node_buffer[IPFIX_MAX_PACKETSIZE];
+
 struct olsr_template_info templates[] = {
 { BaseTemplate,
 	(struct olsr_template_field []) {
 		{ExportTimestamp, ENTERPRISE_ID, sizeof(uint32_t)},
 		{ 292, 0, 0xffff },
 		{ 0 }
-	}
+	},
+	0
 },
 { NodeTemplateIPv4,
 	(struct olsr_template_field []) {
@@ -58,7 +99,8 @@ struct olsr_template_info templates[] = {
 		{HTimeType, ENTERPRISE_ID, sizeof(uint8_t)},
 		{ 293, 0, 0xffff },
 		{ 0 }
-	}
+	},
+	0
 },
 { TargetHostTemplateIPv4,
 	(struct olsr_template_field []) {
@@ -66,7 +108,8 @@ struct olsr_template_info templates[] = {
 		{OLSRSequenceNumberType, ENTERPRISE_ID, sizeof(uint16_t) },
 		{TargetHostLQType, ENTERPRISE_ID, sizeof(uint32_t) },
 		{ 0 }
-	}
+	},
+	0
 },
 { NeighborHostTemplateIPv4,
 	(struct olsr_template_field []) {
@@ -74,7 +117,8 @@ struct olsr_template_info templates[] = {
 		{NeighborLinkCodeType, ENTERPRISE_ID, sizeof(uint8_t) },
 		{NeighborLQType, ENTERPRISE_ID, sizeof(uint32_t) },
 		{ 0 }
-	}
+	},
+	0
 },
 { FlowTemplateIPv4,
 	(struct olsr_template_field []) {
@@ -87,7 +131,8 @@ struct olsr_template_info templates[] = {
 		{IPFIX_TYPEID_flowStartSeconds, 0, sizeof(uint32_t) },
 		{IPFIX_TYPEID_flowEndSeconds, 0, sizeof(uint32_t) },
 		{ 0 }
-	}
+	},
+	0
 },
 { CaptureStatisticsTemplate,
 	(struct olsr_template_field []) {
@@ -97,20 +142,86 @@ struct olsr_template_info templates[] = {
 		{CaptureStatisticsDroppedPackets, ENTERPRISE_ID, sizeof(uint32_t) },
 		{CaptureStatisticsTimestamp, ENTERPRISE_ID, sizeof(uint32_t) },
 		{ 0 }
-	}
+	},
+	0
+},
+{ EventLoopStatisticsTemplate,
+	(struct olsr_template_field []) {
+		{EventCallbackNameType, ENTERPRISE_ID, EVENT_CALLBACK_NAME_LEN},
+		{EventCallbackKindType, ENTERPRISE_ID, sizeof(uint8_t)},
+		{EventCallbackCallsType, ENTERPRISE_ID, sizeof(uint64_t)},
+		{EventCallbackTotalTimeType, ENTERPRISE_ID, sizeof(uint64_t)},
+		{EventCallbackMaxTimeType, ENTERPRISE_ID, sizeof(uint32_t)},
+		{EventCallbackStallsType, ENTERPRISE_ID, sizeof(uint32_t)},
+		{EventCallbackHistogramType, ENTERPRISE_ID, EVENT_LOOP_HISTOGRAM_BUCKETS * sizeof(uint32_t)},
+		{ExportTimestamp, ENTERPRISE_ID, sizeof(uint32_t)},
+		{ 0 }
+	},
+	1
+},
+{ PipelineStatisticsTemplate,
+	(struct olsr_template_field []) {
+		{PipelineStageType, ENTERPRISE_ID, sizeof(uint8_t)},
+		{PipelineStagePassesType, ENTERPRISE_ID, sizeof(uint64_t)},
+		{PipelineStageSamplesType, ENTERPRISE_ID, sizeof(uint64_t)},
+		{PipelineStageTicksType, ENTERPRISE_ID, sizeof(uint64_t)},
+		{PipelineStageMaxTicksType, ENTERPRISE_ID, sizeof(uint64_t)},
+		{PipelineTickUnitType, ENTERPRISE_ID, sizeof(uint8_t)},
+		{ExportTimestamp, ENTERPRISE_ID, sizeof(uint32_t)},
+		{ 0 }
+	},
+	1
+},
+#ifdef SUPPORT_PERF_COUNTERS
+{ PerfCounterStatisticsTemplate,
+	(struct olsr_template_field []) {
+		{PerfStageType, ENTERPRISE_ID, sizeof(uint8_t)},
+		{PerfCountersAvailableType, ENTERPRISE_ID, sizeof(uint8_t)},
+		{PerfSamplesType, ENTERPRISE_ID, sizeof(uint64_t)},
+		{PerfCyclesType, ENTERPRISE_ID, sizeof(uint64_t)},
+		{PerfInstructionsType, ENTERPRISE_ID, sizeof(uint64_t)},
+		{PerfCacheMissesType, ENTERPRISE_ID, sizeof(uint64_t)},
+		{PerfBranchMissesType, ENTERPRISE_ID, sizeof(uint64_t)},
+		{ExportTimestamp, ENTERPRISE_ID, sizeof(uint32_t)},
+		{ 0 }
+	},
+	1
 },
+#endif
 { HNATemplateIPv4,
 	(struct olsr_template_field []) {
 		{HNANetworkIPv4, ENTERPRISE_ID, sizeof(uint32_t)},
 		{HNANetworkPrefixLength, ENTERPRISE_ID, sizeof(uint8_t) },
 		{ 0 }
-	}
+	},
+	0
 },
 { MIDTemplateIPv4,
 	(struct olsr_template_field []) {
 		{MIDAddressIPv4, ENTERPRISE_ID, sizeof(uint32_t)},
 		{ 0 }
-	}
+	},
+	0
+},
+{ DeltaBaseTemplate,
+	(struct olsr_template_field []) {
+		{ExportTimestamp, ENTERPRISE_ID, sizeof(uint32_t)},
+		{SnapshotTimestampType, ENTERPRISE_ID, sizeof(uint32_t)},
+		{DeltaSequenceNumberType, ENTERPRISE_ID, sizeof(uint32_t)},
+		{ 292, 0, 0xffff },
+		{ 0 }
+	},
+	0
+},
+{ DeltaNodeTemplateIPv4,
+	(struct olsr_template_field []) {
+		{NodeAddressIPv4Type, ENTERPRISE_ID, sizeof(uint32_t)},
+		{HTimeType, ENTERPRISE_ID, sizeof(uint8_t)},
+		{DeltaEntryActionType, ENTERPRISE_ID, sizeof(uint8_t)},
+		{ 293, 0, 0xffff },
+		{ 0 }
+	},
+	0
 },
 #ifdef SUPPORT_IPV6
 { NodeTemplateIPv6,
@@ -119,14 +230,16 @@ struct olsr_template_info templates[] = {
 		{HTimeType, ENTERPRISE_ID, sizeof(uint8_t)},
 		{ 293, 0, 0xffff },
 		{ 0 }
-	}
+	},
+	0
 },
 { TargetHostTemplateIPv6,
 	(struct olsr_template_field []) {
 		{TargetHostIPv6Type, ENTERPRISE_ID, sizeof(struct in6_addr)},
 		{OLSRSequenceNumberType, ENTERPRISE_ID, sizeof(uint16_t) },
 		{ 0 }
-	}
+	},
+	0
 },
 { NeighborHostTemplateIPv6,
 	(struct olsr_template_field []) {
@@ -134,7 +247,8 @@ struct olsr_template_info templates[] = {
 		{NeighborLinkCodeType, ENTERPRISE_ID, sizeof(uint8_t) },
 		{NeighborLQType, ENTERPRISE_ID, sizeof(uint32_t) },
 		{ 0 }
-	}
+	},
+	0
 },
 { FlowTemplateIPv6,
 	(struct olsr_template_field []) {
@@ -147,25 +261,41 @@ struct olsr_template_info templates[] = {
 		{IPFIX_TYPEID_flowStartSeconds, 0, sizeof(uint32_t) },
 		{IPFIX_TYPEID_flowEndSeconds, 0, sizeof(uint32_t) },
 		{ 0 }
-	}
+	},
+	0
 },
 { HNATemplateIPv6,
 	(struct olsr_template_field []) {
 		{HNANetworkIPv6, ENTERPRISE_ID, sizeof(struct in6_addr)},
 		{HNANetworkPrefixLength, ENTERPRISE_ID, sizeof(uint8_t) },
 		{ 0 }
-	}
+	},
+	0
 },
 { MIDTemplateIPv6,
 	(struct olsr_template_field []) {
 		{MIDAddressIPv6, ENTERPRISE_ID, sizeof(struct in6_addr)},
 		{ 0 }
-	}
+	},
+	0
+},
+{ DeltaNodeTemplateIPv6,
+	(struct olsr_template_field []) {
+		{NodeAddressIPv6Type, ENTERPRISE_ID, sizeof(struct in6_addr)},
+		{HTimeType, ENTERPRISE_ID, sizeof(uint8_t)},
+		{DeltaEntryActionType, ENTERPRISE_ID, sizeof(uint8_t)},
+		{ 293, 0, 0xffff },
+		{ 0 }
+	},
+	0
 },
 #endif
 };
 
 #define CAPTURE_STATISTICS_TEMPLATE_LEN (2 * sizeof(uint8_t) + 3 * sizeof(uint32_t))
+#define PIPELINE_STATISTICS_TEMPLATE_LEN (2 * sizeof(uint8_t) + 4 * sizeof(uint64_t) + sizeof(uint32_t))
+#define PERF_COUNTER_STATISTICS_TEMPLATE_LEN (2 * sizeof(uint8_t) + 5 * sizeof(uint64_t) + sizeof(uint32_t))
+#define EVENT_LOOP_STATISTICS_TEMPLATE_LEN (EVENT_CALLBACK_NAME_LEN + sizeof(uint8_t) + 2 * sizeof(uint64_t) + 3 * sizeof(uint32_t) + EVENT_LOOP_HISTOGRAM_BUCKETS * sizeof(uint32_t))
 #define FLOW_TEMPLATE_LEN (sizeof(uint8_t) + 2 * sizeof(uint16_t) + sizeof(uint64_t) + 2 * sizeof(uint32_t))
 #define FLOW_TEMPLATE_IPV4_LEN (FLOW_TEMPLATE_LEN + 2 * sizeof(uint32_t))
 #define FLOW_TEMPLATE_IPV6_LEN (FLOW_TEMPLATE_LEN + 2 * sizeof(struct in6_addr))
@@ -238,6 +368,11 @@ static size_t mid_list_encode(const struct ip_addr_t *addr,
 										struct buffer_info *buffer,
 										struct export_status *status);
 
+static size_t delta_base_encode(time_t timestamp,
+								const struct export_parameters *params,
+								struct buffer_info *buffer,
+								struct delta_export_status *status);
+
 static void export_flow_database(khash_t(1) *flow_database,
 								 ipfix_exporter *exporter,
 								 flow_capture_session *session,
@@ -266,8 +401,16 @@ static size_t count_fields(const struct olsr_template_info *template_info) {
 
 static int declare_template(ipfix_exporter *exporter,
 							const struct olsr_template_info *template_info) {
-	if (ipfix_start_template(exporter, template_info->template_id, count_fields(template_info)))
+	size_t field_count = count_fields(template_info);
+
+	if (template_info->scope_field_count) {
+		if (ipfix_start_optionstemplate(exporter, template_info->template_id,
+										template_info->scope_field_count,
+										field_count - template_info->scope_field_count))
+			return -1;
+	} else if (ipfix_start_template(exporter, template_info->template_id, field_count)) {
 		return -1;
+	}
 
 	struct olsr_template_field *template_field = template_info->fields;
 
@@ -366,7 +509,7 @@ static size_t neighbor_host_list_encode(const struct ip_addr_t *addr,
 
 	vtime_container_foreach(status->hs_iterator) {
 		if (buffer->pos + neighbor_host_len(addr->protocol) > buffer->end) {
-			status->ts_iterator.stop = 1;
+			status->hs_iterator.stop = 1;
 			break;
 		}
 
@@ -435,7 +578,7 @@ static size_t hna_network_list_encode(const struct ip_addr_t *addr,
 
 	vtime_container_foreach(status->hna_iterator) {
 		if (buffer->pos + hna_network_len(addr->protocol) > buffer->end) {
-			status->ts_iterator.stop = 1;
+			status->hna_iterator.stop = 1;
 			break;
 		}
 
@@ -534,6 +677,47 @@ static size_t base_encode(time_t timestamp,
 	return (buffer->pos - buffer_start);
 }
 
+/**
+  * Encodes the complete node record into a newly allocated buffer which is
+  * stored in the node. The cached record is released as soon as the node
+  * changes (see mark_node_dirty()).
+  *
+  * Nodes which need more than space bytes, the space the node list has in
+  * an IPFIX message, are not cached as they never fit into a message as a
+  * whole.
+  */
+static void node_cache_update(const struct ip_addr_t *addr,
+							  struct node_entry *node,
+							  size_t space) {
+	struct export_status status;
+
+	if (space > sizeof(node_buffer))
+		space = sizeof(node_buffer);
+
+	struct buffer_info info = { node_buffer, node_buffer, node_buffer + space };
+
+	vtime_container_clear_iterator(status.ts_iterator);
+	vtime_container_clear_iterator(status.hs_iterator);
+	vtime_container_clear_iterator(status.hna_iterator);
+	vtime_container_clear_iterator(status.mid_iterator);
+
+	size_t len = node_encode(addr, node, &info, &status);
+
+	if (status.ts_iterator.stop || status.hs_iterator.stop
+			|| status.hna_iterator.stop || status.mid_iterator.stop
+			|| node_buffer + len > info.end || len > UINT16_MAX) {
+		// Node does not fit into a single record - do not cache it.
+		return;
+	}
+
+	node->encoded = (uint8_t *) malloc(len);
+	if (!node->encoded)
+		return;
+
+	memcpy(node->encoded, node_buffer, len);
+	node->encoded_len = len;
+}
+
 static size_t node_list_len(network_protocol proto,
 							const node_set_hash *node_set) {
 	size_t len = SUBTEMPLATE_LIST_HDR_LEN; // List header
@@ -565,6 +749,8 @@ static size_t node_list_encode(network_protocol proto,
 		break;
 	}
 
+	uint8_t *const list_start = buffer->pos;
+
 	for (; status->current_entry != kh_end(node_set); ++(status->current_entry)) {
 		if (!kh_exist(node_set, status->current_entry))
 			continue;
@@ -572,6 +758,25 @@ static size_t node_list_encode(network_protocol proto,
 		struct ip_addr_t addr = kh_key(node_set, status->current_entry);
 		struct node_entry *node = kh_value(node_set, status->current_entry);
 
+		// Unchanged nodes are copied from the cache. Only nodes which do not
+		// fit into an empty message are encoded piece by piece.
+		if (!node->encoded && !status->ts_iterator.elem
+				&& !status->hs_iterator.elem && !status->hna_iterator.elem
+				&& !status->mid_iterator.elem)
+			node_cache_update(&addr, node, buffer->end - list_start);
+
+		if (node->encoded) {
+			if (buffer->pos + node->encoded_len <= buffer->end) {
+				memcpy(buffer->pos, node->encoded, node->encoded_len);
+				buffer->pos += node->encoded_len;
+
+				continue;
+			}
+
+			if (buffer->pos != list_start)
+				break;
+		}
+
 		if (buffer->pos + node_len(&addr, node) > buffer->end)
 			break;
 
@@ -745,11 +950,14 @@ void export_full(struct export_parameters *params) {
 
 	msg(MSG_INFO, "Exporting OLSR data");
 
-	// Expire old entries
+	// Expire old entries. A full snapshot does not report withdrawn entries
+	// hence the pending changes can be dropped right away.
 	expire_node_set_entries(node_set);
+	commit_node_set_changes(node_set);
 
 	struct export_status status;
 	time_t timestamp = time(NULL);
+	int failed = 0;
 
 	vtime_container_clear_iterator(status.ts_iterator);
 	vtime_container_clear_iterator(status.hs_iterator);
@@ -761,37 +969,471 @@ void export_full(struct export_parameters *params) {
 	while (status.current_entry != kh_end(node_set)) {
 		if (ipfix_start_data_set(exporter, htons(BaseTemplate))) {
 			msg(MSG_ERROR, "Failed to start data set.");
+			failed = 1;
+			break;
+		}
 
-			return;
+		uint16_t space = ipfix_get_remaining_space(exporter);
+		uint8_t *start = ipfix_reserve_data_field(exporter, space);
+
+		if (start == NULL) {
+			ipfix_cancel_data_set(exporter);
+			failed = 1;
+			break;
 		}
 
-		struct buffer_info info = { message_buffer, message_buffer, message_buffer + ipfix_get_remaining_space(exporter) };
+		struct buffer_info info = { start, start, start + space };
 		size_t buffer_len = base_encode(timestamp, node_set, &info, &status);
 
 		DPRINTF("Status at %p %p %d %d", status.ts_iterator.elem, status.hs_iterator, status.current_entry, kh_end(node_set));
 
-		if (ipfix_put_data_field(exporter, message_buffer, buffer_len)) {
+		if (ipfix_commit_data_field(exporter, buffer_len)) {
 			msg(MSG_ERROR, "Failed to add data record.");
-			return;
+			failed = 1;
+			break;
 		}
 
 		if (ipfix_end_data_set(exporter, 1)) {
 			msg(MSG_ERROR, "Failed to end data set.");
-			return;
+			failed = 1;
+			break;
 		}
 
 		if (ipfix_send(exporter)) {
 			msg(MSG_ERROR, "Failed to send IPFIX message.");
-			return;
+			failed = 1;
+			break;
+		}
+	}
+
+	if (failed) {
+		// The changes have already been dropped, hence deltas must not be
+		// based on any snapshot until the next one has been sent.
+		params->snapshot_timestamp = 0;
+		return;
+	}
+
+	params->snapshot_timestamp = timestamp;
+	params->delta_sequence_number = 0;
+	params->exports_since_snapshot = 0;
+}
+
+#ifdef SUPPORT_IPV6
+#define template_for_protocol(protocol, name) \
+	((protocol) == IPv6 ? name##IPv6 : name##IPv4)
+#else
+#define template_for_protocol(protocol, name) name##IPv4
+#endif
+
+/**
+  * Returns 1 if the entry has to be reported for the given action, 0
+  * otherwise. Entries which have been created and withdrawn between two
+  * exports are not reported at all.
+  */
+static inline int delta_entry_matches(const struct set_entry_common *common,
+									  enum delta_entry_action action) {
+	switch (action) {
+	case DeltaEntryCreated:
+		return common->created;
+	case DeltaEntryChanged:
+		return !common->created && common->changed;
+	case DeltaEntryWithdrawn:
+		return !common->created;
+	}
+
+	return 0;
+}
+
+/**
+  * Encodes a sub template list containing the entries of the container
+  * which match the given action. Entries which have already been exported
+  * (according to offset) are skipped. Nothing is written if no entry
+  * matches.
+  *
+  * complete is set to 0 if the buffer was too small to hold all entries.
+  */
+#define delta_list_encode(container, action, template_id, entry_len, entry_encode, protocol, buffer, offset, records, complete) \
+	if (container && complete) { \
+		uint8_t *const _list_start = buffer->pos; \
+		typeof(container->first) _bucket = (action == DeltaEntryWithdrawn) \
+				? container->expired : container->first; \
+		typeof(_bucket->first) _entry; \
+		size_t _index = 0; \
+		if (buffer->pos + SUBTEMPLATE_MULTILIST_HDR_LEN > buffer->end) { \
+			complete = 0; \
+		} else { \
+			pkt_put_u16(&buffer->pos, template_id); \
+			uint8_t *_list_length = buffer->pos; \
+			pkt_put_u16(&buffer->pos, 0); \
+			for (; _bucket && complete; _bucket = _bucket->next) { \
+				for (_entry = _bucket->first; _entry; _entry = _entry->next) { \
+					if (!delta_entry_matches(&_entry->common, action) \
+							|| _index++ < offset) \
+						continue; \
+					if (buffer->pos + entry_len > buffer->end) { \
+						complete = 0; \
+						break; \
+					} \
+					entry_encode(_entry, protocol, buffer); \
+					offset++; \
+					records++; \
+				} \
+			} \
+			if (buffer->pos == _list_length + sizeof(uint16_t)) \
+				buffer->pos = _list_start; \
+			else \
+				pkt_put_u16(&_list_length, buffer->pos - (_list_length + sizeof(uint16_t))); \
+		} \
+	}
+
+/**
+  * Returns the minimum length of a delta node record.
+  */
+static size_t delta_node_len(const struct node_entry *node) {
+	size_t len = ip_addr_len(node->addr.protocol);
+	len += sizeof(uint8_t); // HTime
+	len += sizeof(uint8_t); // Action
+
+	len += sizeof(uint8_t) + sizeof(uint16_t); // Variable length of list
+	len += sizeof(uint8_t); // Length of subTemplateMultiList header (Semantics field)
+
+	return len;
+}
+
+/**
+  * Encodes the entries of the node which match the current action of the
+  * export status. Nothing is written if there are no such entries, unless
+  * the HTime of the node has changed, which is reported by a changed record
+  * without entries.
+  *
+  * Returns 1 if all entries have been encoded, 0 if the buffer was too small.
+  */
+static int delta_node_encode(const struct node_entry *node,
+							 struct buffer_info *buffer,
+							 struct delta_export_status *status) {
+	uint8_t *const buffer_start = buffer->pos;
+	const struct ip_addr_t *addr = &node->addr;
+	size_t records = status->records;
+	int complete = 1;
+
+	pkt_put_ipaddress(&buffer->pos, &addr->addr, addr->protocol); // Node IP address
+	if (node->hello_set)
+		pkt_put_u8(&buffer->pos, node->hello_set->htime);
+	else
+		pkt_put_u8(&buffer->pos, 0);
+	pkt_put_u8(&buffer->pos, status->action);
+
+	uint8_t *len_ptr = pkt_put_variable_length(&buffer->pos);
+	pkt_put_u8(&buffer->pos, 0x3); // allOf semantics for subTemplateMultiList
+
+	delta_list_encode(node->topology_set, status->action,
+					  template_for_protocol(addr->protocol, TargetHostTemplate),
+					  target_host_len(addr->protocol), target_host_encode,
+					  addr->protocol, buffer, status->offset[0],
+					  status->records, complete)
+	delta_list_encode(node->hello_set, status->action,
+					  template_for_protocol(addr->protocol, NeighborHostTemplate),
+					  neighbor_host_len(addr->protocol), neighbor_host_encode,
+					  addr->protocol, buffer, status->offset[1],
+					  status->records, complete)
+	delta_list_encode(node->hna_set, status->action,
+					  template_for_protocol(addr->protocol, HNATemplate),
+					  hna_network_len(addr->protocol), hna_network_encode,
+					  addr->protocol, buffer, status->offset[2],
+					  status->records, complete)
+	delta_list_encode(node->mid_set, status->action,
+					  template_for_protocol(addr->protocol, MIDTemplate),
+					  mid_len(addr->protocol), mid_encode,
+					  addr->protocol, buffer, status->offset[3],
+					  status->records, complete)
+
+	if (status->records == records && complete
+			&& status->action == DeltaEntryChanged && node->htime_changed) {
+		// No entry has changed apart from the HTime
+		pkt_put_u16(&len_ptr, buffer->pos - (len_ptr + sizeof(uint16_t)));
+		status->records++;
+	} else if (status->records == records) {
+		// Nothing to report for this node and action
+		buffer->pos = buffer_start;
+	} else {
+		pkt_put_u16(&len_ptr, buffer->pos - (len_ptr + sizeof(uint16_t)));
+	}
+
+	return complete;
+}
+
+/**
+  * Advances the export status to the next action or, if all actions of the
+  * current node have been exported, to the next dirty node.
+  *
+  * Withdrawals are reported first so that collectors can apply the records
+  * in order if an entry has been withdrawn and created again.
+  */
+static void delta_export_advance(struct delta_export_status *status) {
+	memset(status->offset, 0, sizeof(status->offset));
+
+	switch (status->action) {
+	case DeltaEntryWithdrawn:
+		status->action = DeltaEntryCreated;
+		break;
+	case DeltaEntryCreated:
+		status->action = DeltaEntryChanged;
+		break;
+	case DeltaEntryChanged:
+		status->action = DeltaEntryWithdrawn;
+		status->node = status->node->next_dirty;
+		break;
+	}
+}
+
+/**
+  * Returns the length of a delta base record without any node record.
+  */
+static size_t delta_base_len() {
+	size_t len = 3 * sizeof(uint32_t); // Timestamps and delta sequence number
+
+	len += sizeof(uint8_t) + sizeof(uint16_t); // Variable length of list
+	len += SUBTEMPLATE_LIST_HDR_LEN; // List header
+
+	return len;
+}
+
+/**
+  * Encodes a delta base record containing the changes of the dirty nodes
+  * which share the address family of the current node. The record ends at
+  * the first node of another family as all records of a subTemplateList
+  * use the same template.
+  */
+static size_t delta_base_encode(time_t timestamp,
+								const struct export_parameters *params,
+								struct buffer_info *buffer,
+								struct delta_export_status *status) {
+	uint8_t *const buffer_start = buffer->pos;
+	const network_protocol protocol = status->node->addr.protocol;
+
+	pkt_put_u32(&buffer->pos, timestamp);
+	pkt_put_u32(&buffer->pos, params->snapshot_timestamp);
+	pkt_put_u32(&buffer->pos, params->delta_sequence_number);
+
+	uint8_t *len_ptr = pkt_put_variable_length(&buffer->pos);
+	uint8_t *const list_start = buffer->pos;
+
+	pkt_put_u8(&buffer->pos, 0x03); // allOf semantic
+	pkt_put_u16(&buffer->pos, template_for_protocol(protocol, DeltaNodeTemplate));
+
+	while (status->node && status->node->addr.protocol == protocol) {
+		if (buffer->pos + delta_node_len(status->node) > buffer->end)
+			break;
+
+		if (!delta_node_encode(status->node, buffer, status))
+			break;
+
+		delta_export_advance(status);
+	}
+
+	pkt_put_u16(&len_ptr, buffer->pos - list_start);
+
+	return (buffer->pos - buffer_start);
+}
+
+/**
+  * Exports the OLSR entries which have been created, changed or withdrawn
+  * since the last export.
+  *
+  * Every record carries the timestamp of the full snapshot it is based on and
+  * a delta sequence number which allows collectors to detect lost deltas.
+  */
+void export_delta(struct export_parameters *params) {
+	ipfix_exporter *exporter = params->exporter;
+	khash_t(2) *node_set = params->node_set;
+
+	if (node_set == NULL || exporter == NULL)
+		return;
+
+	expire_node_set_entries(node_set);
+
+	struct delta_export_status status;
+	status.node = dirty_node_list();
+	status.action = DeltaEntryWithdrawn;
+	memset(status.offset, 0, sizeof(status.offset));
+
+	if (!status.node) {
+		DPRINTF("No OLSR changes to export");
+		return;
+	}
+
+	msg(MSG_INFO, "Exporting OLSR changes");
+
+	time_t timestamp = time(NULL);
+	// Pending changes are kept until they have been handed to ipfixlolib so
+	// that a failed export is repeated by the next one.
+	int failed = 0;
+
+	while (status.node) {
+		if (ipfix_start_data_set(exporter, htons(DeltaBaseTemplate))) {
+			msg(MSG_ERROR, "Failed to start data set.");
+			failed = 1;
+			break;
+		}
+
+		// Every message carries its own sequence number so that collectors
+		// notice lost messages.
+		params->delta_sequence_number++;
+
+		uint16_t records = 0;
+
+		while (status.node) {
+			uint16_t space = ipfix_get_remaining_space(exporter);
+
+			if (space < delta_base_len() + delta_node_len(status.node))
+				break;
+
+			uint8_t *start = ipfix_reserve_data_field(exporter, space);
+
+			if (start == NULL) {
+				failed = 1;
+				break;
+			}
+
+			struct buffer_info info = { start, start, start + space };
+			const struct node_entry *node = status.node;
+			status.records = 0;
+			size_t buffer_len = delta_base_encode(timestamp, params, &info, &status);
+
+			if (status.records == 0) {
+				// Nodes without changes have been skipped up to a node of
+				// the other address family.
+				if (status.node != node)
+					continue;
+
+				break;
+			}
+
+			if (ipfix_commit_data_field(exporter, buffer_len)) {
+				msg(MSG_ERROR, "Failed to add data record.");
+				failed = 1;
+				break;
+			}
+
+			records++;
+		}
+
+		if (records == 0) {
+			ipfix_cancel_data_set(exporter);
+			params->delta_sequence_number--;
+
+			if (status.node && !failed)
+				msg(MSG_ERROR, "OLSR changes do not fit into an IPFIX message.");
+
+			break;
+		}
+
+		if (ipfix_end_data_set(exporter, records)) {
+			msg(MSG_ERROR, "Failed to end data set.");
+			failed = 1;
+			break;
 		}
+
+		if (ipfix_send(exporter)) {
+			msg(MSG_ERROR, "Failed to send IPFIX message.");
+			failed = 1;
+			break;
+		}
+	}
+
+	if (!failed)
+		commit_node_set_changes(node_set);
+}
+
+/**
+  * Exports the OLSR information. Sends a full snapshot every
+  * snapshot_interval exports and only the changes in between.
+  */
+void export_olsr(struct export_parameters *params) {
+	if (params->snapshot_interval == 0
+			|| params->snapshot_timestamp == 0
+			|| params->exports_since_snapshot + 1 >= params->snapshot_interval) {
+		export_full(params);
+	} else {
+		params->exports_since_snapshot++;
+		export_delta(params);
+	}
+
+	ipfix_flush(params->exporter);
+}
+
+#ifdef SUPPORT_ANONYMIZATION
+/**
+  * Logs the hit rates of the CryptoPAN cache of one address family if
+  * addresses have been anonymized since the last call. prefixes names the
+  * cache levels, the last one being the complete address.
+  */
+static void log_cryptopan_family_statistics(const struct cryptopan *cryptopan,
+											const struct cryptopan_statistics *statistics,
+											uint64_t *previous_lookups,
+											const char *family,
+											const char * const *prefixes,
+											int levels) {
+	double lookups = statistics->lookups;
+	char hits[128];
+	size_t len = 0;
+	int level;
+
+	if (cryptopan->cache == NULL || statistics->lookups == *previous_lookups)
+		return;
+
+	*previous_lookups = statistics->lookups;
+
+	for (level = levels - 1; level >= 0 && len < sizeof(hits); level--) {
+		len += snprintf(hits + len, sizeof(hits) - len, " %.1f%% %s",
+						100 * statistics->hits[level] / lookups,
+						prefixes[level]);
 	}
+
+	msg(MSG_INFO, "CryptoPAN %s cache: %llu lookups, hits:%s, %llu AES blocks, %llu evictions",
+		family,
+		(unsigned long long) statistics->lookups,
+		hits,
+		(unsigned long long) statistics->blocks,
+		(unsigned long long) statistics->evictions);
 }
 
+static void log_cryptopan_statistics(const struct cryptopan *cryptopan) {
+	static const char * const prefixes[CRYPTOPAN_CACHE_LEVELS] = {
+		"/16", "/24", "address"
+	};
+	static uint64_t previous_lookups = 0;
+#ifdef SUPPORT_IPV6
+	static const char * const prefixes6[CRYPTOPAN6_CACHE_LEVELS] = {
+		"/48", "/64", "/96", "/112", "address"
+	};
+	static uint64_t previous_lookups6 = 0;
+#endif
+
+	log_cryptopan_family_statistics(cryptopan, &cryptopan->statistics,
+									&previous_lookups, "IPv4",
+									prefixes, CRYPTOPAN_CACHE_LEVELS);
+#ifdef SUPPORT_IPV6
+	log_cryptopan_family_statistics(cryptopan, &cryptopan->statistics6,
+									&previous_lookups6, "IPv6",
+									prefixes6, CRYPTOPAN6_CACHE_LEVELS);
+#endif
+}
+#endif
+
 void export_flows(struct export_flow_parameter *param) {
 	DPRINTF("Exporting flows");
 	flow_capture_session *session = param->session;
 	ipfix_exporter *exporter = param->exporter;
 
+	// Flows stay in the database until TCP collectors have caught up
+	if (ipfix_backpressure(exporter)) {
+		msg(MSG_INFO, "Postponing flow export, collectors fall behind.");
+		return;
+	}
+
+	perf_stage_begin(PerfStageExport);
+
 	export_flow_database(session->ipv4_flow_database,
 						 exporter,
 						 session,
@@ -804,6 +1446,14 @@ void export_flows(struct export_flow_parameter *param) {
 						 FlowTemplateIPv6,
 						 FLOW_TEMPLATE_IPV6_LEN);
 #endif
+
+	ipfix_flush(exporter);
+
+	perf_stage_end(PerfStageExport);
+
+#ifdef SUPPORT_ANONYMIZATION
+	log_cryptopan_statistics(&session->cryptopan);
+#endif
 }
 
 static void export_flow_database(khash_t(1) *flow_database,
@@ -812,6 +1462,7 @@ static void export_flow_database(khash_t(1) *flow_database,
 								 uint16_t template_id,
 								 size_t template_len) {
 	time_t now = time(NULL);
+	uint8_t *start = NULL;
 	uint8_t *buffer = NULL;
 	uint8_t *buffer_end = NULL;
 	khiter_t k;
@@ -829,11 +1480,11 @@ static void export_flow_database(khash_t(1) *flow_database,
 
 		kh_del(1, flow_database, k);
 
+		pipeline_sample_begin();
+
 		if (buffer == NULL || (buffer + template_len) > buffer_end) {
 			if (buffer != NULL) {
-				if (ipfix_put_data_field(exporter,
-										 message_buffer,
-										 buffer - message_buffer)) {
+				if (ipfix_commit_data_field(exporter, buffer - start)) {
 					msg(MSG_ERROR, "Failed to add data record.");
 					return;
 				}
@@ -843,10 +1494,14 @@ static void export_flow_database(khash_t(1) *flow_database,
 					return;
 				}
 
+				pipeline_timing_begin();
 				if (ipfix_send(exporter)) {
 					msg(MSG_ERROR, "Failed to send IPFIX message.");
 					return;
 				}
+				pipeline_stage_done(PipelineStageSend);
+
+				pipeline_sample_begin();
 			}
 
 			if (ipfix_start_data_set(exporter, htons(template_id))) {
@@ -854,17 +1509,38 @@ static void export_flow_database(khash_t(1) *flow_database,
 				return;
 			}
 
-			buffer = message_buffer;
-			buffer_end = message_buffer + ipfix_get_remaining_space(exporter);
+			uint16_t space = ipfix_get_remaining_space(exporter);
+
+			// Encode the records directly into the message
+			start = ipfix_reserve_data_field(exporter, space);
+			if (start == NULL) {
+				ipfix_cancel_data_set(exporter);
+				return;
+			}
+
+			buffer = start;
+			buffer_end = start + space;
 		}
 
 #ifdef SUPPORT_ANONYMIZATION
 		if (key->protocol == IPv4 && session->cryptopan.initialised) {
-			key->src_addr.v4.s_addr = anonymize_ipv4(&session->cryptopan,
-													 key->src_addr.v4.s_addr);
-			key->dst_addr.v4.s_addr = anonymize_ipv4(&session->cryptopan,
-													 key->dst_addr.v4.s_addr);
+			uint32_t addrs[2] = { ntohl(key->src_addr.v4.s_addr), ntohl(key->dst_addr.v4.s_addr) };
+
+			anonymize_ipv4_batch(&session->cryptopan, addrs, addrs, 2);
+			key->src_addr.v4.s_addr = htonl(addrs[0]);
+			key->dst_addr.v4.s_addr = htonl(addrs[1]);
+		}
+#ifdef SUPPORT_IPV6
+		else if (key->protocol == IPv6 && session->cryptopan.initialised) {
+			uint8_t addrs[2][16];
+
+			memcpy(addrs[0], key->src_addr.v6.s6_addr, 16);
+			memcpy(addrs[1], key->dst_addr.v6.s6_addr, 16);
+			anonymize_ipv6_batch(&session->cryptopan, addrs[0], addrs[0], 2);
+			memcpy(key->src_addr.v6.s6_addr, addrs[0], 16);
+			memcpy(key->dst_addr.v6.s6_addr, addrs[1], 16);
 		}
+#endif
 #endif
 		pkt_put_ipaddress(&buffer, &key->src_addr, key->protocol);
 		pkt_put_ipaddress(&buffer, &key->dst_addr, key->protocol);
@@ -891,12 +1567,12 @@ static void export_flow_database(khash_t(1) *flow_database,
 
 		release_object(session->flow_key_cache, key);
 		release_object(session->flow_info_cache, info);
+
+		pipeline_stage_done(PipelineStageEncode);
 	}
 
-	if (buffer != NULL && buffer != message_buffer) {
-		if (ipfix_put_data_field(exporter,
-								 message_buffer,
-								 buffer - message_buffer)) {
+	if (buffer != NULL && buffer != start) {
+		if (ipfix_commit_data_field(exporter, buffer - start)) {
 			msg(MSG_ERROR, "Failed to add data record.");
 			return;
 		}
@@ -906,10 +1582,12 @@ static void export_flow_database(khash_t(1) *flow_database,
 			return;
 		}
 
+		pipeline_timing_begin();
 		if (ipfix_send(exporter)) {
 			msg(MSG_ERROR, "Failed to send IPFIX message.");
 			return;
 		}
+		pipeline_stage_done(PipelineStageSend);
 	}
 }
 
@@ -956,6 +1634,108 @@ static inline size_t export_capture_statistics_session(ipfix_exporter *exporter,
 
 
 
+/**
+  * Adds a data set with the per-stage packet path counters to the current
+  * message. Pass, sample and tick counters are deltas since the previous
+  * call, the maximum is kept since startup. The records are encoded starting
+  * at buffer which has to point behind the data already added to the message.
+  */
+static int export_pipeline_statistics(ipfix_exporter *exporter, uint8_t *buffer,
+									  const time_t *time) {
+	static struct pipeline_stage_counters previous[PipelineStageCount];
+	struct pipeline_stage_counters current[PipelineStageCount];
+	uint8_t * const start = buffer;
+	size_t i;
+
+	if (ipfix_start_data_set(exporter, htons(PipelineStatisticsTemplate))) {
+		msg(MSG_ERROR, "Failed to start pipeline statistics data set.");
+		return -1;
+	}
+
+	if (ipfix_get_remaining_space(exporter) < PipelineStageCount * PIPELINE_STATISTICS_TEMPLATE_LEN
+			|| start + PipelineStageCount * PIPELINE_STATISTICS_TEMPLATE_LEN > message_buffer + sizeof(message_buffer)) {
+		ipfix_cancel_data_set(exporter);
+		return -1;
+	}
+
+	pipeline_statistics_aggregate(current);
+
+	for (i = 0; i < PipelineStageCount; i++) {
+		pkt_put_u8(&buffer, (uint8_t) i);
+		pkt_put_u64(&buffer, current[i].count - previous[i].count);
+		pkt_put_u64(&buffer, current[i].samples - previous[i].samples);
+		pkt_put_u64(&buffer, current[i].ticks - previous[i].ticks);
+		pkt_put_u64(&buffer, current[i].max_ticks);
+		pkt_put_u8(&buffer, PIPELINE_TICK_UNIT);
+		pkt_put_u32(&buffer, (uint32_t) *time);
+	}
+
+	if (ipfix_put_data_field(exporter, start, buffer - start)) {
+		msg(MSG_ERROR, "Failed to put data field.");
+		return -1;
+	}
+
+	if (ipfix_end_data_set(exporter, PipelineStageCount)) {
+		msg(MSG_ERROR, "Failed to end data set.");
+		return -1;
+	}
+
+	memcpy(previous, current, sizeof(previous));
+
+	return 0;
+}
+
+#ifdef SUPPORT_PERF_COUNTERS
+/**
+  * Adds a data set with the hardware counter values of each measured stage
+  * to the current message. The values are cumulative since startup;
+  * counters which are not available are exported as 0.
+  */
+static int export_perf_counter_statistics(ipfix_exporter *exporter, uint8_t *buffer,
+										  const time_t *time) {
+	const struct perf_stage_statistics *statistics = perf_stage_statistics();
+	uint8_t * const start = buffer;
+	size_t i, j;
+
+	if (perf_counters_available() == 0)
+		return 0;
+
+	if (ipfix_start_data_set(exporter, htons(PerfCounterStatisticsTemplate))) {
+		msg(MSG_ERROR, "Failed to start hardware counter statistics data set.");
+		return -1;
+	}
+
+	if (ipfix_get_remaining_space(exporter) < PerfStageCount * PERF_COUNTER_STATISTICS_TEMPLATE_LEN
+			|| start + PerfStageCount * PERF_COUNTER_STATISTICS_TEMPLATE_LEN > message_buffer + sizeof(message_buffer)) {
+		ipfix_cancel_data_set(exporter);
+		return -1;
+	}
+
+	for (i = 0; i < PerfStageCount; i++) {
+		pkt_put_u8(&buffer, (uint8_t) i);
+		pkt_put_u8(&buffer, perf_counters_available());
+		pkt_put_u64(&buffer, statistics[i].samples);
+		for (j = 0; j < PerfCounterCount; j++)
+			pkt_put_u64(&buffer, statistics[i].values[j]);
+		pkt_put_u32(&buffer, (uint32_t) *time);
+	}
+
+	if (ipfix_put_data_field(exporter, start, buffer - start)) {
+		msg(MSG_ERROR, "Failed to put data field.");
+		return -1;
+	}
+
+	if (ipfix_end_data_set(exporter, PerfStageCount)) {
+		msg(MSG_ERROR, "Failed to end data set.");
+		return -1;
+	}
+
+	perf_counters_log();
+
+	return 0;
+}
+#endif
+
 void export_capture_statistics(struct export_capture_parameter *param) {
 	time_t now = time(NULL);
 	uint8_t *buffer = message_buffer;
@@ -982,9 +1762,94 @@ void export_capture_statistics(struct export_capture_parameter *param) {
 		return;
 	}
 
+	if (export_pipeline_statistics(param->exporter, buffer, &now))
+		msg(MSG_ERROR, "Failed to add pipeline statistics.");
+	else
+		buffer += PipelineStageCount * PIPELINE_STATISTICS_TEMPLATE_LEN;
+
+#ifdef SUPPORT_PERF_COUNTERS
+	if (export_perf_counter_statistics(param->exporter, buffer, &now))
+		msg(MSG_ERROR, "Failed to add hardware counter statistics.");
+#endif
+
 	if (ipfix_send(param->exporter)) {
 		msg(MSG_ERROR, "Failed to transmit data set.");
 		return;
 	}
+
+	ipfix_flush(param->exporter);
+}
+
+static void event_loop_statistics_encode(uint8_t **buffer,
+										 const struct event_callback_statistics *statistics,
+										 const time_t *time) {
+	size_t i;
+
+	memset(*buffer, 0, EVENT_CALLBACK_NAME_LEN);
+	if (statistics->name)
+		strncpy((char *) *buffer, statistics->name, EVENT_CALLBACK_NAME_LEN);
+	*buffer += EVENT_CALLBACK_NAME_LEN;
+
+	pkt_put_u8(buffer, (uint8_t) statistics->kind);
+	pkt_put_u64(buffer, statistics->calls);
+	pkt_put_u64(buffer, statistics->total_us);
+	pkt_put_u32(buffer, statistics->max_us);
+	pkt_put_u32(buffer, statistics->stalls);
+
+	for (i = 0; i < EVENT_LOOP_HISTOGRAM_BUCKETS; i++)
+		pkt_put_u32(buffer, statistics->histogram[i]);
+
+	pkt_put_u32(buffer, (uint32_t) *time);
 }
 
+/**
+  * Exports the run time statistics of all event loop callbacks as options
+  * records. The counters are cumulative since startup.
+  */
+void export_event_loop_statistics(ipfix_exporter *exporter) {
+	const struct event_callback_statistics *statistics = event_loop_statistics();
+	time_t now = time(NULL);
+
+	while (statistics != NULL) {
+		uint8_t *buffer = message_buffer;
+		uint16_t record_count = 0;
+
+		if (ipfix_start_data_set(exporter, htons(EventLoopStatisticsTemplate))) {
+			msg(MSG_ERROR, "Failed to start event loop statistics data set.");
+			return;
+		}
+
+		uint16_t space = ipfix_get_remaining_space(exporter);
+
+		while (statistics != NULL
+			   && (buffer - message_buffer) + EVENT_LOOP_STATISTICS_TEMPLATE_LEN <= space) {
+			event_loop_statistics_encode(&buffer, statistics, &now);
+			record_count++;
+
+			statistics = statistics->next;
+		}
+
+		if (record_count == 0) {
+			msg(MSG_ERROR, "Event loop statistics record does not fit into message.");
+			ipfix_cancel_data_set(exporter);
+			return;
+		}
+
+		if (ipfix_put_data_field(exporter, message_buffer, buffer - message_buffer)) {
+			msg(MSG_ERROR, "Failed to put data field.");
+			return;
+		}
+
+		if (ipfix_end_data_set(exporter, record_count)) {
+			msg(MSG_ERROR, "Failed to end data set.");
+			return;
+		}
+
+		if (ipfix_send(exporter)) {
+			msg(MSG_ERROR, "Failed to transmit data set.");
+			return;
+		}
+	}
+
+	ipfix_flush(exporter);
+}
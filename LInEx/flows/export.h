@@ -27,7 +27,39 @@ enum olsr_ipfix_type {
 	MIDAddressIPv4=19, // ipv4Address
 	MIDAddressIPv6=20, // ipv6Address
 	HTimeType=21, // uint8_t
-	TargetHostLQType=22 // uint32_t
+	TargetHostLQType=22, // uint32_t
+	SnapshotTimestampType=23, // dateTimeSeconds
+	DeltaSequenceNumberType=24, // uint32_t
+	DeltaEntryActionType=25, // uint8_t (see enum delta_entry_action)
+	EventCallbackNameType=26, // string
+	EventCallbackKindType=27, // uint8_t (see enum event_callback_kind)
+	EventCallbackCallsType=28, // uint64_t
+	EventCallbackTotalTimeType=29, // uint64_t (microseconds)
+	EventCallbackMaxTimeType=30, // uint32_t (microseconds)
+	EventCallbackStallsType=31, // uint32_t
+	EventCallbackHistogramType=32, // octetArray (EVENT_LOOP_HISTOGRAM_BUCKETS uint32_t)
+	PipelineStageType=33, // uint8_t (see enum pipeline_stage)
+	PipelineStagePassesType=34, // uint64_t (delta since last export)
+	PipelineStageSamplesType=35, // uint64_t (delta since last export)
+	PipelineStageTicksType=36, // uint64_t (delta since last export)
+	PipelineStageMaxTicksType=37, // uint64_t (since startup)
+	PipelineTickUnitType=38, // uint8_t (see enum pipeline_tick_unit)
+	PerfStageType=39, // uint8_t (see enum perf_stage)
+	PerfCountersAvailableType=40, // uint8_t (bit mask, see enum perf_counter)
+	PerfSamplesType=41, // uint64_t
+	PerfCyclesType=42, // uint64_t
+	PerfInstructionsType=43, // uint64_t
+	PerfCacheMissesType=44, // uint64_t
+	PerfBranchMissesType=45 // uint64_t
+};
+
+/**
+  * Describes what happened to the entries contained in a delta node record.
+  */
+enum delta_entry_action {
+	DeltaEntryCreated=0,
+	DeltaEntryChanged=1,
+	DeltaEntryWithdrawn=2
 };
 
 enum olsr_template_id {
@@ -47,6 +79,16 @@ enum olsr_template_id {
 #endif
 	FlowTemplateIPv4=268,
 	CaptureStatisticsTemplate=269,
+	DeltaBaseTemplate=270,
+	DeltaNodeTemplateIPv4=271,
+#ifdef SUPPORT_IPV6
+	DeltaNodeTemplateIPv6=272,
+#endif
+	EventLoopStatisticsTemplate=273,
+	PipelineStatisticsTemplate=274,
+#ifdef SUPPORT_PERF_COUNTERS
+	PerfCounterStatisticsTemplate=275,
+#endif
 };
 
 struct olsr_template_field {
@@ -58,11 +100,41 @@ struct olsr_template_field {
 struct olsr_template_info {
 	enum olsr_template_id template_id;
 	struct olsr_template_field *fields;
+
+	/**
+	  * Number of leading scope fields if this is an options template.
+	  */
+	uint16_t scope_field_count;
 };
 
 struct export_parameters {
 	ipfix_exporter *exporter;
 	node_set_hash *node_set;
+
+	/**
+	  * Number of OLSR exports after which a full snapshot is sent. Exports in
+	  * between only contain the entries which have been created, changed or
+	  * withdrawn. 0 disables delta export.
+	  */
+	uint16_t snapshot_interval;
+
+	/**
+	  * Number of delta exports since the last full snapshot.
+	  */
+	uint16_t exports_since_snapshot;
+
+	/**
+	  * Export timestamp of the last full snapshot which is used as snapshot
+	  * marker in the delta records. 0 until a snapshot has been sent
+	  * completely, which makes export_olsr() send a full snapshot.
+	  */
+	time_t snapshot_timestamp;
+
+	/**
+	  * Sequence number of the last delta export. Reset to 0 by every full
+	  * snapshot.
+	  */
+	uint32_t delta_sequence_number;
 };
 
 struct export_flow_parameter {
@@ -77,7 +149,10 @@ struct export_capture_parameter {
 };
 
 int declare_templates(ipfix_exporter *exporter);
+void export_olsr(struct export_parameters *params);
 void export_full(struct export_parameters *params);
+void export_delta(struct export_parameters *params);
 void export_flows(struct export_flow_parameter *param);
 void export_capture_statistics(struct export_capture_parameter *param);
+void export_event_loop_statistics(ipfix_exporter *exporter);
 #endif
@@ -3,6 +3,8 @@
 #include "iface.h"
 #include "ip_helper.h"
 #include "object_cache.h"
+#include "pipeline_stats.h"
+#include "perf_counters.h"
 
 #include "../event_loop.h"
 
@@ -140,6 +142,7 @@ int start_flow_capture_session(flow_capture_session *session,
 	session->flow_info_cache = NULL;
 #ifdef SUPPORT_ANONYMIZATION
 	session->cryptopan.initialised = 0;
+	session->cryptopan.cache = NULL;
 #endif
 	session->ipv4_flow_database = kh_init(1);
 	if (!session->ipv4_flow_database)
@@ -278,6 +281,7 @@ int add_interface(flow_capture_session *session, char *device_name, bool enable_
 	param->info = info;
 
 	event_loop_add_fd(info->fd, (event_fd_callback) &capture_callback, (event_fd_error_callback) &capture_error_callback, param);
+	event_loop_set_callback_name((const void *) &capture_callback, "capture_callback");
 
     return 0;
 }
@@ -444,8 +448,15 @@ static inline int parse_udp(flow_capture_session *session, struct pktinfo *pkt,
 	flow->src_port = hdr->source;
 	flow->dst_port = hdr->dest;
 
+	pipeline_stage_done(PipelineStageParse);
+
 	uint32_t hash_code = flow_key_hash_code(flow);
-	if (!include_hash_code(session, hash_code)) {
+	pipeline_stage_done(PipelineStageHash);
+
+	bool included = include_hash_code(session, hash_code);
+	pipeline_stage_done(PipelineStageSampling);
+
+	if (!included) {
 		return 0;
 	}
 
@@ -494,6 +505,8 @@ static inline int parse_udp(flow_capture_session *session, struct pktinfo *pkt,
 	info->last_packet_timestamp = pkt->tv->tv_sec;
 	info->total_bytes += pkt->orig_len;
 
+	pipeline_stage_done(PipelineStageLookup);
+
     return 0;
 }
 
@@ -509,8 +522,15 @@ static inline int parse_tcp(flow_capture_session *session, struct pktinfo *pkt,
 	flow->src_port = hdr->source;
 	flow->dst_port = hdr->dest;
 
+	pipeline_stage_done(PipelineStageParse);
+
 	uint32_t hash_code = flow_key_hash_code(flow);
-	if (!include_hash_code(session, hash_code)) {
+	pipeline_stage_done(PipelineStageHash);
+
+	bool included = include_hash_code(session, hash_code);
+	pipeline_stage_done(PipelineStageSampling);
+
+	if (!included) {
 		return 0;
 	}
 
@@ -571,6 +591,8 @@ static inline int parse_tcp(flow_capture_session *session, struct pktinfo *pkt,
 	info->last_packet_timestamp = pkt->tv->tv_sec;
 	info->total_bytes += pkt->orig_len;
 
+	pipeline_stage_done(PipelineStageLookup);
+
     return 0;
 }
 
@@ -581,10 +603,33 @@ void capture_callback(int fd, struct flow_capture_callback_param *param) {
 	struct timeval tv;
 	uint8_t *buffer;
 
-	while ((buffer = capture_packet(param->info, &len, &orig_len, &tv, first_call))) {
+	while (1) {
+		int measured = perf_sample_packet();
+
+		pipeline_sample_begin();
+
+		if (measured)
+			perf_stage_begin(PerfStageCapture);
+
+		buffer = capture_packet(param->info, &len, &orig_len, &tv, first_call);
+		if (!buffer)
+			break;
+
+		if (measured)
+			perf_stage_end(PerfStageCapture);
+
+		pipeline_stage_done(PipelineStageDequeue);
+
 		struct pktinfo pkt = { buffer, buffer + len, buffer, orig_len, &tv };
+
+		if (measured)
+			perf_stage_begin(PerfStageParse);
+
 		parse_ethernet(param->session, &pkt);
 
+		if (measured)
+			perf_stage_end(PerfStageParse);
+
 		capture_packet_done(param->info);
 		first_call = false;
 	}
@@ -31,9 +31,13 @@ vtime_container_iterator(hello_set) {
 	uint8_t stop;
 };
 struct vtime_container_hello_set {
-	time_t htime;
+	/**
+	  * HELLO emission interval of the node in mantissa/exponent notation.
+	  */
+	uint8_t htime;
 	struct vtime_bucket_hello_set *first;
 	struct vtime_bucket_hello_set *last;
+	struct vtime_bucket_hello_set *expired;
 };
 
 #endif
@@ -3,6 +3,32 @@
 #include "hello_set.h"
 #include "hna_set.h"
 #include "mid_set.h"
+#include "../ipfixlolib/msg.h"
+
+/**
+  * Entry of the global expiry queue. Nodes are referenced by their address
+  * rather than by pointer because a node may have been removed before its
+  * queue entry becomes due.
+  */
+struct expiry_queue_entry {
+	time_t vtime;
+	struct ip_addr_t addr;
+};
+
+/**
+  * Binary min-heap ordered by vtime containing the expiry times of all
+  * vtime buckets of all nodes.
+  */
+static struct {
+	struct expiry_queue_entry *entries;
+	size_t size;
+	size_t capacity;
+} expiry_queue = { NULL, 0, 0 };
+
+/**
+  * Nodes which have changed since the last export.
+  */
+static struct node_entry *dirty_nodes = NULL;
 
 inline void init_set_entry_common(struct set_entry_common *common) {
 	common->created = 1;
@@ -71,11 +97,21 @@ struct node_entry *find_or_create_node_entry(node_set_hash *node_set,
 		node->topology_set = NULL;
 		node->hna_set = NULL;
 		node->mid_set = NULL;
+		node->addr = *addr;
+		node->dirty = false;
+		node->next_dirty = NULL;
+		node->htime_changed = false;
+		node->encoded = NULL;
+		node->encoded_len = 0;
 
 		int ret;
 		k = kh_put(2, node_set, *addr, &ret);
 		kh_value(node_set, k) = node;
 
+		// Make sure the node is revisited even if no bucket is ever created
+		// for it.
+		schedule_node_expiry(node, time(NULL));
+
 		return node;
 	}
 
@@ -83,56 +119,168 @@ struct node_entry *find_or_create_node_entry(node_set_hash *node_set,
 
 }
 
+void schedule_node_expiry(const struct node_entry *node, time_t vtime) {
+	if (expiry_queue.size == expiry_queue.capacity) {
+		size_t capacity = expiry_queue.capacity ? 2 * expiry_queue.capacity : 64;
+		struct expiry_queue_entry *entries =
+				realloc(expiry_queue.entries,
+						capacity * sizeof(struct expiry_queue_entry));
+
+		if (!entries) {
+			msg(MSG_ERROR, "Failed to grow expiry queue.");
+			return;
+		}
+
+		expiry_queue.entries = entries;
+		expiry_queue.capacity = capacity;
+	}
+
+	// Sift up
+	size_t i = expiry_queue.size++;
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+
+		if (expiry_queue.entries[parent].vtime <= vtime)
+			break;
+
+		expiry_queue.entries[i] = expiry_queue.entries[parent];
+		i = parent;
+	}
+
+	expiry_queue.entries[i].vtime = vtime;
+	expiry_queue.entries[i].addr = node->addr;
+}
+
+/**
+  * Removes the first element from the expiry queue.
+  */
+static void expiry_queue_pop() {
+	struct expiry_queue_entry last = expiry_queue.entries[--expiry_queue.size];
+	size_t i = 0;
+
+	// Sift down
+	for (;;) {
+		size_t child = 2 * i + 1;
+
+		if (child >= expiry_queue.size)
+			break;
+
+		if (child + 1 < expiry_queue.size
+				&& expiry_queue.entries[child + 1].vtime < expiry_queue.entries[child].vtime)
+			child++;
+
+		if (last.vtime <= expiry_queue.entries[child].vtime)
+			break;
+
+		expiry_queue.entries[i] = expiry_queue.entries[child];
+		i = child;
+	}
+
+	expiry_queue.entries[i] = last;
+}
+
+#define expire_node_container(node, name, now) \
+	if (node->name) { \
+		vtime_container_expire(node->name, now); \
+		if (node->name->expired) \
+			mark_node_dirty(node); \
+		if (node->name->first == NULL && node->name->last == NULL \
+				&& node->name->expired == NULL) { \
+			free(node->name); \
+			node->name = NULL; \
+		} \
+	}
+
+#define commit_node_container(node, name) \
+	if (node->name) { \
+		vtime_container_commit(node->name); \
+		if (node->name->first == NULL && node->name->last == NULL) { \
+			free(node->name); \
+			node->name = NULL; \
+		} \
+	}
+
+static inline bool node_is_empty(const struct node_entry *node) {
+	return node->topology_set == NULL && node->hello_set == NULL
+			&& node->hna_set == NULL && node->mid_set == NULL;
+}
+
+/**
+  * Expires all buckets of the given node which are older than now and
+  * removes the node if it does not contain any information anymore.
+  */
+static void expire_node_entry(node_set_hash *node_set, khiter_t k, time_t now) {
+	struct node_entry *node = kh_value(node_set, k);
+
+	expire_node_container(node, topology_set, now);
+	expire_node_container(node, hello_set, now);
+	expire_node_container(node, hna_set, now);
+	expire_node_container(node, mid_set, now);
+
+	// Dirty nodes are released by commit_node_set_changes()
+	if (node_is_empty(node) && !node->dirty) {
+		free(node->encoded);
+		free(node);
+		kh_del(2, node_set, k);
+	}
+}
+
 void expire_node_set_entries(node_set_hash *node_set) {
 	time_t now = time(NULL);
-	khint_t k;
 
-	for (k = kh_begin(node_set); k != kh_end(node_set); ++k) {
-		if (!kh_exist(node_set, k))
+	while (expiry_queue.size > 0 && expiry_queue.entries[0].vtime < now) {
+		struct ip_addr_t addr = expiry_queue.entries[0].addr;
+		expiry_queue_pop();
+
+		khiter_t k = kh_get(2, node_set, addr);
+
+		// The node may already have been removed due to an earlier entry.
+		if (k == kh_end(node_set))
 			continue;
 
-		struct node_entry *node = kh_value(node_set, k);
+		expire_node_entry(node_set, k, now);
+	}
+}
 
-		if (node->topology_set) {
-			vtime_container_expire(node->topology_set, now);
-			if (node->topology_set->first == NULL
-					&& node->topology_set->last == NULL) {
-				free(node->topology_set);
-				node->topology_set = NULL;
-			}
-		}
+void mark_node_dirty(struct node_entry *node) {
+	free(node->encoded);
+	node->encoded = NULL;
+	node->encoded_len = 0;
 
-		if (node->hello_set) {
-			vtime_container_expire(node->hello_set, now);
-			if (node->hello_set->first == NULL
-					&& node->hello_set->last == NULL) {
-				free(node->hello_set);
-				node->hello_set = NULL;
-			}
-		}
+	if (node->dirty)
+		return;
 
-		if (node->hna_set) {
-			vtime_container_expire(node->hna_set, now);
-			if (node->hna_set->first == NULL
-					&& node->hna_set->last == NULL) {
-				free(node->hna_set);
-				node->hna_set = NULL;
-			}
-		}
+	node->dirty = true;
+	node->next_dirty = dirty_nodes;
+	dirty_nodes = node;
+}
 
-		if (node->mid_set) {
-			vtime_container_expire(node->mid_set, now);
-			if (node->mid_set->first == NULL
-					&& node->mid_set->last == NULL) {
-				free(node->mid_set);
-				node->mid_set = NULL;
-			}
-		}
+struct node_entry *dirty_node_list() {
+	return dirty_nodes;
+}
+
+void commit_node_set_changes(node_set_hash *node_set) {
+	while (dirty_nodes) {
+		struct node_entry *node = dirty_nodes;
+
+		dirty_nodes = node->next_dirty;
+		node->next_dirty = NULL;
+		node->dirty = false;
+		node->htime_changed = false;
+
+		commit_node_container(node, topology_set);
+		commit_node_container(node, hello_set);
+		commit_node_container(node, hna_set);
+		commit_node_container(node, mid_set);
+
+		if (node_is_empty(node)) {
+			khiter_t k = kh_get(2, node_set, node->addr);
+
+			if (k != kh_end(node_set))
+				kh_del(2, node_set, k);
 
-		if (node->topology_set == NULL && node->hello_set == NULL
-				&& node->hna_set == NULL) {
+			free(node->encoded);
 			free(node);
-			kh_del(2, node_set, k);
 		}
 	}
 }
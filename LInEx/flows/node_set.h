@@ -30,6 +30,7 @@
 	struct vtime_container_##name { \
 		struct vtime_bucket_##name *first; \
 		struct vtime_bucket_##name *last; \
+		struct vtime_bucket_##name *expired; \
 	};
 
 #define find_or_create_vtime_container(name, out, node_set, ip_addr) \
@@ -37,8 +38,7 @@
 															ip_addr); \
 		out = node->name; \
 		if (!out) { \
-			out = (typeof(out)) malloc(sizeof(typeof(*out))); \
-			out->first = out->last = NULL; \
+			out = (typeof(out)) calloc(1, sizeof(typeof(*out))); \
 			node->name = out; \
 		}
 
@@ -77,8 +77,13 @@
 	iterator.bucket = iterator.prev_bucket = NULL; \
 	iterator.stop = 0; \
 
+/**
+  * Iterates over all entries of all buckets. prev_elem and next_elem always
+  * refer to the bucket of the current entry so that it can be removed from
+  * its bucket.
+  */
 #define vtime_container_foreach(iterator) \
-	for (; iterator.bucket && !iterator.stop; !iterator.stop && iterator.bucket ? (iterator.prev_bucket = iterator.bucket, iterator.bucket = iterator.bucket->next, (iterator.bucket ? iterator.elem = iterator.bucket->first : NULL)) : 0) \
+	for (; iterator.bucket && !iterator.stop; !iterator.stop && iterator.bucket ? (iterator.prev_bucket = iterator.bucket, iterator.bucket = iterator.bucket->next, iterator.prev_elem = NULL, iterator.elem = iterator.bucket ? iterator.bucket->first : NULL, iterator.next_elem = iterator.elem ? iterator.elem->next : NULL) : 0) \
 		for (; iterator.elem && !iterator.stop; (!iterator.stop && iterator.elem) ? (iterator.prev_elem = iterator.elem, iterator.elem = iterator.next_elem, (iterator.elem ? (iterator.next_elem = iterator.elem->next) : (iterator.next_elem = NULL))) : 0)
 
 #define vtime_container_insert_bucket(container, bucket) \
@@ -98,7 +103,7 @@
 		} \
 	}
 
-#define vtime_container_find_or_create_bucket(container, vtime_bucket, vtime_check) \
+#define vtime_container_find_or_create_bucket(container, vtime_bucket, vtime_check, node) \
 	vtime_bucket = container->first; \
 	for (vtime_bucket = container->first; vtime_bucket; vtime_bucket = vtime_bucket->next) \
 		if (vtime_bucket->vtime == vtime_check) \
@@ -108,6 +113,7 @@
 		vtime_bucket->first = vtime_bucket->last = NULL; \
 		vtime_bucket->vtime = vtime_check; \
 		vtime_container_insert_bucket(container, vtime_bucket); \
+		schedule_node_expiry(node, vtime_check); \
 	}
 
 #define vtime_container_find_entry(it, cmp, args...) \
@@ -120,34 +126,87 @@
 
 #define vtime_bucket_free(bucket) \
 	while (bucket->first) { \
+		typeof(bucket->first) _next = bucket->first->next; \
 		free(bucket->first); \
-		bucket->first = bucket->first->next; \
+		bucket->first = _next; \
 	}
 
+/**
+  * Moves all buckets older than now to the list of expired buckets of the
+  * container. Expired buckets are kept until the next export has reported
+  * them and are released by vtime_container_commit().
+  */
 #define vtime_container_expire(container, now) \
 	while (container->first) { \
 		if (container->first->vtime < now) { \
 			typeof(container->first) _bucket = container->first; \
+			typeof(_bucket->first) _entry; \
 			container->first = _bucket->next; \
 			if (container->last == _bucket) \
 				container->last = NULL; \
-			vtime_bucket_free(_bucket); \
-			free(_bucket); \
+			for (_entry = _bucket->first; _entry; _entry = _entry->next) \
+				_entry->common.expired = 1; \
+			_bucket->next = container->expired; \
+			container->expired = _bucket; \
 		} else { \
 			break; \
 		} \
 	} \
 
-#define vtime_container_move_to_bucket(container, it, vtime) \
+/**
+  * Releases all expired buckets of the container and resets the change
+  * flags of the remaining entries.
+  */
+#define vtime_container_commit(container) \
+	while (container->expired) { \
+		typeof(container->expired) _bucket = container->expired; \
+		container->expired = _bucket->next; \
+		vtime_bucket_free(_bucket); \
+		free(_bucket); \
+	} \
+	{ \
+		typeof(container->first) _bucket; \
+		typeof(container->first->first) _entry; \
+		for (_bucket = container->first; _bucket; _bucket = _bucket->next) \
+			for (_entry = _bucket->first; _entry; _entry = _entry->next) { \
+				_entry->common.created = 0; \
+				_entry->common.changed = 0; \
+			} \
+	}
+
+#define vtime_container_move_to_bucket(container, it, vtime, node) \
 	ll_remove(it.bucket, it.elem, it.prev_elem); \
 	if (!it.bucket->first && !it.bucket->last) { \
 		ll_remove(container, it.bucket, it.prev_bucket); \
 		free(it.bucket); \
 	} \
-	vtime_container_find_or_create_bucket(container, it.bucket, vtime) \
+	vtime_container_find_or_create_bucket(container, it.bucket, vtime, node) \
 	ll_append(it.bucket, it.elem)
 
 struct node_entry {
+	struct ip_addr_t addr;
+
+	/**
+	  * Set if the node is part of the dirty node list, i.e. one of its
+	  * entries has been created, changed or expired since the last export.
+	  */
+	bool dirty;
+	struct node_entry *next_dirty;
+
+	/**
+	  * Set if the HTime of the hello set has changed since the last export.
+	  * The delta export reports the node even if none of its entries has
+	  * changed.
+	  */
+	bool htime_changed;
+
+	/**
+	  * Cached IPFIX encoding of the node record used by the full export.
+	  * Released whenever the node is marked dirty.
+	  */
+	uint8_t *encoded;
+	uint16_t encoded_len;
+
 	vtime_container(topology_set) *topology_set;
 	vtime_container(hello_set) *hello_set;
 	vtime_container(hna_set) *hna_set;
@@ -183,5 +242,41 @@ typedef khash_t(2) node_set_hash;
 struct node_entry *find_or_create_node_entry(node_set_hash *node_set,
 											 const struct ip_addr_t *addr);
 
+/**
+  * Registers the given vtime with the global expiry queue so that the node
+  * will be revisited by expire_node_set_entries() once the vtime has passed.
+  *
+  * Has to be called whenever a new vtime bucket is created for a node.
+  */
+void schedule_node_expiry(const struct node_entry *node, time_t vtime);
+
+/**
+  * Expires all buckets whose vtime has passed and removes nodes which no
+  * longer contain any information.
+  *
+  * Only nodes which have a bucket due for expiry are visited. Expired
+  * entries are kept until commit_node_set_changes() is called.
+  */
 void expire_node_set_entries(node_set_hash *node_set);
+
+/**
+  * Adds the node to the list of dirty nodes unless it is already part of it
+  * and invalidates the cached encoding of the node.
+  */
+void mark_node_dirty(struct node_entry *node);
+
+/**
+  * Returns the first node of the dirty node list. The remaining nodes can be
+  * reached through the next_dirty pointer.
+  */
+struct node_entry *dirty_node_list();
+
+/**
+  * Releases all expired entries of the dirty nodes, resets the change flags
+  * of their entries and empties the dirty node list. Nodes which do not
+  * contain any information anymore are removed.
+  *
+  * Has to be called after the changes have been exported.
+  */
+void commit_node_set_changes(node_set_hash *node_set);
 #endif
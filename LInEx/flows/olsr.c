@@ -3,6 +3,7 @@
 #include "hello_set.h"
 #include "hna_set.h"
 #include "mid_set.h"
+#include "duplicate_set.h"
 #include "olsr_protocol.h"
 #include "capture.h"
 #include "ip_helper.h"
@@ -69,7 +70,6 @@ static int olsr_handle_hna_message(const uint8_t **data,
 static int olsr_handle_mid_message(const uint8_t **data,
 								   struct olsr_common *hdr,
 								   network_protocol protocol);
-int olsr_parse_packet(struct pktinfo *pkt, network_protocol protocol);
 
 static int parse_packet_header(struct pktinfo *pkt);
 static int parse_packet_header_ipv4(struct pktinfo *pkt);
@@ -133,6 +133,7 @@ struct capture_info *olsr_add_capture_interface(struct capture_session *session,
 
 	event_loop_add_fd(info->fd, (event_fd_callback) &olsr_callback,
 					  (event_fd_error_callback) &olsr_error_callback, param);
+	event_loop_set_callback_name((const void *) &olsr_callback, "olsr_callback");
 
 	return info;
 }
@@ -242,11 +243,20 @@ int olsr_parse_packet(struct pktinfo *pkt, network_protocol protocol) {
 	// DPRINTF("Packet Info: Sequence Number %d, Size: %d", packet.seqno, packet.size);
 
     struct olsr_common message;
+	time_t now = time(NULL);
     while (pkt->data < pkt->end_data) {
 		if (olsr_parse_message(&pkt->data, pkt->end_data, &message, protocol)) {
             return -1;
         }
 
+		// Flooded messages reach us over several links - only process the
+		// first copy (see RFC 3626 - 3.4)
+		struct ip_addr_t orig = { protocol, message.orig };
+		if (duplicate_set_check(&orig, message.seqno, now)) {
+			pkt->data = message.end;
+			continue;
+		}
+
 		// DPRINTF("Message Info: Type: %d Hops: %d Size: %d", message.type, message.hops, message.size);
 
         switch (message.type) {
@@ -359,11 +369,17 @@ static int olsr_handle_tc_message(const u_char **data,
 
 			init_set_entry_common(&ts_entry->common);
 			ts_entry->dest_addr = addr;
+			ts_entry->seq = message->ansn;
+			ts_entry->lq_parameters = 0;
 
-			vtime_container_find_or_create_bucket(ts, it.bucket, vtime)
+			vtime_container_find_or_create_bucket(ts, it.bucket, vtime, node)
 			ll_append(it.bucket, ts_entry)
+			mark_node_dirty(node);
 		}
 
+		uint16_t old_seq = ts_entry->seq;
+		uint32_t old_lq_parameters = ts_entry->lq_parameters;
+
 		ts_entry->backoff = 0;
 		ts_entry->seq = message->ansn;
 
@@ -375,8 +391,14 @@ static int olsr_handle_tc_message(const u_char **data,
 			pkt_get_u32(data, &ts_entry->lq_parameters);
 		}
 
+		if (ts_entry->seq != old_seq
+				|| ts_entry->lq_parameters != old_lq_parameters) {
+			ts_entry->common.changed = 1;
+			mark_node_dirty(node);
+		}
+
 		if (it.bucket->vtime != vtime) {
-			vtime_container_move_to_bucket(ts, it, vtime)
+			vtime_container_move_to_bucket(ts, it, vtime, node)
 		}
     }
 
@@ -391,7 +413,7 @@ static int olsr_handle_tc_message(const u_char **data,
 			ll_remove_iterator(it);
 
 			vtime_bucket(topology_set) *bucket = NULL;
-			vtime_container_find_or_create_bucket(ts, bucket, now + TC_INTERVAL)
+			vtime_container_find_or_create_bucket(ts, bucket, now + TC_INTERVAL, node)
 			ll_append(bucket, entry);
 		}
 	}
@@ -446,8 +468,15 @@ static int olsr_handle_hello_message(const u_char **data,
     pkt_get_reltime(data, &message->htime);
     pkt_get_u8(data, &message->will);
 
-	hs->htime = now + message->htime;
-	time_t vtime = now + message->comm.vtime;
+	uint8_t htime = reltime_to_me(message->htime);
+	if (hs->htime != htime) {
+		// A new hello set is reported along with its created entries
+		if (hs->first)
+			node->htime_changed = true;
+		hs->htime = htime;
+		mark_node_dirty(node);
+	}
+	time_t vtime = now + message->comm.vtime / 1e3;
 
 	uint32_t neighbor_entry_len = ip_addr_len(protocol);
     if (message->comm.type == HELLO_LQ_MESSAGE)
@@ -482,18 +511,30 @@ static int olsr_handle_hello_message(const u_char **data,
 				it.elem = (struct hello_set_entry *) malloc(sizeof(struct hello_set_entry));
 				init_set_entry_common(&it.elem->common);
 				it.elem->neighbor_addr = addr;
-				vtime_container_find_or_create_bucket(hs, it.bucket, vtime)
+				it.elem->link_code = info.link_code.val;
+				it.elem->lq_parameters = 0;
+				vtime_container_find_or_create_bucket(hs, it.bucket, vtime, node)
 				ll_append(it.bucket, it.elem)
+				mark_node_dirty(node);
 			}
 
+			uint8_t old_link_code = it.elem->link_code;
+			uint32_t old_lq_parameters = it.elem->lq_parameters;
+
 			it.elem->link_code = info.link_code.val;
 
 			if (message->comm.type == HELLO_LQ_MESSAGE) {
 				pkt_get_u32(data, &it.elem->lq_parameters);
 			}
 
+			if (it.elem->link_code != old_link_code
+					|| it.elem->lq_parameters != old_lq_parameters) {
+				it.elem->common.changed = 1;
+				mark_node_dirty(node);
+			}
+
 			if (it.bucket->vtime != vtime) {
-				vtime_container_move_to_bucket(hs, it, vtime)
+				vtime_container_move_to_bucket(hs, it, vtime, node)
 			}
         }
     }
@@ -589,7 +630,7 @@ static int olsr_handle_hna_message(const uint8_t **data,
 	union olsr_ip_addr network;
 	union olsr_ip_addr netmask;
 	time_t now = time(NULL);
-	time_t vtime = now + hdr->vtime;
+	time_t vtime = now + hdr->vtime / 1e3;
 
 	struct ip_addr_t orig = { protocol, hdr->orig };
 	vtime_container(hna_set) *hs;
@@ -632,12 +673,13 @@ static int olsr_handle_hna_message(const uint8_t **data,
 			it.elem->network = network;
 			it.elem->netmask = prefix_len;
 
-			vtime_container_find_or_create_bucket(hs, it.bucket, vtime)
+			vtime_container_find_or_create_bucket(hs, it.bucket, vtime, node)
 			ll_append(it.bucket, it.elem)
+			mark_node_dirty(node);
 		}
 
 		if (it.bucket->vtime != vtime) {
-			vtime_container_move_to_bucket(hs, it, vtime)
+			vtime_container_move_to_bucket(hs, it, vtime, node)
 		}
 	}
 
@@ -664,7 +706,7 @@ static int olsr_handle_mid_message(const uint8_t **data,
 								   struct olsr_common *hdr,
 								   network_protocol protocol) {
 	uint16_t network_len = ip_addr_len(protocol);
-	time_t vtime = time(NULL) + hdr->vtime;
+	time_t vtime = time(NULL) + hdr->vtime / 1e3;
 	union olsr_ip_addr addr;
 
 	struct ip_addr_t orig = { protocol, hdr->orig };
@@ -672,7 +714,7 @@ static int olsr_handle_mid_message(const uint8_t **data,
 	vtime_container_iterator(mid_set) it;
 	find_or_create_vtime_container(mid_set, set, node_set, &orig);
 
-	while (*data + (2 * network_len) <= hdr->end) {
+	while (*data + network_len <= hdr->end) {
 		pkt_get_ip_address(data, &addr, protocol);
 
 #define mid_cmp(a, args...) compare_mid_set_entry(a, args)
@@ -681,14 +723,16 @@ static int olsr_handle_mid_message(const uint8_t **data,
 
 		if (!it.elem) {
 			it.elem = (struct mid_set_entry *) malloc(sizeof(struct mid_set_entry));
+			init_set_entry_common(&it.elem->common);
 			it.elem->addr = addr;
 
-			vtime_container_find_or_create_bucket(set, it.bucket, vtime)
+			vtime_container_find_or_create_bucket(set, it.bucket, vtime, node)
 			ll_append(it.bucket, it.elem)
+			mark_node_dirty(node);
 		}
 
 		if (it.bucket->vtime != vtime) {
-			vtime_container_move_to_bucket(set, it, vtime)
+			vtime_container_move_to_bucket(set, it, vtime, node)
 		}
 	}
 
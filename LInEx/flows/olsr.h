@@ -1,6 +1,8 @@
 #ifndef OLSR_H_
 #define OLSR_H_
 
+#include "ip_helper.h"
+
 struct capture_info;
 struct capture_session;
 
@@ -8,5 +10,6 @@ struct capture_session;
 
 struct capture_info *olsr_add_capture_interface(struct capture_session *session,
 												const char *interface);
+int olsr_parse_packet(struct pktinfo *pkt, network_protocol protocol);
 
 #endif
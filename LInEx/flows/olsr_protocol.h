@@ -35,6 +35,9 @@
 
 #define TC_INTERVAL 5
 
+/* Hold time of duplicate tuples (RFC 3626 - 18.3) */
+#define DUP_HOLD_TIME 30
+
 enum olsr_message_type {
     HELLO_MESSAGE=1,
     TC_MESSAGE=2,
@@ -0,0 +1,230 @@
+#ifdef SUPPORT_PERF_COUNTERS
+
+#include "perf_counters.h"
+#include "../ipfixlolib/msg.h"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+static const char * const stage_names[PerfStageCount] = {
+	"capture",
+	"parse",
+	"export"
+};
+
+static const uint64_t counter_configs[PerfCounterCount] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static const char * const counter_names[PerfCounterCount] = {
+	"cycles",
+	"instructions",
+	"cache-misses",
+	"branch-misses"
+};
+
+/**
+  * Layout of a read() from the group leader with PERF_FORMAT_GROUP.
+  */
+struct perf_group_read {
+	uint64_t nr;
+	uint64_t values[PerfCounterCount];
+};
+
+static struct {
+	/**
+	  * File descriptor of the group leader (cycles) or -1 if hardware
+	  * counters are not available.
+	  */
+	int leader_fd;
+
+	int fds[PerfCounterCount];
+
+	/**
+	  * Bit mask of the counters which could be opened.
+	  */
+	uint8_t available;
+
+	/**
+	  * Position of each counter in a group read.
+	  */
+	uint8_t position[PerfCounterCount];
+
+	uint32_t sample_counter;
+
+	struct perf_group_read start[PerfStageCount];
+	struct perf_stage_statistics stages[PerfStageCount];
+} perf = { -1 };
+
+static int perf_event_open(struct perf_event_attr *attr, int group_fd, int exclude_kernel) {
+	attr->exclude_kernel = exclude_kernel;
+
+	return syscall(__NR_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+/**
+  * Opens the hardware counters of the calling thread. Counters which are not
+  * supported by the CPU are left out. Fails if not even the cycle counter is
+  * available (e.g. inside of containers, virtual machines without PMU
+  * passthrough or if perf_event_paranoid forbids access) in which case all
+  * other functions become no-ops.
+  */
+int perf_counters_init() {
+	struct perf_event_attr attr;
+	int exclude_kernel = 0;
+	size_t i;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.exclude_hv = 1;
+	attr.disabled = 1;
+
+	for (i = 0; i < PerfCounterCount; i++)
+		perf.fds[i] = -1;
+
+	attr.config = counter_configs[PerfCounterCycles];
+	perf.leader_fd = perf_event_open(&attr, -1, exclude_kernel);
+
+	// Unprivileged processes may only count user space events
+	if (perf.leader_fd == -1 && (errno == EACCES || errno == EPERM)) {
+		exclude_kernel = 1;
+		perf.leader_fd = perf_event_open(&attr, -1, exclude_kernel);
+	}
+
+	if (perf.leader_fd == -1) {
+		msg(MSG_ERROR, "Hardware performance counters are not available (%s).", strerror(errno));
+		return -1;
+	}
+
+	perf.fds[PerfCounterCycles] = perf.leader_fd;
+	perf.available = 1 << PerfCounterCycles;
+	perf.position[PerfCounterCycles] = 0;
+
+	attr.disabled = 0;
+
+	for (i = PerfCounterCycles + 1; i < PerfCounterCount; i++) {
+		attr.config = counter_configs[i];
+		perf.fds[i] = perf_event_open(&attr, perf.leader_fd, exclude_kernel);
+
+		if (perf.fds[i] == -1) {
+			msg(MSG_INFO, "Hardware counter %s is not available (%s).", counter_names[i], strerror(errno));
+			continue;
+		}
+
+		perf.position[i] = __builtin_popcount(perf.available);
+		perf.available |= 1 << i;
+	}
+
+	if (ioctl(perf.leader_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) == -1) {
+		msg(MSG_ERROR, "Failed to enable hardware performance counters (%s).", strerror(errno));
+
+		for (i = 0; i < PerfCounterCount; i++) {
+			if (perf.fds[i] != -1)
+				close(perf.fds[i]);
+			perf.fds[i] = -1;
+		}
+
+		perf.leader_fd = -1;
+		perf.available = 0;
+
+		return -1;
+	}
+
+	msg(MSG_INFO, "Hardware performance counters enabled%s.", exclude_kernel ? " (user space only)" : "");
+
+	return 0;
+}
+
+uint8_t perf_counters_available() {
+	return perf.available;
+}
+
+/**
+  * Decides whether the current packet is measured.
+  */
+int perf_sample_packet() {
+	if (perf.leader_fd == -1)
+		return 0;
+
+	return (++perf.sample_counter & (PERF_COUNTERS_SAMPLE_RATE - 1)) == 0;
+}
+
+static inline int perf_read(struct perf_group_read *result) {
+	if (read(perf.leader_fd, result, sizeof(struct perf_group_read)) < (ssize_t) sizeof(uint64_t))
+		return -1;
+
+	return 0;
+}
+
+void perf_stage_begin(enum perf_stage stage) {
+	if (perf.leader_fd == -1)
+		return;
+
+	if (perf_read(&perf.start[stage]))
+		perf.start[stage].nr = 0;
+}
+
+void perf_stage_end(enum perf_stage stage) {
+	struct perf_group_read end;
+	struct perf_stage_statistics *statistics = &perf.stages[stage];
+	size_t i;
+
+	if (perf.leader_fd == -1 || perf.start[stage].nr == 0)
+		return;
+
+	if (perf_read(&end) || end.nr != perf.start[stage].nr)
+		return;
+
+	statistics->samples++;
+
+	for (i = 0; i < PerfCounterCount; i++) {
+		if (!(perf.available & (1 << i)))
+			continue;
+
+		statistics->values[i] += end.values[perf.position[i]] - perf.start[stage].values[perf.position[i]];
+	}
+
+	perf.start[stage].nr = 0;
+}
+
+const struct perf_stage_statistics *perf_stage_statistics() {
+	return perf.stages;
+}
+
+/**
+  * Logs the average counter values per measured pass of each stage.
+  */
+void perf_counters_log() {
+	size_t i;
+
+	if (perf.leader_fd == -1)
+		return;
+
+	for (i = 0; i < PerfStageCount; i++) {
+		const struct perf_stage_statistics *statistics = &perf.stages[i];
+		const uint64_t *values = statistics->values;
+
+		if (statistics->samples == 0)
+			continue;
+
+		msg(MSG_INFO, "Stage %s: %llu samples, %.1f cycles, %.1f instructions (IPC %.2f), %.2f cache misses, %.2f branch misses per pass",
+			stage_names[i],
+			(unsigned long long) statistics->samples,
+			(double) values[PerfCounterCycles] / statistics->samples,
+			(double) values[PerfCounterInstructions] / statistics->samples,
+			values[PerfCounterCycles] ? (double) values[PerfCounterInstructions] / values[PerfCounterCycles] : 0.0,
+			(double) values[PerfCounterCacheMisses] / statistics->samples,
+			(double) values[PerfCounterBranchMisses] / statistics->samples);
+	}
+}
+
+#endif
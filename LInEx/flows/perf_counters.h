@@ -0,0 +1,60 @@
+#ifndef PERF_COUNTERS_H_
+#define PERF_COUNTERS_H_
+
+#include <stdint.h>
+
+/**
+  * Stages which are measured with hardware performance counters.
+  */
+enum perf_stage {
+	PerfStageCapture=0, // capture_packet()
+	PerfStageParse=1, // parsing and flow table update of a packet
+	PerfStageExport=2, // export of the flow tables
+	PerfStageCount
+};
+
+/**
+  * Hardware events counted per stage. The values are used as bit positions
+  * in the mask returned by perf_counters_available().
+  */
+enum perf_counter {
+	PerfCounterCycles=0,
+	PerfCounterInstructions=1,
+	PerfCounterCacheMisses=2,
+	PerfCounterBranchMisses=3,
+	PerfCounterCount
+};
+
+/**
+  * Only every PERF_COUNTERS_SAMPLE_RATE-th packet is measured as reading the
+  * counters requires a system call. Has to be a power of two.
+  */
+#define PERF_COUNTERS_SAMPLE_RATE 256
+
+struct perf_stage_statistics {
+	/**
+	  * Number of measured passes of the stage.
+	  */
+	uint64_t samples;
+
+	/**
+	  * Sum of the counter values over all measured passes.
+	  */
+	uint64_t values[PerfCounterCount];
+};
+
+#ifdef SUPPORT_PERF_COUNTERS
+int perf_counters_init();
+uint8_t perf_counters_available();
+int perf_sample_packet();
+void perf_stage_begin(enum perf_stage stage);
+void perf_stage_end(enum perf_stage stage);
+const struct perf_stage_statistics *perf_stage_statistics();
+void perf_counters_log();
+#else
+#define perf_sample_packet() 0
+#define perf_stage_begin(stage) do {} while (0)
+#define perf_stage_end(stage) do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,52 @@
+#include "pipeline_stats.h"
+#include "../ipfixlolib/msg.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+__thread struct pipeline_statistics *pipeline_local_statistics = NULL;
+
+/**
+  * Counters of all threads which ever passed a pipeline stage. Entries are
+  * never removed so that the counters of terminated threads are retained.
+  */
+static struct pipeline_statistics *pipeline_threads = NULL;
+
+/**
+  * Allocates the counters of the calling thread and adds them to the global
+  * list without taking a lock.
+  */
+struct pipeline_statistics *pipeline_register_thread() {
+	struct pipeline_statistics *statistics =
+			(struct pipeline_statistics *) calloc(1, sizeof(struct pipeline_statistics));
+
+	if (statistics == NULL)
+		THROWEXCEPTION("Failed to allocate pipeline statistics.");
+
+	do {
+		statistics->next = pipeline_threads;
+	} while (!__sync_bool_compare_and_swap(&pipeline_threads, statistics->next, statistics));
+
+	pipeline_local_statistics = statistics;
+
+	return statistics;
+}
+
+void pipeline_statistics_aggregate(struct pipeline_stage_counters *result) {
+	struct pipeline_statistics *statistics = pipeline_threads;
+	size_t i;
+
+	memset(result, 0, sizeof(struct pipeline_stage_counters) * PipelineStageCount);
+
+	for (; statistics != NULL; statistics = statistics->next) {
+		for (i = 0; i < PipelineStageCount; i++) {
+			const struct pipeline_stage_counters *counters = &statistics->stages[i];
+
+			result[i].count += counters->count;
+			result[i].samples += counters->samples;
+			result[i].ticks += counters->ticks;
+			if (counters->max_ticks > result[i].max_ticks)
+				result[i].max_ticks = counters->max_ticks;
+		}
+	}
+}
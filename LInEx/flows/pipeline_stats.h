@@ -0,0 +1,150 @@
+#ifndef PIPELINE_STATS_H_
+#define PIPELINE_STATS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+  * Stages of the flow capture and export path in processing order.
+  */
+enum pipeline_stage {
+	PipelineStageDequeue=0, // capture_packet()
+	PipelineStageParse=1, // link, network and transport header parsing
+	PipelineStageHash=2, // flow key hash computation
+	PipelineStageSampling=3, // sampling decision
+	PipelineStageLookup=4, // flow table lookup and insert
+	PipelineStageEncode=5, // encoding of a flow record
+	PipelineStageSend=6, // ipfix_send()
+	PipelineStageCount
+};
+
+/**
+  * Unit of the timings.
+  */
+enum pipeline_tick_unit {
+	PipelineTickCycles=0,
+	PipelineTickNanoseconds=1
+};
+
+/**
+  * Only every PIPELINE_TIMING_SAMPLE_RATE-th packet or record is timed. Has to
+  * be a power of two.
+  */
+#define PIPELINE_TIMING_SAMPLE_RATE 64
+
+struct pipeline_stage_counters {
+	/**
+	  * Number of times the stage has been passed.
+	  */
+	uint64_t count;
+
+	/**
+	  * Number of timed passes and the sum of their durations in ticks.
+	  */
+	uint64_t samples;
+	uint64_t ticks;
+
+	/**
+	  * Longest timed pass since startup.
+	  */
+	uint64_t max_ticks;
+};
+
+/**
+  * Counters of a single thread. Only the owning thread writes them, readers
+  * may observe slightly outdated values.
+  */
+struct pipeline_statistics {
+	struct pipeline_stage_counters stages[PipelineStageCount];
+
+	uint32_t sample_counter;
+	uint8_t timing;
+	uint64_t last_mark;
+
+	struct pipeline_statistics *next;
+};
+
+extern __thread struct pipeline_statistics *pipeline_local_statistics;
+
+struct pipeline_statistics *pipeline_register_thread();
+
+#if defined(__i386__) || defined(__x86_64__)
+#define PIPELINE_TICK_UNIT PipelineTickCycles
+static inline uint64_t pipeline_ticks() {
+	uint32_t low, high;
+
+	__asm__ __volatile__ ("rdtsc" : "=a" (low), "=d" (high));
+
+	return ((uint64_t) high << 32) | low;
+}
+#else
+#define PIPELINE_TICK_UNIT PipelineTickNanoseconds
+static inline uint64_t pipeline_ticks() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+static inline struct pipeline_statistics *pipeline_statistics_local() {
+	struct pipeline_statistics *statistics = pipeline_local_statistics;
+
+	if (__builtin_expect(statistics == NULL, 0))
+		statistics = pipeline_register_thread();
+
+	return statistics;
+}
+
+/**
+  * Marks the start of a packet or record. Decides whether its stages are
+  * timed.
+  */
+static inline void pipeline_sample_begin() {
+	struct pipeline_statistics *statistics = pipeline_statistics_local();
+
+	statistics->timing = (++statistics->sample_counter & (PIPELINE_TIMING_SAMPLE_RATE - 1)) == 0;
+	if (statistics->timing)
+		statistics->last_mark = pipeline_ticks();
+}
+
+/**
+  * Unconditionally times the following stage. Used for infrequent stages.
+  */
+static inline void pipeline_timing_begin() {
+	struct pipeline_statistics *statistics = pipeline_statistics_local();
+
+	statistics->timing = 1;
+	statistics->last_mark = pipeline_ticks();
+}
+
+/**
+  * Accounts the given stage. If the current packet is timed, the time since
+  * the last stage (or since the packet started) is attributed to this stage.
+  */
+static inline void pipeline_stage_done(enum pipeline_stage stage) {
+	struct pipeline_statistics *statistics = pipeline_statistics_local();
+	struct pipeline_stage_counters *counters = &statistics->stages[stage];
+
+	counters->count++;
+
+	if (statistics->timing) {
+		uint64_t now = pipeline_ticks();
+		uint64_t ticks = now - statistics->last_mark;
+
+		counters->samples++;
+		counters->ticks += ticks;
+		if (ticks > counters->max_ticks)
+			counters->max_ticks = ticks;
+
+		statistics->last_mark = now;
+	}
+}
+
+/**
+  * Sums up the counters of all threads.
+  */
+void pipeline_statistics_aggregate(struct pipeline_stage_counters *result);
+
+#endif
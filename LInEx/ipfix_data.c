@@ -211,8 +211,13 @@ int dump_send_buffer_to_ipfix(ipfix_exporter* exporter, uint16_t template_id, in
 
 		//** Assemble a dataset **
 
-		//put Data Record
-		ipfix_put_data_field(exporter, send_buffer+i*datarecord_length, datarecord_length);
+		//put Data Record (copied into the IPFIX message)
+		ret=ipfix_put_data_field(exporter, send_buffer+i*datarecord_length, datarecord_length);
+		if (ret != 0) {
+			msg(MSG_ERROR, "ipfix_put_data_field failed!");
+			ipfix_cancel_data_set(exporter);
+			return ret;
+		}
 	}
 
 	ret=ipfix_end_data_set(exporter, num_datarecords);
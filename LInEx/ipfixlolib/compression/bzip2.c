@@ -6,6 +6,23 @@
 
 int bzip2_compression_level = 1;
 
+/*
+ * libbzip2 cannot reset a stream, so the compressor context keeps the
+ * blocks which BZ2_bzCompressInit() allocates and hands them out again for
+ * the next message.
+ */
+#define BZIP2_CACHED_BLOCKS 4
+
+struct bzip2_block {
+	void *data;
+	size_t size;
+	int in_use;
+};
+
+struct bzip2_context {
+	struct bzip2_block blocks[BZIP2_CACHED_BLOCKS];
+};
+
 void ipfix_init_compression_module(const char *params) {
 	char *endptr = NULL;
 	bzip2_compression_level = strtol(params, &endptr, 10);
@@ -19,20 +36,88 @@ void ipfix_init_compression_module(const char *params) {
 	DPRINTF("DEFLATE: Using compression level of %d", bzip2_compression_level);
 }
 
-int ipfix_compress(ipfix_exporter *exporter) {
+void ipfix_deinit_compression_state(ipfix_compression_state *state) {
+	struct bzip2_context *ctx = state->context;
+	int i;
+
+	if (!ctx)
+		return;
+
+	for (i = 0; i < BZIP2_CACHED_BLOCKS; i++)
+		free(ctx->blocks[i].data);
+	free(ctx);
+	state->context = NULL;
+}
+
+static void *bzip2_alloc(void *opaque, int items, int size) {
+	struct bzip2_context *ctx = opaque;
+	size_t length = (size_t) items * size;
+	int i;
+
+	for (i = 0; i < BZIP2_CACHED_BLOCKS; i++) {
+		struct bzip2_block *block = &ctx->blocks[i];
+		if (!block->in_use && block->size == length) {
+			block->in_use = 1;
+			return block->data;
+		}
+	}
+	for (i = 0; i < BZIP2_CACHED_BLOCKS; i++) {
+		struct bzip2_block *block = &ctx->blocks[i];
+		if (!block->in_use) {
+			free(block->data);
+			block->size = 0;
+			if (!(block->data = malloc(length)))
+				return NULL;
+			block->size = length;
+			block->in_use = 1;
+			return block->data;
+		}
+	}
+
+	return malloc(length);
+}
+
+static void bzip2_free(void *opaque, void *ptr) {
+	struct bzip2_context *ctx = opaque;
+	int i;
+
+	for (i = 0; i < BZIP2_CACHED_BLOCKS; i++) {
+		if (ctx->blocks[i].data == ptr) {
+			ctx->blocks[i].in_use = 0;
+			return;
+		}
+	}
+
+	free(ptr);
+}
+
+/*
+ * Every message is a bzip2 stream on its own: the blocks of bzip2 do not
+ * share any history, so neither streaming nor a dictionary would pay off.
+ */
+int ipfix_compress(ipfix_exporter *exporter, ipfix_compression_state *state) {
+	struct bzip2_context *ctx = state->context;
 	bz_stream strm;
+	int level = state->level ? state->level : bzip2_compression_level;
 	int ret;
 	int i;
 
-	strm.bzalloc = NULL;
-	strm.bzfree = NULL;
-	strm.opaque = NULL;
+	if (!ctx) {
+		ctx = calloc(1, sizeof(*ctx));
+		if (!ctx)
+			return -1;
+		state->context = ctx;
+	}
+
+	strm.bzalloc = &bzip2_alloc;
+	strm.bzfree = &bzip2_free;
+	strm.opaque = ctx;
 
 
 	// The compression level is the 100k block size - as we deal with packets
 	// which can be at 65536 bytes length at most the compression level should
 	// not make a difference.
-	ret = BZ2_bzCompressInit(&strm, bzip2_compression_level, 0, 0);
+	ret = BZ2_bzCompressInit(&strm, level > 9 ? 9 : level, 0, 0);
 	if (ret != BZ_OK) {
 		return -1;
 	}
@@ -6,6 +6,14 @@
 
 int deflate_compression_level = 9;
 
+/*
+ * Compressor context of an exporter
+ */
+struct deflate_context {
+	z_stream strm;
+	int open; // 1 if the collector has received a stream which has not been finished
+};
+
 void ipfix_init_compression_module(const char *params) {
 	char *endptr = NULL;
 	deflate_compression_level = strtol(params, &endptr, 10);
@@ -19,58 +27,120 @@ void ipfix_init_compression_module(const char *params) {
 	DPRINTF("DEFLATE: Using compression level of %d", deflate_compression_level);
 }
 
-int ipfix_compress(ipfix_exporter *exporter) {
-	z_stream strm;
+void ipfix_deinit_compression_state(ipfix_compression_state *state) {
+	struct deflate_context *ctx = state->context;
+
+	if (!ctx)
+		return;
+
+	deflateEnd(&ctx->strm);
+	free(ctx);
+	state->context = NULL;
+}
+
+/*
+ * Sets up the stream for the next message. A message on its own and a new
+ * stream start with the dictionary. A restarted stream continues without
+ * any history, so that the collector can decompress it whether or not it
+ * has seen the earlier messages.
+ */
+static int deflate_prepare(struct deflate_context *ctx, ipfix_compression_state *state) {
 	int ret;
-	int i;
 
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
+	if (state->streaming && !state->load_dictionary) {
+		if (state->restart)
+			return deflateReset(&ctx->strm) == Z_OK ? 0 : -1;
+		return 0;
+	}
+
+	// end the current stream so that the collector starts a new one
+	if (ctx->open) {
+		ret = deflate(&ctx->strm, Z_FINISH);
+		assert(ret != Z_STREAM_ERROR);
+	}
 
-	// windowSize of -15 ensures that no additional header is added
-	ret = deflateInit2(&strm, deflate_compression_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
-	if (ret != Z_OK) {
+	if (deflateReset(&ctx->strm) != Z_OK)
 		return -1;
+	if (state->dictionary &&
+	    deflateSetDictionary(&ctx->strm, state->dictionary, state->dictionary_length) != Z_OK)
+		return -1;
+
+	return 0;
+}
+
+int ipfix_compress(ipfix_exporter *exporter, ipfix_compression_state *state) {
+	struct deflate_context *ctx = state->context;
+	z_stream *strm;
+	int level = state->level ? state->level : deflate_compression_level;
+	int ret;
+	int i;
+
+	if (!ctx) {
+		ctx = calloc(1, sizeof(*ctx));
+		if (!ctx)
+			return -1;
+
+		ctx->strm.zalloc = Z_NULL;
+		ctx->strm.zfree = Z_NULL;
+		ctx->strm.opaque = Z_NULL;
+		if (level > 9)
+			level = 9;
+
+		// windowSize of -15 ensures that no additional header is added
+		ret = deflateInit2(&ctx->strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+		if (ret != Z_OK) {
+			free(ctx);
+			return -1;
+		}
+		state->context = ctx;
 	}
+	strm = &ctx->strm;
+
+	strm->avail_out = sizeof(exporter->compression_buffer);
+	strm->next_out = exporter->compression_buffer;
 
-	strm.avail_out = sizeof(exporter->compression_buffer);
-	strm.next_out = exporter->compression_buffer;
+	if (deflate_prepare(ctx, state))
+		return -1;
 
 	for (i = 0; i < exporter->data_sendbuffer->committed; i++) {
-		if (strm.avail_out <= 0) {
+		if (strm->avail_out <= 0) {
 			msg(MSG_ERROR, "Out of buffer space while compressing.");
-			deflateEnd(&strm);
 
 			return -1;
 		}
 
 		struct iovec *vec = &exporter->data_sendbuffer->entries[i];
-		strm.avail_in = vec->iov_len;
-		strm.next_in = vec->iov_base;
+		strm->avail_in = vec->iov_len;
+		strm->next_in = vec->iov_base;
 
-		ret = deflate(&strm, Z_NO_FLUSH);
+		ret = deflate(strm, Z_NO_FLUSH);
 		assert(ret != Z_STREAM_ERROR);
 	}
 
-	strm.avail_in = 0;
-	strm.next_in = NULL;
-	ret = deflate(&strm, Z_FINISH);
+	// A streamed message ends on a byte boundary without ending the stream
+	strm->avail_in = 0;
+	strm->next_in = NULL;
+	ret = deflate(strm, state->streaming ? Z_SYNC_FLUSH : Z_FINISH);
 	assert(ret != Z_STREAM_ERROR);
 
+	if (strm->avail_out == 0) {
+		msg(MSG_ERROR, "Out of buffer space while compressing.");
+
+		return -1;
+	}
+	ctx->open = state->streaming;
+
 	DPRINTF("(Un-)Compressed length: %d / %d", exporter->data_sendbuffer->committed_data_length,
-			sizeof(exporter->compression_buffer) - strm.avail_out);
+			sizeof(exporter->compression_buffer) - strm->avail_out);
 
 	exporter->data_sendbuffer->entries[0].iov_base =
 			exporter->compression_buffer;
 	exporter->data_sendbuffer->entries[0].iov_len =
-			sizeof(exporter->compression_buffer) - strm.avail_out;
+			sizeof(exporter->compression_buffer) - strm->avail_out;
 	exporter->data_sendbuffer->committed = 1;
 	exporter->data_sendbuffer->current = 1;
 	exporter->data_sendbuffer->committed_data_length =
 			exporter->data_sendbuffer->entries[0].iov_len;
 
-	deflateEnd(&strm);
-
 	return 0;
 }
@@ -3,7 +3,8 @@
 #include "../ipfixlolib.h"
 
 void ipfix_init_compression_module(const char *params);
+void ipfix_deinit_compression_state(ipfix_compression_state *state);
 
-int ipfix_compress(ipfix_exporter *exporter);
+int ipfix_compress(ipfix_exporter *exporter, ipfix_compression_state *state);
 
 #endif
@@ -0,0 +1,92 @@
+#include "ipfix_lz4.h"
+#include "../msg.h"
+
+#include <lz4.h>
+
+int lz4_acceleration = 1;
+
+/*
+ * Compressor context of an exporter
+ */
+struct lz4_context {
+	// LZ4 compresses a block from contiguous memory
+	char message[IPFIX_MAX_PACKETSIZE];
+	// LZ4 state, LZ4_sizeofState() bytes
+	char state[];
+};
+
+void ipfix_init_compression_module(const char *params) {
+	char *endptr = NULL;
+
+	if (!params) {
+		lz4_acceleration = 1;
+		return;
+	}
+
+	lz4_acceleration = strtol(params, &endptr, 10);
+	if (lz4_acceleration < 1 || endptr == params) {
+		msg(MSG_ERROR, "Invalid acceleration using default of 1.");
+		lz4_acceleration = 1;
+	}
+
+	DPRINTF("LZ4: Using acceleration of %d", lz4_acceleration);
+}
+
+void ipfix_deinit_compression_state(ipfix_compression_state *state) {
+	free(state->context);
+	state->context = NULL;
+}
+
+/*
+ * Every message is a raw LZ4 block on its own. The collector decompresses
+ * it with LZ4_decompress_safe() into a buffer of IPFIX_MAX_PACKETSIZE
+ * bytes.
+ */
+int ipfix_compress(ipfix_exporter *exporter, ipfix_compression_state *state) {
+	struct lz4_context *ctx = state->context;
+	int length = 0;
+	int ret;
+	int i;
+
+	if (!ctx) {
+		ctx = malloc(sizeof(*ctx) + LZ4_sizeofState());
+		if (!ctx)
+			return -1;
+		state->context = ctx;
+	}
+
+	for (i = 0; i < exporter->data_sendbuffer->committed; i++) {
+		struct iovec *vec = &exporter->data_sendbuffer->entries[i];
+
+		if (length + vec->iov_len > sizeof(ctx->message)) {
+			msg(MSG_ERROR, "Out of buffer space while compressing.");
+
+			return -1;
+		}
+		memcpy(ctx->message + length, vec->iov_base, vec->iov_len);
+		length += vec->iov_len;
+	}
+
+	ret = LZ4_compress_fast_extState(ctx->state, ctx->message,
+					 (char *) exporter->compression_buffer, length,
+					 sizeof(exporter->compression_buffer),
+					 state->level ? state->level : lz4_acceleration);
+	if (ret <= 0) {
+		msg(MSG_ERROR, "Out of buffer space while compressing.");
+
+		return -1;
+	}
+
+	DPRINTF("(Un-)Compressed length: %d / %d", exporter->data_sendbuffer->committed_data_length,
+			ret);
+
+	exporter->data_sendbuffer->entries[0].iov_base =
+			exporter->compression_buffer;
+	exporter->data_sendbuffer->entries[0].iov_len = ret;
+	exporter->data_sendbuffer->committed = 1;
+	exporter->data_sendbuffer->current = 1;
+	exporter->data_sendbuffer->committed_data_length =
+			exporter->data_sendbuffer->entries[0].iov_len;
+
+	return 0;
+}
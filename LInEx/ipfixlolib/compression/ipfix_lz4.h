@@ -0,0 +1,10 @@
+#ifndef IPFIX_LZ4_H_
+#define IPFIX_LZ4_H_
+#include "../ipfixlolib.h"
+
+void ipfix_init_compression_module(const char *params);
+void ipfix_deinit_compression_state(ipfix_compression_state *state);
+
+int ipfix_compress(ipfix_exporter *exporter, ipfix_compression_state *state);
+
+#endif
@@ -0,0 +1,206 @@
+#include "ipfix_zstd.h"
+#include "../msg.h"
+
+#include <zstd.h>
+#include <stdio.h>
+
+int zstd_compression_level = 3;
+// Dictionary trained by ipfix-zstd-train, NULL if none has been given
+void *zstd_dictionary = NULL;
+size_t zstd_dictionary_size = 0;
+
+/*
+ * Compressor context of an exporter
+ */
+struct zstd_context {
+	ZSTD_CCtx *cctx;
+	ZSTD_CDict *cdict; // digested dictionary, NULL if none
+};
+
+/*
+ * Reads the dictionary from <filename>.
+ */
+static int zstd_load_dictionary(const char *filename) {
+	FILE *fh = fopen(filename, "r");
+	long size;
+
+	if (!fh) {
+		msg(MSG_ERROR, "Could not open zstd dictionary %s", filename);
+		return -1;
+	}
+	if (fseek(fh, 0, SEEK_END) || (size = ftell(fh)) <= 0 || fseek(fh, 0, SEEK_SET)) {
+		msg(MSG_ERROR, "Could not read zstd dictionary %s", filename);
+		fclose(fh);
+		return -1;
+	}
+
+	zstd_dictionary = malloc(size);
+	if (!zstd_dictionary || fread(zstd_dictionary, 1, size, fh) != (size_t) size) {
+		msg(MSG_ERROR, "Could not read zstd dictionary %s", filename);
+		free(zstd_dictionary);
+		zstd_dictionary = NULL;
+		fclose(fh);
+		return -1;
+	}
+	zstd_dictionary_size = size;
+	fclose(fh);
+
+	return 0;
+}
+
+/*
+ * Parameters: <level> [<dictionary file>]
+ */
+void ipfix_init_compression_module(const char *params) {
+	char *endptr = NULL;
+
+	free(zstd_dictionary);
+	zstd_dictionary = NULL;
+	zstd_dictionary_size = 0;
+
+	if (!params) {
+		zstd_compression_level = 3;
+		return;
+	}
+
+	zstd_compression_level = strtol(params, &endptr, 10);
+	if (zstd_compression_level < 1 || zstd_compression_level > ZSTD_maxCLevel() ||
+			endptr == params) {
+		msg(MSG_ERROR, "Invalid compression level using default of 3.");
+		zstd_compression_level = 3;
+	} else {
+		while (*endptr == ' ' || *endptr == '\t')
+			endptr++;
+		if (*endptr && zstd_load_dictionary(endptr) == 0)
+			msg(MSG_INFO, "ZSTD: Using %u byte dictionary %s",
+				(unsigned) zstd_dictionary_size, endptr);
+	}
+
+	DPRINTF("ZSTD: Using compression level of %d", zstd_compression_level);
+}
+
+void ipfix_deinit_compression_state(ipfix_compression_state *state) {
+	struct zstd_context *ctx = state->context;
+
+	if (!ctx)
+		return;
+
+	ZSTD_freeCDict(ctx->cdict);
+	ZSTD_freeCCtx(ctx->cctx);
+	free(ctx);
+	state->context = NULL;
+}
+
+/*
+ * Returns the level of the compressor, which may differ from the module
+ * parameter when adaptive compression uses the module more than once.
+ */
+static int zstd_level(ipfix_compression_state *state) {
+	if (state->level > ZSTD_maxCLevel())
+		return ZSTD_maxCLevel();
+	return state->level ? state->level : zstd_compression_level;
+}
+
+/*
+ * Digests the dictionary once instead of for every message. A trained
+ * dictionary takes precedence over the one built from the templates.
+ */
+static int zstd_prepare_dictionary(struct zstd_context *ctx, ipfix_compression_state *state) {
+	ZSTD_freeCDict(ctx->cdict);
+	ctx->cdict = NULL;
+
+	if (zstd_dictionary)
+		ctx->cdict = ZSTD_createCDict(zstd_dictionary, zstd_dictionary_size,
+					      zstd_level(state));
+	else if (state->dictionary)
+		ctx->cdict = ZSTD_createCDict(state->dictionary, state->dictionary_length,
+					      zstd_level(state));
+	else
+		return ZSTD_isError(ZSTD_CCtx_refCDict(ctx->cctx, NULL)) ? -1 : 0;
+
+	if (!ctx->cdict || ZSTD_isError(ZSTD_CCtx_refCDict(ctx->cctx, ctx->cdict)))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Every message is a zstd frame on its own, the dictionary provides the
+ * history. A frame cannot be picked up after a missed message, so the
+ * messages are never streamed.
+ */
+int ipfix_compress(ipfix_exporter *exporter, ipfix_compression_state *state) {
+	struct zstd_context *ctx = state->context;
+	ZSTD_outBuffer out;
+	ZSTD_inBuffer in;
+	unsigned long long length = 0;
+	size_t ret;
+	int i;
+
+	if (!ctx) {
+		ctx = calloc(1, sizeof(*ctx));
+		if (!ctx)
+			return -1;
+		ctx->cctx = ZSTD_createCCtx();
+		if (!ctx->cctx ||
+		    ZSTD_isError(ZSTD_CCtx_setParameter(ctx->cctx, ZSTD_c_compressionLevel,
+							zstd_level(state)))) {
+			ZSTD_freeCCtx(ctx->cctx);
+			free(ctx);
+			return -1;
+		}
+		state->context = ctx;
+		state->load_dictionary = 1;
+	}
+
+	// Parameters and dictionary stay in place, only the frame is reset
+	ZSTD_CCtx_reset(ctx->cctx, ZSTD_reset_session_only);
+	if (state->load_dictionary && zstd_prepare_dictionary(ctx, state))
+		return -1;
+
+	for (i = 0; i < exporter->data_sendbuffer->committed; i++)
+		length += exporter->data_sendbuffer->entries[i].iov_len;
+	// lets zstd pick the parameters for small inputs
+	ZSTD_CCtx_setPledgedSrcSize(ctx->cctx, length);
+
+	out.dst = exporter->compression_buffer;
+	out.size = sizeof(exporter->compression_buffer);
+	out.pos = 0;
+
+	for (i = 0; i < exporter->data_sendbuffer->committed; i++) {
+		struct iovec *vec = &exporter->data_sendbuffer->entries[i];
+		in.src = vec->iov_base;
+		in.size = vec->iov_len;
+		in.pos = 0;
+
+		while (in.pos < in.size) {
+			ret = ZSTD_compressStream2(ctx->cctx, &out, &in, ZSTD_e_continue);
+			if (ZSTD_isError(ret) || out.pos == out.size) {
+				msg(MSG_ERROR, "Out of buffer space while compressing.");
+				return -1;
+			}
+		}
+	}
+
+	in.src = NULL;
+	in.size = 0;
+	in.pos = 0;
+	ret = ZSTD_compressStream2(ctx->cctx, &out, &in, ZSTD_e_end);
+	if (ret != 0) {
+		msg(MSG_ERROR, "Out of buffer space while compressing.");
+		return -1;
+	}
+
+	DPRINTF("(Un-)Compressed length: %d / %d", exporter->data_sendbuffer->committed_data_length,
+			out.pos);
+
+	exporter->data_sendbuffer->entries[0].iov_base =
+			exporter->compression_buffer;
+	exporter->data_sendbuffer->entries[0].iov_len = out.pos;
+	exporter->data_sendbuffer->committed = 1;
+	exporter->data_sendbuffer->current = 1;
+	exporter->data_sendbuffer->committed_data_length =
+			exporter->data_sendbuffer->entries[0].iov_len;
+
+	return 0;
+}
@@ -4,14 +4,29 @@
 
 #include <assert.h>
 
-// Declare compression state outside of local scope to prevent stack overflow
-// See QuickLZ manual.
-qlz_state_compress state_compress;
+void ipfix_deinit_compression_state(ipfix_compression_state *state) {
+	free(state->context);
+	state->context = NULL;
+}
 
-int ipfix_compress(ipfix_exporter *exporter) {
+/*
+ * Every message is compressed on its own: a QuickLZ decompressor cannot
+ * pick up a stream after it has missed a message, and QuickLZ does not
+ * support a preset dictionary.
+ */
+int ipfix_compress(ipfix_exporter *exporter, ipfix_compression_state *state) {
 	int i;
 
-	memset(&state_compress, 0, sizeof(qlz_state_compress));
+	// The compression state is too large for the stack, see QuickLZ manual.
+	qlz_state_compress *state_compress = state->context;
+	if (!state_compress) {
+		state_compress = malloc(sizeof(qlz_state_compress));
+		if (!state_compress)
+			return -1;
+		state->context = state_compress;
+	}
+
+	memset(state_compress, 0, sizeof(qlz_state_compress));
 
 	char *buffer = (char *) exporter->compression_buffer;
 	char *const buffer_end = buffer + sizeof(exporter->compression_buffer);
@@ -27,7 +42,7 @@ int ipfix_compress(ipfix_exporter *exporter) {
 			return -1;
 		}
 
-		buffer += qlz_compress(vec->iov_base, buffer, vec->iov_len, &state_compress);
+		buffer += qlz_compress(vec->iov_base, buffer, vec->iov_len, state_compress);
 	}
 
 	DPRINTF("(Un-)Compressed length: %d / %d", exporter->data_sendbuffer->committed_data_length,
@@ -2,6 +2,8 @@
 #define QUICKLZ_H_
 #include "../ipfixlolib.h"
 
-int ipfix_compress(ipfix_exporter *exporter);
+void ipfix_deinit_compression_state(ipfix_compression_state *state);
+
+int ipfix_compress(ipfix_exporter *exporter, ipfix_compression_state *state);
 
 #endif
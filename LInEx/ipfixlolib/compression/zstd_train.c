@@ -0,0 +1,168 @@
+/*
+ * Trains a zstd dictionary for the zstd compression module from the
+ * uncompressed IPFIX messages of DATAFILE captures.
+ *
+ * Usage: ipfix-zstd-train [-s <dictionary size>] <dictionary> <datafile>...
+ *
+ * Each Data message is a sample, messages carrying only Template Sets are
+ * left out. The dictionary is loaded with COMPRESSION zstd <level> <dictionary>,
+ * the collector needs the same file to decompress the messages.
+ */
+#include "../ipfixlolib.h"
+
+#include <zstd.h>
+#include <zdict.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_DICTIONARY_SIZE (16 * 1024)
+
+static uint8_t *samples = NULL;
+static size_t samples_length = 0;
+static size_t samples_capacity = 0;
+static size_t *sample_sizes = NULL;
+static unsigned sample_count = 0;
+static unsigned sample_capacity = 0;
+
+static void usage(void) {
+	fprintf(stderr, "Usage: ipfix-zstd-train [-s <dictionary size>] <dictionary> <datafile>...\n");
+	exit(1);
+}
+
+/*
+ * Returns 1 if the message contains a Data Set.
+ */
+static int has_data_set(const uint8_t *message, uint16_t length) {
+	uint16_t offset = sizeof(ipfix_header);
+
+	while (offset + sizeof(ipfix_set_header) <= length) {
+		uint16_t set_id = ntohs(*(uint16_t *) (message + offset));
+		uint16_t set_length = ntohs(*(uint16_t *) (message + offset + 2));
+
+		// Set IDs from 256 on refer to templates
+		if (set_id >= 256)
+			return 1;
+		if (set_length < sizeof(ipfix_set_header))
+			return 0;
+		offset += set_length;
+	}
+
+	return 0;
+}
+
+static void add_sample(const uint8_t *message, uint16_t length) {
+	if (samples_length + length > samples_capacity) {
+		samples_capacity = (samples_capacity + length) * 2;
+		if (!(samples = realloc(samples, samples_capacity))) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	if (sample_count == sample_capacity) {
+		sample_capacity = sample_capacity ? sample_capacity * 2 : 1024;
+		if (!(sample_sizes = realloc(sample_sizes, sample_capacity * sizeof(*sample_sizes)))) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	memcpy(samples + samples_length, message, length);
+	samples_length += length;
+	sample_sizes[sample_count++] = length;
+}
+
+/*
+ * Splits a DATAFILE capture into its messages.
+ */
+static int read_datafile(const char *filename) {
+	static uint8_t message[IPFIX_MAX_MESSAGE_SIZE];
+	ipfix_header header;
+	FILE *fh = fopen(filename, "r");
+	unsigned count = 0;
+
+	if (!fh) {
+		perror(filename);
+		return -1;
+	}
+
+	while (fread(&header, sizeof(header), 1, fh) == 1) {
+		uint16_t length = ntohs(header.length);
+
+		if (ntohs(header.version) != IPFIX_VERSION_NUMBER || length < sizeof(header)) {
+			fprintf(stderr, "%s: no uncompressed IPFIX message at offset %ld\n",
+				filename, ftell(fh) - (long) sizeof(header));
+			fclose(fh);
+			return -1;
+		}
+		memcpy(message, &header, sizeof(header));
+		if (fread(message + sizeof(header), 1, length - sizeof(header), fh) != length - sizeof(header)) {
+			fprintf(stderr, "%s: truncated message\n", filename);
+			break;
+		}
+		if (has_data_set(message, length)) {
+			add_sample(message, length);
+			count++;
+		}
+	}
+
+	fclose(fh);
+	printf("%s: %u Data messages\n", filename, count);
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	size_t dictionary_size = DEFAULT_DICTIONARY_SIZE;
+	void *dictionary;
+	size_t ret;
+	FILE *fh;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		switch (opt) {
+		case 's':
+			dictionary_size = strtoul(optarg, NULL, 10);
+			if (dictionary_size < 256)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind < 2)
+		usage();
+
+	for (i = optind + 1; i < argc; i++) {
+		if (read_datafile(argv[i]))
+			return 1;
+	}
+	if (sample_count == 0) {
+		fprintf(stderr, "No Data messages found\n");
+		return 1;
+	}
+
+	if (!(dictionary = malloc(dictionary_size))) {
+		perror("malloc");
+		return 1;
+	}
+	ret = ZDICT_trainFromBuffer(dictionary, dictionary_size, samples, sample_sizes, sample_count);
+	if (ZDICT_isError(ret)) {
+		fprintf(stderr, "Training failed: %s\n", ZDICT_getErrorName(ret));
+		return 1;
+	}
+
+	if (!(fh = fopen(argv[optind], "w")) || fwrite(dictionary, 1, ret, fh) != ret) {
+		perror(argv[optind]);
+		return 1;
+	}
+	fclose(fh);
+	printf("Wrote %u byte dictionary from %u messages to %s\n",
+	       (unsigned) ret, sample_count, argv[optind]);
+
+	return 0;
+}
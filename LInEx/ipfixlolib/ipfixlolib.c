@@ -33,6 +33,11 @@
  jan@petranek.de
  */
 
+#ifdef SUPPORT_SENDMMSG
+/* sendmmsg() */
+#define _GNU_SOURCE
+#endif
+
 #include "ipfixlolib.h"
 #include "encoding.h"
 #include "msg.h"
@@ -41,11 +46,20 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stddef.h>
+#include <poll.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
 
 #ifdef SUPPORT_COMPRESSION
 #include <dlfcn.h>
 #endif
 
+#ifdef SUPPORT_SENDMMSG
+#include <netinet/udp.h>
+#endif
+
 #ifdef __linux__
 /* Copied from linux/in.h */
 #define IP_MTU          14
@@ -66,28 +80,45 @@ static int ensure_exporter_set_up_for_dtls(ipfix_exporter *exporter);
 static void deinit_openssl_ctx(ipfix_exporter *exporter);
 static int setup_dtls_connection(ipfix_exporter *exporter, ipfix_receiving_collector *col, ipfix_dtls_connection *con);
 static int dtls_send(ipfix_exporter *exporter, ipfix_receiving_collector *col, const struct iovec *iov, int iovcnt);
-static int dtls_connect(ipfix_receiving_collector *col, ipfix_dtls_connection *con);
-static void dtls_shutdown_and_cleanup(ipfix_dtls_connection *con);
-static void dtls_fail_connection(ipfix_dtls_connection *con);
+static int dtls_connect(ipfix_exporter *exporter, ipfix_receiving_collector *col, ipfix_dtls_connection *con);
+static void dtls_shutdown_and_cleanup(ipfix_exporter *exporter, ipfix_dtls_connection *con);
+static void dtls_fail_connection(ipfix_exporter *exporter, ipfix_dtls_connection *con);
 #endif
 #ifdef SUPPORT_SCTP
 static int init_send_sctp_socket(struct sockaddr_in serv_addr);
+static void sctp_fail(ipfix_exporter *exporter, int i);
+static int sctp_reconnect(ipfix_exporter *exporter, int i);
+static void sctp_read(ipfix_exporter *exporter, int i);
 #ifdef SUPPORT_DTLS_OVER_SCTP
 static void handle_sctp_event(BIO *bio, void *context, void *buf);
 #endif
 #endif
 #ifdef SUPPORT_COMPRESSION
-static int ipfix_compress_packet(ipfix_exporter *exporter);
+static int ipfix_compress_packet(ipfix_exporter *exporter, struct iovec *iov, int iovcnt);
+static void ipfix_release_compression(ipfix_exporter *exporter);
+static void ipfix_restart_compression(ipfix_exporter *exporter);
 #endif
 static int init_send_udp_socket(struct sockaddr_in serv_addr);
+static int init_send_tcp_socket(struct sockaddr_in serv_addr);
+static void watch_socket(ipfix_exporter *exporter, int fd, int *watched_events, int events);
+static void tcp_connect(ipfix_exporter *exporter, ipfix_receiving_collector *col);
+static void tcp_check_connection(ipfix_exporter *exporter, ipfix_receiving_collector *col);
+static int tcp_send(ipfix_exporter *exporter, ipfix_receiving_collector *col, struct iovec *iov, int iovcnt, int reliable);
+static void tcp_drain(ipfix_exporter *exporter, ipfix_receiving_collector *col);
+static int tcp_prepend_backlog(ipfix_receiving_collector *col, struct iovec *iov, int iovcnt);
+static int ipfix_manage_connection(ipfix_exporter *exporter, int i);
+static ipfix_spill_queue *ipfix_open_spill_queue(ipfix_exporter *exporter, ipfix_receiving_collector *col);
+static void ipfix_close_spill_queue(ipfix_spill_queue *q);
+static void ipfix_replay_spilled_messages(ipfix_exporter *exporter, int i);
 static int enable_pmtu_discovery(int s);
 static int ipfix_find_template(ipfix_exporter *exporter, uint16_t template_id);
-static void ipfix_prepend_header(ipfix_exporter *p_exporter, int data_length, ipfix_sendbuffer *sendbuf);
-static int ipfix_init_sendbuffer(ipfix_sendbuffer **sendbufn);
+static void ipfix_write_header(ipfix_exporter *p_exporter, ipfix_header *header, uint16_t total_length, uint32_t sequence_number);
+static void ipfix_prepend_header(ipfix_exporter *p_exporter, int data_length, ipfix_sendbuffer *sendbuf, uint32_t sequence_number);
+static int ipfix_init_sendbuffer(ipfix_sendbuffer **sendbufn, unsigned data_capacity);
 static int ipfix_reset_sendbuffer(ipfix_sendbuffer *sendbuf);
 static int ipfix_deinit_sendbuffer(ipfix_sendbuffer **sendbuf);
 static int ipfix_init_collector_array(ipfix_receiving_collector **col, int col_capacity);
-static void remove_collector(ipfix_receiving_collector *collector);
+static void remove_collector(ipfix_exporter *exporter, ipfix_receiving_collector *collector);
 static int ipfix_deinit_collector_array(ipfix_receiving_collector **col);
 static int ipfix_init_send_socket(struct sockaddr_in serv_addr , enum ipfix_transport_protocol protocol);
 static int ipfix_init_template_array(ipfix_exporter *exporter, int template_capacity);
@@ -96,12 +127,30 @@ static int ipfix_deinit_template_array(ipfix_exporter *exporter);
 static int ipfix_update_template_sendbuffer(ipfix_exporter *exporter);
 static int ipfix_send_templates(ipfix_exporter* exporter);
 static int ipfix_send_data(ipfix_exporter* exporter);
+static int ipfix_queue_message(ipfix_exporter *exporter, struct iovec *iov, int iovcnt, int compressed);
+static void ipfix_flush_queue(ipfix_exporter *exporter);
+static void ipfix_flush_collected_messages(ipfix_exporter *exporter, int i);
+static unsigned ipfix_elapsed_ms(const struct timespec *since);
 static int ipfix_new_file(ipfix_receiving_collector* recvcoll);
 static void update_exporter_max_message_size(ipfix_exporter *exporter);
 static int update_collector_mtu(ipfix_exporter *exporter, ipfix_receiving_collector *col);
 static int get_mtu(const int s);
 static int ipfix_enterprise_flag_set(uint16_t id);
 
+/*
+ * Tells the socket watcher of the application which IPFIX_SOCKET_* events
+ * a socket has to be watched for from now on. 0 stops watching it.
+ * This is an internal function.
+ */
+static void watch_socket(ipfix_exporter *exporter, int fd, int *watched_events, int events) {
+	if (*watched_events == events)
+		return;
+	if (exporter->socket_watcher)
+		(*exporter->socket_watcher)(fd, *watched_events, events,
+					    exporter->socket_watcher_param);
+	*watched_events = events;
+}
+
 
 #ifdef SUPPORT_DTLS
 /* A separate SSL_CTX object is created for every ipfix_exporter.
@@ -175,7 +224,7 @@ static int dtls_get_replacement_connection_ready(
 	    return -1;
 	}
     }
-    ret = dtls_connect(col,&col->dtls_replacement);
+    ret = dtls_connect(exporter,col,&col->dtls_replacement);
     if (ret == 1) {
 	DPRINTF("Replacement connection setup successful.");
 	return 1; /* SUCCESS */
@@ -184,7 +233,7 @@ static int dtls_get_replacement_connection_ready(
 	if (col->dtls_connect_timeout && 
 		(time(NULL) - col->dtls_replacement.last_reconnect_attempt_time > col->dtls_connect_timeout)) {
 	    msg(MSG_ERROR,"DTLS replacement connection setup taking too long.");
-	    dtls_fail_connection(&col->dtls_replacement);
+	    dtls_fail_connection(exporter,&col->dtls_replacement);
 	} else {
 	    DPRINTF("Replacement connection setup still ongoing.");
 	    return 0;
@@ -200,9 +249,12 @@ static int dtls_send_templates(
     if (exporter->template_sendbuffer->committed_data_length == 0)
 	return 0;
 
+    /* Templates are sent whenever a new DTLS session has been set up */
+    col->sequence_number = 0;
     ipfix_prepend_header(exporter,
 	exporter->template_sendbuffer->committed_data_length,
-	exporter->template_sendbuffer);
+	exporter->template_sendbuffer,
+	col->sequence_number);
     DPRINTF("Sending templates over DTLS.");
     return dtls_send(exporter,col,
 	exporter->template_sendbuffer->entries,
@@ -248,7 +300,7 @@ static int dtls_manage_connection(ipfix_exporter *exporter, ipfix_receiving_coll
 	    DPRINTF("Swapping connections.");
 	    dtls_swap_connections(&col->dtls_main,&col->dtls_replacement);
 	    DPRINTF("Shutting down old DTLS connection.");
-	    dtls_shutdown_and_cleanup(&col->dtls_replacement);
+	    dtls_shutdown_and_cleanup(exporter,&col->dtls_replacement);
 	    col->connect_time = time(NULL);
 	    ret = dtls_send_templates(exporter, col);
 	    /* We do not need to check the return value because
@@ -261,7 +313,7 @@ static int dtls_manage_connection(ipfix_exporter *exporter, ipfix_receiving_coll
     if (col->state == C_NEW) {
 	rc = 1;
 	/* Connection setup is still ongoing. Let's push it forward. */
-	ret = dtls_connect(col,&col->dtls_main);
+	ret = dtls_connect(exporter,col,&col->dtls_main);
 	if (ret == 1) {
 	    /* SUCCESS */
 	    col->state = C_CONNECTED;
@@ -309,7 +361,7 @@ static int dtls_manage_connection(ipfix_exporter *exporter, ipfix_receiving_coll
  *  0 no failure but not yet connected. You need to call dtls_connect again
  *        next time
  *  1 yes. now we're connected. Don't call dtls_connect again. */
-static int dtls_connect(ipfix_receiving_collector *col, ipfix_dtls_connection *con) {
+static int dtls_connect(ipfix_exporter *exporter, ipfix_receiving_collector *col, ipfix_dtls_connection *con) {
     int ret, error;
 
     ret = SSL_connect(con->ssl);
@@ -324,7 +376,7 @@ static int dtls_connect(ipfix_receiving_collector *col, ipfix_dtls_connection *c
 		DPRINTF("Peer authentication successful.");
 	    } else {
 		msg(MSG_ERROR,"Peer authentication failed. Shutting down connection.");
-		dtls_fail_connection(con);
+		dtls_fail_connection(exporter,con);
 		return -1;
 	    }
 	}
@@ -334,7 +386,7 @@ static int dtls_connect(ipfix_receiving_collector *col, ipfix_dtls_connection *c
 	return 0;
     } else {
 	msg_openssl_return_code(MSG_ERROR,"SSL_connect()",ret,error);
-	dtls_fail_connection(con);
+	dtls_fail_connection(exporter,con);
 	return -1;
     }
 }
@@ -350,7 +402,7 @@ static int dtls_connect(ipfix_receiving_collector *col, ipfix_dtls_connection *c
  *     property of the collector.
  */
 
-static int dtls_send_helper( ipfix_dtls_connection *con,
+static int dtls_send_helper( ipfix_exporter *exporter, ipfix_dtls_connection *con,
 	const struct iovec *iov, int iovcnt) {
     int len, error, i;
     char sendbuf[IPFIX_MAX_PACKETSIZE];
@@ -389,7 +441,7 @@ static int dtls_send_helper( ipfix_dtls_connection *con,
 	    /* fall through */
 	default:
 	    msg_openssl_return_code(MSG_ERROR,"SSL_write()",len,error);
-	    dtls_fail_connection(con);
+	    dtls_fail_connection(exporter,con);
 	    return -2;
     }
 }
@@ -412,7 +464,7 @@ static int dtls_send(
 	return -1;
     }
 
-    len = dtls_send_helper(&col->dtls_main, iov, iovcnt);
+    len = dtls_send_helper(exporter, &col->dtls_main, iov, iovcnt);
     if (len == -2) {
 	col->state = C_DISCONNECTED;
 	return -1;
@@ -588,47 +640,30 @@ static int setup_dtls_connection(ipfix_exporter *exporter, ipfix_receiving_colle
     DPRINTF("Set up SSL object.");
 
     con->last_reconnect_attempt_time = time(NULL);
+    /* The handshake proceeds whenever the collector answers */
+    watch_socket(exporter, con->socket, &con->watched_events, IPFIX_SOCKET_READ);
 
     return 0;
 }
 
-static void dtls_shutdown_and_cleanup(ipfix_dtls_connection *con) {
-    int ret,error;
+/* Sends a close_notify alert without waiting for the one of the peer
+ * which would block the event loop. The peer may miss the alert, which
+ * DTLS tolerates as a connection may always end without it. */
+static void dtls_shutdown_and_cleanup(ipfix_exporter *exporter, ipfix_dtls_connection *con) {
+    int ret;
     if (!con->ssl) return;
     DPRINTF("Shutting down SSL connection.");
     ret = SSL_shutdown(con->ssl);
 #ifdef DEBUG
-    error = SSL_get_error(con->ssl,ret);
-    msg_openssl_return_code(MSG_DEBUG,"SSL_shutdown()",ret,error);
-#endif
-    /* TODO: loop only if ret==-1 and error==WANT_READ or WANT_WRITE */
-    int i = 0;
-    while (ret != 1 && !(SSL_get_shutdown(con->ssl) & SSL_RECEIVED_SHUTDOWN)
-	    && ( (ret == 0 && error == SSL_ERROR_SYSCALL) ||
-		 (ret == -1 && (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)))) {
-	fd_set readfds;
-	struct timeval timeout;
-	timeout.tv_sec = 3;
-	timeout.tv_usec = 0;
-	FD_ZERO(&readfds);
-	FD_SET(con->socket, &readfds);
-	ret = select(con->socket + 1,&readfds,NULL,NULL,&timeout);
-	DPRINTF("select returned: %d",ret);
-	DPRINTF("Calling SSL_shutdown()");
-	ret = SSL_shutdown(con->ssl);
-	error = SSL_get_error(con->ssl,ret);
-	msg_openssl_return_code(MSG_DEBUG,"SSL_shutdown()",ret,error);
-	if (i++ == 3) {
-	    msg(MSG_ERROR,"Too many calls to select(). Breaking out.");
-	    break;
-	}
-    }
+    msg_openssl_return_code(MSG_DEBUG,"SSL_shutdown()",ret,SSL_get_error(con->ssl,ret));
+#endif
     /* Note: SSL_free() also frees associated sending and receiving BIOs */
     SSL_free(con->ssl);
     con->ssl = NULL;
     con->last_reconnect_attempt_time = 0;
     /* Close socket */
     if ( con->socket != -1) {
+	watch_socket(exporter, con->socket, &con->watched_events, 0);
 	DPRINTF("Closing socket");
 	ret = close(con->socket);
 	DPRINTF("close returned %d",ret);
@@ -636,24 +671,110 @@ static void dtls_shutdown_and_cleanup(ipfix_dtls_connection *con) {
     }
 }
 
-static void dtls_fail_connection(ipfix_dtls_connection *con) {
+static void dtls_fail_connection(ipfix_exporter *exporter, ipfix_dtls_connection *con) {
     DPRINTF("Failing DTLS connection.");
-    dtls_shutdown_and_cleanup(con);
+    dtls_shutdown_and_cleanup(exporter, con);
+}
+
+/* Processes what the collector sent on an established DTLS connection.
+ * Collectors do not send data but alerts, e.g. when they shut down the
+ * connection, and the socket reports ICMP errors. */
+static void dtls_read(ipfix_exporter *exporter, ipfix_receiving_collector *col) {
+    char buf[256];
+    int ret, error;
+
+    ret = SSL_read(col->dtls_main.ssl, buf, sizeof(buf));
+    error = SSL_get_error(col->dtls_main.ssl, ret);
+    if (ret > 0 || error == SSL_ERROR_WANT_READ)
+	return;
+    msg_openssl_return_code(MSG_ERROR,"SSL_read()",ret,error);
+    dtls_fail_connection(exporter, &col->dtls_main);
+    col->state = C_DISCONNECTED;
 }
 
 #endif /* SUPPORT_DTLS */
 
+/*
+ * Pushes the connection setup of a collector forward and reconnects it
+ * once its reconnection delay has passed. Messages spilled while the
+ * collector was unreachable are replayed once it is connected. Never blocks.
+ * i: index of the collector in the exporters collector_arr
+ * Returns 1 if a connection setup is still ongoing, 0 otherwise.
+ * This is an internal function.
+ */
+static int ipfix_manage_connection(ipfix_exporter *exporter, int i) {
+	ipfix_receiving_collector *col = &exporter->collector_arr[i];
+	time_t time_now = time(NULL);
+	int ret = 0;
+
+	switch (col->protocol) {
+#ifdef SUPPORT_DTLS
+	case DTLS_OVER_UDP:
+	case DTLS_OVER_SCTP:
+		ret = dtls_manage_connection(exporter, col) == 1;
+		break;
+#endif
+#ifdef SUPPORT_SCTP
+	case SCTP:
+		switch (col->state) {
+		case C_NEW:
+			sctp_reconnect(exporter, i);
+			break;
+		case C_DISCONNECTED: // reconnect attempt if reconnection time reached
+			if (exporter->sctp_reconnect_timer == 0) { // 0 = no more reconnection attempts
+				msg(MSG_ERROR, "reconnect failed, removing collector %s:%d (SCTP)", col->ipv4address, col->port_number);
+				remove_collector(exporter, col);
+				update_exporter_max_message_size(exporter);
+				return 0;
+			}
+			if (col->last_reconnect_attempt_time == 0 ||
+			    (time_now - col->last_reconnect_attempt_time) > exporter->sctp_reconnect_timer)
+				sctp_reconnect(exporter, i);
+			break;
+		default:
+			break;
+		}
+		ret = col->state == C_NEW;
+		break;
+#endif
+	case TCP:
+		switch (col->state) {
+		case C_NEW:
+			tcp_check_connection(exporter, col);
+			break;
+		case C_DISCONNECTED: // reconnect attempt if the backoff delay has passed
+			if (time_now - col->last_reconnect_attempt_time >= col->reconnect_delay)
+				tcp_connect(exporter, col);
+			break;
+		default:
+			break;
+		}
+		ret = col->state == C_NEW;
+		break;
+	default:
+		break;
+	}
+
+	if (col->spill && col->state == C_CONNECTED)
+		ipfix_replay_spilled_messages(exporter, i);
+	return ret;
+}
+
 /*!
- * \brief Should be called on a regular basis to push forward DTLS connection setup procedures.
+ * \brief Should be called on a regular basis to push forward connection setup procedures.
  *
  * ipfixlolib depends on the user to call this function regularly
- * if there is an ongoing connection setup procedure. This is
- * necessary because<ul>
+ * if there is an ongoing connection setup procedure or a disconnected
+ * collector. This is necessary because<ul>
  * <li>ipfixlolib is <em>not</em> allowed to block the calling thread,</li>
- * <li>ipfixlolib does not run in a dedicated thread and</li>
- * <li>a DTLS connection setup (i.e. handshake) may take an</li>
- * extended period of time.
+ * <li>ipfixlolib does not run in a dedicated thread,</li>
+ * <li>a DTLS connection setup (i.e. handshake) may take an
+ * extended period of time and</li>
+ * <li>lost SCTP and TCP collectors are reconnected after a delay.</li>
  * </ul>
+ * Applications that registered a socket watcher (see ipfix_set_socket_watcher())
+ * have to call this function from a timer, about every 200 ms, as connections
+ * are then only managed here and in ipfix_socket_event().
  *
  * \param exporter pointer to previously initialized exporter struct
  * \return 1 this function should be called again after a short period of time
@@ -662,20 +783,14 @@ static void dtls_fail_connection(ipfix_dtls_connection *con) {
  */
 int ipfix_beat(ipfix_exporter *exporter) {
     int ret = 0;
-#ifdef SUPPORT_DTLS
     int i;
     for (i = 0; i < exporter->collector_max_num; i++) {
-	ipfix_receiving_collector *col = &exporter->collector_arr[i];
 	// is the collector a valid target?
-	if (col->state != T_UNUSED) {
-	    if (col->protocol == DTLS_OVER_UDP ||
-		    col->protocol == DTLS_OVER_SCTP) {
-		if (dtls_manage_connection(exporter,col))
-		    ret = 1;
-	    }
+	if (exporter->collector_arr[i].state != C_UNUSED) {
+	    if (ipfix_manage_connection(exporter, i))
+		ret = 1;
 	}
     }
-#endif
     return ret;
 }
 
@@ -877,6 +992,389 @@ static int sctp_sendmsgv(int s, struct iovec *vector, int v_len, struct sockaddr
 //END of SCTP Extension Code:
 *********************************************************************/
 
+/*
+ * Initializes a non-blocking TCP socket and starts the connection setup.
+ * Parameters:
+ * serv_addr address and port of the recipient
+ * Returns: a socket which becomes writable once the connection setup is
+ * finished. -1 on failure
+ */
+static int init_send_tcp_socket(struct sockaddr_in serv_addr){
+
+	int s;
+	int flags;
+	// create socket
+	if((s = socket(AF_INET, SOCK_STREAM, 0)) < 0 ) {
+		msg(MSG_ERROR, "error opening TCP socket, %s", strerror(errno));
+		return -1;
+	}
+
+	if ((flags = fcntl(s, F_GETFL)) == -1 || fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1) {
+		msg(MSG_ERROR, "failed to make TCP socket non-blocking, %s", strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	// Workaround strict aliasing warnings
+	union sa {
+	    struct sockaddr sa;
+	    struct sockaddr_in sa_in;
+	};
+
+	union sa addr;
+	addr.sa_in = serv_addr;
+
+	if(connect(s, (const struct sockaddr *) &addr.sa, sizeof(serv_addr) ) < 0
+	   && errno != EINPROGRESS) {
+		msg(MSG_ERROR, "TCP connect failed, %s", strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+/*
+ * Closes the connection to a TCP collector after an error. If it was
+ * connected, everything waiting for it is discarded, as the collector cannot
+ * tell where the transport session ended. The next connection attempt takes place after
+ * twice the previous delay.
+ * This is an internal function.
+ */
+static void tcp_fail(ipfix_exporter *exporter, ipfix_receiving_collector *col) {
+	watch_socket(exporter, col->data_socket, &col->watched_events, 0);
+	if (col->data_socket >= 0)
+		close(col->data_socket);
+	col->data_socket = -1;
+
+	// messages buffered while not connected are still complete
+	if (col->state == C_CONNECTED) {
+		if (col->backlog_length > col->backlog_start)
+			msg(MSG_ERROR, "Discarding %u bytes waiting for TCP collector %s:%d",
+				col->backlog_length - col->backlog_start, col->ipv4address, col->port_number);
+		col->backlog_start = col->backlog_length = 0;
+		col->backpressure = 0;
+		// messages buffered from now on belong to the next transport session
+		col->sequence_number = 0;
+#ifdef SUPPORT_COMPRESSION
+		ipfix_restart_compression(exporter);
+#endif
+	}
+
+	if (col->reconnect_delay == 0)
+		col->reconnect_delay = 1;
+	else if (col->reconnect_delay < IPFIX_TCP_MAX_RECONNECT_DELAY / 2)
+		col->reconnect_delay *= 2;
+	else
+		col->reconnect_delay = IPFIX_TCP_MAX_RECONNECT_DELAY;
+
+	col->state = C_DISCONNECTED;
+	msg(MSG_INFO, "Next connection attempt to TCP collector %s:%d in %u seconds",
+		col->ipv4address, col->port_number, col->reconnect_delay);
+}
+
+/*
+ * Starts the connection setup to a TCP collector. The collector changes to
+ * C_NEW or, if the connection is refused right away, C_DISCONNECTED.
+ * This is an internal function.
+ */
+static void tcp_connect(ipfix_exporter *exporter, ipfix_receiving_collector *col) {
+	col->last_reconnect_attempt_time = time(NULL);
+	col->data_socket = init_send_tcp_socket(col->addr);
+	if (col->data_socket < 0) {
+		tcp_fail(exporter, col);
+		return;
+	}
+	col->state = C_NEW;
+	// the socket becomes writable once the connection is set up
+	watch_socket(exporter, col->data_socket, &col->watched_events, IPFIX_SOCKET_WRITE);
+}
+
+/*
+ * Checks whether the connection setup to a TCP collector in state C_NEW
+ * has finished. A new transport session starts with all active templates.
+ * This is an internal function.
+ */
+static void tcp_check_connection(ipfix_exporter *exporter, ipfix_receiving_collector *col) {
+	struct pollfd pfd;
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	pfd.fd = col->data_socket;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) <= 0)
+		return;
+
+	if (getsockopt(col->data_socket, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+		error = errno;
+	if (error) {
+		msg(MSG_ERROR, "Connecting to TCP collector %s:%d failed, %s",
+			col->ipv4address, col->port_number, strerror(error));
+		tcp_fail(exporter, col);
+		return;
+	}
+
+	msg(MSG_INFO, "Connected to TCP collector %s:%d", col->ipv4address, col->port_number);
+	col->state = C_CONNECTED;
+	col->reconnect_delay = 0;
+	// reading detects when the collector closes the connection
+	watch_socket(exporter, col->data_socket, &col->watched_events, IPFIX_SOCKET_READ);
+
+	if (col->backlog_length == col->backlog_start) {
+		if (exporter->template_sendbuffer->committed_data_length > 0) {
+			ipfix_prepend_header(exporter,
+				exporter->template_sendbuffer->committed_data_length,
+				exporter->template_sendbuffer,
+				0);
+			tcp_send(exporter, col,
+				 exporter->template_sendbuffer->entries,
+				 exporter->template_sendbuffer->current, 1);
+		}
+		return;
+	}
+
+	// the templates precede the messages buffered while not connected
+	msg(MSG_INFO, "Sending %u buffered bytes to TCP collector %s:%d",
+		col->backlog_length - col->backlog_start, col->ipv4address, col->port_number);
+	if (exporter->template_sendbuffer->committed_data_length > 0) {
+		ipfix_prepend_header(exporter,
+			exporter->template_sendbuffer->committed_data_length,
+			exporter->template_sendbuffer,
+			0);
+		if (tcp_prepend_backlog(col, exporter->template_sendbuffer->entries,
+					exporter->template_sendbuffer->current)) {
+			msg(MSG_ERROR, "Failed to grow backlog of TCP collector %s:%d",
+				col->ipv4address, col->port_number);
+			tcp_fail(exporter, col);
+			return;
+		}
+	}
+	tcp_drain(exporter, col);
+}
+
+/*
+ * Signals backpressure once the backlog of a TCP collector exceeds three
+ * quarters of its limit, until it has been drained below one quarter.
+ * This is an internal function.
+ */
+static void tcp_update_backpressure(ipfix_exporter *exporter, ipfix_receiving_collector *col) {
+	unsigned pending = col->backlog_length - col->backlog_start;
+
+	if (!col->backpressure && pending > exporter->tcp_backlog_size / 4 * 3) {
+		col->backpressure = 1;
+		msg(MSG_INFO, "TCP collector %s:%d falls behind, %u bytes waiting",
+			col->ipv4address, col->port_number, pending);
+	} else if (col->backpressure && pending < exporter->tcp_backlog_size / 4) {
+		col->backpressure = 0;
+		msg(MSG_INFO, "TCP collector %s:%d caught up, %llu messages dropped so far",
+			col->ipv4address, col->port_number,
+			(unsigned long long) col->backlog_dropped);
+	}
+}
+
+/*
+ * Grows the backlog of a TCP collector to hold at least needed bytes.
+ * Returns -1 if the memory could not be allocated.
+ * This is an internal function.
+ */
+static int tcp_grow_backlog(ipfix_receiving_collector *col, unsigned needed) {
+	unsigned capacity = col->backlog_capacity ? col->backlog_capacity : IPFIX_MAX_PACKETSIZE;
+	uint8_t *backlog;
+
+	if (needed <= col->backlog_capacity)
+		return 0;
+	while (capacity < needed)
+		capacity *= 2;
+	if (!(backlog = (uint8_t *) realloc(col->backlog, capacity)))
+		return -1;
+	col->backlog = backlog;
+	col->backlog_capacity = capacity;
+	return 0;
+}
+
+/*
+ * Appends a message to the backlog of a TCP collector, except for the first
+ * skip bytes which the socket accepted already.
+ * Returns -1 if the backlog could not be grown.
+ * This is an internal function.
+ */
+static int tcp_append_backlog(ipfix_receiving_collector *col, struct iovec *iov, int iovcnt, unsigned skip) {
+	unsigned length = 0;
+	int j;
+
+	for (j = 0; j < iovcnt; j++)
+		length += iov[j].iov_len;
+	length -= skip;
+
+	if (col->backlog_length + length > col->backlog_capacity && col->backlog_start > 0) {
+		memmove(col->backlog, col->backlog + col->backlog_start,
+			col->backlog_length - col->backlog_start);
+		col->backlog_length -= col->backlog_start;
+		col->backlog_start = 0;
+	}
+	if (tcp_grow_backlog(col, col->backlog_length + length))
+		return -1;
+
+	for (j = 0; j < iovcnt; j++) {
+		if (skip >= iov[j].iov_len) {
+			skip -= iov[j].iov_len;
+			continue;
+		}
+		memcpy(col->backlog + col->backlog_length,
+		       (uint8_t *) iov[j].iov_base + skip, iov[j].iov_len - skip);
+		col->backlog_length += iov[j].iov_len - skip;
+		skip = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Puts a message in front of the backlog of a TCP collector.
+ * Returns -1 if the backlog could not be grown.
+ * This is an internal function.
+ */
+static int tcp_prepend_backlog(ipfix_receiving_collector *col, struct iovec *iov, int iovcnt) {
+	unsigned pending = col->backlog_length - col->backlog_start;
+	unsigned length = 0;
+	unsigned offset;
+	int j;
+
+	for (j = 0; j < iovcnt; j++)
+		length += iov[j].iov_len;
+
+	if (col->backlog_start < length) {
+		if (tcp_grow_backlog(col, length + pending))
+			return -1;
+		memmove(col->backlog + length, col->backlog + col->backlog_start, pending);
+		col->backlog_start = length;
+		col->backlog_length = length + pending;
+	}
+	col->backlog_start -= length;
+
+	offset = col->backlog_start;
+	for (j = 0; j < iovcnt; j++) {
+		memcpy(col->backlog + offset, iov[j].iov_base, iov[j].iov_len);
+		offset += iov[j].iov_len;
+	}
+	return 0;
+}
+
+/*
+ * Sends a message to a TCP collector without blocking. Whatever the socket
+ * does not accept is kept in the backlog and sent by tcp_drain().
+ * Unreliable messages are dropped if the backlog exceeds its limit.
+ * Messages for a collector which is not connected are only kept in the
+ * backlog.
+ * Returns 0 if the message was sent or is kept in the backlog, -1 if it was
+ * dropped.
+ * This is an internal function.
+ */
+static int tcp_send(ipfix_exporter *exporter, ipfix_receiving_collector *col,
+		    struct iovec *iov, int iovcnt, int reliable) {
+	unsigned length = 0;
+	unsigned sent = 0;
+	int j;
+
+	for (j = 0; j < iovcnt; j++)
+		length += iov[j].iov_len;
+
+	if (!reliable && col->backlog_length - col->backlog_start + length > exporter->tcp_backlog_size) {
+		col->backlog_dropped++;
+		msg(MSG_DEBUG, "Backlog of TCP collector %s:%d is full, dropping message",
+			col->ipv4address, col->port_number);
+		return -1;
+	}
+
+	// never overtake the backlog
+	if (col->state == C_CONNECTED && col->backlog_length == col->backlog_start) {
+		struct msghdr m;
+		ssize_t ret;
+
+		memset(&m, 0, sizeof(m));
+		m.msg_iov = iov;
+		m.msg_iovlen = iovcnt;
+		if ((ret = sendmsg(col->data_socket, &m, MSG_NOSIGNAL)) == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				msg(MSG_ERROR, "could not send to %s:%d errno: %s  (TCP)",
+					col->ipv4address, col->port_number, strerror(errno));
+				tcp_fail(exporter, col);
+				return -1;
+			}
+			ret = 0;
+		}
+		sent = ret;
+		if (sent == length)
+			return 0;
+	}
+
+	if (tcp_append_backlog(col, iov, iovcnt, sent)) {
+		// the stream is broken if part of the message has been sent
+		msg(MSG_ERROR, "Failed to grow backlog of TCP collector %s:%d",
+			col->ipv4address, col->port_number);
+		if (col->state == C_CONNECTED)
+			tcp_fail(exporter, col);
+		return -1;
+	}
+	if (col->state == C_CONNECTED)
+		watch_socket(exporter, col->data_socket, &col->watched_events, IPFIX_SOCKET_READ | IPFIX_SOCKET_WRITE);
+	tcp_update_backpressure(exporter, col);
+
+	return 0;
+}
+
+/*
+ * Sends as much of the backlog of a TCP collector as the socket accepts.
+ * This is an internal function.
+ */
+static void tcp_drain(ipfix_exporter *exporter, ipfix_receiving_collector *col) {
+	while (col->backlog_start < col->backlog_length) {
+		ssize_t ret = send(col->data_socket, col->backlog + col->backlog_start,
+				   col->backlog_length - col->backlog_start, MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			msg(MSG_ERROR, "could not send to %s:%d errno: %s  (TCP)",
+				col->ipv4address, col->port_number, strerror(errno));
+			tcp_fail(exporter, col);
+			return;
+		}
+		col->backlog_start += ret;
+	}
+
+	if (col->backlog_start == col->backlog_length) {
+		col->backlog_start = col->backlog_length = 0;
+		watch_socket(exporter, col->data_socket, &col->watched_events, IPFIX_SOCKET_READ);
+	}
+	tcp_update_backpressure(exporter, col);
+}
+
+/*
+ * Discards anything a TCP collector sends and detects when it closes the
+ * connection.
+ * This is an internal function.
+ */
+static void tcp_read(ipfix_exporter *exporter, ipfix_receiving_collector *col) {
+	char buf[256];
+	ssize_t ret;
+
+	while ((ret = recv(col->data_socket, buf, sizeof(buf), 0)) > 0)
+		;
+
+	if (ret == 0) {
+		msg(MSG_ERROR, "TCP collector %s:%d closed the connection",
+			col->ipv4address, col->port_number);
+		tcp_fail(exporter, col);
+	} else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		msg(MSG_ERROR, "Connection to TCP collector %s:%d failed, %s",
+			col->ipv4address, col->port_number, strerror(errno));
+		tcp_fail(exporter, col);
+	}
+}
+
 /*
  * Initialize an exporter process
  * Allocates all memory necessary.
@@ -910,6 +1408,8 @@ int ipfix_init_exporter(uint32_t observation_domain_id, ipfix_exporter **exporte
         tmp->observation_domain_id=observation_domain_id;
 
 	tmp->max_message_size = IPFIX_MTU_CONSERVATIVE_DEFAULT;
+	tmp->copy_data_fields = 1;
+	tmp->send_queue = NULL;
 
         tmp->collector_max_num = 0;
 #ifdef SUPPORT_DTLS
@@ -920,23 +1420,34 @@ int ipfix_init_exporter(uint32_t observation_domain_id, ipfix_exporter **exporte
 	tmp->ca_path = NULL;
 #endif
 #ifdef SUPPORT_COMPRESSION
-	tmp->compression_handle = NULL;
-	tmp->compression_function = NULL;
+	memset(tmp->compressors, 0, sizeof(tmp->compressors));
+	tmp->compressor_count = 0;
+	tmp->compressor_current = 0;
+	tmp->compression_streaming = 0;
+	tmp->compression_dictionary = NULL;
+	tmp->compression_dictionary_length = 0;
+	tmp->compression_adaptive = 0;
+	tmp->compression_min_size = 0;
+	tmp->compression_cpu_budget = 0;
+	tmp->compression_ns = 0;
+	tmp->compression_calm_windows = 0;
+	tmp->compression_step_up_windows = IPFIX_COMPRESSION_STEP_UP_WINDOWS;
+	tmp->compression_stepped_up = 0;
 #endif
         // initialize the sendbuffers
-        ret=ipfix_init_sendbuffer(&(tmp->data_sendbuffer));
+        ret=ipfix_init_sendbuffer(&(tmp->data_sendbuffer), IPFIX_MAX_PACKETSIZE - sizeof(ipfix_header));
         if (ret != 0) {
                 msg(MSG_FATAL, "initializing data sendbuffer failed");
                 goto out1;
         }
 
-        ret=ipfix_init_sendbuffer(&(tmp->template_sendbuffer));
+        ret=ipfix_init_sendbuffer(&(tmp->template_sendbuffer), 0);
         if (ret != 0) {
                 msg(MSG_FATAL, "initializing template sendbuffer failed");
                 goto out2;
         }
 	
-	ret=ipfix_init_sendbuffer(&(tmp->sctp_template_sendbuffer));
+	ret=ipfix_init_sendbuffer(&(tmp->sctp_template_sendbuffer), 0);
         if (ret != 0) {
                 msg(MSG_FATAL, "initializing sctp template sendbuffer failed");
                 goto out5;
@@ -961,6 +1472,13 @@ int ipfix_init_exporter(uint32_t observation_domain_id, ipfix_exporter **exporte
         tmp->template_transmission_timer=IPFIX_DEFAULT_TEMPLATE_TIMER;
 	tmp->sctp_reconnect_timer=IPFIX_DEFAULT_SCTP_RECONNECT_TIMER;
 	tmp->sctp_lifetime=IPFIX_DEFAULT_SCTP_DATA_LIFETIME;
+	tmp->tcp_backlog_size=IPFIX_DEFAULT_TCP_BACKLOG_SIZE;
+	tmp->unconnected_policy=IPFIX_UNCONNECTED_DROP;
+	tmp->spill_directory=NULL;
+	tmp->spill_size=0;
+	tmp->spill_rate=0;
+	tmp->socket_watcher=NULL;
+	tmp->socket_watcher_param=NULL;
 	
         /* finally attach new exporter to the pointer we were given */
         *exporter=tmp;
@@ -996,8 +1514,8 @@ out:
 int ipfix_deinit_exporter(ipfix_exporter *exporter) {
         // cleanup processes
         int ret;
-        // close sockets etc.
-        // (currently, nothing to do)
+        // send queued messages before the collectors are removed
+        ipfix_set_deferred_flush(exporter, 0, 0);
 
         // free all children
 
@@ -1016,10 +1534,15 @@ int ipfix_deinit_exporter(ipfix_exporter *exporter) {
         int i=0;
 	for(i=0;i<exporter->collector_max_num;i++) {
 	    if (exporter->collector_arr[i].state != C_UNUSED)
-		remove_collector(&exporter->collector_arr[i]);
+		remove_collector(exporter, &exporter->collector_arr[i]);
         }
         // deinitialize the collectors
         ret=ipfix_deinit_collector_array(&(exporter->collector_arr));
+	free(exporter->spill_directory);
+#ifdef SUPPORT_COMPRESSION
+	ipfix_release_compression(exporter);
+	free(exporter->compression_dictionary);
+#endif
 
 #ifdef SUPPORT_DTLS
 	deinit_openssl_ctx(exporter);
@@ -1036,49 +1559,69 @@ int ipfix_deinit_exporter(ipfix_exporter *exporter) {
         return 0;
 }
 
+/*
+ * Returns the maximum size of IPFIX messages sent to a collector.
+ * This is an internal function.
+ */
+static uint16_t collector_max_message_size(ipfix_receiving_collector *col) {
+    uint16_t maxsize;
+    switch (col->protocol) {
+	case UDP:
+	    /* IP header: 20 bytes
+	     * UDP header: 8 bytes */
+	    maxsize = col->mtu - (20 + 8);
+	    break;
+#ifdef SUPPORT_DTLS
+	case DTLS_OVER_UDP:
+	    /* DTLS record header:
+	     *   ContentType: 1 byte
+	     *   ProtocolVersion: 2 bytes
+	     *   epoch: 2 bytes
+	     *   seqno: 6 bytes
+	     *   length: 2 bytes
+	     *   (assuming GenericBlockCipher, AES_256_CBC and SHA256)
+	     *   IV: 16 bytes
+	     *   MAC: 32 bytes
+	     *   padding: 15 bytes (worst case)
+	     *   padding_length: 1 byte */
+	    maxsize = col->mtu - 77 - (20 + 8);
+	    /* TODO: Find out maximum size of payload */
+	    if (maxsize > IPFIX_DTLS_MAX_RECORD_LENGTH)
+		maxsize = IPFIX_DTLS_MAX_RECORD_LENGTH;
+	    break;
+#endif
+#ifdef SUPPORT_DTLS_OVER_SCTP
+	case DTLS_OVER_SCTP:
+	    return IPFIX_DTLS_MAX_RECORD_LENGTH;
+#endif
+	default:
+	    /* SCTP, TCP and files */
+	    return IPFIX_MAX_MESSAGE_SIZE;
+    }
+    /* Datagrams never exceed the conservative default, even if the
+     * (discovered) MTU allows it. */
+    if (maxsize > IPFIX_MTU_CONSERVATIVE_DEFAULT)
+	maxsize = IPFIX_MTU_CONSERVATIVE_DEFAULT;
+    return maxsize;
+}
+
+/* Updates the maximum message size of all collectors and sets the
+ * maximum size of the messages built by the exporter to the smallest
+ * of them. */
 static void update_exporter_max_message_size(ipfix_exporter *exporter) {
     ipfix_receiving_collector *col;
     int i;
-    uint16_t max_message_size;
-    max_message_size = exporter->max_message_size;
+    uint16_t max_message_size = 0;
     for(i=0;i<exporter->collector_max_num;i++) {
 	col = &exporter->collector_arr[i];
-	if(col->state != C_UNUSED &&
-		(col->protocol == UDP || col->protocol == DTLS_OVER_UDP)) {
-	    uint16_t maxsize = 0;
-	    switch (col->protocol) {
-		case UDP:
-		    /* IP header: 20 bytes
-		     * UDP header: 8 bytes */
-		    maxsize = col->mtu - (20 + 8);
-		    break;
-#ifdef SUPPORT_DTLS
-		case DTLS_OVER_UDP:
-		    /* DTLS record header:
-		     *   ContentType: 1 byte
-		     *   ProtocolVersion: 2 bytes
-		     *   epoch: 2 bytes
-		     *   seqno: 6 bytes
-		     *   length: 2 bytes
-		     *   (assuming GenericBlockCipher, AES_256_CBC and SHA256)
-		     *   IV: 16 bytes
-		     *   MAC: 32 bytes
-		     *   padding: 15 bytes (worst case)
-		     *   padding_length: 1 byte */
-		    maxsize = col->mtu - 77 - (20 + 8);
-		    /* TODO: Find out maximum size of payload */
-		    if (maxsize > IPFIX_DTLS_MAX_RECORD_LENGTH)
-			maxsize = IPFIX_DTLS_MAX_RECORD_LENGTH;
-		    break;
-#endif
-		default:
-		    break;
-	    }
-	    if (max_message_size > maxsize)
-		max_message_size = maxsize;
-
+	if(col->state != C_UNUSED) {
+	    col->max_message_size = collector_max_message_size(col);
+	    if (max_message_size == 0 || max_message_size > col->max_message_size)
+		max_message_size = col->max_message_size;
 	}
     }
+    if (max_message_size == 0)
+	max_message_size = IPFIX_MTU_CONSERVATIVE_DEFAULT;
     exporter->max_message_size = max_message_size;
     DPRINTF("New exporter max_message_size: %u",max_message_size);
 }
@@ -1093,10 +1636,12 @@ static int update_collector_mtu(ipfix_exporter *exporter,
 	int mtu = get_mtu(col->data_socket);
 	DPRINTF("get_mtu() returned %d",mtu);
 	if (mtu<0) {
-	    remove_collector(col);
+	    remove_collector(exporter, col);
+	    update_exporter_max_message_size(exporter);
 	    return -1;
 	}
-	col->mtu = mtu;
+	/* The MTU of the loopback interface exceeds 16 bits */
+	col->mtu = mtu > IPFIX_MTU_MAX ? IPFIX_MTU_MAX : mtu;
 	update_exporter_max_message_size(exporter);
 #ifdef SUPPORT_DTLS
     } else if (col->protocol == DTLS_OVER_UDP && col->mtu_mode == IPFIX_MTU_DISCOVER) {
@@ -1123,7 +1668,8 @@ static int update_collector_mtu(ipfix_exporter *exporter,
 	    update_exporter_max_message_size(exporter);
 	} else {
 	    DPRINTF("Unable to get MTU from SSL object.");
-	    remove_collector(col);
+	    remove_collector(exporter, col);
+	    update_exporter_max_message_size(exporter);
 	    return -1;
 	}
 #endif
@@ -1240,8 +1786,22 @@ static int add_collector_dtls(
 }
 #endif
 
+/* TCP collectors are kept if the connection cannot be set up right
+   away. The setup is retried with exponential backoff instead.
+ */
+static int add_collector_tcp(
+	ipfix_exporter *exporter,
+	ipfix_receiving_collector *col) {
+    col->backlog_dropped = 0;
+    col->reconnect_delay = 0;
+    col->watched_events = 0;
+    tcp_connect(exporter, col);
+    update_exporter_max_message_size(exporter);
+    return 0;
+}
+
 /* Remaining protocols are
-   SCTP, UDP and TCP at the moment
+   SCTP and UDP at the moment
  */
 static int add_collector_remaining_protocols(
 	ipfix_exporter *exporter,
@@ -1265,9 +1825,12 @@ static int add_collector_remaining_protocols(
     if (col->protocol == UDP)
 	col->state = C_CONNECTED; /* UDP sockets are connected from the very
 				   beginning. */
-    else
+    else {
 	col->state = C_NEW; /* By setting the state to C_NEW we are
 			     basically allocation the slot. */
+	/* The SCTP_COMM_UP notification makes the socket readable */
+	watch_socket(exporter, col->data_socket, &col->watched_events, IPFIX_SOCKET_READ);
+    }
 
     /* col->state must *not* be C_UNUSED when we call
        update_collector_mtu(). That's why we call this function
@@ -1320,8 +1883,6 @@ static int valid_transport_protocol(enum ipfix_transport_protocol p) {
 #endif 
 
 	case TCP:
-	    msg(MSG_FATAL, "Transport Protocol TCP not implemented");
-	    return 0;
 	case UDP:
 	case DATAFILE:
 	    return 1;
@@ -1354,6 +1915,7 @@ static int valid_transport_protocol(enum ipfix_transport_protocol p) {
  * <table><tr><td><em>transport protocol</em></td><td><em>type of *aux_config</em></td></tr>
  * <tr><td>RAWDIR</td><td>NULL</td></tr>
  * <tr><td>SCTP</td><td>NULL</td></tr>
+ * <tr><td>TCP</td><td>NULL</td></tr>
  * <tr><td>UDP</td><td>ipfix_aux_config_udp</td></tr>
  * <tr><td>DTLS_OVER_UDP</td><td>ipfix_aux_config_dtls_over_udp</td></tr>
  * <tr><td>DTLS_OVER_SCTP</td><td>ipfix_aux_config_dtls_over_sctp</td></tr>
@@ -1362,7 +1924,7 @@ static int valid_transport_protocol(enum ipfix_transport_protocol p) {
  * \param exporter pointer to previously initialized exporter struct
  * \param coll_ip4_addr IP address of receiving Collector in dotted notation (e.g. "1.2.3.4")
  * \param coll_port port number of receiving Collector
- * \param proto transport protocol to use, either RAWDIR, SCTP, UDP,
+ * \param proto transport protocol to use, either RAWDIR, SCTP, TCP, UDP,
  * DTLS_OVER_UDP or DTLS_OVER_SCTP. See <tt>\ref ipfix_transport_protocol</tt> for
  * more details.
  * \param aux_config auxiliary configuration data. The type of the data structure depends on the
@@ -1374,6 +1936,7 @@ static int valid_transport_protocol(enum ipfix_transport_protocol p) {
 int ipfix_add_collector(ipfix_exporter *exporter, const char *coll_ip4_addr,
 	int coll_port, enum ipfix_transport_protocol proto, void *aux_config)
 {
+    int ret;
     // check, if exporter is valid
     if(exporter == NULL) {
 	msg(MSG_FATAL, "add_collector, exporter is NULL");
@@ -1381,6 +1944,10 @@ int ipfix_add_collector(ipfix_exporter *exporter, const char *coll_ip4_addr,
     }
     if ( ! valid_transport_protocol(proto)) return -1;
 
+    // the queued messages are numbered for the UDP collectors known so far
+    if (proto == UDP && exporter->send_queue)
+	ipfix_flush_queue(exporter);
+
     // get free slot
     ipfix_receiving_collector *collector = get_free_collector_slot(exporter);
     if( ! collector) {
@@ -1389,11 +1956,25 @@ int ipfix_add_collector(ipfix_exporter *exporter, const char *coll_ip4_addr,
 	   );
 	return -1;
     }
+    collector->protocol = proto;
+    collector->sequence_number = 0;
+    collector->message_length = 0;
+    collector->message_records = 0;
 #ifdef IPFIXLOLIB_RAWDIR_SUPPORT
     /* It is the duty of add_collector_rawdir to set collector->state */
-    if (proto==RAWDIR) return add_collector_rawdir(collector,coll_ip4_addr);
+    if (proto==RAWDIR) {
+	if (add_collector_rawdir(collector,coll_ip4_addr))
+	    return -1;
+	update_exporter_max_message_size(exporter);
+	return 0;
+    }
 #endif
-    if (proto==DATAFILE) return add_collector_datafile(collector, coll_ip4_addr, coll_port);
+    if (proto==DATAFILE) {
+	if (add_collector_datafile(collector, coll_ip4_addr, coll_port))
+	    return -1;
+	update_exporter_max_message_size(exporter);
+	return 0;
+    }
     /*
     FIXME: only a quick fix to make that work
     Must be copied, else pointered data must be around forever
@@ -1405,7 +1986,6 @@ int ipfix_add_collector(ipfix_exporter *exporter, const char *coll_ip4_addr,
      * (third parameter) */
     collector->ipv4address[sizeof(collector->ipv4address)-1] = '\0';
     collector->port_number = coll_port;
-    collector->protocol = proto;
 
     memset(&(collector->addr), 0, sizeof(collector->addr));
     collector->addr.sin_family = AF_INET;
@@ -1415,18 +1995,36 @@ int ipfix_add_collector(ipfix_exporter *exporter, const char *coll_ip4_addr,
 #ifdef SUPPORT_DTLS
     /* It is the duty of add_collector_dtls to set collector->state */
     if (proto == DTLS_OVER_UDP || proto == DTLS_OVER_SCTP)
-	return add_collector_dtls(exporter, collector, aux_config);
+	ret = add_collector_dtls(exporter, collector, aux_config);
+    else
 #endif
-    return add_collector_remaining_protocols(exporter, collector, aux_config);
+    if (proto == TCP)
+	ret = add_collector_tcp(exporter, collector);
+    else
+	ret = add_collector_remaining_protocols(exporter, collector, aux_config);
+
+    /* UDP collectors are never known to be unreachable */
+    if (ret == 0 && proto != UDP && exporter->spill_directory
+	&& !(collector->spill = ipfix_open_spill_queue(exporter, collector)))
+	msg(MSG_ERROR, "Failed to create spill queue for collector %s:%d, "
+	    "messages are dropped while it is unreachable", coll_ip4_addr, coll_port);
+    return ret;
 }
 
-static void remove_collector(ipfix_receiving_collector *collector) {
+static void remove_collector(ipfix_exporter *exporter, ipfix_receiving_collector *collector) {
     DPRINTF("Removing collector.");
+    if (collector->protocol == TCP) {
+	free(collector->backlog);
+	collector->backlog = NULL;
+	collector->backlog_capacity = 0;
+	collector->backlog_start = collector->backlog_length = 0;
+	collector->backpressure = 0;
+    }
 #ifdef SUPPORT_DTLS
     /* Shutdown DTLS connection */
     if (collector->protocol == DTLS_OVER_UDP || collector->protocol == DTLS_OVER_SCTP) {
-	dtls_shutdown_and_cleanup(&collector->dtls_main);
-	dtls_shutdown_and_cleanup(&collector->dtls_replacement);
+	dtls_shutdown_and_cleanup(exporter, &collector->dtls_main);
+	dtls_shutdown_and_cleanup(exporter, &collector->dtls_replacement);
 	free( (void *) collector->peer_fqdn);
     }
     collector->peer_fqdn = NULL;
@@ -1435,6 +2033,7 @@ static void remove_collector(ipfix_receiving_collector *collector) {
     if (collector->protocol != RAWDIR) {
 #endif
     if ( collector->data_socket != -1) {
+	watch_socket(exporter, collector->data_socket, &collector->watched_events, 0);
 	DPRINTF("Closing data socket");
 	close ( collector->data_socket );
     }
@@ -1448,6 +2047,13 @@ static void remove_collector(ipfix_receiving_collector *collector) {
     if (collector->protocol == DATAFILE) {
 	free(collector->basename);
     }
+    free(collector->message);
+    collector->message = NULL;
+    collector->message_length = 0;
+    if (collector->spill) {
+	ipfix_close_spill_queue(collector->spill);
+	collector->spill = NULL;
+    }
     collector->state = C_UNUSED;
 }
 
@@ -1472,7 +2078,8 @@ int ipfix_remove_collector(ipfix_exporter *exporter, const char *coll_ip4_addr,
 	ipfix_receiving_collector *collector = &exporter->collector_arr[i];
 	if( ( strcmp( collector->ipv4address, coll_ip4_addr) == 0 )
 		&& collector->port_number == coll_port) {
-	    remove_collector(collector);
+	    remove_collector(exporter, collector);
+	    update_exporter_max_message_size(exporter);
 	    return 0;
 	}
     }
@@ -1593,17 +2200,15 @@ int ipfix_remove_template(ipfix_exporter *exporter, uint16_t template_id) {
  * needs to be updated. No new header is prepended.
  *
  * The ipfix message header is set according to:
- * - the exporter ( Source ID and sequence number)
+ * - the exporter (Source ID) and the given sequence number
  * - the length of the contained data
  * - the current system time
  * - the ipfix version number
  *
  * Note: the first HEADER_USED_IOVEC_COUNT  iovec struct are reserved for the header! These will be overwritten!
  */
-static void ipfix_prepend_header(ipfix_exporter *p_exporter, int data_length, ipfix_sendbuffer *sendbuf)
+static void ipfix_prepend_header(ipfix_exporter *p_exporter, int data_length, ipfix_sendbuffer *sendbuf, uint32_t sequence_number)
 {
-
-        time_t export_time;
         uint16_t total_length = 0;
 
         // did the user set the data_length field?
@@ -1623,13 +2228,25 @@ static void ipfix_prepend_header(ipfix_exporter *p_exporter, int data_length, ip
                 total_length += sizeof(ipfix_header);
         }
 
+        ipfix_write_header(p_exporter, &sendbuf->packet_header, total_length, sequence_number);
+}
+
+/*
+ * Fills in an ipfix message header: version number, length, export time,
+ * sequence number and the Observation Domain ID of the exporter.
+ * This is an internal function.
+ */
+static void ipfix_write_header(ipfix_exporter *p_exporter, ipfix_header *header, uint16_t total_length, uint32_t sequence_number)
+{
+        time_t export_time;
+
         // write the length into the header
-        (sendbuf->packet_header).length = htons(total_length);
+        header->length = htons(total_length);
 
         // write version number and source ID and sequence number
-        (sendbuf->packet_header).version = htons(IPFIX_VERSION_NUMBER);
-        (sendbuf->packet_header).observation_domain_id = htonl(p_exporter->observation_domain_id);
-        (sendbuf->packet_header).sequence_number = htonl(p_exporter->sequence_number);
+        header->version = htons(IPFIX_VERSION_NUMBER);
+        header->observation_domain_id = htonl(p_exporter->observation_domain_id);
+        header->sequence_number = htonl(sequence_number);
 
         // get the export time:
         export_time = time(NULL);
@@ -1639,7 +2256,7 @@ static void ipfix_prepend_header(ipfix_exporter *p_exporter, int data_length, ip
                 msg(MSG_ERROR,"prepend_header, time() failed, using %d", export_time);
         }
         //  global_last_export_time = (uint32_t) export_time;
-        (sendbuf->packet_header).export_time = htonl((uint32_t)export_time);
+        header->export_time = htonl((uint32_t)export_time);
 }
 
 
@@ -1686,8 +2303,10 @@ out:
 /*
  * Create and initialize an ipfix_sendbuffer for at most maxelements
  * Parameters: ipfix_sendbuffer** sendbuf pointer to a pointer to an ipfix-sendbuffer
+ * data_capacity: size of the contiguous buffer for data fields, 0 if the
+ * sendbuffer does not hold data sets
  */
-static int ipfix_init_sendbuffer(ipfix_sendbuffer **sendbuf)
+static int ipfix_init_sendbuffer(ipfix_sendbuffer **sendbuf, unsigned data_capacity)
 {
         ipfix_sendbuffer *tmp;
 
@@ -1696,6 +2315,16 @@ static int ipfix_init_sendbuffer(ipfix_sendbuffer **sendbuf)
                 goto out;
         }
 
+        tmp->data = NULL;
+        tmp->data_capacity = 0;
+        tmp->data_used = 0;
+        if (data_capacity > 0) {
+                if (!(tmp->data = (uint8_t *) malloc(data_capacity))) {
+                        goto out1;
+                }
+                tmp->data_capacity = data_capacity;
+        }
+
         tmp->current = HEADER_USED_IOVEC_COUNT; // leave the 0th field blank for the header
         tmp->committed = HEADER_USED_IOVEC_COUNT;
         tmp->marker = HEADER_USED_IOVEC_COUNT;
@@ -1714,7 +2343,7 @@ static int ipfix_init_sendbuffer(ipfix_sendbuffer **sendbuf)
         *sendbuf=tmp;
         return 0;
 
-//out1:
+out1:
         free(tmp);
 out:
         return -1;
@@ -1732,6 +2361,7 @@ static int ipfix_reset_sendbuffer(ipfix_sendbuffer *sendbuf)
         sendbuf->committed = HEADER_USED_IOVEC_COUNT;
         sendbuf->marker = HEADER_USED_IOVEC_COUNT;
         sendbuf->committed_data_length = 0;
+        sendbuf->data_used = 0;
 
 		sendbuf->entries[0].iov_len = sizeof(ipfix_header);
 		sendbuf->entries[0].iov_base = &(sendbuf->packet_header);
@@ -1751,7 +2381,11 @@ static int ipfix_reset_sendbuffer(ipfix_sendbuffer *sendbuf)
  */
 static int ipfix_deinit_sendbuffer(ipfix_sendbuffer **sendbuf)
 {
+        if (*sendbuf == NULL)
+                return 0;
+
         // free the sendbuffer itself:
+        free((*sendbuf)->data);
         free(*sendbuf);
         *sendbuf = NULL;
 
@@ -1784,6 +2418,20 @@ static int ipfix_init_collector_array(ipfix_receiving_collector **col, int col_c
 		c->protocol = 0;
 		c->data_socket = -1;
 		c->last_reconnect_attempt_time = 0;
+		c->max_message_size = IPFIX_MTU_CONSERVATIVE_DEFAULT;
+		c->sequence_number = 0;
+		c->message = NULL;
+		c->message_length = 0;
+		c->message_records = 0;
+		c->backlog = NULL;
+		c->backlog_start = 0;
+		c->backlog_length = 0;
+		c->backlog_capacity = 0;
+		c->backpressure = 0;
+		c->backlog_dropped = 0;
+		c->reconnect_delay = 0;
+		c->watched_events = 0;
+		c->spill = NULL;
 #ifdef IPFIXLOLIB_RAWDIR_SUPPORT
 		c->packet_directory_path = NULL;
 		c->packets_written = 0;
@@ -1793,6 +2441,7 @@ static int ipfix_init_collector_array(ipfix_receiving_collector **col, int col_c
 		c->dtls_main.ssl = c->dtls_replacement.ssl = NULL;
 		c->dtls_main.last_reconnect_attempt_time =
 		    c->dtls_replacement.last_reconnect_attempt_time = 0;
+		c->dtls_main.watched_events = c->dtls_replacement.watched_events = 0;
 		c->peer_fqdn = NULL;
 #endif
 
@@ -1998,16 +2647,36 @@ static int ipfix_update_template_sendbuffer (ipfix_exporter *exporter)
 }
 
 #ifdef SUPPORT_SCTP
+/*
+ * Closes the association with an SCTP collector after an error.
+ * i: index of the collector in the exporters collector_arr
+ */
+static void sctp_fail(ipfix_exporter *exporter, int i) {
+	ipfix_receiving_collector *col = &exporter->collector_arr[i];
+
+	if (col->data_socket >= 0) {
+		watch_socket(exporter, col->data_socket, &col->watched_events, 0);
+		close(col->data_socket);
+	}
+	col->data_socket = -1;
+	col->state = C_DISCONNECTED;
+#ifdef SUPPORT_COMPRESSION
+	// messages in flight are lost with the association
+	ipfix_restart_compression(exporter);
+#endif
+}
+
 /*
  * function used by SCTP to reconnect to a collector, if connection
  * was lost. After successful reconnection resend all active templates.
+ * Never blocks: if the association is not yet set up, the collector stays
+ * in C_NEW and this function is called again once the socket is readable.
  * i: index of the collector in the exporters collector_arr
  */
 static int sctp_reconnect(ipfix_exporter *exporter , int i){
 	int bytes_sent, ret, error;
 	socklen_t len;
-	fd_set readfds;
-	struct timeval timeout;
+	struct pollfd pfd;
 	time_t time_now = time(NULL);
 	struct sctp_status ss;
 	union sctp_notification snp;
@@ -2020,8 +2689,7 @@ static int sctp_reconnect(ipfix_exporter *exporter , int i){
 	// error occurred while being connected?
 	if(exporter->collector_arr[i].state == C_CONNECTED) {
 		// the socket has not yet been closed
-		close(exporter->collector_arr[i].data_socket);
-		exporter->collector_arr[i].data_socket = -1;
+		sctp_fail(exporter, i);
 	}
 	    
 	// create new socket if not yet done
@@ -2033,6 +2701,9 @@ static int sctp_reconnect(ipfix_exporter *exporter , int i){
 		    return -1;
 		}
 		exporter->collector_arr[i].state = C_NEW;
+		// the SCTP_COMM_UP notification makes the socket readable
+		watch_socket(exporter, exporter->collector_arr[i].data_socket,
+			     &exporter->collector_arr[i].watched_events, IPFIX_SOCKET_READ);
 	}
 	/* Determine whether socket is readable.
 
@@ -2042,12 +2713,11 @@ static int sctp_reconnect(ipfix_exporter *exporter , int i){
 	   If the socket is not yet readable, the connection setup is
 	   still ongoing.
 	*/
-	/* We don't want select() to wait but to return immediately.
-	   Set timeout to 0. */
-	timeout.tv_sec = timeout.tv_usec = 0;
-	FD_ZERO(&readfds);
-	FD_SET(exporter->collector_arr[i].data_socket, &readfds);
-	ret = select(exporter->collector_arr[i].data_socket + 1,&readfds,NULL,NULL,&timeout);
+	/* We don't want poll() to wait but to return immediately. */
+	pfd.fd = exporter->collector_arr[i].data_socket;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	ret = poll(&pfd, 1, 0);
 	if (ret == 0) {
 	    // connection attempt not yet finished
 	    msg(MSG_DEBUG, "waiting for socket to become readable...");
@@ -2058,10 +2728,8 @@ static int sctp_reconnect(ipfix_exporter *exporter , int i){
 	    msg(MSG_DEBUG, "socket is readable.");
 	} else {
 	    // error
-	    msg(MSG_ERROR, "select() failed: %s", strerror(errno));
-	    close(exporter->collector_arr[i].data_socket);
-	    exporter->collector_arr[i].data_socket = -1;
-	    exporter->collector_arr[i].state = C_DISCONNECTED;
+	    msg(MSG_ERROR, "poll() failed: %s", strerror(errno));
+	    sctp_fail(exporter, i);
 	    return -1;
 	}
 
@@ -2071,17 +2739,13 @@ static int sctp_reconnect(ipfix_exporter *exporter , int i){
 		    SO_ERROR, &error, &len) != 0) {
 	    msg(MSG_ERROR, "getsockopt(fd,SOL_SOCKET,SO_ERROR,...) failed: %s",
 		    strerror(errno));
-	    close(exporter->collector_arr[i].data_socket);
-	    exporter->collector_arr[i].data_socket = -1;
-	    exporter->collector_arr[i].state = C_DISCONNECTED;
+	    sctp_fail(exporter, i);
 	    return -1;
 	}
 	if (error) {
 	    msg(MSG_ERROR, "SCTP connection setup failed: %s",
 		    strerror(error));
-	    close(exporter->collector_arr[i].data_socket);
-	    exporter->collector_arr[i].data_socket = -1;
-	    exporter->collector_arr[i].state = C_DISCONNECTED;
+	    sctp_fail(exporter, i);
 	    return -1;
 	}
 
@@ -2096,36 +2760,28 @@ static int sctp_reconnect(ipfix_exporter *exporter , int i){
 	msg.msg_iovlen = 1;
 	if ((r = recvmsg(exporter->collector_arr[i].data_socket, &msg, 0))<0) {
 	    msg(MSG_ERROR, "SCTP connection setup failed. recvmsg returned: %s",
-		    strerror(error));
-	    close(exporter->collector_arr[i].data_socket);
-	    exporter->collector_arr[i].data_socket = -1;
-	    exporter->collector_arr[i].state = C_DISCONNECTED;
+		    strerror(errno));
+	    sctp_fail(exporter, i);
 	    return -1;
 	}
 	if (r==0) {
 	    msg(MSG_ERROR, "SCTP connection setup failed. recvmsg returned 0");
-	    close(exporter->collector_arr[i].data_socket);
-	    exporter->collector_arr[i].data_socket = -1;
-	    exporter->collector_arr[i].state = C_DISCONNECTED;
+	    sctp_fail(exporter, i);
 	    return -1;
 	}
 	if (!(msg.msg_flags & MSG_NOTIFICATION)) {
 	    msg(MSG_ERROR, "SCTP connection setup failed. recvmsg unexpected user data.");
-	    close(exporter->collector_arr[i].data_socket);
-	    exporter->collector_arr[i].data_socket = -1;
-	    exporter->collector_arr[i].state = C_DISCONNECTED;
+	    sctp_fail(exporter, i);
 	    return -1;
 	}
 	switch (snp.sn_header.sn_type) {
 	    case SCTP_ASSOC_CHANGE:
 		sac = &snp.sn_assoc_change;
-		if (!sac->sac_state==SCTP_COMM_UP) {
+		if (sac->sac_state != SCTP_COMM_UP) {
 		    msg(MSG_ERROR, "SCTP connection setup failed. "
 			    "Received unexpected SCTP_ASSOC_CHANGE notification with state %d",
 			    sac->sac_state);
-		    close(exporter->collector_arr[i].data_socket);
-		    exporter->collector_arr[i].data_socket = -1;
-		    exporter->collector_arr[i].state = C_DISCONNECTED;
+		    sctp_fail(exporter, i);
 		    return -1;
 		}
 		msg(MSG_DEBUG,"Received SCTP_COMM_UP event.");
@@ -2134,9 +2790,7 @@ static int sctp_reconnect(ipfix_exporter *exporter , int i){
 		msg(MSG_ERROR, "SCTP connection setup failed. "
 			"Received unexpected notification of type %d",
 			snp.sn_header.sn_type);
-		close(exporter->collector_arr[i].data_socket);
-		exporter->collector_arr[i].data_socket = -1;
-		exporter->collector_arr[i].state = C_DISCONNECTED;
+		sctp_fail(exporter, i);
 		return -1;
 	}
 
@@ -2146,26 +2800,24 @@ static int sctp_reconnect(ipfix_exporter *exporter , int i){
 		    SCTP_STATUS, &ss, &len) != 0) {
 	    msg(MSG_ERROR, "getsockopt(fd,IPPROTO_SCTP,SCTP_STATUS,...) failed: %s",
 		    strerror(errno));
-	    close(exporter->collector_arr[i].data_socket);
-	    exporter->collector_arr[i].data_socket = -1;
-	    exporter->collector_arr[i].state = C_DISCONNECTED;
+	    sctp_fail(exporter, i);
 	    return -1;
 	}
 	/* Make sure SCTP connection is in state ESTABLISHED */
 	if (ss.sstat_state != SCTP_ESTABLISHED) {
 		msg(MSG_ERROR, "SCTP socket not in state ESTABLISHED");
-	    close(exporter->collector_arr[i].data_socket);
-	    exporter->collector_arr[i].data_socket = -1;
-	    exporter->collector_arr[i].state = C_DISCONNECTED;
+	    sctp_fail(exporter, i);
 	    return -1;
 	}
 
 	msg(MSG_INFO, "Successfully (re)connected to SCTP collector.");
 
-	//reconnected -> resend all active templates
+	//reconnected -> new transport session, resend all active templates
+	exporter->collector_arr[i].sequence_number = 0;
 	ipfix_prepend_header(exporter,
 		exporter->template_sendbuffer->committed_data_length,
-		exporter->template_sendbuffer);
+		exporter->template_sendbuffer,
+		exporter->collector_arr[i].sequence_number);
 
 	if((bytes_sent = sctp_sendmsgv(exporter->collector_arr[i].data_socket,
 		exporter->template_sendbuffer->entries,
@@ -2178,9 +2830,7 @@ static int sctp_reconnect(ipfix_exporter *exporter , int i){
 		0 // context
 			)) == -1) {
 			msg(MSG_ERROR, "SCTP sending templates after reconnection failed, %s", strerror(errno));
-			close(exporter->collector_arr[i].data_socket);
-		exporter->collector_arr[i].data_socket = -1;
-			exporter->collector_arr[i].state = C_DISCONNECTED;
+			sctp_fail(exporter, i);
 			return -1;
 	}
 	msg(MSG_DEBUG, "%d template bytes sent to SCTP collector",bytes_sent);
@@ -2189,6 +2839,54 @@ static int sctp_reconnect(ipfix_exporter *exporter , int i){
 	exporter->collector_arr[i].state = C_CONNECTED;
 	return 0;
 }
+
+/*
+ * Reads the notifications of an established association and closes it
+ * once the collector shuts it down or it is lost. The first reconnection
+ * attempt takes place on the next call of ipfix_beat().
+ * i: index of the collector in the exporters collector_arr
+ */
+static void sctp_read(ipfix_exporter *exporter, int i) {
+	ipfix_receiving_collector *col = &exporter->collector_arr[i];
+	union sctp_notification snp;
+	struct msghdr msg;
+	struct iovec iv;
+	ssize_t r;
+
+	for (;;) {
+		iv.iov_base = &snp;
+		iv.iov_len = sizeof snp;
+		memset(&msg,0,sizeof(msg));
+		msg.msg_iov = &iv;
+		msg.msg_iovlen = 1;
+		if ((r = recvmsg(col->data_socket, &msg, MSG_DONTWAIT)) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+			msg(MSG_ERROR, "SCTP association with %s:%d failed, %s",
+				col->ipv4address, col->port_number, strerror(errno));
+			break;
+		}
+		if (r == 0) {
+			msg(MSG_ERROR, "SCTP collector %s:%d closed the association",
+				col->ipv4address, col->port_number);
+			break;
+		}
+		// collectors do not send data
+		if (!(msg.msg_flags & MSG_NOTIFICATION))
+			continue;
+		if ((snp.sn_header.sn_type == SCTP_ASSOC_CHANGE &&
+		     snp.sn_assoc_change.sac_state != SCTP_COMM_UP &&
+		     snp.sn_assoc_change.sac_state != SCTP_RESTART) ||
+		    snp.sn_header.sn_type == SCTP_SHUTDOWN_EVENT) {
+			msg(MSG_ERROR, "SCTP association with %s:%d lost",
+				col->ipv4address, col->port_number);
+			break;
+		}
+	}
+
+	sctp_fail(exporter, i);
+	col->last_reconnect_attempt_time = 0;
+}
 #endif /*SUPPORT_SCTP*/
 
 /*******************************************************************/
@@ -2225,20 +2923,30 @@ static int ipfix_send_templates(ipfix_exporter* exporter)
 		// T_UNUSED evaluates to 0 which in turn evaluates to false
 		// So basically we check if state is something *not* equal to T_UNUSED
 		if (col->state) {
+			/* Send collected data first as it may refer to
+			   templates which are about to be withdrawn. */
+			if (exporter->sctp_template_sendbuffer->committed_data_length > 0) {
+				ipfix_flush_collected_messages(exporter, i);
+				if (!col->state)
+					continue;
+			}
+			/* Without a socket watcher, nobody else pushes the
+			   connection setup forward. A collector that gets
+			   connected here has just received all templates. */
+			if (!exporter->socket_watcher) {
+				int was_connected = (col->state == C_CONNECTED);
+				ipfix_manage_connection(exporter, i);
+				if (!col->state ||
+				    (!was_connected && col->state == C_CONNECTED))
+					continue;
+			}
 #ifdef SUPPORT_DTLS
 			if (col->protocol == DTLS_OVER_UDP ||
 				col->protocol == DTLS_OVER_SCTP) {
-				/* ensure that we are connected i.e. DTLS handshake has been finished.
-				 * This function does no harm if we are already connected. */
-				if (dtls_manage_connection(exporter,col) < 0)
-				    /* continue if dtls_manage_connection failed */
-				    continue;
-				/* dtls_manage_connection() might return success even if we're not yet connected.
-				 * This might happen if OpenSSL is still waiting for data from the
-				 * remote end and therefore returned SSL_ERROR_WANT_READ. */
+				/* The DTLS handshake might still be ongoing. */
 				if ( col->state != C_CONNECTED ) {
 				    DPRINTF("We are not yet connected so we can't send templates.");
-				    break;
+				    continue;
 				}
 			}
 
@@ -2253,7 +2961,8 @@ static int ipfix_send_templates(ipfix_exporter* exporter)
 					// update the sendbuffer header, as we must set the export time & sequence number!
 					ipfix_prepend_header(exporter,
 						exporter->sctp_template_sendbuffer->committed_data_length,
-						exporter->sctp_template_sendbuffer);
+						exporter->sctp_template_sendbuffer,
+						col->sequence_number);
 					dtls_over_sctp_send(exporter,col,
 						exporter->sctp_template_sendbuffer->entries,
 						exporter->sctp_template_sendbuffer->current,
@@ -2270,7 +2979,8 @@ static int ipfix_send_templates(ipfix_exporter* exporter)
 					// update the sendbuffer header, as we must set the export time & sequence number!
 					ipfix_prepend_header(exporter,
 						exporter->template_sendbuffer->committed_data_length,
-						exporter->template_sendbuffer);
+						exporter->template_sendbuffer,
+						col->sequence_number);
 #ifdef SUPPORT_DTLS
 					if (col->protocol == DTLS_OVER_UDP) {
 						dtls_send(exporter,col,
@@ -2306,27 +3016,17 @@ static int ipfix_send_templates(ipfix_exporter* exporter)
 #ifdef SUPPORT_SCTP
 			case SCTP:
 				switch (col->state){
-				
-				case C_NEW:	// try to connect to the new collector once per second
-					// once per second is not useful here, new collectors must be connected quickly
-					//if (time_now > col->last_reconnect_attempt_time) {
-						sctp_reconnect(exporter, i);
-					//}
-					break;
-				case C_DISCONNECTED: //reconnect attempt if reconnection time reached
-					if(exporter->sctp_reconnect_timer == 0) { // 0 = no more reconnection attempts
-						msg(MSG_ERROR, "reconnect failed, removing collector %s:%d (SCTP)", col->ipv4address, col->port_number);
-						remove_collector(col);
-					} else if ((time_now - col->last_reconnect_attempt_time) >  exporter->sctp_reconnect_timer) {
-						sctp_reconnect(exporter, i);
-					}
+				case C_NEW:
+				case C_DISCONNECTED:
+					// connections are managed by ipfix_manage_connection()
 					break;
 				case C_CONNECTED:
 					if (exporter->sctp_template_sendbuffer->committed_data_length > 0) {
 						// update the sendbuffer header, as we must set the export time & sequence number!
 						ipfix_prepend_header(exporter,
 							exporter->sctp_template_sendbuffer->committed_data_length,
-							exporter->sctp_template_sendbuffer);
+							exporter->sctp_template_sendbuffer,
+							col->sequence_number);
 						if((bytes_sent = sctp_sendmsgv(col->data_socket,
 							exporter->sctp_template_sendbuffer->entries,
 							exporter->sctp_template_sendbuffer->current,
@@ -2339,9 +3039,10 @@ static int ipfix_send_templates(ipfix_exporter* exporter)
 							)) == -1) {
 							// send failed
 							msg(MSG_ERROR, "could not send to %s:%d errno: %s  (SCTP)",col->ipv4address, col->port_number, strerror(errno));
-							sctp_reconnect(exporter, i); //1st reconnect attempt 
-							// if result is C_DISCONNECTED and sctp_reconnect_timer == 0, collector will 
-							// be removed on the next call of ipfix_send_templates()
+							// 1st reconnect attempt on the next beat.
+							// If it fails and sctp_reconnect_timer == 0, the collector will be removed.
+							sctp_fail(exporter, i);
+							col->last_reconnect_attempt_time = 0;
 						} else {
 							// send was successful
 							msg(MSG_VDEBUG, "%d template bytes sent to SCTP collector %s:%d",
@@ -2356,11 +3057,34 @@ static int ipfix_send_templates(ipfix_exporter* exporter)
 			break;
 #endif
 
+			case TCP:
+				switch (col->state) {
+				case C_CONNECTED:
+					if (col->backlog_length > col->backlog_start)
+						tcp_drain(exporter, col);
+					if (col->state == C_CONNECTED &&
+					    exporter->sctp_template_sendbuffer->committed_data_length > 0) {
+						// update the sendbuffer header, as we must set the export time & sequence number!
+						ipfix_prepend_header(exporter,
+							exporter->sctp_template_sendbuffer->committed_data_length,
+							exporter->sctp_template_sendbuffer,
+							col->sequence_number);
+						tcp_send(exporter, col,
+							 exporter->sctp_template_sendbuffer->entries,
+							 exporter->sctp_template_sendbuffer->current, 1);
+					}
+					break;
+				default:
+					break;
+				}
+				break;
+
 #ifdef IPFIXLOLIB_RAWDIR_SUPPORT
 			case RAWDIR:
 				ipfix_prepend_header(exporter,
 					    exporter->template_sendbuffer->committed_data_length,
-					    exporter->template_sendbuffer);
+					    exporter->template_sendbuffer,
+					    col->sequence_number);
 				packet_directory_path = col->packet_directory_path;
 				char fnamebuf[1024];
 				sprintf(fnamebuf, "%s/%08d", packet_directory_path, col->packets_written++);
@@ -2375,7 +3099,8 @@ static int ipfix_send_templates(ipfix_exporter* exporter)
 			case DATAFILE:
 				ipfix_prepend_header(exporter,
 						exporter->template_sendbuffer->committed_data_length,
-						exporter->template_sendbuffer);
+						exporter->template_sendbuffer,
+						col->sequence_number);
 
 				if(col->bytes_written>0 && (col->bytes_written +
 					ntohs(exporter->template_sendbuffer->packet_header.length)
@@ -2412,6 +3137,648 @@ static int ipfix_send_templates(ipfix_exporter* exporter)
 	return 1;
 }
 
+/*
+ Sends a complete IPFIX message to a collector using the collector's
+ transport protocol.
+ Parameters:
+ exporter sending exporting process
+ i index of the collector in the exporters collector_arr
+ iov, iovcnt the message
+
+ Return value:
+ on success: 0
+ on failure: -1
+ This is an internal function.
+ */
+static int ipfix_send_message(ipfix_exporter *exporter, int i, struct iovec *iov, int iovcnt)
+{
+	ipfix_receiving_collector *col = &exporter->collector_arr[i];
+	int bytes_sent;
+	uint64_t length = 0;
+	int j;
+
+	for (j = 0; j < iovcnt; j++)
+		length += iov[j].iov_len;
+
+	switch(col->protocol){
+#ifdef IPFIXLOLIB_RAWDIR_SUPPORT
+	char* packet_directory_path;
+#endif
+	case UDP:
+		if((bytes_sent=writev(col->data_socket, iov, iovcnt)) == -1){
+			msg(MSG_ERROR, "could not send to %s:%d errno: %s  (UDP)",col->ipv4address, col->port_number, strerror(errno));
+			if (errno == EMSGSIZE) {
+				msg(MSG_ERROR, "Updating MTU estimate for collector %s:%d",
+					col->ipv4address,
+					col->port_number);
+				/* If update_collector_mtu fails, it calls
+				   remove_collector(). So keep in mind that
+				   the collector might be gone (set to C_UNUSED)
+				   after calling this function. */
+				update_collector_mtu(exporter, col);
+			}
+			return -1;
+		}
+		msg(MSG_VDEBUG, "%d data bytes sent to UDP collector %s:%d",
+			bytes_sent, col->ipv4address, col->port_number);
+		break;
+#ifdef SUPPORT_DTLS_OVER_SCTP
+	case DTLS_OVER_SCTP:
+		if((bytes_sent=dtls_over_sctp_send( exporter, col, iov, iovcnt,
+						    exporter->sctp_lifetime
+						    )) == -1){
+			msg(MSG_VDEBUG, "could not send to %s:%d (DTLS over SCTP)",col->ipv4address, col->port_number);
+			return -1;
+		}
+		msg(MSG_VDEBUG, "%d data bytes sent to DTLS over SCTP collector %s:%d",
+			bytes_sent, col->ipv4address, col->port_number);
+		break;
+#endif
+
+#ifdef SUPPORT_SCTP
+	case SCTP:
+		if((bytes_sent = sctp_sendmsgv(col->data_socket, iov, iovcnt,
+					       (struct sockaddr*)&(col->addr),
+					       sizeof(col->addr),
+					       0,0, // payload protocol identifier, flags
+					       0,//Stream Number
+					       exporter->sctp_lifetime,//packet lifetime in ms(0 = reliable )
+					       0 // context
+					       )) == -1) {
+			// send failed
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				// association is congested, drop data
+				msg(MSG_VDEBUG, "SCTP collector %s:%d falls behind, dropping message",
+					col->ipv4address, col->port_number);
+				return -1;
+			}
+			msg(MSG_ERROR, "could not send to %s:%d errno: %s  (SCTP)",col->ipv4address, col->port_number, strerror(errno));
+			// drop data, 1st reconnect attempt on the next beat.
+			// If it fails and sctp_reconnect_timer == 0, the collector will be removed.
+			sctp_fail(exporter, i);
+			col->last_reconnect_attempt_time = 0;
+			return -1;
+		}
+		msg(MSG_VDEBUG, "%d data bytes sent to SCTP collector %s:%d",
+			bytes_sent, col->ipv4address, col->port_number);
+		break;
+#endif
+	case TCP:
+		if (tcp_send(exporter, col, iov, iovcnt, 0))
+			return -1;
+		msg(MSG_VDEBUG, "%d data bytes sent to TCP collector %s:%d",
+			(int) length, col->ipv4address, col->port_number);
+		break;
+#ifdef SUPPORT_DTLS
+	case DTLS_OVER_UDP:
+		if((bytes_sent=dtls_send( exporter, col, iov, iovcnt)) == -1){
+			msg(MSG_VDEBUG, "could not send to %s:%d (DTLS over UDP)",col->ipv4address, col->port_number);
+			return -1;
+		}
+		msg(MSG_VDEBUG, "%d data bytes sent to DTLS over UDP collector %s:%d",
+			bytes_sent, col->ipv4address, col->port_number);
+		break;
+#endif
+
+#ifdef IPFIXLOLIB_RAWDIR_SUPPORT
+	case RAWDIR:
+		packet_directory_path = col->packet_directory_path;
+		char fnamebuf[1024];
+		sprintf(fnamebuf, "%s/%08d", packet_directory_path, col->packets_written++);
+		int f = creat(fnamebuf, S_IRWXU | S_IRWXG);
+		if(f<0)
+			msg(MSG_ERROR, "could not open RAWDIR file %s", fnamebuf);
+		else if(writev(f, iov, iovcnt)<0)
+			msg(MSG_ERROR, "could not write to RAWDIR file %s", fnamebuf);
+		close(f);
+		break;
+#endif
+	case DATAFILE:
+		if(col->bytes_written>0 && (col->bytes_written + length
+					    > (uint64_t)(col->maxfilesize) * 1024))
+			ipfix_new_file(col);
+
+		if (col->fh < 0) {
+			msg(MSG_ERROR, "invalid file handle for DATAFILE file (==0!)");
+			return -1;
+		}
+		if (length == 0) {
+			msg(MSG_ERROR, "packet size == 0!");
+			return -1;
+		}
+		if ((bytes_sent = writev(col->fh, iov, iovcnt)) < 0) {
+			msg(MSG_ERROR, "could not write to DATAFILE file");
+			return -1;
+		}
+
+		col->bytes_written += length;
+
+		msg(MSG_DEBUG, "packet_header.length: %d \t bytes_written: %d \t Total: %llu",
+			(int) length, bytes_sent, col->bytes_written);
+		break;
+
+	default:
+		msg(MSG_FATAL, "Transport Protocol not supported");
+		return -1; /* Should not occur since we check the transport
+			      protocol in valid_transport_protocol()*/
+	}
+
+	return 0;
+}
+
+/*
+ * Returns 1 if the messages built by the exporter are collected for the
+ * collector and sent as one larger message by ipfix_flush().
+ * This is an internal function.
+ */
+static int ipfix_collects_messages(ipfix_exporter *exporter, ipfix_receiving_collector *col)
+{
+	if (!exporter->send_queue)
+		return 0;
+#ifdef SUPPORT_COMPRESSION
+	// compressed messages cannot be joined
+	if (exporter->compressor_count)
+		return 0;
+#endif
+	return col->max_message_size > exporter->max_message_size;
+}
+
+/*
+ * Checks whether Data Sets are sent to, or buffered for, a collector.
+ * This is an internal function.
+ */
+static int ipfix_accepts_messages(ipfix_exporter *exporter, ipfix_receiving_collector *col)
+{
+	if (col->state == C_CONNECTED)
+		return 1;
+	return col->state != C_UNUSED && col->protocol == TCP &&
+		exporter->unconnected_policy == IPFIX_UNCONNECTED_BUFFER;
+}
+
+/*
+ * Returns 1 if messages for the collector are appended to its spill queue
+ * instead of being sent: while it is not connected, falls behind or older
+ * messages are still waiting to be replayed.
+ * This is an internal function.
+ */
+static int ipfix_spills_messages(ipfix_receiving_collector *col)
+{
+	return col->spill && (col->state != C_CONNECTED || col->backpressure ||
+			      col->spill->messages > 0);
+}
+
+/*
+ * Maps segment n of a spill queue, creating the segment file if create
+ * is set. Returns NULL on failure.
+ * This is an internal function.
+ */
+static uint8_t *spill_map_segment(ipfix_spill_queue *q, uint32_t n, int create)
+{
+	char path[PATH_MAX];
+	uint8_t *map;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s.%u", q->prefix, n);
+	if ((fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0600)) == -1) {
+		msg(MSG_ERROR, "Failed to open spill segment %s, %s", path, strerror(errno));
+		return NULL;
+	}
+	if (create && ftruncate(fd, q->segment_size) == -1) {
+		msg(MSG_ERROR, "Failed to grow spill segment %s, %s", path, strerror(errno));
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+	map = (uint8_t *) mmap(NULL, q->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		msg(MSG_ERROR, "Failed to map spill segment %s, %s", path, strerror(errno));
+		return NULL;
+	}
+	return map;
+}
+
+/*
+ * Unmaps segment n of a spill queue, if mapped, and removes its file.
+ * This is an internal function.
+ */
+static void spill_remove_segment(ipfix_spill_queue *q, uint32_t n, uint8_t *map)
+{
+	char path[PATH_MAX];
+
+	if (map)
+		munmap(map, q->segment_size);
+	snprintf(path, sizeof(path), "%s.%u", q->prefix, n);
+	unlink(path);
+}
+
+/*
+ * Returns the mapping of the oldest segment of a spill queue and the offset
+ * behind its last message in *end. Returns NULL if it cannot be mapped.
+ * This is an internal function.
+ */
+static uint8_t *spill_read_segment(ipfix_spill_queue *q, unsigned *end)
+{
+	if (q->first == q->last) {
+		*end = q->write_offset;
+		return q->write_map;
+	}
+	if (!q->read_map)
+		q->read_map = spill_map_segment(q, q->first, 0);
+	*end = q->segment_size;
+	return q->read_map;
+}
+
+/*
+ * Removes the oldest segment of a spill queue, which must not be the one
+ * being written, together with the messages not yet replayed from it.
+ * This is an internal function.
+ */
+static void spill_discard_segment(ipfix_spill_queue *q)
+{
+	ipfix_spill_entry entry;
+	uint8_t *map;
+	unsigned end;
+
+	if ((map = spill_read_segment(q, &end))) {
+		while (q->read_offset + sizeof(entry) <= end) {
+			memcpy(&entry, map + q->read_offset, sizeof(entry));
+			if (entry.length == 0)
+				break;
+			q->read_offset += sizeof(entry) + entry.length;
+			q->messages--;
+			q->dropped++;
+		}
+	}
+	spill_remove_segment(q, q->first, q->read_map);
+	q->read_map = NULL;
+	q->read_offset = 0;
+	q->first++;
+}
+
+/*
+ * Creates the spill queue of a collector in the spill directory of the
+ * exporter. Segment files left behind by an earlier run are removed.
+ * Returns NULL on failure.
+ * This is an internal function.
+ */
+static ipfix_spill_queue *ipfix_open_spill_queue(ipfix_exporter *exporter, ipfix_receiving_collector *col)
+{
+	ipfix_spill_queue *q;
+	char name[64];
+	struct dirent *entry;
+	DIR *dir;
+	size_t length;
+
+	snprintf(name, sizeof(name), "%s_%u_%d.", col->ipv4address, col->port_number, col->protocol);
+	length = strlen(name);
+	if (!(dir = opendir(exporter->spill_directory))) {
+		msg(MSG_ERROR, "Failed to open spill directory %s, %s",
+			exporter->spill_directory, strerror(errno));
+		return NULL;
+	}
+	while ((entry = readdir(dir))) {
+		if (strncmp(entry->d_name, name, length) == 0) {
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "%s/%s", exporter->spill_directory, entry->d_name);
+			unlink(path);
+		}
+	}
+	closedir(dir);
+
+	if (!(q = (ipfix_spill_queue *) calloc(1, sizeof(ipfix_spill_queue))))
+		return NULL;
+	if (!(q->prefix = (char *) malloc(strlen(exporter->spill_directory) + length + 1))) {
+		free(q);
+		return NULL;
+	}
+	sprintf(q->prefix, "%s/%s", exporter->spill_directory, name);
+	q->prefix[strlen(q->prefix) - 1] = '\0';
+
+	// every segment has to hold a message of maximum size
+	q->segment_size = exporter->spill_size / 4;
+	if (q->segment_size > IPFIX_SPILL_SEGMENT_SIZE)
+		q->segment_size = IPFIX_SPILL_SEGMENT_SIZE;
+	if (q->segment_size < IPFIX_MAX_PACKETSIZE + sizeof(ipfix_spill_entry))
+		q->segment_size = IPFIX_MAX_PACKETSIZE + sizeof(ipfix_spill_entry);
+	q->max_segments = exporter->spill_size / q->segment_size;
+	if (q->max_segments < 2)
+		q->max_segments = 2;
+	clock_gettime(CLOCK_MONOTONIC, &q->replayed);
+
+	msg(MSG_INFO, "Spilling messages for collector %s:%d to %s.* (%u segments of %u KiB)",
+		col->ipv4address, col->port_number, q->prefix, q->max_segments, q->segment_size / 1024);
+	return q;
+}
+
+/*
+ * Removes all segments of a spill queue and frees it.
+ * This is an internal function.
+ */
+static void ipfix_close_spill_queue(ipfix_spill_queue *q)
+{
+	if (q->messages > 0)
+		msg(MSG_ERROR, "Discarding %llu spilled messages in %s.*",
+			(unsigned long long) q->messages, q->prefix);
+	while (q->first != q->last)
+		spill_discard_segment(q);
+	spill_remove_segment(q, q->last, q->write_map);
+	free(q->prefix);
+	free(q);
+}
+
+/*
+ * Appends an uncompressed message to the spill queue of a collector. The
+ * oldest segment is discarded if the queue would exceed its size.
+ * Returns -1 if the message could not be stored.
+ * This is an internal function.
+ */
+static int ipfix_spill_message(ipfix_receiving_collector *col, struct iovec *iov, int iovcnt,
+			       uint32_t records)
+{
+	ipfix_spill_queue *q = col->spill;
+	ipfix_spill_entry entry;
+	unsigned length = 0;
+	int j;
+
+	for (j = 0; j < iovcnt; j++)
+		length += iov[j].iov_len;
+
+	if (q->write_map && q->write_offset + sizeof(entry) + length > q->segment_size) {
+		// mark the end of the segment and continue in a new one
+		if (q->write_offset + sizeof(entry) <= q->segment_size)
+			memset(q->write_map + q->write_offset, 0, sizeof(entry));
+		if (q->first == q->last)
+			q->read_map = q->write_map;
+		else
+			munmap(q->write_map, q->segment_size);
+		q->write_map = NULL;
+		q->write_offset = 0;
+		q->last++;
+		while (q->last - q->first >= q->max_segments)
+			spill_discard_segment(q);
+	}
+	if (!q->write_map && !(q->write_map = spill_map_segment(q, q->last, 1)))
+		return -1;
+
+	entry.length = length;
+	entry.reserved = 0;
+	entry.records = records;
+	memcpy(q->write_map + q->write_offset, &entry, sizeof(entry));
+	q->write_offset += sizeof(entry);
+	for (j = 0; j < iovcnt; j++) {
+		memcpy(q->write_map + q->write_offset, iov[j].iov_base, iov[j].iov_len);
+		q->write_offset += iov[j].iov_len;
+	}
+	q->messages++;
+
+	if (q->messages == 1)
+		msg(MSG_INFO, "Spilling messages for collector %s:%d", col->ipv4address, col->port_number);
+	return 0;
+}
+
+/*
+ * Replays the messages spilled for collector i, at most spill_rate bytes
+ * per second and only as fast as the collector accepts them. Each message
+ * receives the next sequence number of the current transport session and
+ * is compressed afterwards.
+ * This is an internal function.
+ */
+static void ipfix_replay_spilled_messages(ipfix_exporter *exporter, int i)
+{
+	ipfix_receiving_collector *col = &exporter->collector_arr[i];
+	ipfix_spill_queue *q = col->spill;
+	ipfix_spill_entry entry;
+	struct iovec iov;
+	struct iovec *message;
+	int message_iovcnt;
+	uint8_t *map;
+	unsigned end;
+
+	if (q->messages == 0)
+		return;
+
+	if (exporter->spill_rate) {
+		q->tokens += (uint64_t) exporter->spill_rate * ipfix_elapsed_ms(&q->replayed) / 1000;
+		if (q->tokens > exporter->spill_rate)
+			q->tokens = exporter->spill_rate;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &q->replayed);
+
+	while (q->messages > 0 && col->state == C_CONNECTED) {
+		// wait until the socket takes messages right away
+		if (col->protocol == TCP && col->backlog_length > col->backlog_start)
+			break;
+		if (!(map = spill_read_segment(q, &end))) {
+			spill_discard_segment(q);
+			continue;
+		}
+		if (q->read_offset + sizeof(entry) > end) {
+			spill_discard_segment(q);
+			continue;
+		}
+		memcpy(&entry, map + q->read_offset, sizeof(entry));
+		if (entry.length == 0) {
+			spill_discard_segment(q);
+			continue;
+		}
+		if (exporter->spill_rate && entry.length > q->tokens)
+			break;
+
+		iov.iov_base = map + q->read_offset + sizeof(entry);
+		iov.iov_len = entry.length;
+		((ipfix_header *) iov.iov_base)->sequence_number = htonl(col->sequence_number);
+		message = &iov;
+		message_iovcnt = 1;
+#ifdef SUPPORT_COMPRESSION
+		if (ipfix_compress_packet(exporter, &iov, 1)) {
+			message = exporter->compressed_message;
+			message_iovcnt = exporter->compressed_iovcnt;
+		}
+#endif
+		if (ipfix_send_message(exporter, i, message, message_iovcnt))
+			break;
+		col->sequence_number += entry.records;
+		q->tokens -= exporter->spill_rate ? entry.length : 0;
+
+		q->read_offset += sizeof(entry) + entry.length;
+		q->messages--;
+		if (q->first == q->last && q->read_offset == q->write_offset) {
+			// reuse the segment being written
+			q->read_offset = q->write_offset = 0;
+		}
+	}
+
+	if (q->messages == 0)
+		msg(MSG_INFO, "Replayed all spilled messages to collector %s:%d, %llu discarded",
+			col->ipv4address, col->port_number, (unsigned long long) q->dropped);
+}
+
+/*
+ * Sends a message to collector i, or appends it to the spill queue of the
+ * collector if it cannot take the message now. message is sent, iov is the
+ * same message uncompressed which is spilled so that it can be renumbered
+ * when it is replayed. The sequence number of the collector advances once
+ * the message has been sent.
+ * Returns -1 if the message is lost for the collector.
+ * This is an internal function.
+ */
+static int ipfix_deliver_message(ipfix_exporter *exporter, int i, struct iovec *iov, int iovcnt,
+				 struct iovec *message, int message_iovcnt, uint32_t records)
+{
+	ipfix_receiving_collector *col = &exporter->collector_arr[i];
+
+	if (ipfix_spills_messages(col))
+		return ipfix_spill_message(col, iov, iovcnt, records);
+	if (ipfix_send_message(exporter, i, message, message_iovcnt) == 0) {
+		col->sequence_number += records;
+		return 0;
+	}
+	if (col->spill && col->state != C_UNUSED)
+		return ipfix_spill_message(col, iov, iovcnt, records);
+	// messages dropped by the TCP backlog never reach the collector
+	if (col->protocol != TCP)
+		col->sequence_number += records;
+	return -1;
+}
+
+/*
+ * Sends the messages collected for collector i as a single message.
+ * This is an internal function.
+ */
+static void ipfix_flush_collected_messages(ipfix_exporter *exporter, int i)
+{
+	ipfix_receiving_collector *col = &exporter->collector_arr[i];
+	struct iovec iov;
+
+	if (col->message_length == 0)
+		return;
+
+	if (ipfix_accepts_messages(exporter, col) || col->spill) {
+		ipfix_write_header(exporter, (ipfix_header *) col->message,
+				   col->message_length, col->sequence_number);
+		iov.iov_base = col->message;
+		iov.iov_len = col->message_length;
+		ipfix_deliver_message(exporter, i, &iov, 1, &iov, 1, col->message_records);
+	}
+
+	col->message_length = 0;
+	col->message_records = 0;
+}
+
+/*
+ * Appends the sets of the committed data sendbuffer to the messages
+ * collected for collector i. The collected messages are sent before if the
+ * sets do not fit and after if the next message would not fit or the first
+ * one has been waiting for the maximum delay of the send queue.
+ * Returns -1 if no buffer could be allocated.
+ * This is an internal function.
+ */
+static int ipfix_collect_message(ipfix_exporter *exporter, int i)
+{
+	ipfix_receiving_collector *col = &exporter->collector_arr[i];
+	ipfix_sendbuffer *dsb = exporter->data_sendbuffer;
+	unsigned j;
+
+	if (!col->message) {
+		if (!(col->message = (uint8_t *) malloc(IPFIX_MAX_PACKETSIZE))) {
+			msg(MSG_ERROR, "Failed to allocate message buffer for collector %s:%d",
+				col->ipv4address, col->port_number);
+			return -1;
+		}
+	}
+
+	if (col->message_length + dsb->committed_data_length > col->max_message_size)
+		ipfix_flush_collected_messages(exporter, i);
+
+	if (col->message_length == 0) {
+		// the message header is written when the message is sent
+		col->message_length = sizeof(ipfix_header);
+		col->message_records = 0;
+		clock_gettime(CLOCK_MONOTONIC, &col->message_first);
+	}
+
+	// entries[0] is the message header of the exporter
+	for (j = 1; j < dsb->committed; j++) {
+		memcpy(col->message + col->message_length, dsb->entries[j].iov_base, dsb->entries[j].iov_len);
+		col->message_length += dsb->entries[j].iov_len;
+	}
+	col->message_records += exporter->sn_increment;
+
+	if (col->message_length + exporter->max_message_size - sizeof(ipfix_header) > col->max_message_size
+	    || ipfix_elapsed_ms(&col->message_first) >= exporter->send_queue->max_delay)
+		ipfix_flush_collected_messages(exporter, i);
+
+	return 0;
+}
+
+/*
+ * Writes sequence_number into the Message Header of the data sendbuffer and
+ * sets message and message_iovcnt to the message to send. With compression,
+ * the message is compressed unless this has been done with the same
+ * sequence number for a previous collector: *compression is -1 until the
+ * message has been compressed, 1 if it is compressed with
+ * *compressed_sequence_number and 0 if it is sent uncompressed.
+ * Returns 1 if the message is compressed.
+ * This is an internal function.
+ */
+static int ipfix_prepare_message(ipfix_exporter *exporter, uint32_t sequence_number,
+				 int *compression, uint32_t *compressed_sequence_number,
+				 struct iovec **message, int *message_iovcnt)
+{
+	ipfix_sendbuffer *dsb = exporter->data_sendbuffer;
+
+	dsb->packet_header.sequence_number = htonl(sequence_number);
+	*message = dsb->entries;
+	*message_iovcnt = dsb->committed;
+#ifdef SUPPORT_COMPRESSION
+	if (*compression < 0 || (*compression && *compressed_sequence_number != sequence_number)) {
+		*compression = ipfix_compress_packet(exporter, dsb->entries, dsb->committed);
+		*compressed_sequence_number = sequence_number;
+	}
+	if (*compression) {
+		*message = exporter->compressed_message;
+		*message_iovcnt = exporter->compressed_iovcnt;
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+#ifdef SUPPORT_COMPRESSION
+/*
+ * Checks whether all UDP collectors expect the same sequence number for the
+ * next message added to the send queue and stores it in sequence_number.
+ * Otherwise compressed messages, whose Message Header cannot be rewritten
+ * per collector, cannot be queued.
+ * This is an internal function.
+ */
+static int ipfix_queue_sequence_number(ipfix_exporter *exporter, uint32_t *sequence_number)
+{
+	ipfix_send_queue *queue = exporter->send_queue;
+	uint32_t queued = 0;
+	int found = 0;
+	unsigned j;
+	int i;
+
+	for (j = 0; j < queue->count; j++)
+		queued += queue->records[j];
+
+	*sequence_number = exporter->sequence_number;
+	for (i = 0; i < exporter->collector_max_num; i++) {
+		ipfix_receiving_collector *col = &exporter->collector_arr[i];
+		if (col->state != C_CONNECTED || col->protocol != UDP)
+			continue;
+		if (found && *sequence_number != col->sequence_number + queued)
+			return 0;
+		*sequence_number = col->sequence_number + queued;
+		found = 1;
+	}
+
+	return 1;
+}
+#endif
+
 /*
  Send data to collectors
  Sends all data committed via ipfix_put_data_field to this exporter.
@@ -2425,24 +3792,44 @@ static int ipfix_send_templates(ipfix_exporter* exporter)
 static int ipfix_send_data(ipfix_exporter* exporter)
 {
 	int i;
-	int bytes_sent;
 	// send the current data_sendbuffer:
 	int data_length=0;
+	// the UDP collectors share the message in the send queue
+	int use_queue = exporter->send_queue != NULL;
+	uint32_t queue_sequence_number = 0;
+	// at least one UDP collector waits for the queued message
+	int queue_message = 0;
+	// the message sent to a collector, see ipfix_prepare_message()
+	struct iovec *message;
+	int message_iovcnt;
+	int compression = -1;
+	uint32_t compressed_sequence_number = 0;
+	// the message header cannot be rewritten
+	int compressed = 0;
+#ifdef SUPPORT_COMPRESSION
+	// at least one collector misses the message
+	int lost = 0;
+#endif
 
 	// is there data to send?
 	if (exporter->data_sendbuffer->committed_data_length > 0 ) {
 		data_length = exporter->data_sendbuffer->committed_data_length;
 
 		// prepend a header to the sendbuffer
-		ipfix_prepend_header(exporter, data_length, exporter->data_sendbuffer);
+		ipfix_prepend_header(exporter, data_length, exporter->data_sendbuffer, exporter->sequence_number);
 #ifdef SUPPORT_COMPRESSION
-		ipfix_compress_packet(exporter);
-		data_length = exporter->data_sendbuffer->committed_data_length;
+		// send compressed messages to each UDP collector on its own unless
+		// all of them expect the same sequence number
+		if (use_queue && exporter->compressor_count
+		    && !ipfix_queue_sequence_number(exporter, &queue_sequence_number)) {
+			ipfix_flush_queue(exporter);
+			use_queue = 0;
+		}
 #endif
 		// send the sendbuffer to all collectors
 		for (i = 0; i < exporter->collector_max_num; i++) {
 			ipfix_receiving_collector *col = &exporter->collector_arr[i];
-			if (col->state == C_CONNECTED) {
+			if (ipfix_accepts_messages(exporter, col) || col->spill) {
 #ifdef DEBUG
 				DPRINTFL(MSG_VDEBUG, "Sending to exporter %s", col->ipv4address);
 
@@ -2464,171 +3851,484 @@ static int ipfix_send_data(ipfix_exporter* exporter)
 	   between tested_length and committed_data_length */
 				DPRINTFL(MSG_VDEBUG, "Total length of sendbuffer: %u bytes (IPFIX Message header + set headers + records)", tested_length );
 #endif
-				switch(col->protocol){
-#ifdef IPFIXLOLIB_RAWDIR_SUPPORT
-				char* packet_directory_path;
-#endif
-				case UDP:
-					if((bytes_sent=writev( col->data_socket,
-										   exporter->data_sendbuffer->entries,
-										   exporter->data_sendbuffer->committed
-										   )) == -1){
-						msg(MSG_ERROR, "could not send to %s:%d errno: %s  (UDP)",col->ipv4address, col->port_number, strerror(errno));
-						if (errno == EMSGSIZE) {
-							msg(MSG_ERROR, "Updating MTU estimate for collector %s:%d",
-								col->ipv4address,
-								col->port_number);
-							/* If update_collector_mtu fails, it calls
-			 remove_collector(). So keep in mind that
-			 the collector might be gone (set to C_UNUSED)
-			 after calling this function. */
-							update_collector_mtu(exporter, col);
-						}
-					}else{
+				if (ipfix_collects_messages(exporter, col)
+				    && ipfix_collect_message(exporter, i) == 0)
+					continue;
+				// keep the order if the collector stopped collecting messages
+				ipfix_flush_collected_messages(exporter, i);
+				if (!ipfix_accepts_messages(exporter, col) && !col->spill) {
+#ifdef SUPPORT_COMPRESSION
+					lost = 1;
+#endif
+					continue;
+				}
 
-						msg(MSG_VDEBUG, "%d data bytes sent to UDP collector %s:%d",
-							bytes_sent, col->ipv4address, col->port_number);
-					}
-					break;
-#ifdef SUPPORT_DTLS_OVER_SCTP
-				case DTLS_OVER_SCTP:
-					if((bytes_sent=dtls_over_sctp_send( exporter, col,
-														exporter->data_sendbuffer->entries,
-														exporter->data_sendbuffer->committed,
-														exporter->sctp_lifetime
-														)) == -1){
-						msg(MSG_VDEBUG, "could not send to %s:%d (DTLS over SCTP)",col->ipv4address, col->port_number);
-					}else{
-
-						msg(MSG_VDEBUG, "%d data bytes sent to DTLS over SCTP collector %s:%d",
-							bytes_sent, col->ipv4address, col->port_number);
-					}
-					break;
+				if (col->protocol == UDP && use_queue) {
+					queue_message = 1;
+					continue;
+				}
+
+				ipfix_prepare_message(exporter, col->sequence_number,
+						      &compression, &compressed_sequence_number,
+						      &message, &message_iovcnt);
+				if (ipfix_deliver_message(exporter, i,
+							  exporter->data_sendbuffer->entries,
+							  exporter->data_sendbuffer->committed,
+							  message, message_iovcnt,
+							  exporter->sn_increment)) {
+#ifdef SUPPORT_COMPRESSION
+					lost = 1;
 #endif
+				}
+			} else if (col->state != C_UNUSED) {
+#ifdef SUPPORT_COMPRESSION
+				lost = 1;
+#endif
+			}
+		} // end exporter loop
+		if (queue_message) {
+			compressed = ipfix_prepare_message(exporter, queue_sequence_number,
+							   &compression, &compressed_sequence_number,
+							   &message, &message_iovcnt);
+			ipfix_queue_message(exporter, message, message_iovcnt, compressed);
+		}
+#ifdef SUPPORT_COMPRESSION
+		// the next message must not build on this one
+		if (lost)
+			ipfix_restart_compression(exporter);
+#endif
+		// increment sequence number
+		exporter->sequence_number += exporter->sn_increment;
+		exporter->sn_increment = 0;
+	}  // end if
 
-#ifdef SUPPORT_SCTP
-				case SCTP:
-					if((bytes_sent = sctp_sendmsgv(col->data_socket,
-												   exporter->data_sendbuffer->entries,
-												   exporter->data_sendbuffer->committed,
-												   (struct sockaddr*)&(col->addr),
-												   sizeof(col->addr),
-												   0,0, // payload protocol identifier, flags
-												   0,//Stream Number
-												   exporter->sctp_lifetime,//packet lifetime in ms(0 = reliable )
-												   0 // context
-												   )) == -1) {
-						// send failed
-						msg(MSG_ERROR, "could not send to %s:%d errno: %s  (SCTP)",col->ipv4address, col->port_number, strerror(errno));
-						// drop data and call sctp_reconnect
-						sctp_reconnect(exporter, i);
-						// if result is C_DISCONNECTED and sctp_reconnect_timer == 0, collector will
-						// be removed on the next call of ipfix_send_templates()
-					}
-					msg(MSG_VDEBUG, "%d data bytes sent to SCTP collector %s:%d",
-						bytes_sent, col->ipv4address, col->port_number);
-					break;
+	// reset the sendbuffer
+	ipfix_reset_sendbuffer(exporter->data_sendbuffer);
+	return 0;
+}
+
+
+/*!
+ * \brief Send data to Collectors.
+ *
+ * Sends all data committed via <tt>ipfix_put_data_field</tt> to this exporter.
+ * If necessary, sends all associated templates.
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \return >=0 success
+ * \return -1 failure
+ * \sa ipfix_start_template(), ipfix_start_data_set()
+ */
+/*
+ */
+int ipfix_send(ipfix_exporter *exporter)
+{
+        int ret = 0;
+
+        if(ipfix_send_templates(exporter) < 0) {
+                msg(MSG_ERROR, "sending templates failed");
+                ret = -1;
+        }
+        if(ipfix_send_data(exporter) < 0) {
+                msg(MSG_ERROR, "sending data failed");
+                ret = -1;
+        }
+
+        return ret;
+}
+
+#if defined(SUPPORT_SENDMMSG) && !defined(UDP_SEGMENT)
+/* Linux >= 4.18, missing in older C library headers */
+#define UDP_SEGMENT 103
 #endif
-#ifdef SUPPORT_DTLS
-				case DTLS_OVER_UDP:
-					if((bytes_sent=dtls_send( exporter, col,
-											  exporter->data_sendbuffer->entries,
-											  exporter->data_sendbuffer->committed
-											  )) == -1){
-						msg(MSG_VDEBUG, "could not send to %s:%d (DTLS over UDP)",col->ipv4address, col->port_number);
-					}else{
-
-						msg(MSG_VDEBUG, "%d data bytes sent to DTLS over UDP collector %s:%d",
-							bytes_sent, col->ipv4address, col->port_number);
-					}
-					break;
+
+/*!
+ * \brief Queue IPFIX messages for UDP collectors instead of sending them
+ * right away.
+ *
+ * ipfix_send() then copies every completed message into a queue which is
+ * sent by ipfix_flush() with as few system calls as possible: messages of
+ * equal size are handed to the kernel in a single send using UDP
+ * segmentation offload (UDP_SEGMENT) where available, the others are batched
+ * with sendmmsg(). The queue is flushed automatically once
+ * <tt>max_messages</tt> messages are queued, the queue is full or the oldest
+ * message has been waiting for <tt>max_delay</tt> milliseconds when the next
+ * one is queued. Callers should call ipfix_flush() after exporting a batch of
+ * messages.
+ *
+ * Collectors accepting larger messages than the exporter builds (e.g. SCTP
+ * collectors next to a UDP collector with a smaller MTU) collect consecutive
+ * messages instead and receive them as a single message of up to their own
+ * maximum message size when the next message would not fit, the first one
+ * has been waiting for <tt>max_delay</tt> milliseconds or ipfix_flush() is
+ * called. Sequence numbers are counted per collector. Compressed messages
+ * are not collected.
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \param max_messages maximum number of queued messages, at most
+ * IPFIX_SEND_QUEUE_MAX_MESSAGES. 0 sends the queued messages and disables
+ * deferred flushing.
+ * \param max_delay maximum time in milliseconds a message may be queued
+ * \return 0 success
+ * \return -1 failure. Reasons include:<ul><li>memory allocation failed</li></ul>
+ * \sa ipfix_flush()
+ */
+int ipfix_set_deferred_flush(ipfix_exporter *exporter, unsigned max_messages, unsigned max_delay)
+{
+	ipfix_send_queue *queue = exporter->send_queue;
+
+	if (max_messages == 0) {
+		if (queue) {
+			ipfix_flush(exporter);
+			free(queue->data);
+			free(queue);
+			exporter->send_queue = NULL;
+		}
+		return 0;
+	}
+
+	if (!queue) {
+		if (!(queue = (ipfix_send_queue *) malloc(sizeof(ipfix_send_queue))))
+			return -1;
+		if (!(queue->data = (uint8_t *) malloc(IPFIX_SEND_QUEUE_SIZE))) {
+			free(queue);
+			return -1;
+		}
+		queue->used = 0;
+		queue->count = 0;
+#ifdef SUPPORT_SENDMMSG
+		queue->gso = 1;
+#else
+		queue->gso = 0;
 #endif
+		exporter->send_queue = queue;
+	}
+
+	if (max_messages > IPFIX_SEND_QUEUE_MAX_MESSAGES)
+		max_messages = IPFIX_SEND_QUEUE_MAX_MESSAGES;
+
+	queue->max_messages = max_messages;
+	queue->max_delay = max_delay;
+
+	return 0;
+}
+
+/*
+ * Returns the number of milliseconds passed since the given point in time
+ * of the monotonic clock.
+ * This is an internal function.
+ */
+static unsigned ipfix_elapsed_ms(const struct timespec *since) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - since->tv_sec) * 1000
+		+ (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/*
+ * Copies the message of the data sendbuffer, as given by iov, into the send
+ * queue. The queue is flushed before if the message does not fit and after
+ * if one of the thresholds is reached.
+ * This is an internal function.
+ */
+static int ipfix_queue_message(ipfix_exporter *exporter, struct iovec *iov, int iovcnt, int compressed) {
+	ipfix_send_queue *queue = exporter->send_queue;
+	unsigned length = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		length += iov[i].iov_len;
+
+	if (queue->used + length > IPFIX_SEND_QUEUE_SIZE)
+		ipfix_flush_queue(exporter);
+
+	if (queue->count == 0)
+		clock_gettime(CLOCK_MONOTONIC, &queue->first_queued);
+
+	queue->lengths[queue->count] = length;
+	queue->records[queue->count] = exporter->sn_increment;
+	queue->compressed[queue->count] = compressed;
+	queue->count++;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(queue->data + queue->used, iov[i].iov_base, iov[i].iov_len);
+		queue->used += iov[i].iov_len;
+	}
+
+	if (queue->count >= queue->max_messages || ipfix_elapsed_ms(&queue->first_queued) >= queue->max_delay)
+		ipfix_flush_queue(exporter);
+
+	return 0;
+}
+
+/*
+ * Writes the sequence numbers of a UDP collector into the headers of the
+ * queued messages and advances the sequence number of the collector.
+ * This is an internal function.
+ */
+static void ipfix_number_queued_messages(ipfix_send_queue *queue, ipfix_receiving_collector *col) {
+	unsigned offset = 0;
+	uint32_t sequence_number;
+	unsigned i;
+
+	for (i = 0; i < queue->count; i++) {
+		if (!queue->compressed[i]) {
+			sequence_number = htonl(col->sequence_number);
+			memcpy(queue->data + offset + offsetof(ipfix_header, sequence_number),
+			       &sequence_number, sizeof(sequence_number));
+		}
+		col->sequence_number += queue->records[i];
+		offset += queue->lengths[i];
+	}
+}
+
+#ifdef SUPPORT_SENDMMSG
+/*
+ * Logs a failed send to a UDP collector. Returns -1 if the collector has
+ * been removed due to the error.
+ * This is an internal function.
+ */
+static int ipfix_udp_send_failed(ipfix_exporter *exporter, ipfix_receiving_collector *col) {
+	msg(MSG_ERROR, "could not send to %s:%d errno: %s  (UDP)",col->ipv4address, col->port_number, strerror(errno));
+	if (errno == EMSGSIZE) {
+		msg(MSG_ERROR, "Updating MTU estimate for collector %s:%d",
+			col->ipv4address,
+			col->port_number);
+		/* If update_collector_mtu fails, it calls
+		   remove_collector(). */
+		update_collector_mtu(exporter, col);
+		if (col->state != C_CONNECTED)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Sends count messages with sendmmsg(). Messages the kernel refuses are
+ * skipped.
+ * Returns the number of system calls or -1 if the collector has been removed.
+ * This is an internal function.
+ */
+static int ipfix_sendmmsg(ipfix_exporter *exporter, ipfix_receiving_collector *col,
+			  struct mmsghdr *msgs, unsigned count) {
+	unsigned sent = 0;
+	int calls = 0;
+	int ret;
+
+	while (sent < count) {
+		ret = sendmmsg(col->data_socket, msgs + sent, count - sent, 0);
+		calls++;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (ipfix_udp_send_failed(exporter, col))
+				return -1;
+			sent++;
+			continue;
+		}
+		sent += ret;
+	}
+
+	return calls;
+}
+
+/*
+ * Sends count messages of segment_size bytes (the last one may be shorter)
+ * stored back to back at data in a single send with UDP segmentation
+ * offload.
+ * Returns 0 on success, 1 if the kernel does not support UDP_SEGMENT and
+ * -1 if the collector has been removed.
+ * This is an internal function.
+ */
+static int ipfix_send_gso(ipfix_exporter *exporter, ipfix_receiving_collector *col,
+			  uint8_t *data, unsigned length, uint16_t segment_size) {
+	char control[CMSG_SPACE(sizeof(uint16_t))];
+	struct iovec iov;
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
 
-#ifdef IPFIXLOLIB_RAWDIR_SUPPORT
-				case RAWDIR:
-					packet_directory_path = col->packet_directory_path;
-					char fnamebuf[1024];
-					sprintf(fnamebuf, "%s/%08d", packet_directory_path, col->packets_written++);
-					int f = creat(fnamebuf, S_IRWXU | S_IRWXG);
-					if(f<0)
-						msg(MSG_ERROR, "could not open RAWDIR file %s", fnamebuf);
-					else if(writev(f, exporter->data_sendbuffer->entries, exporter->data_sendbuffer->committed)<0)
-						msg(MSG_ERROR, "could not write to RAWDIR file %s", fnamebuf);
-					close(f);
-					break;
-#endif
-				case DATAFILE:
-					if(col->bytes_written>0 && (col->bytes_written +
-												ntohs(exporter->data_sendbuffer->packet_header.length)
-												> (uint64_t)(col->maxfilesize) * 1024))
-						ipfix_new_file(col);
+	iov.iov_base = data;
+	iov.iov_len = length;
+
+	memset(&mh, 0, sizeof(mh));
+	memset(control, 0, sizeof(control));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(uint16_t));
+
+	while (sendmsg(col->data_socket, &mh, 0) < 0) {
+		if (errno == EINTR)
+			continue;
+		if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP) {
+			msg(MSG_INFO, "UDP segmentation offload not available (%s), using sendmmsg()", strerror(errno));
+			exporter->send_queue->gso = 0;
+			return 1;
+		}
+		return ipfix_udp_send_failed(exporter, col);
+	}
 
-					if (col->fh < 0) {
-						msg(MSG_ERROR, "invalid file handle for DATAFILE file (==0!)");
-						break;
-					}
-					if (exporter->data_sendbuffer->packet_header.length == 0) {
-						msg(MSG_ERROR, "packet size == 0!");
-						break;
-					}
-					if ((bytes_sent = writev(col->fh, exporter->data_sendbuffer->entries,
-											 exporter->data_sendbuffer->committed)) < 0) {
-						msg(MSG_ERROR, "could not write to DATAFILE file");
-						break;
-					}
+	return 0;
+}
 
-					col->bytes_written += ntohs(exporter->data_sendbuffer->packet_header.length);
+/*
+ * Returns the index behind the run of messages starting at first which can
+ * be sent with a single UDP_SEGMENT send: messages of equal length, the last
+ * of which may be shorter.
+ * This is an internal function.
+ */
+static unsigned ipfix_gso_run_end(const ipfix_send_queue *queue, unsigned first) {
+	uint16_t segment_size = queue->lengths[first];
+	unsigned length = segment_size;
+	unsigned i = first + 1;
+
+	while (i < queue->count && i - first < IPFIX_GSO_MAX_SEGMENTS
+		   && length + queue->lengths[i] <= IPFIX_GSO_MAX_BYTES
+		   && queue->lengths[i] <= segment_size) {
+		length += queue->lengths[i];
+		if (queue->lengths[i++] < segment_size)
+			break;
+	}
 
-					msg(MSG_DEBUG, "packet_header.length: %d \t bytes_written: %d \t Total: %llu",
-						ntohs(exporter->data_sendbuffer->packet_header.length), bytes_sent,
-						col->bytes_written);
-					break;
+	return i;
+}
 
-				default:
-					msg(MSG_FATAL, "Transport Protocol not supported");
-					break; /* Should not occur since we check the transport
-			protocol in valid_transport_protocol()*/
-				}
+/*
+ * Sends all queued messages to a UDP collector.
+ * This is an internal function.
+ */
+static void ipfix_flush_udp_collector(ipfix_exporter *exporter, ipfix_receiving_collector *col) {
+	ipfix_send_queue *queue = exporter->send_queue;
+	struct mmsghdr msgs[IPFIX_SEND_QUEUE_MAX_MESSAGES];
+	struct iovec iov[IPFIX_SEND_QUEUE_MAX_MESSAGES];
+	unsigned offset = 0;
+	unsigned batch = 0;
+	unsigned calls = 0;
+	unsigned i = 0;
+	unsigned end, length;
+	int ret;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	while (i < queue->count) {
+		end = queue->gso ? ipfix_gso_run_end(queue, i) : i + 1;
+
+		if (end - i > 1) {
+			unsigned j;
+
+			for (j = i, length = 0; j < end; j++)
+				length += queue->lengths[j];
+
+			// keep the order of the messages
+			if (batch > 0) {
+				if ((ret = ipfix_sendmmsg(exporter, col, msgs, batch)) < 0)
+					return;
+				calls += ret;
+				batch = 0;
 			}
-		} // end exporter loop
-		// increment sequence number
-		exporter->sequence_number += exporter->sn_increment;
-		exporter->sn_increment = 0;
-	}  // end if
 
-	// reset the sendbuffer
-	ipfix_reset_sendbuffer(exporter->data_sendbuffer);
-	return 0;
+			ret = ipfix_send_gso(exporter, col, queue->data + offset, length, queue->lengths[i]);
+			if (ret < 0)
+				return;
+			if (ret == 0) {
+				calls++;
+				offset += length;
+				i = end;
+				continue;
+			}
+		}
+
+		iov[batch].iov_base = queue->data + offset;
+		iov[batch].iov_len = queue->lengths[i];
+		msgs[batch].msg_hdr.msg_iov = &iov[batch];
+		msgs[batch].msg_hdr.msg_iovlen = 1;
+		batch++;
+
+		offset += queue->lengths[i];
+		i++;
+	}
+
+	if (batch > 0) {
+		if ((ret = ipfix_sendmmsg(exporter, col, msgs, batch)) < 0)
+			return;
+		calls += ret;
+	}
+
+	msg(MSG_VDEBUG, "%u messages (%u bytes) sent to UDP collector %s:%d in %u calls",
+		queue->count, queue->used, col->ipv4address, col->port_number, calls);
+}
+#else
+static void ipfix_flush_udp_collector(ipfix_exporter *exporter, ipfix_receiving_collector *col) {
+	ipfix_send_queue *queue = exporter->send_queue;
+	unsigned offset = 0;
+	unsigned i;
+
+	for (i = 0; i < queue->count && col->state == C_CONNECTED; i++) {
+		if (send(col->data_socket, queue->data + offset, queue->lengths[i], 0) == -1) {
+			msg(MSG_ERROR, "could not send to %s:%d errno: %s  (UDP)",col->ipv4address, col->port_number, strerror(errno));
+			if (errno == EMSGSIZE)
+				update_collector_mtu(exporter, col);
+		}
+		offset += queue->lengths[i];
+	}
 }
+#endif
+
+/*
+ * Sends the messages queued for UDP collectors.
+ * This is an internal function.
+ */
+static void ipfix_flush_queue(ipfix_exporter *exporter)
+{
+	ipfix_send_queue *queue = exporter->send_queue;
+	int i;
+
+	if (queue->count == 0)
+		return;
+
+	for (i = 0; i < exporter->collector_max_num; i++) {
+		ipfix_receiving_collector *col = &exporter->collector_arr[i];
+		if (col->state == C_CONNECTED && col->protocol == UDP) {
+			ipfix_number_queued_messages(queue, col);
+			ipfix_flush_udp_collector(exporter, col);
+		}
+	}
 
+	queue->count = 0;
+	queue->used = 0;
+}
 
 /*!
- * \brief Send data to Collectors.
+ * \brief Send the messages queued for UDP collectors and the messages
+ * collected for collectors accepting larger messages.
  *
- * Sends all data committed via <tt>ipfix_put_data_field</tt> to this exporter.
- * If necessary, sends all associated templates.
+ * Does nothing unless deferred flushing has been enabled with
+ * ipfix_set_deferred_flush().
  *
  * \param exporter pointer to previously initialized exporter struct
- * \return >=0 success
- * \return -1 failure
- * \sa ipfix_start_template(), ipfix_start_data_set()
- */
-/*
+ * \return 0 This value is <em>always</em> returned.
+ * \sa ipfix_set_deferred_flush()
  */
-int ipfix_send(ipfix_exporter *exporter)
+int ipfix_flush(ipfix_exporter *exporter)
 {
-        int ret = 0;
+	int i;
 
-        if(ipfix_send_templates(exporter) < 0) {
-                msg(MSG_ERROR, "sending templates failed");
-                ret = -1;
-        }
-        if(ipfix_send_data(exporter) < 0) {
-                msg(MSG_ERROR, "sending data failed");
-                ret = -1;
-        }
+	if (!exporter->send_queue)
+		return 0;
 
-        return ret;
+	ipfix_flush_queue(exporter);
+
+	for (i = 0; i < exporter->collector_max_num; i++)
+		ipfix_flush_collected_messages(exporter, i);
+
+	return 0;
 }
 
 /*******************************************************************/
@@ -2776,23 +4476,33 @@ uint16_t ipfix_get_remaining_space(ipfix_exporter *exporter) {
  * </ul>
  *
  * \param exporter pointer to previously initialized exporter struct
- * \param data pointer to data that should be added to the send buffer. Please
- * note, that this <em>pointer</em> will be stored in the send buffer instead
- * of copying the data. As a consequence, the data <em>must</em> stay at the
- * given memory location until the IPFIX message has been sent via
- * ipfix_send().
+ * \param data pointer to data that should be added to the send buffer. By
+ * default, the data is copied into the send buffer and may be modified or
+ * released as soon as this function returns. If copying has been disabled
+ * with ipfix_set_copy_data_fields(), the <em>pointer</em> will be stored in
+ * the send buffer instead of copying the data. As a consequence, the data
+ * <em>must</em> stay at the given memory location until the IPFIX message has
+ * been sent via ipfix_send().
  * \param length length of data pointed to by <tt>data</tt>
  * \return 0 success
  * \return -1 failure. Reasons include:<ul><li>no open data set</li><li>send
  * buffer too small</li></ul>
- * \sa ipfix_get_remaining_space()
+ * \sa ipfix_get_remaining_space(), ipfix_reserve_data_field()
  */
 int ipfix_put_data_field(ipfix_exporter *exporter,void *data, unsigned length) {
     ipfix_sendbuffer *dsb = exporter->data_sendbuffer;
+    void *dst;
+
     if(exporter->data_sendbuffer->current == exporter->data_sendbuffer->committed) {
 	msg(MSG_ERROR, "ipfix_put_data_field called but there is no started set.");
 	return -1;
     }
+    if (exporter->copy_data_fields) {
+	if (!(dst = ipfix_reserve_data_field(exporter, length)))
+	    return -1;
+	memcpy(dst, data, length);
+	return ipfix_commit_data_field(exporter, length);
+    }
     if (dsb->current >= IPFIX_MAX_SENDBUFSIZE) {
 	msg(MSG_ERROR, "Sendbuffer too small to handle  %i entries!\n", dsb->current );
 	return -1;
@@ -2804,6 +4514,123 @@ int ipfix_put_data_field(ipfix_exporter *exporter,void *data, unsigned length) {
     return 0;
 }
 
+/*
+ * Returns 1 if the next length bytes of the contiguous data buffer can be
+ * appended to the last entry of the sendbuffer. Only entries added after the
+ * marker are extended so that ipfix_delete_data_fields_upto_marker() and
+ * ipfix_cancel_data_set() can still remove whole entries.
+ * This is an internal function.
+ */
+static int ipfix_data_extends_last_entry(ipfix_sendbuffer *dsb) {
+    struct iovec *last = &dsb->entries[dsb->current - 1];
+
+    return dsb->current > dsb->marker
+	&& (uint8_t *) last->iov_base + last->iov_len == dsb->data + dsb->data_used;
+}
+
+/*!
+ * \brief Reserve space for a data field in the send buffer.
+ *
+ * Returns a pointer into the contiguous data buffer of the current IPFIX
+ * message into which the caller can encode up to <tt>length</tt> bytes of
+ * records. The data becomes part of the open data set once it is committed
+ * with <tt>ipfix_commit_data_field()</tt>. Nothing has to be committed if
+ * the reserved space turns out not to be needed. The pointer is only valid
+ * until the next call of any other data set function.
+ *
+ * As with <tt>ipfix_put_data_field()</tt>, the user is responsible for not
+ * exceeding the maximum message size given by
+ * <tt>ipfix_get_remaining_space()</tt>.
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \param length maximum number of bytes the caller is going to write
+ * \return pointer to the reserved space
+ * \return NULL failure. Reasons include:<ul><li>no open data set</li><li>send
+ * buffer too small</li></ul>
+ * \sa ipfix_commit_data_field()
+ */
+void *ipfix_reserve_data_field(ipfix_exporter *exporter, unsigned length) {
+    ipfix_sendbuffer *dsb = exporter->data_sendbuffer;
+
+    if (dsb->current == dsb->committed) {
+	msg(MSG_ERROR, "ipfix_reserve_data_field called but there is no started set.");
+	return NULL;
+    }
+    if (length > dsb->data_capacity - dsb->data_used) {
+	msg(MSG_ERROR, "Sendbuffer too small to hold %u more bytes!", length);
+	return NULL;
+    }
+    if (dsb->current >= IPFIX_MAX_SENDBUFSIZE && !ipfix_data_extends_last_entry(dsb)) {
+	msg(MSG_ERROR, "Sendbuffer too small to handle  %i entries!", dsb->current);
+	return NULL;
+    }
+
+    return dsb->data + dsb->data_used;
+}
+
+/*!
+ * \brief Add the first <tt>length</tt> bytes of the space returned by
+ * <tt>ipfix_reserve_data_field()</tt> to the open data set.
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \param length number of bytes written into the reserved space
+ * \return 0 success
+ * \return -1 failure. Reasons include:<ul><li>no open data set</li><li>send
+ * buffer too small</li></ul>
+ * \sa ipfix_reserve_data_field()
+ */
+int ipfix_commit_data_field(ipfix_exporter *exporter, unsigned length) {
+    ipfix_sendbuffer *dsb = exporter->data_sendbuffer;
+
+    if (dsb->current == dsb->committed) {
+	msg(MSG_ERROR, "ipfix_commit_data_field called but there is no started set.");
+	return -1;
+    }
+    if (length == 0)
+	return 0;
+    if (length > dsb->data_capacity - dsb->data_used) {
+	msg(MSG_ERROR, "Sendbuffer too small to hold %u more bytes!", length);
+	return -1;
+    }
+
+    if (ipfix_data_extends_last_entry(dsb)) {
+	dsb->entries[dsb->current - 1].iov_len += length;
+    } else {
+	if (dsb->current >= IPFIX_MAX_SENDBUFSIZE) {
+	    msg(MSG_ERROR, "Sendbuffer too small to handle  %i entries!", dsb->current);
+	    return -1;
+	}
+	dsb->entries[dsb->current].iov_base = dsb->data + dsb->data_used;
+	dsb->entries[dsb->current].iov_len = length;
+	dsb->current++;
+    }
+
+    dsb->data_used += length;
+    dsb->set_manager.data_length += length;
+    return 0;
+}
+
+/*!
+ * \brief Select whether ipfix_put_data_field() copies the data into the send
+ * buffer (the default) or only stores a pointer to it.
+ *
+ * Copying packs the records of a data set into a single contiguous buffer
+ * which avoids the limit of IPFIX_MAX_SENDBUFSIZE fields per message and
+ * allows the caller to reuse its buffers right away. Storing pointers avoids
+ * the copy for callers which keep their data until ipfix_send() and which
+ * add few large fields.
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \param enabled 1 to copy the data, 0 to store pointers
+ * \return 0 This value is <em>always</em> returned.
+ * \sa ipfix_put_data_field()
+ */
+int ipfix_set_copy_data_fields(ipfix_exporter *exporter, int enabled)
+{
+    exporter->copy_data_fields = enabled;
+    return 0;
+}
+
 /*!
  * \brief Marks the end of a data set
  *
@@ -2847,6 +4674,18 @@ int ipfix_end_data_set(ipfix_exporter *exporter, uint16_t number_of_records)
 }
 
 
+/*
+ * Returns the space of an entry to the contiguous data buffer if the entry
+ * refers to it. Only the most recently added entries may be released.
+ * This is an internal function.
+ */
+static void ipfix_release_data(ipfix_sendbuffer *dsb, struct iovec *entry) {
+    uint8_t *base = (uint8_t *) entry->iov_base;
+
+    if (dsb->data != NULL && base >= dsb->data && base < dsb->data + dsb->data_capacity)
+	dsb->data_used -= entry->iov_len;
+}
+
 /*!
  * \brief Cancel a previously started data set
  *
@@ -2878,6 +4717,7 @@ int ipfix_cancel_data_set(ipfix_exporter *exporter)
 
         // clean up entries
 	for(i=exporter->data_sendbuffer->committed; i<exporter->data_sendbuffer->current; i++) {
+	    ipfix_release_data(exporter->data_sendbuffer, &exporter->data_sendbuffer->entries[i]);
 	    exporter->data_sendbuffer->entries[i].iov_base = NULL;
 	    exporter->data_sendbuffer->entries[i].iov_len = 0;
 	}
@@ -2926,6 +4766,7 @@ int ipfix_delete_data_fields_upto_marker(ipfix_exporter *exporter)
 	    for(i=exporter->data_sendbuffer->marker; i<exporter->data_sendbuffer->current; i++) {
 		// decrease data_length
 		manager->data_length -= exporter->data_sendbuffer->entries[i].iov_len;
+		ipfix_release_data(exporter->data_sendbuffer, &exporter->data_sendbuffer->entries[i]);
 		exporter->data_sendbuffer->entries[i].iov_base = NULL;
 		exporter->data_sendbuffer->entries[i].iov_len = 0;
 	    }
@@ -2942,6 +4783,51 @@ out:
 /* Generation of a data template set and option template set       */
 /*******************************************************************/
 
+/*
+ * Returns the slot of the template with the given ID after cleaning up a
+ * previous definition of this template, or a free slot if the template is
+ * unknown.
+ * Returns -1 if no free slot is available.
+ * This is an internal function.
+ */
+static int ipfix_prepare_template_slot(ipfix_exporter *exporter, uint16_t template_id) {
+    int found_index = ipfix_find_template(exporter, template_id);
+
+    // have we found a template?
+    if(found_index >= 0) {
+	// we must overwrite the old template.
+	// first, clean up the old template:
+	switch (exporter->template_arr[found_index].state){
+	    case T_SENT:
+		// create a withdrawal message first
+		ipfix_remove_template(exporter, exporter->template_arr[found_index].template_id);
+		/* fall through */
+	    case T_WITHDRAWN:
+		// send withdrawal messages
+		ipfix_send_templates(exporter);
+		/* fall through */
+	    case T_COMMITED:
+	    case T_UNCLEAN:
+	    case T_TOBEDELETED:
+		// nothing to do, template can be deleted
+		ipfix_deinit_template(exporter, &(exporter->template_arr[found_index]));
+		break;
+	    default:
+		DPRINTFL(MSG_VDEBUG, "template valid flag is T_UNUSED or invalid\n");	
+		break;
+	}
+    } else {
+	/* allocate a new, free slot */
+	found_index = ipfix_get_free_template_slot(exporter);
+	if (found_index < 0) {
+	    msg(MSG_ERROR,"Unable to find free template slot.");
+	    return -1;
+	}
+    }
+
+    return found_index;
+}
+
 /*!
  * \brief Marks the beginning of a Data Template Set and a Template Record
  *
@@ -3001,43 +4887,13 @@ int ipfix_start_datatemplate (ipfix_exporter *exporter,
        Data Templates are (still) a proprietary extension to IPFIX. */
     int datatemplate=(fixedfield_count || preceding) ? 1 : 0;
     /* Make sure that template_id is > 255 */
-    if ( ! template_id > 255 ) {
+    if (template_id <= 255) {
 	msg(MSG_ERROR, "Template id has to be > 255. Start of template cancelled.");
 	return -1;
     }
-    int found_index = ipfix_find_template(exporter, template_id);
-
-    // have we found a template?
-    if(found_index >= 0) {
-	// we must overwrite the old template.
-	// first, clean up the old template:
-	switch (exporter->template_arr[found_index].state){
-	    case T_SENT:
-		// create a withdrawal message first
-		ipfix_remove_template(exporter, exporter->template_arr[found_index].template_id);
-		/* fall through */
-	    case T_WITHDRAWN:
-		// send withdrawal messages
-		ipfix_send_templates(exporter);
-		/* fall through */
-	    case T_COMMITED:
-	    case T_UNCLEAN:
-	    case T_TOBEDELETED:
-		// nothing to do, template can be deleted
-		ipfix_deinit_template(exporter, &(exporter->template_arr[found_index]));
-		break;
-	    default:
-		DPRINTFL(MSG_VDEBUG, "template valid flag is T_UNUSED or invalid\n");	
-		break;
-	}
-    } else {
-	/* allocate a new, free slot */
-	found_index = ipfix_get_free_template_slot(exporter);
-	if (found_index < 0) {
-	    msg(MSG_ERROR,"Unable to find free template slot.");
-	    return -1;
-	}
-    }
+    int found_index = ipfix_prepare_template_slot(exporter, template_id);
+    if (found_index < 0)
+	return -1;
 
     char *p_pos;
     char *p_end;
@@ -3088,25 +4944,88 @@ int ipfix_start_datatemplate (ipfix_exporter *exporter,
     }
     // ++ End of Template Record Header
 
-    exporter->template_arr[found_index].fields_length = (datatemplate ? 12 : 8);
+    exporter->template_arr[found_index].fields_length = (datatemplate ? 12 : 8);
+
+    return 0;
+}
+/*!
+ * \brief Start defining a new Options Template (Set).
+ *
+ * Options Templates (RFC 5101: 3.4.2.2) describe records carrying
+ * information about the Exporting Process itself. The first
+ * <tt>scope_field_count</tt> fields added with ipfix_put_template_field()
+ * are Scope Fields identifying the entity the record refers to, the remaining
+ * <tt>option_field_count</tt> fields carry the actual values.
+ *
+ * Like ipfix_start_template(), only one Template Record per Set is supported
+ * and the Options Template has to be finished with ipfix_end_template().
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \param template_id the template's ID (in host byte order). Must be > 255.
+ * \param scope_field_count number of Scope Fields (in host byte order). Must be > 0.
+ * \param option_field_count number of non-scope fields (in host byte order)
+ * \return 0 success
+ * \return -1 failure
+ * \sa ipfix_put_template_field(), ipfix_end_template()
+ */
+int ipfix_start_optionstemplate(ipfix_exporter *exporter,
+	uint16_t template_id, uint16_t scope_field_count, uint16_t option_field_count)
+{
+    char *p_pos;
+    char *p_end;
+    uint16_t field_count = scope_field_count + option_field_count;
+
+    /* Make sure that template_id is > 255 */
+    if (template_id <= 255) {
+	msg(MSG_ERROR, "Template id has to be > 255. Start of options template cancelled.");
+	return -1;
+    }
+
+    if (scope_field_count == 0) {
+	msg(MSG_ERROR, "Options template %u requires at least one scope field.", template_id);
+	return -1;
+    }
+
+    int found_index = ipfix_prepare_template_slot(exporter, template_id);
+    if (found_index < 0)
+	return -1;
+
+    ipfix_lo_template *templ = &exporter->template_arr[found_index];
+
+    // 4 bytes Set Header and 6 bytes Options Template Record Header
+    templ->max_fields_length = 8 * field_count + 10;
+    templ->template_fields = (char*)malloc(templ->max_fields_length);
+    if (templ->template_fields == NULL) {
+	msg(MSG_ERROR, "Failed to allocate memory for options template %u.", template_id);
+	return -1;
+    }
+
+    templ->state = T_UNCLEAN;
+    templ->template_id = template_id;
+    templ->field_count = field_count;
+    templ->fixedfield_count = 0;
+    templ->fields_added = 0;
+
+    p_pos = templ->template_fields;
+    p_end = p_pos + templ->max_fields_length;
+
+    // ++ Start of Set Header
+    // set ID is 3 for an Options Template Set
+    write_unsigned16 (&p_pos, p_end, 3);
+    // write 0 to the length field; this will be overwritten by end_template
+    write_unsigned16 (&p_pos, p_end, 0);
+    // ++ End of Set Header
+
+    // ++ Start of Options Template Record Header
+    write_unsigned16 (&p_pos, p_end, template_id);
+    write_unsigned16 (&p_pos, p_end, field_count);
+    write_unsigned16 (&p_pos, p_end, scope_field_count);
+    // ++ End of Options Template Record Header
+
+    templ->fields_length = 10;
 
     return 0;
 }
-/*!
- * \brief Marks the beginning of an option template set. (Not yet implemented)
- *
- * \param exporter pointer to previously initialized exporter struct
- * \param template_id the template's ID (in host byte order)
- * \param scope_length the option scope length (in host byte oder)
- * \param option_length the option scope length (in host byte oder)
- * \return -1 Not yet implemented. This value is <em>always</em> returned.
- */
-int ipfix_start_optionstemplate(ipfix_exporter *exporter,
-	uint16_t template_id, uint16_t scope_length, uint16_t option_length)
-{
-        msg(MSG_FATAL, "start_optionstemplate() not implemented");
-        return -1;
-}
 
 /*!
  * \brief Add a field to the previously started template, options template, or data
@@ -3426,6 +5345,195 @@ int ipfix_set_sctp_reconnect_timer(ipfix_exporter *exporter, uint32_t timer) {
     return 0;
 }
 
+/*!
+ * \brief Set the size of the backlog of TCP collectors
+ *
+ * Messages which the socket of a TCP Collector does not accept right away
+ * wait in a backlog until the socket becomes writable. Data Sets are dropped
+ * as long as the backlog would exceed the given size, Templates never are.
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \param size maximum number of bytes waiting for a single Collector
+ * \return 0 This value is always returned.
+ * \sa ipfix_backpressure()
+ */
+int ipfix_set_tcp_backlog(ipfix_exporter *exporter, unsigned size) {
+    exporter->tcp_backlog_size = size;
+    return 0;
+}
+
+/*!
+ * \brief Set what happens to Data Sets for collectors which are not connected
+ *
+ * By default, Data Sets are dropped until a Collector is connected. With
+ * IPFIX_UNCONNECTED_BUFFER, TCP Collectors keep them in their backlog while
+ * the connection is set up or lost, subject to the size set by
+ * ipfix_set_tcp_backlog(), and receive them after the Templates once they
+ * are connected. Data Sets for other Collectors are always dropped.
+ * Whatever waits for a Collector when its connection is lost is discarded,
+ * as the Collector cannot tell which part of it was received.
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \param policy IPFIX_UNCONNECTED_DROP or IPFIX_UNCONNECTED_BUFFER
+ * \return 0 This value is always returned.
+ */
+int ipfix_set_unconnected_policy(ipfix_exporter *exporter, enum ipfix_unconnected_policy policy) {
+    exporter->unconnected_policy = policy;
+    return 0;
+}
+
+/*!
+ * \brief Keep messages on disk while collectors are unreachable
+ *
+ * Every TCP, SCTP and DTLS Collector added afterwards gets a spill queue in
+ * the given directory, preferably on a tmpfs. Messages for a Collector which
+ * is not connected, falls behind (see ipfix_backpressure()) or refused a
+ * message are appended to memory mapped segment files of its queue instead
+ * of being dropped. Once the Collector is connected again, ipfix_beat()
+ * replays them in order, at most <tt>rate</tt> bytes per second, before new
+ * messages are sent directly again. Replayed messages are renumbered for the
+ * new transport session.
+ *
+ * If a queue exceeds <tt>size</tt> bytes, its oldest segment is discarded.
+ * Messages still waiting in the backlog of a TCP Collector when its
+ * connection is lost are not spilled. Segment files left behind in the
+ * directory are removed when the Collector is added, so messages do not
+ * survive a restart of the application. Spilling takes precedence over
+ * ipfix_set_unconnected_policy().
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \param directory directory of the segment files, NULL disables spilling
+ * \param size maximum number of bytes in the queue of each Collector
+ * \param rate maximum number of bytes replayed per second, 0 for no limit
+ * \return 0 success
+ * \return -1 failure. Reasons include:<ul><li>memory allocation failed</li></ul>
+ */
+int ipfix_set_spill_queue(ipfix_exporter *exporter, const char *directory, unsigned size, unsigned rate) {
+    free(exporter->spill_directory);
+    exporter->spill_directory = NULL;
+    if (directory && !(exporter->spill_directory = strdup(directory)))
+	return -1;
+    exporter->spill_size = size;
+    exporter->spill_rate = rate;
+    return 0;
+}
+
+/*!
+ * \brief Register a function which watches the sockets of collectors
+ *
+ * Sockets of TCP, SCTP and DTLS Collectors never block. The watcher is called whenever the
+ * events a socket has to be watched for change, with <tt>old_events</tt>
+ * 0 for a new socket and <tt>events</tt> 0 before the socket is closed.
+ * Events are combinations of IPFIX_SOCKET_READ and IPFIX_SOCKET_WRITE. The
+ * events which occur have to be reported by calling ipfix_socket_event(),
+ * usually from the event loop of the application.
+ *
+ * With a watcher, ipfix_beat() has to be called from a timer to reconnect
+ * lost Collectors. Without a watcher, the connection setup and the backlog
+ * only make progress when ipfix_send() is called.
+ *
+ * This function must be called before Collectors are added.
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \param watcher function called with the socket, the events it was watched
+ * for so far and the events it has to be watched for from now on
+ * \param user_param passed to the watcher
+ * \return 0 This value is always returned.
+ * \sa ipfix_socket_event()
+ */
+int ipfix_set_socket_watcher(ipfix_exporter *exporter,
+			     void (*watcher)(int fd, int old_events, int events, void *user_param),
+			     void *user_param) {
+    exporter->socket_watcher = watcher;
+    exporter->socket_watcher_param = user_param;
+    return 0;
+}
+
+/*!
+ * \brief Handle events on a socket of a collector
+ *
+ * Pushes the connection setup and DTLS handshakes forward, sends the backlog
+ * of TCP Collectors once the socket is writable and detects when the
+ * Collector closes the connection. Errors of the socket may be reported as
+ * either event.
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \param fd the socket as passed to the watcher
+ * \param events the IPFIX_SOCKET_* events which occurred
+ * \sa ipfix_set_socket_watcher()
+ */
+void ipfix_socket_event(ipfix_exporter *exporter, int fd, int events) {
+    int i;
+    for (i = 0; i < exporter->collector_max_num; i++) {
+	ipfix_receiving_collector *col = &exporter->collector_arr[i];
+	if (col->state == C_UNUSED)
+	    continue;
+
+	switch (col->protocol) {
+#ifdef SUPPORT_DTLS
+	case DTLS_OVER_UDP:
+	case DTLS_OVER_SCTP:
+	    if (col->dtls_main.socket == fd && col->state == C_CONNECTED) {
+		if (events & IPFIX_SOCKET_READ)
+		    dtls_read(exporter, col);
+	    } else if (col->dtls_main.socket == fd || col->dtls_replacement.socket == fd) {
+		/* handshake of the main or the replacement connection */
+		dtls_manage_connection(exporter, col);
+	    } else
+		continue;
+	    return;
+#endif
+#ifdef SUPPORT_SCTP
+	case SCTP:
+	    if (col->data_socket != fd)
+		continue;
+	    if (col->state == C_NEW)
+		sctp_reconnect(exporter, i);
+	    else if (col->state == C_CONNECTED && (events & IPFIX_SOCKET_READ))
+		sctp_read(exporter, i);
+	    return;
+#endif
+	case TCP:
+	    if (col->data_socket != fd)
+		continue;
+	    if (col->state == C_NEW) {
+		tcp_check_connection(exporter, col);
+	    } else if (col->state == C_CONNECTED) {
+		if (events & IPFIX_SOCKET_READ)
+		    tcp_read(exporter, col);
+		if (col->state == C_CONNECTED && (events & IPFIX_SOCKET_WRITE))
+		    tcp_drain(exporter, col);
+	    }
+	    return;
+	default:
+	    continue;
+	}
+    }
+}
+
+/*!
+ * \brief Check whether TCP collectors fall behind
+ *
+ * Backpressure is signalled once the backlog of a TCP Collector fills more
+ * than three quarters of the size set by ipfix_set_tcp_backlog() and until
+ * it has been drained below one quarter. Data exported meanwhile is likely
+ * to be dropped, so the caller should postpone it.
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \return 1 at least one Collector falls behind
+ * \return 0 otherwise
+ * \sa ipfix_set_tcp_backlog()
+ */
+int ipfix_backpressure(ipfix_exporter *exporter) {
+    int i;
+    for (i = 0; i < exporter->collector_max_num; i++) {
+	if (exporter->collector_arr[i].state != C_UNUSED &&
+	    exporter->collector_arr[i].backpressure)
+	    return 1;
+    }
+    return 0;
+}
+
 /*!
  * \brief Setup X.509 certificate used for authentication
  *
@@ -3592,51 +5700,540 @@ static void
 #endif
 
 #ifdef SUPPORT_COMPRESSION
-int ipfix_init_compression(ipfix_exporter *exporter,
-						   const char *module_name,
-						   const char *module_parameters) {
-	if (exporter->compression_handle) {
-		dlclose(exporter->compression_handle);
+/*
+ * Releases the compressor states and unloads the compression modules.
+ * This is an internal function.
+ */
+static void ipfix_release_compression(ipfix_exporter *exporter) {
+	int i;
+
+	for (i = 0; i < exporter->compressor_count; i++) {
+		ipfix_compressor *c = &exporter->compressors[i];
+		if (c->deinit)
+			c->deinit(&c->state);
+		dlclose(c->handle);
+	}
+	memset(exporter->compressors, 0, sizeof(exporter->compressors));
+	exporter->compressor_count = 0;
+	exporter->compressor_current = 0;
+}
 
-		exporter->compression_handle = NULL;
-		exporter->compression_function = NULL;
+/*
+ * Makes the next message of every compressor independent of the earlier
+ * ones, as a collector has missed a message.
+ * This is an internal function.
+ */
+static void ipfix_restart_compression(ipfix_exporter *exporter) {
+	int i;
+
+	for (i = 0; i < exporter->compressor_count; i++)
+		exporter->compressors[i].state.restart = 1;
+}
+
+/*
+ * Loads a compression module and appends it to the compressors of the
+ * exporter. The module is initialised with module_parameters unless they
+ * are NULL.
+ * This is an internal function.
+ */
+static int ipfix_load_compressor(ipfix_exporter *exporter,
+				 const char *module_name,
+				 const char *module_parameters, int level) {
+	ipfix_compressor *c;
+
+	if (exporter->compressor_count >= IPFIX_MAX_COMPRESSORS) {
+		msg(MSG_ERROR, "Cannot use more than %d compression modules", IPFIX_MAX_COMPRESSORS);
+		return -1;
 	}
+	c = &exporter->compressors[exporter->compressor_count];
 
 	char filename[FILENAME_MAX];
-	snprintf(filename, FILENAME_MAX, "ipfixlolib/lib%s.so",
+	memset(c, 0, sizeof(*c));
+
+	// modules named after their library carry the prefix ipfix_
+	snprintf(filename, FILENAME_MAX, "ipfixlolib/libipfix_%s.so",
 			 module_name);
 	filename[FILENAME_MAX - 1] = 0;
-
-	exporter->compression_handle = dlopen(filename, RTLD_NOW);
-	if (!exporter->compression_handle) {
+	c->handle = dlopen(filename, RTLD_NOW);
+	if (!c->handle) {
+		snprintf(filename, FILENAME_MAX, "ipfixlolib/lib%s.so",
+				 module_name);
+		filename[FILENAME_MAX - 1] = 0;
+		c->handle = dlopen(filename, RTLD_NOW);
+	}
+	if (!c->handle) {
 		msg(MSG_ERROR, "Failed to open compression module (%s): %s", filename, dlerror());
 		return -1;
 	}
 
-	void *init_func = dlsym(exporter->compression_handle,
-							"ipfix_init_compression_module");
-	if (init_func) {
+	void *init_func = dlsym(c->handle, "ipfix_init_compression_module");
+	if (init_func && module_parameters) {
 		((void (*) (const char *)) init_func)(module_parameters);
 	}
 
-	exporter->compression_function = dlsym(exporter->compression_handle,
-										   "ipfix_compress");
-	if (!exporter->compression_function) {
-		dlclose(exporter->compression_handle);
-		exporter->compression_handle = NULL;
+	c->compress = dlsym(c->handle, "ipfix_compress");
+	if (!c->compress) {
+		dlclose(c->handle);
+		c->handle = NULL;
 
 		msg(MSG_ERROR, "Invalid compression library: %s", dlerror());
 		return -1;
 	}
+	c->deinit = dlsym(c->handle, "ipfix_deinit_compression_state");
+
+	// the first message starts a new stream
+	c->state.restart = 1;
+	c->state.load_dictionary = 1;
+	c->state.dictionary = exporter->compression_dictionary;
+	c->state.dictionary_length = exporter->compression_dictionary_length;
+	c->state.level = level;
+	exporter->compressor_count++;
+
+	return 0;
+}
+
+/*!
+ * \brief Loads a compression module which compresses all Data messages.
+ *
+ * The module <tt>ipfixlolib/libipfix_&lt;module_name&gt;.so</tt>, or
+ * <tt>ipfixlolib/lib&lt;module_name&gt;.so</tt> if there is none, has to export
+ * <tt>int ipfix_compress(ipfix_exporter *, ipfix_compression_state *)</tt>
+ * which replaces the data sendbuffer with the compressed message. It may
+ * export <tt>void ipfix_init_compression_module(const char *)</tt>, which
+ * receives <tt>module_parameters</tt>, and
+ * <tt>void ipfix_deinit_compression_state(ipfix_compression_state *)</tt>,
+ * which releases the compressor context the module keeps in the state.
+ *
+ * Compression modules added by ipfix_add_compression() are unloaded.
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \param module_name name of the compression module
+ * \param module_parameters parameters of the module, e.g. the compression level
+ * \return 0 on success, -1 on failure
+ */
+int ipfix_init_compression(ipfix_exporter *exporter,
+						   const char *module_name,
+						   const char *module_parameters) {
+	// Queued and collected messages have been built uncompressed
+	ipfix_flush(exporter);
+
+	ipfix_release_compression(exporter);
+
+	return ipfix_load_compressor(exporter, module_name, module_parameters, 0);
+}
+
+/*!
+ * \brief Adds a cheaper compressor for adaptive compression.
+ *
+ * Adaptive compression moves on to the next compressor if the previous one
+ * exceeds the CPU budget, see ipfix_set_adaptive_compression(). Compressors
+ * are numbered in the order they are added, starting with 1 after the one
+ * loaded by ipfix_init_compression(). A module may be added several times
+ * with different levels.
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \param module_name name of the compression module
+ * \param module_parameters parameters passed to the module, NULL to leave
+ * the module as it is if it has been loaded before
+ * \param level compression level, 0 for the level given to the module
+ * \return 0 on success, -1 on failure
+ * \sa ipfix_init_compression()
+ */
+int ipfix_add_compression(ipfix_exporter *exporter,
+			  const char *module_name,
+			  const char *module_parameters, int level) {
+	if (exporter->compressor_count == 0) {
+		msg(MSG_ERROR, "ipfix_init_compression() has to be called first");
+		return -1;
+	}
+
+	return ipfix_load_compressor(exporter, module_name, module_parameters, level);
+}
+
+/*!
+ * \brief Chooses the compression of each message.
+ *
+ * Messages shorter than <tt>min_size</tt> bytes, and messages which do not
+ * become shorter, are sent uncompressed. Once compressing took more than
+ * <tt>cpu_budget</tt> percent of the time during the last
+ * IPFIX_COMPRESSION_WINDOW milliseconds, the next cheaper compressor added
+ * by ipfix_add_compression() is used, and after the cheapest one none at
+ * all. Once it took less than half of the budget, or less than the budget
+ * while collectors fall behind, during IPFIX_COMPRESSION_STEP_UP_WINDOWS
+ * windows in a row, the next stronger compressor is used. Whenever that one
+ * exceeds the budget in its first window, the number of windows is doubled,
+ * up to IPFIX_COMPRESSION_MAX_STEP_UP_WINDOWS, so that a compressor which
+ * is too expensive is only tried now and then.
+ *
+ * Each compressed message is preceded by an ipfix_compression_header
+ * telling the collector which compressor to use, while uncompressed
+ * messages start with the Message Header as usual.
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \param min_size messages shorter than this are not compressed
+ * \param cpu_budget percentage of the time which may be spent compressing,
+ * 0 for no limit
+ * \return 0 on success
+ */
+int ipfix_set_adaptive_compression(ipfix_exporter *exporter,
+				   unsigned min_size, unsigned cpu_budget) {
+	ipfix_flush(exporter);
+
+	exporter->compression_adaptive = 1;
+	exporter->compression_min_size = min_size;
+	exporter->compression_cpu_budget = cpu_budget;
+	exporter->compressor_current = 0;
+	exporter->compression_ns = 0;
+	exporter->compression_calm_windows = 0;
+	exporter->compression_step_up_windows = IPFIX_COMPRESSION_STEP_UP_WINDOWS;
+	exporter->compression_stepped_up = 0;
+	clock_gettime(CLOCK_MONOTONIC, &exporter->compression_window);
+
+	return 0;
+}
+
+/*!
+ * \brief Keeps the compression history across messages.
+ *
+ * Messages to a single TCP, SCTP or file collector are compressed as one
+ * stream: every message ends on a flush boundary, and later messages refer
+ * to the data of earlier ones. The collector has to feed all compressed
+ * messages of a transport session into one decompressor, preloaded with the
+ * dictionary, and start it afresh with the dictionary whenever a stream
+ * ends. After a message has been lost, the next one does not refer to any
+ * earlier data.
+ *
+ * Messages are compressed one by one as long as the exporter has more than
+ * one collector, a UDP collector, a spill queue or partially reliable SCTP.
+ * Only modules which support it stream, see the module sources.
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \param streaming 1 to keep the history across messages, 0 to compress
+ * each message on its own (default)
+ * \return 0 on success
+ */
+int ipfix_set_compression_streaming(ipfix_exporter *exporter, int streaming) {
+	// a pending message belongs to the current mode
+	ipfix_flush(exporter);
+
+	exporter->compression_streaming = streaming != 0;
+
+	return 0;
+}
+
+/*!
+ * \brief Sets the preset dictionary of the compressors.
+ *
+ * Each compressed message, or each stream if streaming is enabled, starts
+ * with the dictionary as history. The collector has to use the same
+ * dictionary, see ipfix_build_compression_dictionary(). Only the last
+ * IPFIX_MAX_DICTIONARY_SIZE bytes are used. Modules without dictionary
+ * support ignore it.
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \param dictionary the dictionary, which is copied, or NULL to remove it
+ * \param length length of the dictionary in bytes
+ * \return 0 on success, -1 on failure
+ */
+int ipfix_set_compression_dictionary(ipfix_exporter *exporter,
+				     const unsigned char *dictionary, unsigned length) {
+	unsigned char *copy = NULL;
+	int i;
+
+	// a pending message belongs to the current dictionary
+	ipfix_flush(exporter);
+
+	if (dictionary && length > IPFIX_MAX_DICTIONARY_SIZE) {
+		dictionary += length - IPFIX_MAX_DICTIONARY_SIZE;
+		length = IPFIX_MAX_DICTIONARY_SIZE;
+	}
+	if (dictionary && length > 0) {
+		if (!(copy = malloc(length))) {
+			msg(MSG_ERROR, "Failed to allocate compression dictionary");
+			return -1;
+		}
+		memcpy(copy, dictionary, length);
+	} else {
+		length = 0;
+	}
+
+	free(exporter->compression_dictionary);
+	exporter->compression_dictionary = copy;
+	exporter->compression_dictionary_length = length;
+	for (i = 0; i < exporter->compressor_count; i++) {
+		ipfix_compression_state *state = &exporter->compressors[i].state;
+		state->dictionary = copy;
+		state->dictionary_length = length;
+		state->load_dictionary = 1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Builds a preset dictionary from the layouts of the templates.
+ *
+ * The dictionary contains a Message Header carrying the version and the
+ * Observation Domain ID, followed by the Set Header and a zeroed Data Record
+ * of each template and options template in the order of the template IDs.
+ * Variable-length fields are assumed to be empty. A collector builds the same dictionary from the
+ * templates it has received. The dictionary ends once the buffer is full.
+ *
+ * \param exporter pointer to previously initialized exporter struct
+ * \param buffer receives the dictionary
+ * \param size size of the buffer
+ * \return length of the dictionary, -1 if the buffer cannot hold the
+ * Message Header
+ */
+int ipfix_build_compression_dictionary(ipfix_exporter *exporter,
+				       unsigned char *buffer, unsigned size) {
+	ipfix_header header;
+	unsigned length = 0;
+	int next_id = 0;
+	int i;
+
+	if (size < sizeof(header))
+		return -1;
+	memset(&header, 0, sizeof(header));
+	header.version = htons(IPFIX_VERSION_NUMBER);
+	header.observation_domain_id = htonl(exporter->observation_domain_id);
+	memcpy(buffer, &header, sizeof(header));
+	length = sizeof(header);
+
+	// repeated selection sort over the template IDs
+	while (next_id <= 0xffff) {
+		ipfix_lo_template *templ = NULL;
+		uint16_t record_length = 0;
+		uint16_t set_length;
+		int offset;
+
+		for (i = 0; i < exporter->ipfix_lo_template_maxsize; i++) {
+			ipfix_lo_template *t = &exporter->template_arr[i];
+			if ((t->state == T_COMMITED || t->state == T_SENT) &&
+			    t->template_id >= next_id &&
+			    (!templ || t->template_id < templ->template_id))
+				templ = t;
+		}
+		if (!templ)
+			break;
+		next_id = templ->template_id + 1;
+
+		/* Walk the field specifiers behind the Set Header and the
+		   Template Record Header. Options templates carry an
+		   additional scope field count. Data templates, which carry
+		   fixed values, are left out. */
+		switch (ntohs(*(uint16_t *) templ->template_fields)) {
+		case 2:
+			offset = 8;
+			break;
+		case 3:
+			offset = 10;
+			break;
+		default:
+			continue;
+		}
+		while (offset + 4 <= templ->fields_length) {
+			uint16_t type = ntohs(*(uint16_t *) (templ->template_fields + offset));
+			uint16_t field_length = ntohs(*(uint16_t *) (templ->template_fields + offset + 2));
+
+			record_length += field_length == 65535 ? 1 : field_length;
+			offset += type & 0x8000 ? 8 : 4;
+		}
+
+		set_length = htons(sizeof(ipfix_set_header) + record_length);
+		if (length + sizeof(ipfix_set_header) + record_length > size)
+			break;
+		buffer[length] = templ->template_id >> 8;
+		buffer[length + 1] = templ->template_id & 0xff;
+		memcpy(buffer + length + 2, &set_length, sizeof(set_length));
+		memset(buffer + length + sizeof(ipfix_set_header), 0, record_length);
+		length += sizeof(ipfix_set_header) + record_length;
+	}
+
+	return length;
+}
+
+/*
+ * Returns 1 if the next message continues the compressed stream, see
+ * ipfix_set_compression_streaming().
+ * This is an internal function.
+ */
+static int ipfix_streams_compressed_messages(ipfix_exporter *exporter) {
+	ipfix_receiving_collector *col = NULL;
+	int i;
+
+	if (!exporter->compression_streaming)
+		return 0;
+
+	for (i = 0; i < exporter->collector_max_num; i++) {
+		if (exporter->collector_arr[i].state == C_UNUSED)
+			continue;
+		if (col)
+			return 0;
+		col = &exporter->collector_arr[i];
+	}
+	if (!col || col->spill)
+		return 0;
+
+	switch (col->protocol) {
+	case TCP:
+	case DATAFILE:
+		return 1;
+#ifdef SUPPORT_SCTP
+	case SCTP:
+		return exporter->sctp_lifetime == 0;
+#endif
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Returns 1 if collectors fall behind, which makes a better compression
+ * ratio worth more CPU time.
+ * This is an internal function.
+ */
+static int ipfix_falls_behind(ipfix_exporter *exporter) {
+	int i;
+
+	if (ipfix_backpressure(exporter))
+		return 1;
+	for (i = 0; i < exporter->collector_max_num; i++) {
+		ipfix_receiving_collector *col = &exporter->collector_arr[i];
+		if (col->state != C_UNUSED && col->spill && col->spill->messages > 0)
+			return 1;
+	}
 
 	return 0;
 }
 
-static int ipfix_compress_packet(ipfix_exporter *exporter) {
-	if (!exporter->compression_function)
+/*
+ * Switches to a cheaper or stronger compressor once per measurement window,
+ * see ipfix_set_adaptive_compression().
+ * This is an internal function.
+ */
+static void ipfix_adapt_compression(ipfix_exporter *exporter) {
+	unsigned elapsed = ipfix_elapsed_ms(&exporter->compression_window);
+	uint64_t budget_ns;
+	int over_budget;
+	int current = exporter->compressor_current;
+
+	if (elapsed < IPFIX_COMPRESSION_WINDOW)
+		return;
+
+	budget_ns = (uint64_t) elapsed * 10000 * exporter->compression_cpu_budget;
+	over_budget = exporter->compression_ns > budget_ns;
+	if (exporter->compression_stepped_up) {
+		/* back off if the stronger compressor does not fit the budget */
+		if (!over_budget)
+			exporter->compression_step_up_windows = IPFIX_COMPRESSION_STEP_UP_WINDOWS;
+		else if (exporter->compression_step_up_windows < IPFIX_COMPRESSION_MAX_STEP_UP_WINDOWS)
+			exporter->compression_step_up_windows *= 2;
+	}
+
+	if (exporter->compression_cpu_budget == 0) {
+		current = 0;
+	} else if (over_budget) {
+		if (current < exporter->compressor_count)
+			current++;
+		exporter->compression_calm_windows = 0;
+	} else if (current > 0 &&
+		   (exporter->compression_ns < budget_ns / 2 || ipfix_falls_behind(exporter))) {
+		if (++exporter->compression_calm_windows >= exporter->compression_step_up_windows) {
+			current--;
+			exporter->compression_calm_windows = 0;
+		}
+	} else {
+		exporter->compression_calm_windows = 0;
+	}
+	exporter->compression_stepped_up = current < exporter->compressor_current;
+
+	if (current != exporter->compressor_current) {
+		msg(MSG_DEBUG, "Spent %llu us of %u ms compressing, switching to compressor %d",
+		    (unsigned long long) exporter->compression_ns / 1000, elapsed, current);
+		exporter->compressor_current = current;
+	}
+	exporter->compression_ns = 0;
+	clock_gettime(CLOCK_MONOTONIC, &exporter->compression_window);
+}
+
+/*
+ * Compresses the message given by iov, whose Message Header already carries
+ * the sequence number of the collector. Returns 1 if the message has been
+ * compressed into exporter->compressed_message and 0 if it is sent as it is.
+ * This is an internal function.
+ */
+static int ipfix_compress_packet(ipfix_exporter *exporter, struct iovec *iov, int iovcnt) {
+	ipfix_sendbuffer *dsb = exporter->data_sendbuffer;
+	ipfix_sendbuffer sb;
+	unsigned length = 0;
+	ipfix_compressor *c;
+	struct timespec start, end;
+	int streaming;
+	int ret;
+	int i;
+
+	if (exporter->compressor_count == 0)
+		return 0;
+
+	for (i = 0; i < iovcnt; i++)
+		length += iov[i].iov_len;
+
+	if (exporter->compression_adaptive) {
+		ipfix_adapt_compression(exporter);
+		if (exporter->compressor_current == exporter->compressor_count ||
+		    length < exporter->compression_min_size)
+			return 0;
+	}
+	c = &exporter->compressors[exporter->compressor_current];
+
+	streaming = ipfix_streams_compressed_messages(exporter);
+	if (streaming != c->state.streaming) {
+		// the stream of the previous mode has ended
+		c->state.streaming = streaming;
+		c->state.restart = 1;
+		c->state.load_dictionary = 1;
+	}
+
+	// the module compresses the committed entries of the data sendbuffer
+	memcpy(sb.entries, iov, iovcnt * sizeof(struct iovec));
+	sb.committed = sb.current = iovcnt;
+	sb.committed_data_length = length - sizeof(ipfix_header);
+	exporter->data_sendbuffer = &sb;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = c->compress(exporter, &c->state);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	exporter->data_sendbuffer = dsb;
+	exporter->compression_ns += (end.tv_sec - start.tv_sec) * 1000000000ULL
+		+ end.tv_nsec - start.tv_nsec;
+
+	if (ret == 0 && exporter->compression_adaptive &&
+	    sb.committed_data_length + sizeof(ipfix_compression_header) >= length) {
+		// the collector never sees this part of the stream
+		c->state.restart = 1;
+		ret = 1;
+	} else if (ret) {
+		msg(MSG_ERROR, "Failed to compress message");
+		c->state.restart = 1;
+	}
+	if (ret)
 		return 0;
+	c->state.restart = 0;
+	c->state.load_dictionary = 0;
+
+	exporter->compressed_iovcnt = 0;
+	if (exporter->compression_adaptive) {
+		exporter->compression_header.marker = IPFIX_COMPRESSION_MARKER;
+		exporter->compression_header.compressor = exporter->compressor_current;
+		exporter->compression_header.length =
+			htons(sb.committed_data_length + sizeof(ipfix_compression_header));
+		exporter->compressed_message[0].iov_base = &exporter->compression_header;
+		exporter->compressed_message[0].iov_len = sizeof(ipfix_compression_header);
+		exporter->compressed_iovcnt = 1;
+	}
+	exporter->compressed_message[exporter->compressed_iovcnt++] = sb.entries[0];
 
-	return exporter->compression_function(exporter);
+	return 1;
 }
 #endif
 
@@ -151,7 +151,7 @@ extern "C" {
  * maximum number of templates at a time;
  * can be specified by user
  */
-#define IPFIX_MAX_TEMPLATES 16
+#define IPFIX_MAX_TEMPLATES 32
 
 /*
  * Default time, until templates are re-sent again:
@@ -190,6 +190,82 @@ extern "C" {
  */
 #define IPFIX_MAX_PACKETSIZE (1<<16)
 
+/*
+ * maximum size of an IPFIX Message as limited by the 16 bit Length field of
+ * the Message Header. Applies to SCTP, TCP and file collectors.
+ */
+#define IPFIX_MAX_MESSAGE_SIZE 65535
+
+/*
+ * maximum size of a preset compression dictionary. Deflate does not look
+ * further back than 32 KiB.
+ */
+#define IPFIX_MAX_DICTIONARY_SIZE (32 * 1024)
+
+/*
+ * maximum number of compressors adaptive compression chooses from, see
+ * ipfix_add_compression()
+ */
+#define IPFIX_MAX_COMPRESSORS 4
+
+/*
+ * First byte of a message compressed by adaptive compression and length of
+ * the time in milliseconds over which the time spent compressing is
+ * measured before the compressor is switched
+ */
+#define IPFIX_COMPRESSION_MARKER 0xcf
+#define IPFIX_COMPRESSION_WINDOW 1000
+
+/*
+ * number of windows in a row which allow a stronger compressor before
+ * adaptive compression switches to it, doubled up to the maximum whenever
+ * the stronger compressor exceeds the budget right away
+ */
+#define IPFIX_COMPRESSION_STEP_UP_WINDOWS 4
+#define IPFIX_COMPRESSION_MAX_STEP_UP_WINDOWS 64
+
+/*
+ * maximum number of messages and bytes which can be queued for UDP
+ * collectors if deferred flushing is enabled
+ */
+#define IPFIX_SEND_QUEUE_MAX_MESSAGES 64
+#define IPFIX_SEND_QUEUE_SIZE (256 * 1024)
+
+/*
+ * Default number of bytes which may wait for a TCP collector to accept them
+ * before Data Sets are dropped, see ipfix_set_tcp_backlog()
+ */
+#define IPFIX_DEFAULT_TCP_BACKLOG_SIZE (512 * 1024)
+
+/*
+ * Maximum time in seconds between two attempts to connect to a TCP
+ * collector. The time doubles after each failed attempt.
+ */
+#define IPFIX_TCP_MAX_RECONNECT_DELAY 300
+
+/*
+ * Maximum size of a segment file of a spill queue. Queues smaller than four
+ * segments use a quarter of their size per segment.
+ */
+#define IPFIX_SPILL_SEGMENT_SIZE (1024 * 1024)
+
+/*! \brief Socket events, see ipfix_set_socket_watcher() */
+#define IPFIX_SOCKET_READ 1
+#define IPFIX_SOCKET_WRITE 2
+
+/*! \brief What happens to Data Sets for a collector which is not connected,
+ * see ipfix_set_unconnected_policy() */
+enum ipfix_unconnected_policy {
+	IPFIX_UNCONNECTED_DROP, /*!< drop them, the default */
+	IPFIX_UNCONNECTED_BUFFER /*!< keep them in the backlog of TCP collectors */
+};
+
+/*
+ * limits of a single UDP segmentation offload (UDP_SEGMENT) send
+ */
+#define IPFIX_GSO_MAX_SEGMENTS 64
+#define IPFIX_GSO_MAX_BYTES (65535 - 20 - 8)
+
 /* MTU considerations apply to UDP and DTLS over UDP only. */
 
 /* The MTU is set by the user. Path MTU discovery is turned off. */
@@ -328,7 +404,7 @@ enum ipfix_transport_protocol {
 	DATAFILE,
 	SCTP, /*!< SCTP, most favorable */
 	UDP, /*!< UDP, available on all platforms, may result in MTU issues */
-	TCP, /*!< TCP, currently unsupported by ipfixlolib */
+	TCP, /*!< TCP, non-blocking, requires ipfix_set_socket_watcher() */
 	DTLS_OVER_UDP, /*!< DTLS over UDP, requires OpenSSL */
 	DTLS_OVER_SCTP /*!< DTLS over SCTP, requires OpenSSL w/ SCTP patches from sctp.fh-muenster.de and recent version of FreeBSD */
 };
@@ -405,6 +481,18 @@ enum template_state {T_UNUSED, T_UNCLEAN, T_COMMITED, T_SENT, T_WITHDRAWN, T_TOB
  *  - state <= C_NEW
  *  - Templates are sent
  *  - state <= C_CONNECTED
+ *
+ * TCP:
+ *  - state == C_UNUSED
+ *  - socket() and non-blocking connect()
+ *  - state <= C_NEW
+ *  - The socket becomes writable, connection setup succeeded
+ *  - state <= C_CONNECTED
+ *  - Templates are sent
+ *  - Connection fails, the backlog is discarded
+ *  - state <= C_DISCONNECTED
+ *  - After the reconnect delay: socket() and connect() again
+ *  - state <= C_NEW
  */
 enum collector_state {C_UNUSED, C_NEW, C_DISCONNECTED, C_CONNECTED};
 
@@ -475,14 +563,75 @@ typedef struct {
 	ipfix_set_manager set_manager; /* Only relevant when sendbuffer used
 					  for data. Not relevant if used for
 					  template sets. */
+	uint8_t *data; /* Contiguous buffer for data fields which are copied
+			* by ipfix_put_data_field() or encoded in place via
+			* ipfix_reserve_data_field(). Adjacent fields of a set
+			* share a single entry in .entries.
+			* NULL for template sendbuffers. */
+	unsigned data_capacity; /* size of .data in bytes */
+	unsigned data_used; /* number of bytes of .data in use */
 } ipfix_sendbuffer;
 
+/*
+ * Completed IPFIX messages waiting to be sent to the UDP collectors, see
+ * ipfix_set_deferred_flush()
+ */
+typedef struct {
+	uint8_t *data; /* the queued messages back to back */
+	unsigned used; /* number of bytes of .data in use */
+	unsigned count; /* number of queued messages */
+	uint16_t lengths[IPFIX_SEND_QUEUE_MAX_MESSAGES]; /* length of each message */
+	uint32_t records[IPFIX_SEND_QUEUE_MAX_MESSAGES]; /* number of data records
+							  * of each message */
+	uint8_t compressed[IPFIX_SEND_QUEUE_MAX_MESSAGES]; /* 1 if the message
+							    * header cannot be
+							    * rewritten */
+	unsigned max_messages; /* flush once this many messages are queued */
+	unsigned max_delay; /* flush once the oldest message has been queued
+			     * for this many milliseconds */
+	struct timespec first_queued; /* time the oldest message was queued */
+	int gso; /* 1 as long as the kernel accepts UDP_SEGMENT */
+} ipfix_send_queue;
+
+/*
+ * Precedes every message in a segment file of a spill queue. A length of 0
+ * marks the end of the messages in a segment.
+ */
+typedef struct {
+	uint16_t length; /* length of the message, which is spilled uncompressed */
+	uint16_t reserved;
+	uint32_t records; /* number of data records in the message */
+} ipfix_spill_entry;
+
+/*
+ * Messages waiting on disk for a collector which cannot take them, see
+ * ipfix_set_spill_queue(). The messages are appended to memory mapped
+ * segment files <prefix>.<number>. Segments are removed once they have been
+ * replayed, or unread if the queue exceeds its size.
+ */
+typedef struct {
+	char *prefix; /* path of the segment files without the number */
+	unsigned segment_size; /* size of each segment file in bytes */
+	unsigned max_segments; /* the oldest segment is discarded beyond this */
+	uint32_t first; /* number of the oldest segment */
+	uint32_t last; /* number of the segment being written */
+	uint8_t *read_map; /* mapping of segment .first if it is not .last */
+	unsigned read_offset; /* offset of the next message to replay */
+	uint8_t *write_map; /* mapping of segment .last, NULL if not mapped */
+	unsigned write_offset; /* offset behind the last message */
+	uint64_t messages; /* number of waiting messages */
+	uint64_t dropped; /* number of messages discarded unread */
+	uint64_t tokens; /* bytes which may be replayed right away */
+	struct timespec replayed; /* time tokens were last added */
+} ipfix_spill_queue;
+
 #ifdef SUPPORT_DTLS
 typedef struct {
 	int socket;
 	// uint16_t mtu;
 	SSL *ssl;
 	time_t last_reconnect_attempt_time;
+	int watched_events; /* IPFIX_SOCKET_* events socket is watched for */
 } ipfix_dtls_connection;
 #endif
 
@@ -506,6 +655,33 @@ typedef struct {
 	int mtu_mode; /* Either IPFIX_MTU_FIXED or IPFIX_MTU_DISCOVER */
 	uint16_t mtu; /* Maximum transmission unit.
 			 Applies to UDP and DTLS over UDP only. */
+	uint16_t max_message_size; /* Maximum size of an IPFIX message sent
+				    * to this collector. Derived from the MTU
+				    * for UDP and DTLS over UDP. */
+	uint32_t sequence_number; /* Number of data records sent to this
+				   * collector in the current transport
+				   * session */
+	/* If deferred flushing is enabled and the collector accepts larger
+	 * messages than the exporter builds, consecutive messages are
+	 * collected here and sent as one message. */
+	uint8_t *message; /* allocated on first use, IPFIX_MAX_PACKETSIZE bytes */
+	unsigned message_length; /* bytes in .message including the message
+				  * header, 0 if empty */
+	uint32_t message_records; /* number of data records in .message */
+	struct timespec message_first; /* time the first message was collected */
+	/* TCP only: bytes the socket did not accept yet. Data is dropped
+	 * while the backlog exceeds the limit of the exporter, templates
+	 * never are. */
+	uint8_t *backlog;
+	unsigned backlog_start; /* offset of the first unsent byte */
+	unsigned backlog_length; /* offset behind the last unsent byte */
+	unsigned backlog_capacity; /* size of .backlog in bytes */
+	int backpressure; /* 1 from 3/4 of the limit down to 1/4 of it */
+	uint64_t backlog_dropped; /* number of messages dropped */
+	unsigned reconnect_delay; /* seconds between the last and the next
+				   * connection attempt */
+	int watched_events; /* IPFIX_SOCKET_* events data_socket is watched for */
+	ipfix_spill_queue *spill; /* NULL unless spilling is enabled */
 #ifdef IPFIXLOLIB_RAWDIR_SUPPORT
 	char* packet_directory_path; /*!< if protocol==RAWDIR: path to a directory to store packets in. Ignored otherwise. */
 	int packets_written; /*!< if protcol==RAWDIR: number of packets written to packet_directory_path. Ignored otherwise. */
@@ -555,19 +731,66 @@ typedef struct{
 				// to build Set Headers for Template Sets.
 } ipfix_lo_template;
 
+#ifdef SUPPORT_COMPRESSION
+/*
+ * Compressor state which an exporter keeps across messages and hands to
+ * ipfix_compress() of the compression module, see ipfix_init_compression()
+ */
+typedef struct {
+	void *context; /* owned by the compression module, NULL until the first
+			* message has been compressed */
+	uint8_t streaming; /* 1 if the message continues the history of the
+			    * previous one and ends on a flush boundary */
+	uint8_t restart; /* 1 if the message must not refer to any earlier
+			  * message, e.g. because the collector missed one */
+	uint8_t load_dictionary; /* 1 if a streaming message starts a new stream
+				  * which is preceded by the dictionary */
+	const unsigned char *dictionary; /* preset dictionary, NULL if none */
+	unsigned dictionary_length;
+	int level; /* compression level, 0 for the one given to the module */
+} ipfix_compression_state;
+
+struct ipfix_exporter_t;
+
+/*
+ * A compression module loaded by ipfix_init_compression() or
+ * ipfix_add_compression()
+ */
+typedef struct {
+	void *handle;
+	int (*compress)(struct ipfix_exporter_t *, ipfix_compression_state *);
+	void (*deinit)(ipfix_compression_state *); /* NULL if the module keeps no context */
+	ipfix_compression_state state;
+} ipfix_compressor;
+
+/*
+ * Precedes each compressed message if adaptive compression is enabled, see
+ * ipfix_set_adaptive_compression(). Messages sent uncompressed start with
+ * the version number of the Message Header instead, whose first byte is 0.
+ */
+typedef struct {
+	uint8_t marker; /* IPFIX_COMPRESSION_MARKER */
+	uint8_t compressor; /* index of the compressor, 0 for the one loaded by
+			     * ipfix_init_compression() */
+	uint16_t length; /* length of the message including this header */
+} ipfix_compression_header;
+#endif
+
 /*
  * Each exporting process is associated with a sequence number and a source ID
  * The exporting process keeps track of the sequence number.
  */
 typedef struct ipfix_exporter_t {
-	uint32_t sequence_number; // total number of data records 
+	uint32_t sequence_number; // total number of data records
 	uint32_t sn_increment; // to be added to sequence number before sending data records
 	uint32_t observation_domain_id;
 	uint16_t max_message_size; /* Maximum size of an IPFIX message.
 		       * This is the maximum size that all collectors allow.
-		       * If a new collector is added that only allows
-		       * smaller IPFIX messages, this value has to be
-		       * updated.
+		       * Collectors allowing larger messages may collect
+		       * several of them into one, see
+		       * ipfix_set_deferred_flush().
+		       * Updated whenever a collector is added or removed
+		       * or its MTU changes.
 		       * Only observed when sending messages
 		       * containing data sets. IPFIX messages
 		       * containing template sets might get
@@ -575,6 +798,10 @@ typedef struct ipfix_exporter_t {
 	ipfix_sendbuffer *template_sendbuffer;
 	ipfix_sendbuffer *sctp_template_sendbuffer;
 	ipfix_sendbuffer *data_sendbuffer;
+	ipfix_send_queue *send_queue; /* NULL unless deferred flushing is enabled */
+	int copy_data_fields; /* If set, ipfix_put_data_field() copies the data
+			       * into the sendbuffer instead of referencing it.
+			       * Enabled by default. */
 	int collector_max_num; // maximum available collector
 	ipfix_receiving_collector *collector_arr; // array of (collector_max_num) collectors
 
@@ -595,6 +822,17 @@ typedef struct ipfix_exporter_t {
 	// time, after new sctp reconnection will be initiated (default = 5 min)
 	// (0 ==> no reconnection -> destroy collector)
 	uint32_t sctp_reconnect_timer;
+	// maximum number of bytes waiting for a TCP collector
+	unsigned tcp_backlog_size;
+	// what happens to Data Sets while a TCP collector is not connected
+	enum ipfix_unconnected_policy unconnected_policy;
+	// directory of the spill queues of new collectors, NULL if disabled
+	char *spill_directory;
+	unsigned spill_size; // maximum number of bytes in each spill queue
+	unsigned spill_rate; // bytes per second replayed, 0 for no limit
+	// tells the application which collector sockets to watch for events
+	void (*socket_watcher)(int fd, int old_events, int events, void *user_param);
+	void *socket_watcher_param;
 	int ipfix_lo_template_maxsize;
 	ipfix_lo_template *template_arr;
 #ifdef SUPPORT_DTLS
@@ -605,10 +843,34 @@ typedef struct ipfix_exporter_t {
 	const char *ca_path;
 #endif
 #ifdef SUPPORT_COMPRESSION
-	void *compression_handle;
-	int (*compression_function)(struct ipfix_exporter_t *);
+	ipfix_compressor compressors[IPFIX_MAX_COMPRESSORS]; /* from the
+							      * strongest to the
+							      * cheapest one */
+	int compressor_count; /* 0 if messages are sent uncompressed */
+	int compressor_current; /* compresses the next message, compressor_count
+				 * if it is sent uncompressed */
+	int compression_streaming; /* see ipfix_set_compression_streaming() */
+	unsigned char *compression_dictionary; /* shared by all compressors */
+	unsigned compression_dictionary_length;
+	/* see ipfix_set_adaptive_compression() */
+	int compression_adaptive;
+	unsigned compression_min_size;
+	unsigned compression_cpu_budget;
+	struct timespec compression_window; /* start of the current measurement */
+	uint64_t compression_ns; /* time spent compressing since then */
+	unsigned compression_calm_windows; /* windows in a row which allowed
+					    * a stronger compressor */
+	unsigned compression_step_up_windows; /* calm windows needed before
+					       * switching to it */
+	int compression_stepped_up; /* the last window switched to a stronger
+				     * compressor */
+	ipfix_compression_header compression_header;
 	// Buffer which is used to store the compressed data
 	unsigned char compression_buffer[IPFIX_MAX_PACKETSIZE];
+	/* the message last compressed by ipfix_compress_packet(), preceded by
+	 * compression_header in adaptive mode */
+	struct iovec compressed_message[2];
+	int compressed_iovcnt;
 #endif
 } ipfix_exporter;
 
@@ -620,7 +882,7 @@ int ipfix_deinit_exporter(ipfix_exporter *exporter);
 int ipfix_add_collector(ipfix_exporter *exporter, const char *coll_ip4_addr, int coll_port, enum ipfix_transport_protocol proto, void *aux_config);
 int ipfix_remove_collector(ipfix_exporter *exporter, const char *coll_ip4_addr, int coll_port);
 int ipfix_start_template(ipfix_exporter *exporter, uint16_t template_id,  uint16_t field_count);
-int ipfix_start_optionstemplate_set(ipfix_exporter *exporter, uint16_t template_id, uint16_t scope_length, uint16_t option_length);
+int ipfix_start_optionstemplate(ipfix_exporter *exporter, uint16_t template_id, uint16_t scope_field_count, uint16_t option_field_count);
 int ipfix_start_datatemplate(ipfix_exporter *exporter, uint16_t template_id, uint16_t preceding, uint16_t field_count, uint16_t fixedfield_count);
 int ipfix_put_template_field(ipfix_exporter *exporter, uint16_t template_id, uint16_t type, uint16_t length, uint32_t enterprise_id);
 int ipfix_put_template_fixedfield(ipfix_exporter *exporter, uint16_t template_id, uint16_t type, uint16_t length, uint32_t enterprise_id);
@@ -628,6 +890,9 @@ int ipfix_end_template(ipfix_exporter *exporter, uint16_t template_id );
 int ipfix_start_data_set(ipfix_exporter *exporter, uint16_t template_id);
 uint16_t ipfix_get_remaining_space(ipfix_exporter *exporter);
 int ipfix_put_data_field(ipfix_exporter *exporter,void *data, unsigned length);
+void *ipfix_reserve_data_field(ipfix_exporter *exporter, unsigned length);
+int ipfix_commit_data_field(ipfix_exporter *exporter, unsigned length);
+int ipfix_set_copy_data_fields(ipfix_exporter *exporter, int enabled);
 int ipfix_end_data_set(ipfix_exporter *exporter, uint16_t number_of_records);
 int ipfix_cancel_data_set(ipfix_exporter *exporter);
 int ipfix_set_data_field_marker(ipfix_exporter *exporter);
@@ -635,9 +900,19 @@ int ipfix_delete_data_fields_upto_marker(ipfix_exporter *exporter);
 int ipfix_put_template_data(ipfix_exporter *exporter, uint16_t template_id, void* data, uint16_t data_length);
 int ipfix_remove_template(ipfix_exporter *exporter, uint16_t template_id);
 int ipfix_send(ipfix_exporter *exporter);
+int ipfix_set_deferred_flush(ipfix_exporter *exporter, unsigned max_messages, unsigned max_delay);
+int ipfix_flush(ipfix_exporter *exporter);
 int ipfix_set_template_transmission_timer(ipfix_exporter *exporter, uint32_t timer); 	 
 int ipfix_set_sctp_lifetime(ipfix_exporter *exporter, uint32_t lifetime);
 int ipfix_set_sctp_reconnect_timer(ipfix_exporter *exporter, uint32_t timer);
+int ipfix_set_tcp_backlog(ipfix_exporter *exporter, unsigned size);
+int ipfix_set_unconnected_policy(ipfix_exporter *exporter, enum ipfix_unconnected_policy policy);
+int ipfix_set_spill_queue(ipfix_exporter *exporter, const char *directory, unsigned size, unsigned rate);
+int ipfix_set_socket_watcher(ipfix_exporter *exporter,
+			     void (*watcher)(int fd, int old_events, int events, void *user_param),
+			     void *user_param);
+void ipfix_socket_event(ipfix_exporter *exporter, int fd, int events);
+int ipfix_backpressure(ipfix_exporter *exporter);
 
 int ipfix_set_dtls_certificate(ipfix_exporter *exporter, const char *certificate_chain_file, const char *private_key_file);
 int ipfix_set_ca_locations(ipfix_exporter *exporter, const char *ca_file, const char *ca_path);
@@ -646,6 +921,16 @@ int ipfix_set_ca_locations(ipfix_exporter *exporter, const char *ca_file, const
 int ipfix_init_compression(ipfix_exporter *exporter,
 						   const char *module_name,
 						   const char *module_parameters);
+int ipfix_add_compression(ipfix_exporter *exporter,
+			  const char *module_name,
+			  const char *module_parameters, int level);
+int ipfix_set_adaptive_compression(ipfix_exporter *exporter,
+				   unsigned min_size, unsigned cpu_budget);
+int ipfix_set_compression_streaming(ipfix_exporter *exporter, int streaming);
+int ipfix_set_compression_dictionary(ipfix_exporter *exporter,
+				     const unsigned char *dictionary, unsigned length);
+int ipfix_build_compression_dictionary(ipfix_exporter *exporter,
+				       unsigned char *buffer, unsigned size);
 #endif
 
 #ifdef __cplusplus
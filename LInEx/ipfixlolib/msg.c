@@ -8,11 +8,35 @@
 #include "msg.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
 
-static int msg_level=MSG_DEFAULT;
+int msg_level=MSG_DEFAULT;
 static char *MSG_TAB[]={ "FATAL", "LINEX", "ERROR", "INFO ", "DEBUG", "VDEBUG", 0};
 
+/**
+  * Entry of the log ring. The sequence number tells producers and the
+  * consumer whether the entry is free (sequence == position) or contains a
+  * message (sequence == position + 1).
+  */
+struct msg_ring_entry {
+	volatile uint32_t sequence;
+	char text[MSG_RING_ENTRY_LEN];
+};
+
+/**
+  * Log ring of the asynchronous mode, NULL if messages are printed
+  * synchronously.
+  */
+static struct msg_ring_entry *msg_ring = NULL;
+static volatile uint32_t msg_ring_head = 0;
+static uint32_t msg_ring_tail = 0;
+
+static uint64_t msg_suppressed = 0;
+static uint64_t msg_dropped = 0;
+static uint64_t msg_dropped_reported = 0;
+
 void msg_setlevel(int l)
 {
 	msg_level = l;
@@ -23,32 +47,236 @@ int msg_getlevel()
 	return msg_level;
 }
 
-/*
- the main logging routine
+/**
+  * Claims a free entry of the log ring. Returns NULL if the ring is full.
+  *
+  * This is a bounded multi-producer queue as msg() can and will be called
+  * by concurrent threads. The entry has to be published with
+  * msg_ring_commit().
+  */
+static struct msg_ring_entry *msg_ring_reserve(uint32_t *position)
+{
+	uint32_t pos = msg_ring_head;
 
- we don't have to lock, because glibc's printf() system is doing it already
+	while (1) {
+		struct msg_ring_entry *entry = &msg_ring[pos & (MSG_RING_SIZE - 1)];
+		int32_t diff = (int32_t) (entry->sequence - pos);
 
- if you, however, change this function to a custom backend, you WILL have to lock
- because msg() can and will be called by concurrent threads!
- */
-void msg_work(const int line, const char* file, const char* pv, const char* func, const int level, const char *fmt, ...)
+		if (diff == 0) {
+			uint32_t old = __sync_val_compare_and_swap(&msg_ring_head, pos, pos + 1);
+
+			if (old == pos) {
+				*position = pos;
+				return entry;
+			}
+
+			pos = old;
+		} else if (diff < 0) {
+			__sync_fetch_and_add(&msg_dropped, 1);
+			return NULL;
+		} else {
+			pos = msg_ring_head;
+		}
+	}
+}
+
+static void msg_ring_commit(struct msg_ring_entry *entry, uint32_t position)
+{
+	__sync_synchronize();
+	entry->sequence = position + 1;
+}
+
+static void msg_vprint(const int line, const char* file, const int level, const char *fmt, va_list args)
 {
-        /* nummerically higher value means lower priority */
-        if (level > msg_level) {
-                return;
-        } else {
-                va_list args;
+	/* fatal messages are printed immediately, but after everything queued before */
+	if (msg_ring != NULL && level != MSG_FATAL) {
+		struct msg_ring_entry *entry;
+		uint32_t position;
+		int len;
+
+		if ((entry = msg_ring_reserve(&position)) == NULL)
+			return;
+
 #ifdef DEBUG
-                printf("%s in %s:%d: ", MSG_TAB[level], file, line);
+		len = snprintf(entry->text, MSG_RING_ENTRY_LEN, "%s in %s:%d: ", MSG_TAB[level], file, line);
 #else
-                printf("%s: ", MSG_TAB[level]);
+		len = snprintf(entry->text, MSG_RING_ENTRY_LEN, "%s: ", MSG_TAB[level]);
 #endif
-                va_start(args, fmt);
-                vprintf(fmt, args);
-                va_end(args);
-                printf("\n");
-        }
+		if (len < MSG_RING_ENTRY_LEN)
+			vsnprintf(entry->text + len, MSG_RING_ENTRY_LEN - len, fmt, args);
+
+		msg_ring_commit(entry, position);
+		return;
+	}
+
+	msg_flush();
+#ifdef DEBUG
+	printf("%s in %s:%d: ", MSG_TAB[level], file, line);
+#else
+	printf("%s: ", MSG_TAB[level]);
+#endif
+	vprintf(fmt, args);
+	printf("\n");
+	if (msg_ring != NULL)
+		fflush(stdout);
+}
+
+static void msg_print(const int line, const char* file, const int level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	msg_vprint(line, file, level, fmt, args);
+	va_end(args);
+}
+
+/*
+ the main logging routine
+
+ in synchronous mode we don't have to lock, because glibc's printf() system
+ is doing it already. In asynchronous mode, messages are formatted into the
+ lock-free log ring and printed by msg_flush().
+ */
+void msg_work(const int line, const char* file, const char* pv, const char* func, const int level, const char *fmt, ...)
+{
+	/* nummerically higher value means lower priority */
+	if (level > msg_level) {
+		return;
+	} else {
+		va_list args;
 
+		va_start(args, fmt);
+		msg_vprint(line, file, level, fmt, args);
+		va_end(args);
+	}
 }
 
+/**
+  * Rate limited variant of msg_work() used by msg(). The caller has already
+  * checked the level.
+  *
+  * Concurrent threads may race on the state of the call site, which only
+  * makes the limit slightly inaccurate.
+  */
+void msg_site_work(struct msg_site *site, const int line, const char* file, const char* pv, const char* func, const int level, const char *fmt, ...)
+{
+	uint32_t now = time(NULL);
+	uint32_t suppressed = 0;
+	va_list args;
+
+	if (site->window != now) {
+		site->window = now;
+		site->count = 0;
+		suppressed = site->suppressed;
+		site->suppressed = 0;
+	}
+
+	if (site->count >= MSG_RATE_LIMIT && level != MSG_FATAL) {
+		site->suppressed++;
+		__sync_fetch_and_add(&msg_suppressed, 1);
+		return;
+	}
+
+	site->count++;
+
+	va_start(args, fmt);
+	msg_vprint(line, file, level, fmt, args);
+	va_end(args);
+
+	if (suppressed)
+		msg_print(line, file, level, "%u similar messages suppressed (%s:%d).", suppressed, file, line);
+}
+
+/**
+  * Switches to asynchronous mode. Messages are then queued in the log ring
+  * and have to be printed periodically by calling msg_flush().
+  *
+  * Returns 0 on success, -1 otherwise.
+  */
+int msg_init_async()
+{
+	struct msg_ring_entry *ring;
+	uint32_t i;
+
+	if (msg_ring != NULL)
+		return 0;
+
+	ring = malloc(MSG_RING_SIZE * sizeof(struct msg_ring_entry));
+	if (ring == NULL)
+		return -1;
+
+	for (i = 0; i < MSG_RING_SIZE; i++)
+		ring[i].sequence = i;
+
+	msg_ring_head = 0;
+	msg_ring_tail = 0;
+
+	__sync_synchronize();
+	msg_ring = ring;
+
+	return 0;
+}
+
+/**
+  * Switches back to synchronous mode. Queued messages are printed if flush
+  * is set and discarded otherwise (e.g. in a forked child which must not
+  * print the messages of its parent again).
+  */
+void msg_exit_async(int flush)
+{
+	struct msg_ring_entry *ring = msg_ring;
+
+	if (ring == NULL)
+		return;
+
+	if (flush)
+		msg_flush();
+
+	msg_ring = NULL;
+	free(ring);
+}
+
+/**
+  * Prints all messages queued in the log ring. Must only be called by a
+  * single thread at a time, usually from the event loop.
+  */
+void msg_flush()
+{
+	uint64_t dropped;
+
+	if (msg_ring == NULL)
+		return;
+
+	while (1) {
+		struct msg_ring_entry *entry = &msg_ring[msg_ring_tail & (MSG_RING_SIZE - 1)];
 
+		if (entry->sequence != msg_ring_tail + 1)
+			break;
+
+		__sync_synchronize();
+		fputs(entry->text, stdout);
+		fputc('\n', stdout);
+
+		entry->sequence = msg_ring_tail + MSG_RING_SIZE;
+		msg_ring_tail++;
+	}
+
+	dropped = msg_dropped;
+	if (dropped != msg_dropped_reported) {
+		printf("%s: Log ring full, %llu messages dropped.\n", MSG_TAB[MSG_ERROR],
+			   (unsigned long long) (dropped - msg_dropped_reported));
+		msg_dropped_reported = dropped;
+	}
+
+	fflush(stdout);
+}
+
+/**
+  * Returns the total number of messages suppressed by the rate limit and
+  * dropped because the log ring was full.
+  */
+void msg_statistics(uint64_t *suppressed, uint64_t *dropped)
+{
+	*suppressed = msg_suppressed;
+	*dropped = msg_dropped;
+}
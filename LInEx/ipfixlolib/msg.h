@@ -1,6 +1,8 @@
 #ifndef _MSG_H_
 #define _MSG_H_
 
+#include <stdint.h>
+
 #define MSG_BLANK 256
 #define MSG_VDEBUG 5
 #define MSG_DEBUG 4
@@ -10,6 +12,31 @@
 #define MSG_FATAL 0
 #define MSG_DEFAULT MSG_ERROR
 
+/**
+  * Every call site of msg() may print at most MSG_RATE_LIMIT messages per
+  * second. Further messages are counted and reported along with the next
+  * message of the call site.
+  */
+#define MSG_RATE_LIMIT 10
+
+/**
+  * Number of entries of the log ring and maximum length of a single message
+  * in asynchronous mode. Longer messages are truncated.
+  */
+#define MSG_RING_SIZE 256
+#define MSG_RING_ENTRY_LEN 256
+
+/**
+  * Rate limiting state of a single msg() call site.
+  */
+struct msg_site {
+	uint32_t window;
+	uint32_t count;
+	uint32_t suppressed;
+};
+
+extern int msg_level;
+
 #ifdef DEBUG
 #define DPRINTF(fmt, args...) msg_work(__LINE__, __FILE__, __PRETTY_FUNCTION__, __func__, MSG_DEBUG, fmt, ##args)
 #define DPRINTFL(lvl, fmt, args...) msg_work(__LINE__, __FILE__, __PRETTY_FUNCTION__, __func__, lvl, fmt, ##args)
@@ -20,10 +47,24 @@
 
 #define THROWEXCEPTION(fmt, args...)  do { msg_work(__LINE__, __FILE__, __PRETTY_FUNCTION__, __func__, MSG_FATAL, fmt, ##args); exit(-1); } while (0)
 
-#define msg(lvl, fmt, args...) msg_work(__LINE__, __FILE__, __PRETTY_FUNCTION__, __func__, lvl, fmt, ##args)
+/**
+  * The level is checked before the arguments are evaluated, hence disabled
+  * messages cost a single comparison.
+  */
+#define msg(lvl, fmt, args...) do { \
+		static struct msg_site _msg_site; \
+		if ((lvl) <= msg_level) \
+			msg_site_work(&_msg_site, __LINE__, __FILE__, __PRETTY_FUNCTION__, __func__, lvl, fmt, ##args); \
+	} while (0)
 
 void msg_setlevel(int l);
 int msg_getlevel();
 void msg_work(const int, const char*, const char*, const char*, const int, const char *, ...);
+void msg_site_work(struct msg_site *, const int, const char*, const char*, const char*, const int, const char *, ...);
+
+int msg_init_async();
+void msg_exit_async(int flush);
+void msg_flush();
+void msg_statistics(uint64_t *suppressed, uint64_t *dropped);
 
 #endif
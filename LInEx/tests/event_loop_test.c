@@ -0,0 +1,85 @@
+/*
+ * event_loop_test.c
+ *
+ * Checks that a EVENT_TIMER_CATCHUP_BURST timer whose callback takes longer
+ * than its interval does not starve the file descriptors of the event loop.
+ *
+ * The timer runs every TEST_TIMER_INTERVAL ms but its callback sleeps for
+ * TEST_CALLBACK_DURATION ms, so it falls further behind on every run. A
+ * byte is waiting in a pipe from the start; the test succeeds as soon as the
+ * callback of the pipe is run and fails if the timer has run
+ * TEST_MAX_TIMER_RUNS times before.
+ */
+
+#include "../event_loop.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#define TEST_TIMER_INTERVAL 5
+#define TEST_CALLBACK_DURATION 20
+#define TEST_MAX_TIMER_RUNS 100
+#define TEST_TIMEOUT 10
+
+static unsigned int timer_runs = 0;
+
+static void slow_timer_callback(void *user_param) {
+	struct timespec duration = {
+		0, TEST_CALLBACK_DURATION * 1000000L
+	};
+
+	nanosleep(&duration, NULL);
+
+	if (++timer_runs == TEST_MAX_TIMER_RUNS) {
+		fprintf(stderr, "FAIL: pipe not polled after %u timer runs\n",
+				timer_runs);
+		exit(1);
+	}
+}
+
+static void pipe_callback(int fd, void *user_param) {
+	char c;
+
+	if (read(fd, &c, 1) != 1) {
+		perror("read");
+		exit(1);
+	}
+
+	printf("OK: pipe polled after %u timer runs\n", timer_runs);
+	exit(0);
+}
+
+int main(int argc, char **argv) {
+	int fds[2];
+
+	// Terminates the test if the event loop does not return from the timers
+	alarm(TEST_TIMEOUT);
+
+	if (pipe(fds)) {
+		perror("pipe");
+		return 1;
+	}
+
+	if (write(fds[1], "x", 1) != 1) {
+		perror("write");
+		return 1;
+	}
+
+	if (event_loop_schedule_timer(0, TEST_TIMER_INTERVAL,
+								  EVENT_TIMER_CATCHUP_BURST,
+								  &slow_timer_callback, NULL) == NULL) {
+		fprintf(stderr, "Failed to schedule timer.\n");
+		return 1;
+	}
+
+	if (event_loop_add_fd(fds[0], &pipe_callback, NULL, NULL)) {
+		fprintf(stderr, "Failed to add pipe to event loop.\n");
+		return 1;
+	}
+
+	event_loop_run();
+
+	return 1;
+}